@@ -0,0 +1,154 @@
+#include "AccessLog.h"
+
+#include <cstring>
+
+std::FILE *AccessLog::file_     = nullptr;
+std::mutex AccessLog::mutex_;
+size_t     AccessLog::buffered_ = 0;
+
+// Size of an encoded record without its URI
+static const size_t RECORD_HEADER_SIZE = 26;
+
+const char *to_string(AccessOutcome outcome) {
+  switch (outcome) {
+    case AccessOutcome::Hit: return "hit";
+    case AccessOutcome::Miss: return "miss";
+    case AccessOutcome::Tunnel: return "tunnel";
+    case AccessOutcome::Rejected: return "rejected";
+    case AccessOutcome::Error: return "error";
+    case AccessOutcome::Peer: return "peer";
+  }
+  return "unknown";
+}
+
+/**
+  @brief Start writing the access log, should be called once before any ProxyConnection objects are created
+
+  @param[in]  path  File to write, appended to if it is an access log of this version
+
+  @return  True if the file was opened
+**/
+bool AccessLog::open(const std::string &path) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  std::FILE                  *file = std::fopen(path.c_str(), "a+b");
+  if (!file) {
+    log("Error opening access log %s: %s", path.c_str(), strerror(errno));
+    return false;
+  }
+  // Records are flushed in large blocks, or when the log is closed
+  setvbuf(file, nullptr, _IOFBF, ACCESS_LOG_BUFFER_SIZE);
+
+  // A new file starts with the header, an existing one must have been written by this version
+  char          magic[4];
+  std::uint32_t version = ACCESS_LOG_VERSION;
+  std::fseek(file, 0, SEEK_END);
+  if (std::ftell(file) == 0) {
+    std::fwrite(ACCESS_LOG_MAGIC, 1, 4, file);
+    std::fwrite(&version, sizeof(version), 1, file);
+    std::fflush(file);
+  } else {
+    std::rewind(file);
+    if (std::fread(magic, 1, 4, file) != 4 || memcmp(magic, ACCESS_LOG_MAGIC, 4) != 0 ||
+        std::fread(&version, sizeof(version), 1, file) != 1 || version != ACCESS_LOG_VERSION) {
+      log("%s is not an access log of version %d, not appending to it", path.c_str(), ACCESS_LOG_VERSION);
+      std::fclose(file);
+      return false;
+    }
+    std::fseek(file, 0, SEEK_END);
+  }
+  file_     = file;
+  buffered_ = 0;
+  return true;
+}
+
+void AccessLog::close() {
+  std::lock_guard<std::mutex> lock(mutex_);
+  if (!file_) return;
+  std::fclose(file_);
+  file_ = nullptr;
+}
+
+/**
+  @brief Append a request to the access log, if it is enabled
+
+  @param[in]  request  Request that was answered
+  @param[in]  status   Status code of the response
+  @param[in]  size     Bytes written to the client
+  @param[in]  outcome  How the request was answered
+  @param[in]  start    Time the request started
+**/
+void AccessLog::record(const HTTPRequest &request, int status, std::uint64_t size, AccessOutcome outcome, time_point start) {
+  if (!enabled()) return;
+
+  time_point    now        = myclock::now();
+  auto          wall_start = std::chrono::system_clock::now() - std::chrono::duration_cast<std::chrono::system_clock::duration>(now - start);
+  std::uint64_t latency    = std::chrono::duration_cast<std::chrono::microseconds>(now - start).count();
+  std::uint64_t timestamp  = std::chrono::duration_cast<std::chrono::microseconds>(wall_start.time_since_epoch()).count();
+  std::string uri = request.method == RequestMethod::CONNECT ? request.proxy_uri.host + ":" + request.proxy_uri.port
+                                                             : request.proxy_uri.absolute();
+  if (uri.size() > UINT16_MAX) uri.resize(UINT16_MAX);
+
+  char          buf[RECORD_HEADER_SIZE];
+  std::uint32_t latency32 = latency > UINT32_MAX ? UINT32_MAX : static_cast<std::uint32_t>(latency);
+  std::uint16_t status16 = static_cast<std::uint16_t>(status), uri_len = static_cast<std::uint16_t>(uri.size());
+  std::uint8_t  outcome8 = static_cast<std::uint8_t>(outcome), method8 = static_cast<std::uint8_t>(request.method);
+  memcpy(buf, &timestamp, 8);
+  memcpy(buf + 8, &latency32, 4);
+  memcpy(buf + 12, &size, 8);
+  memcpy(buf + 20, &status16, 2);
+  memcpy(buf + 22, &outcome8, 1);
+  memcpy(buf + 23, &method8, 1);
+  memcpy(buf + 24, &uri_len, 2);
+
+  std::lock_guard<std::mutex> lock(mutex_);
+  if (!file_) return;
+  // Flush before the buffer would overflow, so the record is never split over two writes
+  if (buffered_ + sizeof(buf) + uri.size() > ACCESS_LOG_BUFFER_SIZE) {
+    std::fflush(file_);
+    buffered_ = 0;
+  }
+  std::fwrite(buf, 1, sizeof(buf), file_);
+  std::fwrite(uri.data(), 1, uri.size(), file_);
+  buffered_ += sizeof(buf) + uri.size();
+}
+
+AccessLogReader::AccessLogReader(const std::string &path) {
+  char          magic[4];
+  std::uint32_t version;
+  file_ = std::fopen(path.c_str(), "rb");
+  if (!file_) return;
+  if (std::fread(magic, 1, 4, file_) != 4 || memcmp(magic, ACCESS_LOG_MAGIC, 4) != 0 ||
+      std::fread(&version, sizeof(version), 1, file_) != 1 || version != ACCESS_LOG_VERSION) {
+    std::fclose(file_);
+    file_ = nullptr;
+  }
+}
+
+AccessLogReader::~AccessLogReader() {
+  if (file_) std::fclose(file_);
+}
+
+/**
+  @brief Read the next record
+
+  @param[out]  record  Record that was read
+
+  @return  False at the end of the log, or if the last record is truncated
+**/
+bool AccessLogReader::next(AccessLogRecord &record) {
+  char          buf[RECORD_HEADER_SIZE];
+  std::uint8_t  outcome8, method8;
+  std::uint16_t uri_len;
+  if (!file_ || std::fread(buf, 1, sizeof(buf), file_) != sizeof(buf)) return false;
+  memcpy(&record.timestamp_us, buf, 8);
+  memcpy(&record.latency_us, buf + 8, 4);
+  memcpy(&record.size, buf + 12, 8);
+  memcpy(&record.status, buf + 20, 2);
+  memcpy(&outcome8, buf + 22, 1);
+  memcpy(&method8, buf + 23, 1);
+  memcpy(&uri_len, buf + 24, 2);
+  record.outcome = static_cast<AccessOutcome>(outcome8);
+  record.method  = static_cast<RequestMethod>(method8);
+  record.uri.resize(uri_len);
+  return uri_len == 0 || std::fread(&record.uri[0], 1, uri_len, file_) == uri_len;
+}
@@ -0,0 +1,235 @@
+#include "Admission.h"
+
+#include <cmath>
+#include <cstring>
+
+// Largest bucket that fits the fixed-point token count
+static const std::uint32_t MAX_BURST = UINT16_MAX >> ADMISSION_TOKEN_SHIFT;
+
+/**
+  @brief Set an admission limit from a command line option
+
+  @param[in]  option  Option of the form `<name>=<value>`, where name is one of connections, per_client, rate, burst,
+                      queue (in seconds) or clients
+
+  @return  True if the option was valid
+**/
+bool AdmissionLimits::parse(const std::string &option) {
+  size_t eq = option.find('=');
+  if (eq == std::string::npos) return false;
+
+  std::string name  = option.substr(0, eq);
+  char       *end   = nullptr;
+  double      value = std::strtod(option.c_str() + eq + 1, &end);
+  if (end == option.c_str() + eq + 1 || *end != '\0' || value < 0) return false;
+
+  if (name == "connections") connections = static_cast<std::uint32_t>(value);
+  else if (name == "per_client") per_client = static_cast<std::uint32_t>(value);
+  else if (name == "rate") rate = value;
+  else if (name == "burst") burst = static_cast<std::uint32_t>(value);
+  else if (name == "queue") queue = std::chrono::milliseconds{static_cast<std::int64_t>(value * 1000)};
+  else if (name == "clients") clients = std::max<std::uint32_t>(static_cast<std::uint32_t>(value), ADMISSION_SHARDS);
+  else return false;
+  return true;
+}
+
+/**
+  @brief Set the limits, should be called once before any connection is admitted
+
+  @param[in]  limits  Admission limits
+**/
+void Admission::configure(const AdmissionLimits &limits) {
+  limits_ = limits;
+  if (limits_.rate > 0 && limits_.burst == 0) limits_.burst = static_cast<std::uint32_t>(std::ceil(limits_.rate));
+  burst_ = std::min(limits_.burst, MAX_BURST) << ADMISSION_TOKEN_SHIFT;
+
+  shards_.reset();
+  if (limits_.per_client == 0 && limits_.rate <= 0) return;
+  shard_size_ = 1;
+  while (shard_size_ * ADMISSION_SHARDS < limits_.clients) shard_size_ <<= 1;
+  shards_.reset(new Shard[ADMISSION_SHARDS]);
+  for (size_t i = 0; i < ADMISSION_SHARDS; i++) shards_[i].entries.reset(new Entry[shard_size_]());
+  log("Admission control tracks %zu clients in %zu KB", shard_size_ * ADMISSION_SHARDS,
+      shard_size_ * ADMISSION_SHARDS * sizeof(Entry) / 1024);
+}
+
+/**
+  @brief Decide whether a new connection is served, and count it if it is
+
+  Once the global limit is reached, waits up to the queue time for another connection to close. The caller stops
+  accepting while it waits, so the backlog of the listening socket pushes back on new clients.
+
+  @param[inout]  client  Key of the client, set to 0 if the client table is full and the client is not tracked
+
+  @return  AdmissionDecision  Whether the connection is admitted, and if not why
+**/
+AdmissionDecision Admission::admit(std::uint64_t &client) {
+  if (limits_.connections > 0 && active_ >= limits_.connections) {
+    if (limits_.queue.count() == 0) return AdmissionDecision::Overloaded;
+    std::unique_lock<std::mutex> lock(wait_mutex_);
+    if (!slot_freed_.wait_for(lock, limits_.queue, [this] { return active_ < limits_.connections || Signaler::done; }) ||
+        Signaler::done) {
+      return AdmissionDecision::Overloaded;
+    }
+  }
+
+  if (shards_ && client != 0 && limits_.per_client > 0) {
+    size_t                      start;
+    Shard                      &s = shard(client, start);
+    std::lock_guard<std::mutex> lock(s.mutex);
+    Entry                      *entry = find(s, start, client, now_ms(), true);
+    if (!entry) {
+      client = 0;
+    } else if (entry->connections >= limits_.per_client) {
+      return AdmissionDecision::ClientLimit;
+    } else {
+      entry->connections++;
+    }
+  }
+  active_++;
+  return AdmissionDecision::Admit;
+}
+
+/**
+  @brief Take a token from the client's bucket before serving a request
+
+  @param[in]  client  Key of the client
+
+  @return  True if the client is within its rate
+**/
+bool Admission::allow_request(std::uint64_t client) {
+  if (!shards_ || client == 0 || limits_.rate <= 0) return true;
+
+  size_t                      start;
+  std::uint32_t               now = now_ms();
+  Shard                      &s   = shard(client, start);
+  std::lock_guard<std::mutex> lock(s.mutex);
+  Entry                      *entry = find(s, start, client, now, true);
+  if (!entry) return true;
+  refill(*entry, now);
+  if (entry->tokens < (1 << ADMISSION_TOKEN_SHIFT)) return false;
+  entry->tokens -= 1 << ADMISSION_TOKEN_SHIFT;
+  return true;
+}
+
+/**
+  @brief Release an admitted connection once it is closed
+
+  @param[in]  client  Key of the client, as set by admit()
+**/
+void Admission::release(std::uint64_t client) {
+  active_--;
+  if (limits_.queue.count() > 0) {
+    // Taking the lock orders the decrement before a waiter's check, so the notification cannot be lost
+    { std::lock_guard<std::mutex> lock(wait_mutex_); }
+    slot_freed_.notify_one();
+  }
+
+  if (!shards_ || client == 0 || limits_.per_client == 0) return;
+  size_t                      start;
+  Shard                      &s = shard(client, start);
+  std::lock_guard<std::mutex> lock(s.mutex);
+  Entry                      *entry = find(s, start, client, now_ms(), false);
+  if (entry && entry->connections > 0) entry->connections--;
+}
+
+/**
+  @brief Get the key of the client connected to a socket
+
+  IPv4 addresses, including IPv4-mapped IPv6 addresses, are used as they are. IPv6 addresses are hashed.
+
+  @param[in]  fd  Connected socket
+
+  @return  Client key, or 0 if the peer address is unknown
+**/
+std::uint64_t Admission::client_key(int fd) {
+  struct sockaddr_storage addr;
+  socklen_t               len = sizeof(addr);
+  if (getpeername(fd, (struct sockaddr *)&addr, &len) < 0) return 0;
+
+  if (addr.ss_family == AF_INET) {
+    return (std::uint64_t{1} << 32) | ntohl(((struct sockaddr_in *)&addr)->sin_addr.s_addr);
+  }
+  if (addr.ss_family == AF_INET6) {
+    const struct in6_addr &ip = ((struct sockaddr_in6 *)&addr)->sin6_addr;
+    if (IN6_IS_ADDR_V4MAPPED(&ip)) {
+      std::uint32_t v4;
+      memcpy(&v4, ip.s6_addr + 12, 4);
+      return (std::uint64_t{1} << 32) | ntohl(v4);
+    }
+    std::uint64_t halves[2];
+    memcpy(halves, ip.s6_addr, 16);
+    return (halves[0] * 0x9e3779b97f4a7c15ULL ^ halves[1]) | (std::uint64_t{1} << 63);
+  }
+  return 0;
+}
+
+/**
+  @brief Get the process-wide admission control
+
+  @return  Admission&  Process-wide admission control
+**/
+Admission &Admission::global() {
+  static Admission admission;
+  return admission;
+}
+
+/**
+  @brief Get the shard of a client, and the slot its probe sequence starts at
+**/
+Admission::Shard &Admission::shard(std::uint64_t client, size_t &start) const {
+  // splitmix64 finalizer, so that consecutive addresses spread over all shards
+  std::uint64_t h = client;
+  h               = (h ^ (h >> 30)) * 0xbf58476d1ce4e5b9ULL;
+  h               = (h ^ (h >> 27)) * 0x94d049bb133111ebULL;
+  h ^= h >> 31;
+  start = (h >> 6) & (shard_size_ - 1);
+  return shards_[h % ADMISSION_SHARDS];
+}
+
+/**
+  @brief Find the entry of a client with linear probing, the shard must be locked
+
+  Entries are never emptied, so a probe sequence ends at the first unused entry. A new client takes the first reusable
+  entry of its sequence.
+
+  @param[in]  create  Whether to add the client if it is not found
+
+  @return  Entry of the client, or nullptr if it is not found and cannot be added
+**/
+Admission::Entry *Admission::find(Shard &shard, size_t start, std::uint64_t client, std::uint32_t now_ms, bool create) {
+  Entry *free = nullptr;
+  for (size_t i = 0; i < ADMISSION_MAX_PROBE && i < shard_size_; i++) {
+    Entry &entry = shard.entries[(start + i) & (shard_size_ - 1)];
+    if (entry.key == client) return &entry;
+    if (entry.key == 0) {
+      if (!free) free = &entry;
+      break;
+    }
+    if (!free && reusable(entry, now_ms)) free = &entry;
+  }
+  if (!create || !free) return nullptr;
+
+  free->key         = client;
+  free->refilled_ms = now_ms;
+  free->tokens      = static_cast<std::uint16_t>(burst_);
+  free->connections = 0;
+  return free;
+}
+
+void Admission::refill(Entry &entry, std::uint32_t now_ms) const {
+  std::uint64_t added = static_cast<std::uint64_t>((now_ms - entry.refilled_ms) * limits_.rate * (1 << ADMISSION_TOKEN_SHIFT) / 1000);
+  if (added == 0) return;
+  entry.tokens      = static_cast<std::uint16_t>(std::min<std::uint64_t>(burst_, entry.tokens + added));
+  entry.refilled_ms = now_ms;
+}
+
+bool Admission::reusable(const Entry &entry, std::uint32_t now_ms) const {
+  if (entry.connections > 0) return false;
+  if (limits_.rate <= 0) return true;
+  return entry.tokens + (now_ms - entry.refilled_ms) * limits_.rate * (1 << ADMISSION_TOKEN_SHIFT) / 1000 >= burst_;
+}
+
+std::uint32_t Admission::now_ms() const {
+  return static_cast<std::uint32_t>(std::chrono::duration_cast<std::chrono::milliseconds>(myclock::now() - created_).count());
+}
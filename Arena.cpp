@@ -0,0 +1,104 @@
+#include "Arena.h"
+
+// Set once the calling thread's idle blocks are freed, blocks released after that are freed right away
+static thread_local bool thread_blocks_gone = false;
+
+/**
+  Full-size blocks released by the arenas of one thread, freed when the thread exits
+**/
+struct ThreadBlocks {
+  std::vector<char *> blocks;
+
+  ~ThreadBlocks() {
+    thread_blocks_gone = true;
+    for (char *block : blocks) ::operator delete(block);
+  }
+};
+
+static std::vector<char *> *thread_blocks() {
+  if (thread_blocks_gone) return nullptr;
+  static thread_local ThreadBlocks blocks;
+  return &blocks.blocks;
+}
+
+/**
+  @brief Allocate a block, reusing one released on this thread if it is full-size
+
+  @param[in]  size  Size of the block
+
+  @return  Block of `size` bytes
+**/
+static char *new_block(size_t size) {
+  std::vector<char *> *idle = size == ARENA_BLOCK_SIZE ? thread_blocks() : nullptr;
+  if (!idle || idle->empty()) return static_cast<char *>(::operator new(size));
+  char *block = idle->back();
+  idle->pop_back();
+  return block;
+}
+
+/**
+  @brief Free a block, or keep it for the thread's next arena if it is full-size and the thread holds few blocks
+
+  @param[in]  block  Block to free
+  @param[in]  size   Size of the block
+**/
+static void free_block(char *block, size_t size) {
+  std::vector<char *> *idle = size == ARENA_BLOCK_SIZE ? thread_blocks() : nullptr;
+  if (idle && idle->size() < ARENA_THREAD_BLOCKS) {
+    idle->push_back(block);
+    return;
+  }
+  ::operator delete(block);
+}
+
+Arena::Arena(size_t block_size) : block_size_(block_size) { blocks_.reserve(8); }
+
+Arena::~Arena() { release(); }
+
+/**
+  @brief Allocate memory from the arena
+
+  @param[in]  n      Number of bytes to allocate
+  @param[in]  align  Required alignment, must be a power of two no larger than alignof(std::max_align_t)
+
+  @return  Pointer to the allocated memory, valid until the next call to `reset()`
+**/
+void *Arena::allocate(size_t n, size_t align) {
+  size_t offset = (offset_ + align - 1) & ~(align - 1);
+
+  if (blocks_.empty() || offset + n > blocks_.back().size) {
+    // Start a new block, oversized allocations get a block of their own
+    size_t size = std::max(block_size_, n);
+    blocks_.push_back(Block{new_block(size), size});
+    offset = 0;
+  }
+
+  void *ptr = blocks_.back().data + offset;
+  offset_   = offset + n;
+  bytes_used_ += n;
+  return ptr;
+}
+
+/**
+  @brief Release all memory allocated from the arena, keeping the first block for reuse
+**/
+void Arena::reset() {
+  for (size_t i = 1; i < blocks_.size(); i++) {
+    free_block(blocks_[i].data, blocks_[i].size);
+  }
+  if (blocks_.size() > 1) blocks_.resize(1);
+  offset_     = 0;
+  bytes_used_ = 0;
+}
+
+/**
+  @brief Release all memory allocated from the arena, including the first block
+**/
+void Arena::release() {
+  for (auto &block : blocks_) {
+    free_block(block.data, block.size);
+  }
+  blocks_.clear();
+  offset_     = 0;
+  bytes_used_ = 0;
+}
@@ -0,0 +1,254 @@
+#include "BodyStore.h"
+
+#include <cstring>
+
+#include "Metrics.h"
+
+static constexpr std::uint64_t XXH_PRIME64_1 = 0x9E3779B185EBCA87ULL;
+static constexpr std::uint64_t XXH_PRIME64_2 = 0xC2B2AE3D27D4EB4FULL;
+static constexpr std::uint64_t XXH_PRIME64_3 = 0x165667B19E3779F9ULL;
+static constexpr std::uint64_t XXH_PRIME64_4 = 0x85EBCA77C2B2AE63ULL;
+static constexpr std::uint64_t XXH_PRIME64_5 = 0x27D4EB2F165667C5ULL;
+
+static inline std::uint64_t rotl64(std::uint64_t x, int r) { return (x << r) | (x >> (64 - r)); }
+
+static inline std::uint64_t read64(const unsigned char *p) {
+  std::uint64_t v;
+  memcpy(&v, p, sizeof(v));
+  return v;
+}
+
+static inline std::uint32_t read32(const unsigned char *p) {
+  std::uint32_t v;
+  memcpy(&v, p, sizeof(v));
+  return v;
+}
+
+static inline std::uint64_t xxh_round(std::uint64_t acc, std::uint64_t input) {
+  acc += input * XXH_PRIME64_2;
+  acc = rotl64(acc, 31);
+  return acc * XXH_PRIME64_1;
+}
+
+static inline std::uint64_t xxh_merge_round(std::uint64_t acc, std::uint64_t val) {
+  acc ^= xxh_round(0, val);
+  return acc * XXH_PRIME64_1 + XXH_PRIME64_4;
+}
+
+// Streaming XXH64 with seed 0, on a little-endian host
+class XXH64 {
+ public:
+  void update(const unsigned char *p, size_t len) {
+    const unsigned char *end = p + len;
+    total_ += len;
+    if (buffered_ + len < 32) {
+      memcpy(buffer_ + buffered_, p, len);
+      buffered_ += len;
+      return;
+    }
+    if (buffered_ > 0) {
+      size_t fill = 32 - buffered_;
+      memcpy(buffer_ + buffered_, p, fill);
+      stripe(buffer_);
+      p += fill;
+      buffered_ = 0;
+    }
+    for (; p + 32 <= end; p += 32) stripe(p);
+    memcpy(buffer_, p, end - p);
+    buffered_ = end - p;
+  }
+
+  std::uint64_t digest() const {
+    const unsigned char *p = buffer_, *end = buffer_ + buffered_;
+    std::uint64_t        h;
+    if (total_ >= 32) {
+      h = rotl64(v_[0], 1) + rotl64(v_[1], 7) + rotl64(v_[2], 12) + rotl64(v_[3], 18);
+      for (std::uint64_t v : v_) h = xxh_merge_round(h, v);
+    } else {
+      h = XXH_PRIME64_5;
+    }
+    h += total_;
+
+    for (; p + 8 <= end; p += 8) h = rotl64(h ^ xxh_round(0, read64(p)), 27) * XXH_PRIME64_1 + XXH_PRIME64_4;
+    if (p + 4 <= end) {
+      h = rotl64(h ^ (read32(p) * XXH_PRIME64_1), 23) * XXH_PRIME64_2 + XXH_PRIME64_3;
+      p += 4;
+    }
+    for (; p < end; p++) h = rotl64(h ^ (*p * XXH_PRIME64_5), 11) * XXH_PRIME64_1;
+
+    h ^= h >> 33;
+    h *= XXH_PRIME64_2;
+    h ^= h >> 29;
+    h *= XXH_PRIME64_3;
+    h ^= h >> 32;
+    return h;
+  }
+
+ private:
+  void stripe(const unsigned char *p) {
+    for (int i = 0; i < 4; i++) v_[i] = xxh_round(v_[i], read64(p + 8 * i));
+  }
+
+  std::uint64_t v_[4]     = {XXH_PRIME64_1 + XXH_PRIME64_2, XXH_PRIME64_2, 0, 0 - XXH_PRIME64_1};
+  unsigned char buffer_[32];
+  size_t        buffered_ = 0;
+  std::uint64_t total_    = 0;
+};
+
+Body::Body(const Body &other) : digest_(other.digest_) {
+  if (interned()) {
+    data_ = other.data_;
+    BodyStore::global().reference(size());
+  } else if (other.data_) {
+    data_ = std::make_shared<IOBuf>(*other.data_);
+  }
+}
+
+Body::Body(Body &&other) noexcept : data_(std::move(other.data_)), digest_(other.digest_) { other.digest_ = 0; }
+
+Body::~Body() { release(); }
+
+Body &Body::operator=(const Body &other) {
+  if (this != &other) *this = Body(other);
+  return *this;
+}
+
+Body &Body::operator=(Body &&other) noexcept {
+  if (this != &other) {
+    release();
+    data_         = std::move(other.data_);
+    digest_       = other.digest_;
+    other.digest_ = 0;
+  }
+  return *this;
+}
+
+Body &Body::operator=(IOBuf &&data) {
+  release();
+  data_ = std::make_shared<IOBuf>(std::move(data));
+  return *this;
+}
+
+/**
+  @return  Contents of the body
+**/
+const IOBuf &Body::buf() const {
+  static const IOBuf empty;
+  return data_ ? *data_ : empty;
+}
+
+void Body::append(const char *data, size_t size) { mutate().append(data, size); }
+
+void Body::append(const IOBuf &data) { mutate().append(data); }
+
+/**
+  @brief Get the body for writing, detaching it from the store first if it is interned. The detached copy shares the
+  blocks of the interned body, which are never written to since they are shared.
+
+  @return  IOBuf&  Private contents of the body
+**/
+IOBuf &Body::mutate() {
+  if (interned()) {
+    auto copy = std::make_shared<IOBuf>(*data_);
+    release();
+    data_ = std::move(copy);
+  } else if (!data_) {
+    data_ = std::make_shared<IOBuf>();
+  }
+  return *data_;
+}
+
+void Body::release() {
+  if (interned()) BodyStore::global().unreference(size());
+  data_.reset();
+  digest_ = 0;
+}
+
+/**
+  @brief Share a body with the identical bodies already stored, or store it for later ones
+
+  Bodies smaller than BODY_STORE_MIN_SIZE, and bodies whose digest collides with a different stored body, stay private.
+  Bodies that fill only a small part of their blocks, such as redirects and error pages, are compacted first, since
+  they are about to be kept in the cache.
+
+  @param[in,out]  body  Private body, interned on return
+**/
+void BodyStore::intern(Body &body) {
+  if (body.interned()) return;
+  if (body.data_) body.data_->compact();
+  if (body.size() < BODY_STORE_MIN_SIZE) return;
+
+  std::uint64_t digest = BodyStore::digest(*body.data_);
+  // Declared before the lock is taken, so the last reference to a stored body is never dropped while holding it
+  std::shared_ptr<IOBuf> shared;
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto                        it = bodies_.find(digest);
+    if (it != bodies_.end()) shared = it->second.lock();
+    if (shared) {
+      if (*shared != *body.data_) return;
+      Metrics::body_dedup_hits.add();
+    } else {
+      IOBuf *data     = new IOBuf(std::move(*body.data_));
+      shared          = std::shared_ptr<IOBuf>(data, [this, digest](IOBuf *data) { release(digest, data); });
+      bodies_[digest] = shared;
+      count_.store(bodies_.size(), std::memory_order_relaxed);
+      stored_bytes_.fetch_add(data->size(), std::memory_order_relaxed);
+    }
+  }
+  body.data_   = std::move(shared);
+  body.digest_ = digest;
+  reference(body.size());
+}
+
+/**
+  @brief Free a stored body once the last response holding it is freed
+
+  @param[in]  digest  Digest of the body
+  @param[in]  data    Contents of the body
+**/
+void BodyStore::release(std::uint64_t digest, const IOBuf *data) {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto                        it = bodies_.find(digest);
+    // The digest may have been stored again already, by a body interned after this one expired
+    if (it != bodies_.end() && it->second.expired()) bodies_.erase(it);
+    count_.store(bodies_.size(), std::memory_order_relaxed);
+    stored_bytes_.fetch_sub(data->size(), std::memory_order_relaxed);
+  }
+  delete data;
+}
+
+/**
+  @return  Bytes of the interned bodies, as held by responses, per byte stored. 1 when no body is stored
+**/
+double BodyStore::dedup_ratio() const {
+  std::uint64_t stored = stored_bytes();
+  return stored == 0 ? 1.0 : static_cast<double>(referenced_bytes()) / stored;
+}
+
+/**
+  @brief Compute the digest a body is stored under
+
+  @param[in]  data  Contents of the body
+
+  @return  XXH64 of the body, never 0
+**/
+std::uint64_t BodyStore::digest(const IOBuf &data) {
+  XXH64 state;
+  data.for_each([&](const char *p, size_t len) { state.update(reinterpret_cast<const unsigned char *>(p), len); });
+  std::uint64_t h = state.digest();
+  return h == 0 ? 1 : h;
+}
+
+/**
+  @brief Get the process-wide body store
+
+  The store is never destroyed, so the responses in caches destroyed after it at exit can still release their bodies.
+
+  @return  BodyStore&  Process-wide body store
+**/
+BodyStore &BodyStore::global() {
+  static BodyStore *store = new BodyStore();
+  return *store;
+}
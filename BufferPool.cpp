@@ -0,0 +1,120 @@
+#include "BufferPool.h"
+
+std::mutex               BufferPool::mutex_;
+std::vector<std::string> BufferPool::small_;
+std::vector<std::string> BufferPool::large_;
+std::atomic<size_t>      BufferPool::idle_{0};
+std::atomic<size_t>      BufferPool::idle_bytes_{0};
+std::atomic<size_t>      BufferPool::borrowed_{0};
+std::atomic<size_t>      BufferPool::borrowed_bytes_{0};
+
+// Set once the calling thread's buffers are destroyed, buffers released after that go to the shared pool
+static thread_local bool thread_buffers_gone = false;
+
+BufferPool::ThreadBuffers::ThreadBuffers() {
+  small.reserve(BUFFER_POOL_THREAD_IDLE);
+  large.reserve(BUFFER_POOL_THREAD_IDLE);
+}
+
+BufferPool::ThreadBuffers::~ThreadBuffers() {
+  thread_buffers_gone = true;
+  for (auto *pool : {&small, &large}) {
+    for (auto &buf : *pool) {
+      size_t capacity = buf.capacity();
+      if (release_shared(std::move(buf))) continue;
+      idle_.fetch_sub(1, std::memory_order_relaxed);
+      idle_bytes_.fetch_sub(capacity, std::memory_order_relaxed);
+    }
+  }
+}
+
+/**
+  @brief Get the idle buffers of the calling thread
+
+  @return  Buffers of the thread, or nullptr once the thread is exiting and they are gone
+**/
+BufferPool::ThreadBuffers *BufferPool::thread_buffers() {
+  if (thread_buffers_gone) return nullptr;
+  static thread_local ThreadBuffers buffers;
+  return &buffers;
+}
+
+/**
+  @brief Get a buffer of at least `size` bytes, from the thread's idle buffers, then from the shared pool, allocating
+  a new one if none are idle
+
+  @param[in]  size  Required buffer size, rounded up to MAXLINE or MAXBUF
+
+  @return  Handle to a buffer resized to its size class
+**/
+BufferPool::PooledBuffer BufferPool::acquire(size_t size) {
+  bool           small    = size <= MAXLINE;
+  size_t         capacity = small ? MAXLINE : std::max<size_t>(size, MAXBUF);
+  ThreadBuffers *local    = thread_buffers();
+  std::string    buf;
+  bool           reused   = false;
+  if (local && !(small ? local->small : local->large).empty()) {
+    std::vector<std::string> &pool = small ? local->small : local->large;
+    buf                            = std::move(pool.back());
+    pool.pop_back();
+    reused = true;
+  } else {
+    std::vector<std::string>   &pool = small ? small_ : large_;
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (!pool.empty()) {
+      buf = std::move(pool.back());
+      pool.pop_back();
+      reused = true;
+    }
+  }
+  if (reused) {
+    idle_.fetch_sub(1, std::memory_order_relaxed);
+    idle_bytes_.fetch_sub(buf.capacity(), std::memory_order_relaxed);
+  }
+  buf.resize(capacity);
+  size_t bytes = buf.capacity();
+  borrowed_.fetch_add(1, std::memory_order_relaxed);
+  borrowed_bytes_.fetch_add(bytes, std::memory_order_relaxed);
+  return PooledBuffer(std::move(buf), bytes);
+}
+
+/**
+  @brief Return a buffer to the thread's idle buffers, or to the shared pool once the thread holds enough. The buffer
+  is freed if the shared pool is full.
+
+  @param[in]  buf    Buffer to return
+  @param[in]  bytes  Bytes counted as borrowed when the buffer was handed out, 0 for a buffer not from the pool
+**/
+void BufferPool::release(std::string &&buf, size_t bytes) {
+  if (bytes > 0) {
+    borrowed_.fetch_sub(1, std::memory_order_relaxed);
+    borrowed_bytes_.fetch_sub(bytes, std::memory_order_relaxed);
+  }
+  size_t capacity = buf.capacity();
+  if (capacity < MAXLINE) return;
+
+  ThreadBuffers            *local = thread_buffers();
+  std::vector<std::string> *pool  = local ? (capacity < MAXBUF ? &local->small : &local->large) : nullptr;
+  if (pool && pool->size() < BUFFER_POOL_THREAD_IDLE) {
+    pool->push_back(std::move(buf));
+  } else if (!release_shared(std::move(buf))) {
+    return;
+  }
+  idle_.fetch_add(1, std::memory_order_relaxed);
+  idle_bytes_.fetch_add(capacity, std::memory_order_relaxed);
+}
+
+/**
+  @brief Return a buffer to the shared pool, unless it is full
+
+  @param[in]  buf  Buffer to return, of at least MAXLINE bytes
+
+  @return  True if the pool kept the buffer, false if it was freed
+**/
+bool BufferPool::release_shared(std::string &&buf) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  std::vector<std::string>   &pool = buf.capacity() < MAXBUF ? small_ : large_;
+  if (pool.size() >= BUFFER_POOL_MAX_IDLE) return false;
+  pool.push_back(std::move(buf));
+  return true;
+}
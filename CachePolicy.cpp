@@ -0,0 +1,174 @@
+#include "CachePolicy.h"
+
+#include <time.h>
+
+#include <algorithm>
+#include <cstdlib>
+
+// Directives of a Cache-Control header that matter to a shared cache
+struct CacheControl {
+  bool no_store   = false;
+  bool no_cache   = false;
+  bool is_private = false;
+  long max_age    = -1;
+  long s_maxage   = -1;
+};
+
+static CacheControl parse_cache_control(StrView header) {
+  CacheControl cc;
+  std::string  value = header.str();
+  for (size_t start = 0; start < value.size();) {
+    size_t      end       = std::min(value.find(',', start), value.size());
+    std::string directive = lower(strip(value.substr(start, end - start), " \t"));
+    start                 = end + 1;
+
+    size_t      eq       = directive.find('=');
+    std::string name     = directive.substr(0, eq);
+    std::string argument = eq == std::string::npos ? "" : strip(directive.substr(eq + 1), "\"");
+    if (name == "no-store") cc.no_store = true;
+    else if (name == "no-cache") cc.no_cache = true;
+    else if (name == "private") cc.is_private = true;
+    else if (name == "max-age" && !argument.empty()) cc.max_age = std::strtol(argument.c_str(), nullptr, 10);
+    else if (name == "s-maxage" && !argument.empty()) cc.s_maxage = std::strtol(argument.c_str(), nullptr, 10);
+  }
+  return cc;
+}
+
+// Parse an IMF-fixdate, such as "Sun, 06 Nov 1994 08:49:37 GMT"
+static bool parse_http_date(StrView header, std::time_t &date) {
+  std::string value = header.str();
+  struct tm   tm    = {};
+  if (!strptime(value.c_str(), "%a, %d %b %Y %H:%M:%S", &tm)) return false;
+  date = timegm(&tm);
+  return true;
+}
+
+/**
+  @brief Set the TTL of a kind of response from a command line option
+
+  @param[in]  option  `<redirect|negative>=<seconds>`
+
+  @return  False if the option is invalid
+**/
+bool CachePolicy::parse(const std::string &option) {
+  size_t eq = option.find('=');
+  if (eq == std::string::npos) return false;
+
+  std::string name    = option.substr(0, eq);
+  char       *end     = nullptr;
+  long        seconds = std::strtol(option.c_str() + eq + 1, &end, 10);
+  if (end == option.c_str() + eq + 1 || *end != '\0' || seconds < 0) return false;
+
+  if (name == "redirect") redirect = std::chrono::seconds(seconds);
+  else if (name == "negative") negative = std::chrono::seconds(seconds);
+  else return false;
+  return true;
+}
+
+/**
+  @brief Decide how long a response from the server may be cached
+
+  @param[in]  response  Response from the server
+
+  @return  TTL of the response, 0 if it must not be cached
+**/
+std::chrono::seconds CachePolicy::ttl(const HTTPResponse &response) const {
+  std::chrono::seconds heuristic{0};
+  switch (static_cast<int>(response.code())) {
+    case 200:
+      heuristic = timeout;
+      break;
+    case 301:
+    case 308:
+      heuristic = redirect;
+      break;
+    case 302:
+    case 307:
+      break;
+    case 404:
+    case 410:
+      heuristic = negative;
+      break;
+    default:
+      return std::chrono::seconds(0);
+  }
+
+  CacheControl cc = parse_cache_control(response.header(Header::CacheControl));
+  if (cc.no_store || cc.no_cache || cc.is_private) return std::chrono::seconds(0);
+
+  // Explicit freshness: s-maxage, then max-age, then Expires relative to Date. An invalid Expires is in the past.
+  std::chrono::seconds fresh_for = heuristic;
+  if (cc.s_maxage >= 0) fresh_for = std::chrono::seconds(cc.s_maxage);
+  else if (cc.max_age >= 0) fresh_for = std::chrono::seconds(cc.max_age);
+  else if (!response.header(Header::Expires).empty()) {
+    std::time_t expires = 0, date = time(nullptr);
+    if (!parse_http_date(response.header(Header::Expires), expires)) expires = 0;
+    parse_http_date(response.header(Header::Date), date);
+    fresh_for = std::chrono::seconds(std::max<std::time_t>(expires - date, 0));
+  }
+  return std::min(fresh_for, timeout);
+}
+
+/**
+  @brief Remember the deadline of a page about to be cached, if it expires before the cache timeout
+
+  @param[in]  key  Key the page is cached under
+  @param[in]  ttl  TTL of the page, from ttl()
+
+  @return  False if the page must not be cached, since too many deadlines are tracked already in its shard
+**/
+bool CachePolicy::stored(const URIKey &key, std::chrono::seconds ttl) {
+  Shard                      &s = shard(key);
+  std::lock_guard<std::mutex> lock(s.mutex);
+  if (ttl >= timeout) {
+    if (s.deadlines.erase(key)) resized(s);
+    return true;
+  }
+
+  time_point now = myclock::now();
+  if (s.deadlines.size() >= CACHE_POLICY_MAX_TRACKED / CACHE_POLICY_SHARDS && !s.deadlines.count(key)) {
+    for (auto it = s.deadlines.begin(); it != s.deadlines.end();) {
+      if (it->second <= now) it = s.deadlines.erase(it);
+      else ++it;
+    }
+    resized(s);
+    if (s.deadlines.size() >= CACHE_POLICY_MAX_TRACKED / CACHE_POLICY_SHARDS) return false;
+  }
+  s.deadlines[key] = now + ttl;
+  resized(s);
+  return true;
+}
+
+/**
+  @brief Check whether a page found in the page cache is still fresh
+
+  @param[in]  key  Key the page is cached under
+
+  @return  False if the page is past its deadline and must be removed from the cache
+**/
+bool CachePolicy::fresh(const URIKey &key) {
+  Shard &s = shard(key);
+  if (s.size.load(std::memory_order_relaxed) == 0) return true;
+  std::lock_guard<std::mutex> lock(s.mutex);
+  auto                        it = s.deadlines.find(key);
+  if (it == s.deadlines.end() || myclock::now() < it->second) return true;
+  s.deadlines.erase(it);
+  resized(s);
+  return false;
+}
+
+// Publish the size of a shard after its deadlines changed, must be called with its mutex held
+void CachePolicy::resized(Shard &s) {
+  size_t size = s.deadlines.size();
+  tracked_.fetch_add(size - s.size.exchange(size, std::memory_order_relaxed), std::memory_order_relaxed);
+}
+
+/**
+  @brief Get the process-wide cache policy, configured from the command line
+
+  @return  CachePolicy&  Process-wide cache policy
+**/
+CachePolicy &CachePolicy::global() {
+  static CachePolicy policy;
+  return policy;
+}
@@ -0,0 +1,91 @@
+#include "CannedResponse.h"
+
+#include <algorithm>
+#include <iterator>
+#include <mutex>
+#include <unordered_map>
+#include <utility>
+
+// Every ResponseCode the proxy can send, sorted by code so it can be searched
+static constexpr ResponseCode response_codes[] = {
+    ResponseCode::OK,       ResponseCode::PartialContent,      ResponseCode::BadRequest,      ResponseCode::Forbidden,
+    ResponseCode::NotFound, ResponseCode::RangeNotSatisfiable, ResponseCode::TooManyRequests, ResponseCode::InternalServerError,
+    ResponseCode::ServiceUnavailable, ResponseCode::GatewayTimeout,
+};
+static constexpr size_t num_response_codes = std::size(response_codes);
+
+static_assert(std::is_sorted(std::begin(response_codes), std::end(response_codes)), "response_codes must be sorted");
+static_assert(std::adjacent_find(std::begin(response_codes), std::end(response_codes)) == std::end(response_codes),
+              "response_codes must not have duplicates");
+
+/**
+  @brief Serialize a bodiless response
+
+  @param[in]  code      Response code
+  @param[in]  http_1_0  True for a HTTP/1.0 response that closes the connection, false for a HTTP/1.1 keep-alive one
+
+  @return  std::string  Serialized response
+**/
+static std::string serialize(ResponseCode code, bool http_1_0) {
+  std::string status = std::to_string(static_cast<int>(code)) + " " + to_string(code) + "\r\n";
+  if (http_1_0) return "HTTP/1.0 " + status + "Connection: close\r\nContent-Length: 0\r\n\r\n";
+  return "HTTP/1.1 " + status + "Connection: keep-alive\r\nContent-Length: 0\r\n\r\n";
+}
+
+/**
+  Pre-serialized bodiless responses for every ResponseCode and HTTP version, built once on first use
+**/
+struct CannedResponses {
+  std::string http_1_0[num_response_codes];
+  std::string http_1_1[num_response_codes];
+
+  CannedResponses() {
+    for (size_t i = 0; i < num_response_codes; i++) {
+      http_1_0[i] = serialize(response_codes[i], true);
+      http_1_1[i] = serialize(response_codes[i], false);
+    }
+  }
+};
+
+/**
+  @brief Get a serialized response for a code missing from the table, built on its first use and kept for the life of
+  the process, so the reference stays valid like those into the table
+
+  @param[in]  code      Response code
+  @param[in]  http_1_0  True for a HTTP/1.0 response
+
+  @return  const std::string&  Serialized response
+**/
+static const std::string &uncanned_response(ResponseCode code, bool http_1_0) {
+  static std::mutex                                                   mutex;
+  static std::unordered_map<int, std::pair<std::string, std::string>> responses;
+
+  std::lock_guard<std::mutex> lock(mutex);
+  auto                        it = responses.find(static_cast<int>(code));
+  if (it == responses.end()) {
+    log("No canned response for status %d, building one", static_cast<int>(code));
+    it = responses.emplace(static_cast<int>(code), std::make_pair(serialize(code, true), serialize(code, false))).first;
+  }
+  return http_1_0 ? it->second.first : it->second.second;
+}
+
+/**
+  @brief Get a pre-serialized response with no body for a status code
+
+  The returned string is built once per process and can be written to a client without any allocation. Codes missing
+  from the table are served too, with a response built on their first use.
+
+  @param[in]  code     Response code
+  @param[in]  version  HTTP version of the request, anything other than "HTTP/1.0" is answered with HTTP/1.1
+
+  @return  const std::string&  Serialized response
+**/
+const std::string &canned_response(ResponseCode code, const std::string &version) {
+  static const CannedResponses responses;
+
+  bool                http_1_0 = version == "HTTP/1.0";
+  const ResponseCode *it       = std::lower_bound(std::begin(response_codes), std::end(response_codes), code);
+  if (it == std::end(response_codes) || *it != code) return uncanned_response(code, http_1_0);
+  size_t idx = it - std::begin(response_codes);
+  return http_1_0 ? responses.http_1_0[idx] : responses.http_1_1[idx];
+}
@@ -0,0 +1,110 @@
+#include "Compression.h"
+
+/**
+  @brief Compress a string into gzip format
+
+  @param[in]   in     Data to compress
+  @param[out]  out    Output string to store compressed data in
+  @param[in]   level  zlib compression level
+
+  @return  True if compression succeeded, false otherwise
+**/
+bool gzip_compress(const std::string &in, std::string &out, int level) {
+  z_stream stream;
+  memset(&stream, 0, sizeof(stream));
+
+  // windowBits + 16 selects a gzip wrapper instead of raw zlib
+  if (deflateInit2(&stream, level, Z_DEFLATED, MAX_WBITS + 16, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+    log("Error initializing deflate stream");
+    return false;
+  }
+
+  out.resize(deflateBound(&stream, in.size()));
+  stream.next_in   = reinterpret_cast<Bytef *>(const_cast<char *>(in.data()));
+  stream.avail_in  = in.size();
+  stream.next_out  = reinterpret_cast<Bytef *>(&out[0]);
+  stream.avail_out = out.size();
+
+  int ret = deflate(&stream, Z_FINISH);
+  if (ret != Z_STREAM_END) {
+    log("Error compressing body: %s", stream.msg ? stream.msg : "unknown error");
+    deflateEnd(&stream);
+    out.clear();
+    return false;
+  }
+  out.resize(stream.total_out);
+  deflateEnd(&stream);
+  return true;
+}
+
+/**
+  @brief Decompress a gzip-encoded string
+
+  @param[in]   in         Data to decompress
+  @param[out]  out        Output string to store decompressed data in
+  @param[in]   size_hint  Expected decompressed size, used to preallocate the output
+
+  @return  True if decompression succeeded, false otherwise
+**/
+bool gzip_decompress(const std::string &in, std::string &out, size_t size_hint) {
+  z_stream stream;
+  memset(&stream, 0, sizeof(stream));
+
+  if (inflateInit2(&stream, MAX_WBITS + 16) != Z_OK) {
+    log("Error initializing inflate stream");
+    return false;
+  }
+
+  out.resize(size_hint > 0 ? size_hint : in.size() * 4);
+  stream.next_in  = reinterpret_cast<Bytef *>(const_cast<char *>(in.data()));
+  stream.avail_in = in.size();
+
+  int ret = Z_OK;
+  while (ret != Z_STREAM_END) {
+    // Grow output if the size hint was too small
+    if (stream.total_out == out.size()) out.resize(out.size() * 2);
+    stream.next_out  = reinterpret_cast<Bytef *>(&out[stream.total_out]);
+    stream.avail_out = out.size() - stream.total_out;
+
+    ret = inflate(&stream, Z_NO_FLUSH);
+    if (ret != Z_OK && ret != Z_STREAM_END) {
+      log("Error decompressing body: %s", stream.msg ? stream.msg : "unknown error");
+      inflateEnd(&stream);
+      out.clear();
+      return false;
+    }
+  }
+  out.resize(stream.total_out);
+  inflateEnd(&stream);
+  return true;
+}
+
+/**
+  @brief Check if an Accept-Encoding header value allows a given content coding
+
+  @param[in]  accept_encoding  Value of the Accept-Encoding header
+  @param[in]  coding           Content coding to check for, e.g. "gzip"
+
+  @return  True if the coding is listed (or matched by "*") with a non-zero q-value
+**/
+bool accepts_encoding(const std::string &accept_encoding, const std::string &coding) {
+  std::stringstream stream(lower(accept_encoding));
+  std::string       item;
+
+  while (std::getline(stream, item, ',')) {
+    std::string name = item, params;
+    size_t      param_idx = item.find(';');
+    if (param_idx != std::string::npos) {
+      name   = item.substr(0, param_idx);
+      params = item.substr(param_idx + 1);
+    }
+    name = strip(name, " \t");
+    if (name != coding && name != "*") continue;
+
+    // Check for an explicit q=0, which means "not acceptable"
+    size_t q_idx = params.find("q=");
+    if (q_idx != std::string::npos && std::atof(params.c_str() + q_idx + 2) <= 0.0) return false;
+    return true;
+  }
+  return false;
+}
@@ -1,17 +1,76 @@
 #include "Connection.h"
+#include "BufferPool.h"
+#include "IOBuf.h"
+#include "IOUring.h"
+#include "Metrics.h"
+#include "Reactor.h"
+#include "SocketOptions.h"
+#include "Trace.h"
+#include "URIKey.h"
 
-Connection::Connection(Connection&& other) : sockfd_(other.sockfd_), ip_cache_(other.ip_cache_) { other.sockfd_ = -1; }
+IOBackend Connection::backend_ = IOBackend::Syscall;
+
+/**
+  @brief Get the io_uring through which a coroutine on a shared reactor runs its socket operations
+
+  @param[in]  reactor  Reactor of the calling thread
+
+  @return  Ring of the reactor, or nullptr if the reactor uses system calls or is private
+**/
+static IOUring* reactor_ring(Reactor& reactor) {
+  return Connection::backend() == IOBackend::IOUring && reactor.shared() ? reactor.ring() : nullptr;
+}
+
+/**
+  @brief Convert the result of an io_uring operation to that of the system call it replaces
+
+  @param[in]  res  Result, or -errno
+
+  @return  Result, or -1 with errno set
+**/
+static int op_result(int res) {
+  if (res >= 0) return res;
+  errno = -res;
+  return -1;
+}
+
+Connection::Connection(Connection&& other)
+    : sockfd_(other.sockfd_), ring_slot_(other.ring_slot_), ring_(other.ring_), ip_cache_(other.ip_cache_) {
+  other.sockfd_    = -1;
+  other.ring_slot_ = -1;
+  other.ring_      = nullptr;
+}
 
 Connection::~Connection() { close(); }
 
-int Connection::connect(ProxyURI* proxy_info) {
-  struct addrinfo hints, *server_info = NULL;
-  std::string     key = proxy_info->host + ":" + proxy_info->port;
+/**
+  @brief Connect to a server, blocking the calling thread
+
+  @param[inout]  proxy_info  Server to connect to, its IP is set once connected
+
+  @return  Connected socket, or -1 on error
+**/
+int Connection::connect(ProxyURI* proxy_info) { return Reactor::block_on(async_connect(proxy_info)); }
+
+/**
+  @brief Connect to a server, at its cached address if there is one. On a shared reactor, the DNS lookup runs on a
+  helper thread and the coroutine waits for the connection instead of blocking.
+
+  @param[inout]  proxy_info  Server to connect to, its IP is set once connected
+
+  @return  Connected socket, or -1 on error
+**/
+Task<int> Connection::async_connect(ProxyURI* proxy_info) {
+  struct addrinfo* server_info = NULL;
+  URIKey           key         = URIKey::origin(*proxy_info);
   // Check cache for Host/IP mapping
-  auto addr           = ip_cache_->get(key);
+  auto             addr        = ip_cache_->get(key);
   if (addr) {
-    sockfd_ = connect(proxy_info, addr.get());
-    if (sockfd_ >= 0) return sockfd_;
+    co_await async_connect(proxy_info, addr->ai_family, addr->ai_socktype, addr->ai_protocol, addr->ai_addr.get(), addr->ai_addrlen);
+    if (sockfd_ >= 0) {
+      Metrics::dns_cache_hits.add();
+      co_return sockfd_;
+    }
     else {
       log("Error connecting to server at cached IP: %s\nRemoving cached value and finding new IP", strerror(errno));
       ip_cache_->remove(key);
@@ -19,17 +78,9 @@ int Connection::connect(ProxyURI* proxy_info) {
   }
 
   // Cache value not found, get IP from DNS
-  memset(&hints, 0, sizeof(hints));
-
-  log("Getting server info for %s:%s", proxy_info->host.c_str(), proxy_info->port.c_str());
-  hints.ai_protocol = IPPROTO_TCP;
-  int ret           = getaddrinfo(proxy_info->host.c_str(), proxy_info->port.c_str(), &hints, &server_info);
-  if (ret != 0) {
-    log("getaddrinfo failed: host=%s:%s, error=%s", proxy_info->host.c_str(), proxy_info->port.c_str(), gai_strerror(ret));
-    return -1;
-  }
+  if (co_await async_resolve(*proxy_info, &server_info) != 0) co_return -1;
   for (struct addrinfo* rp = server_info; rp != NULL; rp = rp->ai_next) {
-    sockfd_ = connect(proxy_info, rp);
+    co_await async_connect(proxy_info, rp->ai_family, rp->ai_socktype, rp->ai_protocol, rp->ai_addr, rp->ai_addrlen);
     if (sockfd_ == -1) continue;
 
     // Cache IP
@@ -37,11 +88,72 @@ int Connection::connect(ProxyURI* proxy_info) {
     break;
   }
   freeaddrinfo(server_info);
-  return sockfd_;
+  co_return sockfd_;
+}
+
+/**
+  @brief Look up the addresses of a server with getaddrinfo(), which runs on a helper thread on a shared reactor
+
+  @param[in]   proxy_info   Server to look up
+  @param[out]  server_info  Addresses of the server, to be freed with freeaddrinfo()
+
+  @return  0 on success, or the error code of getaddrinfo()
+**/
+Task<int> Connection::async_resolve(const ProxyURI& proxy_info, struct addrinfo** server_info) {
+  struct addrinfo hints;
+  memset(&hints, 0, sizeof(hints));
+
+  log("Getting server info for %s:%s", proxy_info.host.c_str(), proxy_info.port.c_str());
+  hints.ai_protocol    = IPPROTO_TCP;
+  int        ret       = 0;
+  time_point dns_start = myclock::now();
+  co_await Reactor::current().offload([&] { ret = getaddrinfo(proxy_info.host.c_str(), proxy_info.port.c_str(), &hints, server_info); });
+  time_point dns_end = myclock::now();
+  Metrics::dns.record(dns_end - dns_start);
+  Trace::record(TracePhase::Dns, dns_start, dns_end);
+  if (ret != 0) {
+    log("getaddrinfo failed: host=%s:%s, error=%s", proxy_info.host.c_str(), proxy_info.port.c_str(), gai_strerror(ret));
+  }
+  co_return ret;
+}
+
+/**
+  @brief Select the I/O backend used by all connections, falling back to system calls if io_uring is unavailable
+
+  @param[in]  backend  Requested backend
+**/
+void Connection::set_backend(IOBackend backend) {
+  if (backend == IOBackend::IOUring && !IOUring::supported()) {
+    log("io_uring is not supported by this kernel, falling back to system calls");
+    backend = IOBackend::Syscall;
+  }
+  backend_ = backend;
+}
+
+/**
+  @brief Get the fixed file slot of the socket in the calling thread's ring, registering it on first use
+
+  @return  Fixed file slot, or -1 if the socket can not be used as a fixed file
+**/
+int Connection::ring_slot() {
+  IOUring& ring = IOUring::thread_ring();
+  if (!is_connected() || !ring.ok()) return -1;
+  if (ring_ == &ring) return ring_slot_;
+  if (ring_) return -1;  // Registered with another thread's ring
+
+  ring_slot_ = ring.register_file(sockfd_);
+  if (ring_slot_ >= 0) ring_ = &ring;
+  return ring_slot_;
 }
 
 void Connection::close() {
-  if (sockfd_ > 0) ::close(sockfd_);
+  if (ring_) ring_->unregister_file(ring_slot_);
+  ring_      = nullptr;
+  ring_slot_ = -1;
+  if (sockfd_ > 0) {
+    Reactor::current().forget(sockfd_);
+    ::close(sockfd_);
+  }
   sockfd_ = -1;
 }
 
@@ -50,73 +162,282 @@ int Connection::recv(std::string& buf, size_t n, int flags, bool autoclose) {
   return recv(&buf[0], max_len, flags, autoclose);
 }
 
-int Connection::recv(char* buf, size_t n, int flags, bool autoclose) {
-  if (!is_connected()) return -1;
-  int read = ::recv(sockfd_, &buf[0], n, flags);
-  if (read == 0) {
+int Connection::recv(char* buf, size_t n, int flags, bool autoclose) { return Reactor::block_on(async_recv(buf, n, flags, autoclose)); }
+
+Task<int> Connection::async_recv(std::string& buf, size_t n, int flags, bool autoclose) {
+  size_t max_len = n > 0 ? n : buf.capacity();
+  return async_recv(&buf[0], max_len, flags, autoclose);
+}
+
+/**
+  @brief Receive from the socket once. On a shared reactor, the coroutine waits until the socket is readable unless
+  flags has MSG_DONTWAIT, or until the receive completes on the reactor's io_uring; elsewhere the call blocks.
+
+  @return  Number of bytes received, or -1 on error with errno set
+**/
+Task<int> Connection::async_recv(char* buf, size_t n, int flags, bool autoclose) {
+  if (!is_connected()) co_return -1;
+  Reactor& reactor = Reactor::current();
+  IOUring* ring    = reactor_ring(reactor);
+  bool     wait    = reactor.shared() && !(flags & MSG_DONTWAIT);
+  int      read    = -1;
+  if (ring && wait) {
+    int slot = ring_slot();
+    read     = op_result(co_await ring->async_recv(slot >= 0 ? slot : sockfd_, slot >= 0, buf, n, flags));
+  } else {
+    read = io_recv(&buf[0], n, reactor.shared() ? flags | MSG_DONTWAIT : flags);
+  }
+  while (read < 0 && (errno == EWOULDBLOCK || errno == EAGAIN) && wait) {
+    if (!co_await reactor.readable(sockfd_)) {
+      errno = Signaler::done ? EINTR : EBADF;
+      break;
+    }
+    read = io_recv(&buf[0], n, flags | MSG_DONTWAIT);
+  }
+  if (read == 0 || (read < 0 && !(errno == EWOULDBLOCK || errno == EAGAIN))) {
     if (autoclose) {
       int old_errno = errno;
       close();
       errno = old_errno;
     }
-  } else if (read < 0 && !(errno == EWOULDBLOCK || errno == EAGAIN)) {
+  }
+  co_return read;
+}
+
+/**
+  @brief Send on the socket once. On a shared reactor, the coroutine waits until the socket is writable, or until the
+  send completes on the reactor's io_uring; elsewhere the call blocks.
+
+  @return  Number of bytes sent, or -1 on error with errno set
+**/
+Task<int> Connection::async_send(const char* buf, size_t n, bool autoclose) {
+  if (!is_connected()) co_return -1;
+  Reactor& reactor = Reactor::current();
+  IOUring* ring    = reactor_ring(reactor);
+  int      sent    = -1;
+  if (ring) {
+    int slot = ring_slot();
+    sent     = op_result(co_await ring->async_send(slot >= 0 ? slot : sockfd_, slot >= 0, buf, n, 0));
+  } else {
+    sent = io_send(buf, n, reactor.shared() ? MSG_DONTWAIT : 0);
+  }
+  while (sent < 0 && (errno == EWOULDBLOCK || errno == EAGAIN) && reactor.shared()) {
+    if (!co_await reactor.writable(sockfd_)) {
+      errno = Signaler::done ? EINTR : EBADF;
+      break;
+    }
+    sent = io_send(buf, n, MSG_DONTWAIT);
+  }
+  if (sent == 0 || (sent < 0 && !(errno == EWOULDBLOCK || errno == EAGAIN))) {
     if (autoclose) {
       int old_errno = errno;
       close();
       errno = old_errno;
     }
   }
-  return read;
+  co_return sent;
 }
 
 int Connection::send_n(const std::string& data, size_t len, bool autoclose) {
+  return Reactor::block_on(async_send_n(data, len, autoclose));
+}
+
+Task<int> Connection::async_send_n(const std::string& data, size_t len, bool autoclose) {
+  co_return co_await async_send_n(data.data(), len > 0 ? len : data.size(), autoclose);
+}
+
+/**
+  @brief Send a buffer that is not held in a string, such as a response in shared memory
+
+  @param[in]  data       Data to send
+  @param[in]  len        Number of bytes to send
+  @param[in]  autoclose  Close the connection on error
+
+  @return  Number of bytes sent, or the result of the failed send
+**/
+Task<int> Connection::async_send_n(const char* data, size_t len, bool autoclose) {
   int n_send_total = 0;
   int n_send       = 0;
-  int size         = len > 0 ? len : data.size();
+  int size         = len;
 
-  if (!is_connected()) return -1;
+  if (!is_connected()) co_return -1;
   while (n_send_total < size && !Signaler::done) {
-    n_send = write(sockfd_, &data[n_send_total], size - n_send_total);
-    if (n_send < 0) {
-      if (errno == EWOULDBLOCK || errno == EAGAIN) {
-        continue;
-      } else {
-        if (autoclose) {
-          int old_errno = errno;
-          close();
-          errno = old_errno;
-        }
-        return n_send;
-      }
-    } else if (n_send == 0) {
-      if (autoclose) {
-        int old_errno = errno;
-        close();
-        errno = old_errno;
-      }
-      return n_send;
+    n_send = co_await async_send(data + n_send_total, size - n_send_total, autoclose);
+    if (n_send < 0 && (errno == EWOULDBLOCK || errno == EAGAIN)) continue;
+    if (n_send <= 0) co_return n_send;
+    n_send_total += n_send;
+  }
+  co_return n_send_total;
+}
+
+/**
+  @brief Send gathered buffers on the socket once. On a shared reactor, the coroutine waits until the socket is
+  writable, or until the send completes on the reactor's io_uring; elsewhere the call blocks.
+
+  @return  Number of bytes sent, or -1 on error with errno set
+**/
+Task<int> Connection::async_sendmsg(const struct iovec* iov, size_t iovcnt, bool autoclose) {
+  if (!is_connected()) co_return -1;
+  Reactor& reactor = Reactor::current();
+  IOUring* ring    = reactor_ring(reactor);
+  int      sent    = -1;
+  if (ring) {
+    // Kept in the coroutine frame, the kernel may read the message until the send completes
+    struct msghdr msg = {};
+    msg.msg_iov       = const_cast<struct iovec*>(iov);
+    msg.msg_iovlen    = iovcnt;
+    int slot          = ring_slot();
+    sent              = op_result(co_await ring->async_sendmsg(slot >= 0 ? slot : sockfd_, slot >= 0, &msg, 0));
+  } else {
+    sent = io_sendmsg(iov, iovcnt, reactor.shared() ? MSG_DONTWAIT : 0);
+  }
+  while (sent < 0 && (errno == EWOULDBLOCK || errno == EAGAIN) && reactor.shared()) {
+    if (!co_await reactor.writable(sockfd_)) {
+      errno = Signaler::done ? EINTR : EBADF;
+      break;
     }
+    sent = io_sendmsg(iov, iovcnt, MSG_DONTWAIT);
+  }
+  if (sent == 0 || (sent < 0 && !(errno == EWOULDBLOCK || errno == EAGAIN))) {
+    if (autoclose) {
+      int old_errno = errno;
+      close();
+      errno = old_errno;
+    }
+  }
+  co_return sent;
+}
+
+/**
+  @brief Send a response whose body is held in a chained buffer, together with its head, without copying the body
+
+  @param[in]  head       Status line and headers
+  @param[in]  body       Body, sent straight from its blocks
+  @param[in]  autoclose  Close the connection on error
+
+  @return  Number of bytes sent, or the result of the failed send
+**/
+Task<int> Connection::async_send_n(const std::string& head, const IOBuf& body, bool autoclose) {
+  std::vector<struct iovec> iov;
+  iov.reserve(1 + body.num_blocks());
+  if (!head.empty()) iov.push_back(iovec{const_cast<char*>(head.data()), head.size()});
+  body.iovecs(iov);
+
+  int    n_send_total = 0;
+  int    n_send       = 0;
+  size_t first        = 0;
+  if (!is_connected()) co_return -1;
+  while (first < iov.size() && !Signaler::done) {
+    n_send = co_await async_sendmsg(&iov[first], std::min<size_t>(iov.size() - first, IOV_MAX), autoclose);
+    if (n_send < 0 && (errno == EWOULDBLOCK || errno == EAGAIN)) continue;
+    if (n_send <= 0) co_return n_send;
     n_send_total += n_send;
+
+    // Skip the iovecs sent, and the part sent of a partially sent one
+    size_t sent = n_send;
+    while (first < iov.size() && sent >= iov[first].iov_len) sent -= iov[first++].iov_len;
+    if (sent > 0) {
+      iov[first].iov_base = static_cast<char*>(iov[first].iov_base) + sent;
+      iov[first].iov_len -= sent;
+    }
   }
-  return n_send_total;
+  co_return n_send_total;
+}
+
+/**
+  @brief Receive from the socket through the thread's io_uring, or with recv(2) when using system calls. Shared
+  reactors, whose rings only run asynchronous operations, use recv(2) too.
+
+  @return  Number of bytes received, or -1 on error with errno set
+**/
+int Connection::io_recv(char* buf, size_t n, int flags) {
+  if (backend_ == IOBackend::IOUring && !Reactor::current().shared()) {
+    IOUring& ring = IOUring::thread_ring();
+    int      slot = ring_slot();
+    if (ring.ok()) return ring.recv(slot >= 0 ? slot : sockfd_, slot >= 0, buf, n, flags);
+  }
+  return ::recv(sockfd_, buf, n, flags);
+}
+
+/**
+  @brief Send on the socket through the thread's io_uring, or with send(2) when using system calls
+
+  @return  Number of bytes sent, or -1 on error with errno set
+**/
+int Connection::io_send(const char* buf, size_t n, int flags) {
+  if (backend_ == IOBackend::IOUring && !Reactor::current().shared()) {
+    IOUring& ring = IOUring::thread_ring();
+    int      slot = ring_slot();
+    if (ring.ok()) return ring.send(slot >= 0 ? slot : sockfd_, slot >= 0, buf, n, flags);
+  }
+  return ::send(sockfd_, buf, n, flags | MSG_NOSIGNAL);
+}
+
+/**
+  @brief Send gathered buffers on the socket through the thread's io_uring, or with sendmsg(2) when using system calls
+
+  @return  Number of bytes sent, or -1 on error with errno set
+**/
+int Connection::io_sendmsg(const struct iovec* iov, size_t iovcnt, int flags) {
+  struct msghdr msg = {};
+  msg.msg_iov       = const_cast<struct iovec*>(iov);
+  msg.msg_iovlen    = iovcnt;
+  if (backend_ == IOBackend::IOUring && !Reactor::current().shared()) {
+    IOUring& ring = IOUring::thread_ring();
+    int      slot = ring_slot();
+    if (ring.ok()) return ring.sendmsg(slot >= 0 ? slot : sockfd_, slot >= 0, &msg, flags);
+  }
+  return ::sendmsg(sockfd_, &msg, flags | MSG_NOSIGNAL);
 }
 
 int Connection::read_n(std::string& buf, int n, bool autoclose) { return read_n(&buf[0], n, autoclose); }
 
-int Connection::read_n(char* buf, int n, bool autoclose) {
+int Connection::read_n(char* buf, int n, bool autoclose) { return Reactor::block_on(async_read_n(buf, n, autoclose)); }
+
+Task<int> Connection::async_read_n(std::string& buf, int n, bool autoclose) { return async_read_n(&buf[0], n, autoclose); }
+
+Task<int> Connection::async_read_n(char* buf, int n, bool autoclose) {
   int n_read_total = 0;
   int n_read       = 0;
 
-  if (!is_connected()) return -1;
+  if (!is_connected()) co_return -1;
+  while (n_read_total < n && is_connected() && !Signaler::done) {
+    n_read = co_await async_recv(&buf[n_read_total], n - n_read_total, 0, autoclose);
+    if (n_read <= 0) {
+      if (errno == EWOULDBLOCK || errno == EAGAIN) continue;
+      co_return n_read;
+    }
+    n_read_total += n_read;
+  }
+  co_return n_read_total;
+}
+
+/**
+  @brief Read exactly `n` bytes from the socket straight into the blocks of a chained buffer
+
+  @param[inout]  buf        Buffer to append to, its last block is filled before new ones are chained
+  @param[in]     n          Number of bytes to read
+  @param[in]     autoclose  Close the connection on error
+
+  @co_return  Number of bytes read, or the result of the failed read
+**/
+Task<int> Connection::async_read_n(IOBuf& buf, size_t n, bool autoclose) {
+  size_t n_read_total = 0;
+  int    n_read       = 0;
+
+  if (!is_connected()) co_return -1;
   while (n_read_total < n && is_connected() && !Signaler::done) {
-    n_read = recv(&buf[n_read_total], n - n_read_total, 0, autoclose);
+    size_t room;
+    char*  dst = buf.prepare(room);
+    n_read     = co_await async_recv(dst, std::min(room, n - n_read_total), 0, autoclose);
     if (n_read <= 0) {
       if (errno == EWOULDBLOCK || errno == EAGAIN) continue;
-      return n_read;
+      co_return n_read;
     }
+    buf.commit(n_read);
     n_read_total += n_read;
   }
-  return n_read_total;
+  co_return n_read_total;
 }
 
 /**
@@ -127,7 +448,9 @@ int Connection::read_n(char* buf, int n, bool autoclose) {
 
   @return  Number of bytes read, or -1 on error
 **/
-int Connection::read_http_header(std::string& buf, std::string& header) {
+int Connection::read_http_header(std::string& buf, std::string& header) { return Reactor::block_on(async_read_http_header(buf, header)); }
+
+Task<int> Connection::async_read_http_header(std::string& buf, std::string& header) {
   int  n_src      = 0;
   bool body_found = false;
 
@@ -135,9 +458,9 @@ int Connection::read_http_header(std::string& buf, std::string& header) {
   if (!header.empty()) header.clear();
 
   // make sure connection is alive
-  n_src = recv(&buf[0], 1, MSG_PEEK | MSG_DONTWAIT);
+  n_src = co_await async_recv(&buf[0], 1, MSG_PEEK | MSG_DONTWAIT);
   if (n_src <= 0 && !(errno == EWOULDBLOCK || errno == EAGAIN)) {
-    return n_src;
+    co_return n_src;
   }
 
   int err_count = 0;
@@ -145,14 +468,14 @@ int Connection::read_http_header(std::string& buf, std::string& header) {
     err_count++;
     if (err_count > 100) {
       log("Can't find body! Current header:\n%s", header.c_str());
-      return header.size() > 0 ? -1 : 0;
+      co_return header.size() > 0 ? -1 : 0;
     }
 
     // Read from connections
-    n_src = recv(buf, buf.capacity(), MSG_PEEK);
+    n_src = co_await async_recv(buf, buf.capacity(), MSG_PEEK);
     if (n_src <= 0) {
       if (errno == EWOULDBLOCK || errno == EAGAIN) continue;
-      return n_src;
+      co_return n_src;
     }
 
     // Find message body
@@ -161,66 +484,76 @@ int Connection::read_http_header(std::string& buf, std::string& header) {
     size_t header_len_buf = body_found ? body_index + 4 : n_src;
 
     // Read and append headers (possibly only a segment)
-    n_src = read_n(buf, header_len_buf);
-    if (n_src <= 0) return n_src;
+    n_src = co_await async_read_n(buf, header_len_buf);
+    if (n_src <= 0) co_return n_src;
     header.append(buf.begin(), buf.begin() + n_src);
   }
-  if (!body_found) return -1;
+  if (!body_found) co_return -1;
 
-  return header.size();
+  co_return header.size();
 }
 
 std::unique_ptr<HTTPResponse> Connection::read_http_response(std::string& buf, ProxyURI proxy_info) {
+  return Reactor::block_on(async_read_http_response(buf, proxy_info));
+}
+
+Task<std::unique_ptr<HTTPResponse>> Connection::async_read_http_response(std::string& buf, ProxyURI proxy_info) {
   int n_src = 0;
 
-  // Read response header
-  std::string header;
-  n_src = read_http_header(buf, header);
-  if (n_src <= 0) return nullptr;
+  // Read response header, called right after the request is sent so this is the time to first byte
+  time_point   start  = myclock::now();
+  PooledBuffer header = BufferPool::acquire(MAXLINE);
+  n_src               = co_await async_read_http_header(buf, *header);
+  if (n_src <= 0) co_return nullptr;
+  time_point header_end = myclock::now();
+  Metrics::upstream_ttfb.record(header_end - start);
+  Trace::record(TracePhase::ResponseHeader, start, header_end);
 
   // Parse response header
-  auto response = std::unique_ptr<HTTPResponse>(new HTTPResponse(header, proxy_info));
+  auto response = std::unique_ptr<HTTPResponse>(new HTTPResponse(*header, proxy_info));
   log("Received response from server:\n%s", response->dump().c_str());
 
   // Read response body
-  n_src = read_http_response_body(buf, *response);
-  if (response->content_length() > 0 && n_src <= 0) return nullptr;
-  else if (response->content_length() > 0 && n_src < 0) return nullptr;
+  n_src = co_await async_read_http_response_body(buf, *response);
+  Trace::record(TracePhase::ResponseBody, header_end, myclock::now());
+  // A body cut short is an error whatever the Content-Length, a chunked response has none
+  if (n_src < 0 || (response->content_length() > 0 && n_src == 0)) co_return nullptr;
 
-  return response;
+  co_return response;
 }
 
 /**
-  @brief Read response body with chunked encoding from a connection
+  @brief Read response body with chunked encoding from a connection. The chunks are read straight into the blocks of
+  the body, chunk sizes and trailing CRLFs through `buf`.
 
   @param[inout]  buf       Buffer to temporarily store read data, may be garbage after call
   @param[inout]  response  Response object to store body in
 
-  @return  Number of bytes read, or -1 on error
+  @co_return  Number of bytes read, or -1 on error, including a connection closed before the last chunk
 **/
 int Connection::read_http_response_body_chunked(std::string& buf, HTTPResponse& response) {
-  int n_src = 0;
+  return Reactor::block_on(async_read_http_response_body_chunked(buf, response));
+}
+
+Task<int> Connection::async_read_http_response_body_chunked(std::string& buf, HTTPResponse& response) {
+  int   n_src = 0;
+  IOBuf body;
 
-  // Read all chunks and compile into body
-  do {
+  // Read all chunks and compile into body. Any failure before the last chunk fails the whole body, so a truncated
+  // response is never mistaken for a complete one.
+  while (!Signaler::done) {
     // Read chunk size
-    n_src = recv(&buf[0], buf.capacity(), MSG_PEEK);
-    if (n_src <= 0) {
-      if (errno == EWOULDBLOCK || errno == EAGAIN) {
-        continue;
-      } else {
-        return n_src;
-      }
-    }
+    n_src = co_await async_recv(&buf[0], buf.capacity(), MSG_PEEK);
+    if (n_src <= 0) co_return -1;
 
     // Parse chunk size
     size_t chunk_size_index = buf.find("\r\n");
     if (chunk_size_index == std::string::npos) {
       log("Error: chunk size not found");
-      return -1;
+      co_return -1;
     }
-    n_src = read_n(buf, chunk_size_index + 2);
-    if (n_src <= 0) return n_src;
+    n_src = co_await async_read_n(buf, chunk_size_index + 2);
+    if (n_src <= 0) co_return -1;
 
     // Check for extensions
     size_t        chunk_extension_index = buf.find(";");
@@ -229,109 +562,90 @@ int Connection::read_http_response_body_chunked(std::string& buf, HTTPResponse&
     if (chunk_size == 0) {
       log("Reached end of chunked encoding");
       // End of chunked encoding, read final CRLF
-      n_src = read_n(&buf[chunk_size_index + 2], 2);
-      if (n_src <= 0) return n_src;
-      break;
+      n_src = co_await async_read_n(&buf[chunk_size_index + 2], 2);
+      if (n_src <= 0) co_return -1;
+      response.append_to_body(body);
+      co_return response.body().size();
     }
 
-    // Read chunk
-    std::uint64_t bytes_read = 0;
-    while (bytes_read < chunk_size + 2 && !Signaler::done) {
-      int bytes_to_read = std::min(buf.capacity(), chunk_size + 2 - bytes_read);
-      n_src             = read_n(&buf[0], bytes_to_read);
-      if (n_src <= 0) return n_src;
-      bytes_read += n_src;
-
-      // Sanity check
-      if (bytes_read == chunk_size + 2) {
-        log("Finished reading chunk of size %llu", chunk_size);
-        if (buf[n_src - 2] != '\r' || buf[n_src - 1] != '\n') {
-          log("Error: chunk does not end with CRLF");
-        }
-        response.append_to_body(buf, n_src - 2);
-      } else {
-        response.append_to_body(buf, n_src);
-      }
+    // Read chunk, then its CRLF
+    n_src = co_await async_read_n(body, chunk_size);
+    if (n_src <= 0) co_return -1;
+    n_src = co_await async_read_n(&buf[0], 2);
+    if (n_src <= 0) co_return -1;
+
+    // Sanity check
+    log("Finished reading chunk of size %llu", chunk_size);
+    if (buf[0] != '\r' || buf[1] != '\n') {
+      log("Error: chunk does not end with CRLF");
     }
-    log("Appended chunk of size %llu to body", chunk_size);
-  } while (n_src > 0 && !Signaler::done);
-  return response.body().size();
+  }
+  co_return -1;
 }
 
 /**
-  @brief Read response body with known content length from a connection
+  @brief Read response body with known content length from a connection, straight into the blocks of the body
 
-  @param[inout]  buf       Buffer to temporarily store read data, may be garbage after call
+  @param[inout]  buf       Unused, kept for symmetry with the chunked reader
   @param[inout]  response  Response object to store body in
 
-  @return  Number of bytes read, or -1 on error
+  @co_return  Number of bytes read, or -1 on error
 **/
 int Connection::read_http_response_body(std::string& buf, HTTPResponse& response) {
-  int body_len = 0, n_src = 0;
+  return Reactor::block_on(async_read_http_response_body(buf, response));
+}
 
-  if (response.is_chunked()) return read_http_response_body_chunked(buf, response);
+Task<int> Connection::async_read_http_response_body(std::string& buf, HTTPResponse& response) {
+  if (response.is_chunked()) co_return co_await async_read_http_response_body_chunked(buf, response);
+  if (response.content_length() == 0) co_return 0;
 
   // Read response.content_length() bytes from connection
-  while (body_len < response.content_length() && !Signaler::done) {
-    if (n_src > 0) bzero(&buf[0], n_src);
-    n_src = recv(&buf[0], std::min(MAXLINE, (int)(response.content_length() - body_len)));
-    if (n_src <= 0) {
-      if (errno == EWOULDBLOCK || errno == EAGAIN) {
-        continue;
-      } else {
-        return n_src;
-      }
-    }
-
-    response.append_to_body(buf, n_src);
-    body_len += n_src;
-    log("Continuing to read response body...read %d bytes", n_src);
-  }
-  return body_len;
+  IOBuf body;
+  int   n_src = co_await async_read_n(body, response.content_length());
+  if (n_src <= 0) co_return n_src;
+  response.append_to_body(body);
+  log("Read response body of %d bytes", n_src);
+  co_return n_src;
 }
 
-int Connection::connect(ProxyURI* proxy_info, addrinfo const* addr_info) {
-  sockfd_ = socket(addr_info->ai_family, addr_info->ai_socktype, addr_info->ai_protocol);
-  if (sockfd_ == -1) return -1;
-  if (::connect(sockfd_, addr_info->ai_addr, addr_info->ai_addrlen) == 0) {
-    switch (addr_info->ai_family) {
-      case AF_INET: {
-        char dst[INET_ADDRSTRLEN];
-        log("Connected via IPv4: %s", inet_ntop(addr_info->ai_family, &addr_info->ai_addr, dst, sizeof(dst)));
-        proxy_info->ip = std::string(dst);
-        break;
-      }
-      case AF_INET6: {
-        char dst[INET6_ADDRSTRLEN];
-        log("Connected via IPv6: %s", inet_ntop(addr_info->ai_family, &addr_info->ai_addr, dst, sizeof(dst)));
-        proxy_info->ip = std::string(dst);
-        break;
-      }
-      default: {
-        log("Connected via unknown protocol");
-        break;
-      }
-    }
-    return sockfd_;
-  }
-  ::close(sockfd_);
-  return sockfd_ = -1;
-}
+/**
+  @brief Connect to one address of a server. On a shared reactor the socket is non-blocking, and the coroutine waits
+  until the connection is established.
+
+  @param[inout]  proxy_info  Server to connect to, its IP is set once connected
 
-int Connection::connect(ProxyURI* proxy_info, AddrInfo const* addr_info) {
-  sockfd_ = socket(addr_info->ai_family, addr_info->ai_socktype, addr_info->ai_protocol);
-  if (sockfd_ == -1) return -1;
-  if (::connect(sockfd_, addr_info->ai_addr.get(), addr_info->ai_addrlen) == 0) {
-    switch (addr_info->ai_family) {
+  @return  Connected socket, or -1 on error
+**/
+Task<int> Connection::async_connect(ProxyURI* proxy_info, int family, int socktype, int protocol, const struct sockaddr* addr,
+                                    socklen_t addrlen) {
+  Reactor& reactor = Reactor::current();
+  sockfd_          = socket(family, socktype | (reactor.shared() ? SOCK_NONBLOCK : 0), protocol);
+  if (sockfd_ == -1) co_return -1;
+  SocketOptions::global().apply(sockfd_, SocketRole::Upstream);
+  time_point connect_start = myclock::now();
+  int        ret           = ::connect(sockfd_, addr, addrlen);
+  if (ret < 0 && errno == EINPROGRESS) {
+    int       error = 0;
+    socklen_t len   = sizeof(error);
+    if (!co_await reactor.writable(sockfd_)) error = Signaler::done ? EINTR : EBADF;
+    else if (getsockopt(sockfd_, SOL_SOCKET, SO_ERROR, &error, &len) < 0) error = errno;
+    ret   = error == 0 ? 0 : -1;
+    errno = error;
+  }
+  time_point connect_end = myclock::now();
+  Metrics::connect.record(connect_end - connect_start);
+  Trace::record(TracePhase::Connect, connect_start, connect_end);
+  if (ret == 0) {
+    switch (family) {
       case AF_INET: {
         char dst[INET_ADDRSTRLEN];
-        log("Connected via IPv4: %s", inet_ntop(addr_info->ai_family, &addr_info->ai_addr, dst, sizeof(dst)));
+        log("Connected via IPv4: %s", inet_ntop(family, &reinterpret_cast<const sockaddr_in*>(addr)->sin_addr, dst, sizeof(dst)));
         proxy_info->ip = std::string(dst);
         break;
       }
       case AF_INET6: {
         char dst[INET6_ADDRSTRLEN];
-        log("Connected via IPv6: %s", inet_ntop(addr_info->ai_family, &addr_info->ai_addr, dst, sizeof(dst)));
+        log("Connected via IPv6: %s", inet_ntop(family, &reinterpret_cast<const sockaddr_in6*>(addr)->sin6_addr, dst, sizeof(dst)));
         proxy_info->ip = std::string(dst);
         break;
       }
@@ -340,8 +654,10 @@ int Connection::connect(ProxyURI* proxy_info, AddrInfo const* addr_info) {
         break;
       }
     }
-    return sockfd_;
+    co_return sockfd_;
   }
-  ::close(sockfd_);
-  return sockfd_ = -1;
+  int old_errno = errno;
+  close();
+  errno = old_errno;
+  co_return -1;
 }
@@ -1,58 +1,100 @@
 #include "HTTPRequest.h"
+#include "Arena.h"
+#include "HeaderTable.h"
+
+#include <cstring>
+#include <string_view>
+
+/**
+  @brief Split the target of a request line into a ProxyURI, like parse_uri() with no base URI, but straight from the
+  request so that the target is not copied first
+
+  @param[in]   target   Target of the request line
+  @param[in]   connect  True for the `host:port` target of a CONNECT request
+  @param[out]  uri      URI to fill in, whose fields are empty
+**/
+static void parse_target(std::string_view target, bool connect, ProxyURI &uri) {
+  // The section is never sent to the server
+  target = target.substr(0, target.find('#'));
+
+  size_t scheme = target.find("://");
+  if (!connect && scheme == std::string_view::npos) {
+    if (target.empty() || target[0] != '/') uri.uri = "/";
+    uri.uri.append(target.data(), target.size());
+    return;
+  }
+
+  std::string_view authority = connect ? target : target.substr(scheme + 3);
+  size_t           path      = authority.find('/');
+  if (path == std::string_view::npos) uri.uri = "/";
+  else uri.uri.assign(authority.data() + path, authority.size() - path);
+  authority = authority.substr(0, path);
+
+  size_t colon = authority.find(':');
+  uri.host.assign(authority.data(), std::min(colon, authority.size()));
+  if (colon == std::string_view::npos) uri.port = "80";
+  else uri.port.assign(authority.data() + colon + 1, authority.size() - colon - 1);
+}
 
 /**
   @brief Construct a HTTPRequest from a string
 
   @param[in]  message  Input string to parse
+  @param[in]  arena    Arena to allocate the header table from, or nullptr to use the global heap
 **/
-HTTPRequest::HTTPRequest(const std::string &message) {
-  std::stringstream stream(message);
-  std::string       line, uri;
-
-  std::getline(stream, line);
+HTTPRequest::HTTPRequest(const std::string &message, Arena *arena) : headers(arena) {
+  std::string_view target;
+  size_t           pos = 0, start = 0, len = 0;
 
   // Split first line
-  {
-    strip(line, "\r");
-    std::stringstream tmp_stream(line);
-    tmp_stream >> method;
-    tmp_stream >> uri;
-    tmp_stream >> version;
-  }
-  while (std::getline(stream, line) && line != "\r") {
-    std::stringstream header_line(line);
-    std::string       key, value;
-    std::getline(header_line, key, ':');
-    std::getline(header_line, value);
-    headers[normalize_field_name(key)] = strip(value, " \r");
+  if (next_line(message, pos, start, len)) {
+    size_t method_end = message.find(' ', start);
+    size_t uri_end    = method_end == std::string::npos ? std::string::npos : message.find(' ', method_end + 1);
+    if (uri_end != std::string::npos && uri_end < start + len) {
+      method = to_method(message.substr(start, method_end - start));
+      target = std::string_view(message).substr(method_end + 1, uri_end - method_end - 1);
+      version.assign(message, uri_end + 1, start + len - uri_end - 1);
+    } else {
+      method = RequestMethod::UNKNOWN;
+    }
   }
+  headers.parse(message, pos);
 
   // Add default headers
-  if (!contains(headers, "Connection")) {
-    headers["Connection"] = version == "HTTP/1.1" ? "Keep-Alive" : "Close";
+  if (!headers.contains(Header::Connection)) {
+    headers.set(Header::Connection, version == "HTTP/1.1" ? "Keep-Alive" : "Close");
   }
-  if (!contains(headers, "Proxy-Connection")) {
-    headers["Proxy-Connection"] = "Keep-Alive";
+  if (!headers.contains(Header::ProxyConnection)) {
+    headers.set(Header::ProxyConnection, "Keep-Alive");
   }
 
   // Remove bad headers
-  headers.erase("Upgrade-Insecure-Requests");
+  headers.erase(Header::UpgradeInsecureRequests);
 
-  if (method == RequestMethod::CONNECT) {
-    uri = "http://" + uri;
-  }
-  proxy_uri = parse_uri(uri);
-  if (proxy_uri.uri.empty()) {
-    proxy_uri.uri = "/";
-  }
+  parse_target(target, method == RequestMethod::CONNECT, proxy_uri);
   if (proxy_uri.port.empty()) {
     proxy_uri.port = "80";
   }
   if (proxy_uri.host.empty()) {
-    proxy_uri.host = headers["Host"];
+    StrView host = headers.get(Header::Host);
+    if (!host.empty()) proxy_uri.host.assign(host.data, host.size);
+    return;
+  }
+
+  // The value is copied into the table, so it is built in the arena if there is one
+  size_t      size = proxy_uri.host.size() + 1 + proxy_uri.port.size();
+  std::string scratch;
+  char       *host = nullptr;
+  if (arena) {
+    host = static_cast<char *>(arena->allocate(size, 1));
   } else {
-    headers["Host"] = proxy_uri.host + ":" + proxy_uri.port;
+    scratch.resize(size);
+    host = &scratch[0];
   }
+  memcpy(host, proxy_uri.host.data(), proxy_uri.host.size());
+  host[proxy_uri.host.size()] = ':';
+  memcpy(host + proxy_uri.host.size() + 1, proxy_uri.port.data(), proxy_uri.port.size());
+  headers.set(Header::Host, StrView(host, size));
 }
 
 /**
@@ -67,12 +109,13 @@ std::ostream &operator<<(std::ostream &os, HTTPRequest request) {
   int max_line_width = get_terminal_width() - 3;
   os << request.method << " " << request.proxy_uri.uri << " " << request.version << std::endl;
 
-  for (const auto &kv : request.headers) {
-    os << kv.first << ": ";
-    if (kv.first.length() + kv.second.length() + 2 > (size_t)max_line_width) {
-      os << kv.second.substr(0, max_line_width - (kv.first.length() + 2)) << "..." << std::endl;
+  for (const auto &entry : request.headers) {
+    StrView name = request.headers.name(entry), value = request.headers.value(entry);
+    os << name << ": ";
+    if (name.size + value.size + 2 > (size_t)max_line_width) {
+      os << StrView(value.data, max_line_width - (name.size + 2)) << "..." << std::endl;
     } else {
-      os << kv.second << std::endl;
+      os << value << std::endl;
     }
   }
   return os;
@@ -84,13 +127,20 @@ std::ostream &operator<<(std::ostream &os, HTTPRequest request) {
   @return  std::string  String representation of HTTPRequest
 **/
 std::string HTTPRequest::dump() const {
-  std::stringstream stream;
+  std::string out;
+  dump(out);
+  return out;
+}
 
-  stream << method << " " << proxy_uri.uri << " " << version << "\r\n";
-  // stream << "Host: " << proxy_uri.host << ":" << (proxy_uri.port.empty() ? "80" : proxy_uri.port) << "\r\n";
-  for (const auto &kv : headers) {
-    stream << kv.first << ": " << kv.second << "\r\n";
-  }
-  stream << "\r\n";
-  return stream.str();
+/**
+  @brief Dump a HTTPRequest into an existing string, reusing its capacity
+
+  @param[out]  out  String to store the request in, overwritten
+**/
+void HTTPRequest::dump(std::string &out) const {
+  out.clear();
+  out.reserve(MAXLINE);
+  out.append(to_string(method)).append(" ").append(proxy_uri.uri).append(" ").append(version).append("\r\n");
+  headers.dump(out);
+  out.append("\r\n");
 }
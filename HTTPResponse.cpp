@@ -1,4 +1,56 @@
 #include "HTTPResponse.h"
+#include "BodyStore.h"
+#include "CannedResponse.h"
+#include "Compression.h"
+#include "HeaderTable.h"
+#include "Range.h"
+
+bool HTTPResponse::compress_text_bodies = false;
+
+static IOBuf to_buf(const std::string& data) {
+  IOBuf buf;
+  buf.append(data);
+  return buf;
+}
+
+// Suffix of the ETag of a representation compressed by compressed()
+static const std::string GZIP_ETAG_SUFFIX = "-gzip";
+
+/**
+  @brief Add Accept-Encoding to the field names of a Vary header, keeping the ones the server listed
+
+  @param[in]  vary  Value of the Vary header, may be empty
+
+  @return  std::string  Value of the Vary header of the compressed representation
+**/
+static std::string vary_accept_encoding(StrView vary) {
+  std::string value = vary.str();
+  for (size_t start = 0; start < value.size();) {
+    size_t      end  = std::min(value.find(',', start), value.size());
+    std::string name = lower(strip(value.substr(start, end - start), " \t"));
+    start            = end + 1;
+    if (name == "*" || name == "accept-encoding") return value;
+  }
+  return strip(value, " \t").empty() ? "Accept-Encoding" : value + ", Accept-Encoding";
+}
+
+/**
+  @brief Add or remove the suffix that distinguishes the ETag of the compressed representation, inside the quotes of
+  the entity tag
+
+  @param[in]  etag  Entity tag, strong or weak
+  @param[in]  gzip  True to add the suffix, false to remove it
+
+  @return  std::string  Entity tag of the other representation
+**/
+static std::string gzip_etag(StrView etag, bool gzip) {
+  std::string value = etag.str();
+  size_t      end   = !value.empty() && value.back() == '"' ? value.size() - 1 : value.size();
+  if (gzip) return value.insert(end, GZIP_ETAG_SUFFIX);
+  size_t      start = end - std::min(end, GZIP_ETAG_SUFFIX.size());
+  if (value.compare(start, end - start, GZIP_ETAG_SUFFIX) == 0) value.erase(start, end - start);
+  return value;
+}
 
 /**
   @brief Write a HTTPResponse to a string
@@ -6,54 +58,63 @@
   @return std::string  HTTPResponse as a string
 **/
 HTTPResponse::HTTPResponse(const std::string headers, const ProxyURI& proxy_uri) : proxy_uri_(proxy_uri) {
-  std::stringstream response(headers);
-  std::string       line;
-  std::getline(response, line);
-  std::stringstream status_line(line);
-  std::string       version, code;
-  status_line >> version >> code;
-  version_ = version;
-  code_    = static_cast<ResponseCode>(std::stoi(code));
-  std::getline(status_line, msg_);  // Get the rest of the line (message)
-  msg_ = strip(msg_, " \r");
-  while (std::getline(response, line) && line != "\r") {
-    std::stringstream header_line(line);
-    std::string       key, value;
-    std::getline(header_line, key, ':');
-    std::getline(header_line, value);
-    headers_[normalize_field_name(key)] = strip(value, " \r");
+  size_t pos = 0, start = 0, len = 0;
+
+  // Split status line into version, code and message
+  if (next_line(headers, pos, start, len)) {
+    size_t version_end = headers.find(' ', start);
+    if (version_end == std::string::npos || version_end >= start + len) version_end = start + len;
+    version_.assign(headers, start, version_end - start);
+
+    char*  code_end  = nullptr;
+    code_            = static_cast<ResponseCode>(std::strtol(headers.c_str() + version_end, &code_end, 10));
+    size_t msg_start = std::min<size_t>(code_end - headers.c_str(), start + len);
+    msg_             = strip(headers.substr(msg_start, start + len - msg_start), " \r");
   }
+  headers_.parse(headers, pos);
 
   // Add default headers
-  if (!contains(headers_, "Proxy-Connection")) {
-    headers_["Proxy-Connection"] = "keep-alive";
+  if (!headers_.contains(Header::ProxyConnection)) {
+    headers_.set(Header::ProxyConnection, "keep-alive");
   }
-  if (version_ == "HTTP/1.0" && !contains(headers_, "Connection")) {
-    headers_["Connection"] = "close";
-  } else if (version_ == "HTTP/1.1" && !contains(headers_, "Connection")) {
-    headers_["Connection"] = "keep-alive";
+  if (version_ == "HTTP/1.0" && !headers_.contains(Header::Connection)) {
+    headers_.set(Header::Connection, "close");
+  } else if (version_ == "HTTP/1.1" && !headers_.contains(Header::Connection)) {
+    headers_.set(Header::Connection, "keep-alive");
   }
-  headers_["Host"] = proxy_uri_.host + ":" + (proxy_uri_.port.empty() ? "80" : proxy_uri_.port);
+  headers_.set(Header::Host, proxy_uri_.host + ":" + (proxy_uri_.port.empty() ? "80" : proxy_uri_.port));
 
   // Read content length
-  if (contains(headers_, "Content-Length")) {
-    content_length_ = std::stoull(headers_["Content-Length"]);
-    headers_.erase("Content-Length");
-    // Preallocate space for body
-    body_.reserve(content_length_);
-  } else if (contains(headers_, "Transfer-Encoding") && headers_["Transfer-Encoding"] == "chunked") {
+  if (headers_.contains(Header::ContentLength)) {
+    content_length_ = std::strtoull(headers_.get(Header::ContentLength).str().c_str(), nullptr, 10);
+    headers_.erase(Header::ContentLength);
+  } else if (headers_.get(Header::TransferEncoding) == "chunked") {
     chunked_ = true;
   } else {
     log("Warning: No content length or chunked encoding specified");
   }
   // Read content type
-  if (contains(headers_, "Content-Type")) {
-    content_type_  = headers_.at("Content-Type");
+  if (headers_.contains(Header::ContentType)) {
+    content_type_  = headers_.get(Header::ContentType).str();
     size_t ext_pos = content_type_.find(';');
     if (ext_pos != std::string::npos) content_type_ = content_type_.substr(0, ext_pos);
   }
+
+  // Range requests are served by the proxy from complete bodies
+  if (code_ == ResponseCode::OK && !headers_.contains(Header::AcceptRanges)) {
+    headers_.set(Header::AcceptRanges, "bytes");
+  }
 }
 
+/**
+  @brief Get a header field of the response, as received from the server
+
+  @param[in]  id  Header ID
+
+  @return  View of the first value of the field, or an empty view if it is not present
+**/
+StrView HTTPResponse::header(Header id) const { return headers_.get(id); }
+
 /**
   @brief Appends a string to the body of the HTTPResponse
 
@@ -63,40 +124,305 @@ HTTPResponse::HTTPResponse(const std::string headers, const ProxyURI& proxy_uri)
   @return  True if string was successfully appended, false if it would exceed the content length
 **/
 bool HTTPResponse::append_to_body(const std::string& data, std::uint64_t size) {
-  if (!chunked_ && body_.length() + size > content_length_) {
+  if (!chunked_ && body_.size() + size > content_length_) {
     return false;
   }
-  body_.append(data.begin(), data.begin() + size);
+  body_.append(data.data(), size);
   if (chunked_) {
     content_length_ += size;
   }
   return true;
 }
 
+/**
+  @brief Appends a buffer to the body of the HTTPResponse, sharing its blocks instead of copying them
+
+  @param[in]  data  Buffer to append to body
+
+  @return  True if the buffer was successfully appended, false if it would exceed the content length
+**/
+bool HTTPResponse::append_to_body(const IOBuf& data) {
+  if (!chunked_ && body_.size() + data.size() > content_length_) {
+    return false;
+  }
+  body_.append(data);
+  if (chunked_) {
+    content_length_ += data.size();
+  }
+  return true;
+}
+
 /**
   @brief Write a HTTPResponse to a string
 
   @return String representation of HTTPResponse
 **/
 std::string HTTPResponse::dump() const {
-  std::stringstream response;
+  std::string out;
+  dump(out);
+  return out;
+}
+
+/**
+  @brief Write a HTTPResponse into an existing string, reusing its capacity
 
-  // Dump response to buffer
-  response << version_ << " " << static_cast<int>(code_) << " " << msg_ << "\r\n";
-  for (const auto& kv : headers_) {
-    if (kv.first == "Transfer-Encoding" && kv.second == "chunked") {
+  @param[out]  out  String to store the response in, overwritten
+**/
+void HTTPResponse::dump(std::string& out) const {
+  out.clear();
+  out.reserve(MAXLINE + (content_length_ > 0 ? body_.size() : 0));
+  dump_head(out);
+  if (content_length_ > 0) {
+    body_.buf().copy_to(out);
+  }
+}
+
+/**
+  @brief Write the status line and headers of a HTTPResponse into an existing string, and its body into a buffer
+  sharing the blocks of the body instead of copying it
+
+  @param[out]  out   String to store the status line and headers in, overwritten
+  @param[out]  body  Buffer to store the body in, overwritten
+**/
+void HTTPResponse::dump(std::string& out, IOBuf& body) const {
+  out.clear();
+  body.clear();
+  dump_head(out);
+  if (content_length_ > 0) {
+    body = body_.buf();
+  }
+}
+
+/**
+  @brief Append the status line and headers of the response to a string
+
+  @param[out]  out  String to append to
+**/
+void HTTPResponse::dump_head(std::string& out) const {
+  out.append(version_).append(" ").append(std::to_string(static_cast<int>(code_))).append(" ").append(msg_).append("\r\n");
+  dump_headers(out, false);
+  if (has_content_length_) out.append("Content-Length: ").append(std::to_string(content_length_)).append("\r\n");
+  out.append("\r\n");
+}
+
+/**
+  @brief Append the header fields of the response to a string, leaving out ones the proxy rewrites
+
+  @param[out]  out                String to append to
+  @param[in]   skip_content_type  True to leave out Content-Type, e.g. for multipart bodies
+**/
+void HTTPResponse::dump_headers(std::string& out, bool skip_content_type) const {
+  for (const auto& entry : headers_) {
+    if (entry.id == Header::TransferEncoding && headers_.value(entry) == "chunked") {
       continue;
     }
-    response << kv.first << ": " << kv.second << "\r\n";
+    if (skip_content_type && entry.id == Header::ContentType) {
+      continue;
+    }
+    StrView name = headers_.name(entry), value = headers_.value(entry);
+    out.append(name.data, name.size).append(": ").append(value.data, value.size).append("\r\n");
   }
-  if (has_content_length_) response << "Content-Length: " << content_length_ << "\r\n";
-  response << "\r\n";
-  if (content_length_ > 0) {
-    response << body_;
+}
+
+/**
+  @brief Create a copy of the response with a gzip-compressed body, for storage in the page cache
+
+  Only text bodies that are not already content-encoded are compressed. If compression is disabled or does not
+  shrink the body, the body is copied unmodified. A compressed copy adds Accept-Encoding to the fields the response
+  varies on, and gets its own ETag, since it is a different representation. The body of the copy is interned in the
+  BodyStore, so cached copies of identical bodies share one.
+
+  @return  HTTPResponse  Compressed copy of the response
+**/
+HTTPResponse HTTPResponse::compressed() const {
+  HTTPResponse ret(*this);
+
+  std::string body;
+  bool        compress = compress_text_bodies && !compressed_ && is_text(content_type_) && body_.size() >= MIN_COMPRESS_SIZE &&
+                  !headers_.contains(Header::ContentEncoding);
+  if (compress && gzip_compress(body_.buf().str(), body) && body.size() < body_.size()) {
+    log("Compressed body of %s from %lu to %lu bytes", proxy_uri_.absolute().c_str(), body_.size(), body.size());
+
+    ret.identity_length_    = body_.size();
+    ret.body_               = to_buf(body);
+    ret.content_length_     = ret.body_.size();
+    ret.has_content_length_ = true;
+    ret.chunked_            = false;
+    ret.compressed_         = true;
+    ret.headers_.set(Header::ContentEncoding, "gzip");
+    ret.headers_.set(Header::Vary, vary_accept_encoding(headers_.get(Header::Vary)));
+    if (headers_.contains(Header::ETag)) ret.headers_.set(Header::ETag, gzip_etag(headers_.get(Header::ETag), true));
+    ret.headers_.erase(Header::TransferEncoding);
+  }
+  BodyStore::global().intern(ret.body_);
+  return ret;
+}
+
+/**
+  @brief Create a copy of a response compressed by `compressed()` with the original body and ETag restored
+
+  @return  HTTPResponse  Decompressed copy of the response, or an unmodified copy if it was not compressed
+**/
+HTTPResponse HTTPResponse::decompressed() const {
+  HTTPResponse ret(*this);
+
+  if (!compressed_) return ret;
+
+  std::string body;
+  if (!gzip_decompress(body_.buf().str(), body, identity_length_)) return ret;
+
+  ret.body_           = to_buf(body);
+  ret.content_length_ = ret.body_.size();
+  ret.compressed_     = false;
+  ret.headers_.erase(Header::ContentEncoding);
+  if (headers_.contains(Header::ETag)) ret.headers_.set(Header::ETag, gzip_etag(headers_.get(Header::ETag), false));
+  return ret;
+}
+
+/**
+  @brief Get the body of the response, decompressing it first if it was compressed for the page cache
+
+  @return  std::string  Uncompressed body
+**/
+std::string HTTPResponse::decoded_body() const {
+  std::string body;
+  if (!compressed_ || !gzip_decompress(body_.buf().str(), body, identity_length_)) return body_.buf().str();
+  return body;
+}
+
+/**
+  @brief Write a HTTPResponse to a string, in an encoding the requesting client accepts
+
+  @param[in]   request  Request the response is being sent for
+  @param[out]  out      String to store the response in, overwritten
+**/
+void HTTPResponse::dump(const HTTPRequest& request, std::string& out) const {
+  IOBuf body;
+  dump(request, out, body);
+  body.copy_to(out);
+}
+
+/**
+  @brief Write the status line and headers of a HTTPResponse to a string and its body to a buffer, in an encoding the
+  requesting client accepts. The body shares the blocks of the response's body, ranges included.
+
+  Compressed bodies are sent as-is to clients that accept gzip, and decompressed for all other clients. A body that
+  can not be decompressed is never sent to a client that does not accept gzip, which gets a 500 response instead.
+
+  @param[in]   request  Request the response is being sent for
+  @param[out]  out      String to store the status line and headers in, overwritten
+  @param[out]  body     Buffer to store the body in, overwritten
+**/
+void HTTPResponse::dump(const HTTPRequest& request, std::string& out, IOBuf& body) const {
+  StrView range = request.headers.get(Header::Range);
+  if (!range.empty() && request.method == RequestMethod::GET && code_ == ResponseCode::OK) {
+    // Ranges and their If-Range validator always refer to the uncompressed representation. A body that can not be
+    // decompressed is sent whole, without the range, as decompressed() then returns it still compressed.
+    if (compressed_) {
+      HTTPResponse identity = decompressed();
+      if (!identity.compressed_) return identity.dump(request, out, body);
+    } else if (if_range_matches(request)) {
+      std::vector<ByteRange> ranges;
+      switch (parse_range(range.str(), body_.size(), ranges)) {
+        case RangeStatus::Satisfiable:
+          return dump_ranges(ranges, out, body);
+        case RangeStatus::Unsatisfiable:
+          return dump_range_not_satisfiable(out, body);
+        case RangeStatus::None:
+          break;
+      }
+    }
+  }
+
+  if (!compressed_) return dump(out, body);
+
+  StrView accept_encoding = request.headers.get(Header::AcceptEncoding);
+  if (!accept_encoding.empty() && accepts_encoding(accept_encoding.str(), "gzip")) {
+    return dump(out, body);
+  }
+  HTTPResponse identity = decompressed();
+  if (identity.compressed_) {
+    log("Error decompressing the cached body of %s", proxy_uri_.absolute().c_str());
+    out = canned_response(ResponseCode::InternalServerError, request.version);
+    body.clear();
+    return;
+  }
+  identity.dump(out, body);
+}
+
+/**
+  @brief Check the If-Range precondition of a request against this response
+
+  @param[in]  request  Request containing a Range header
+
+  @return  True if there is no If-Range header or it matches the strong ETag or Last-Modified date of the response
+**/
+bool HTTPResponse::if_range_matches(const HTTPRequest& request) const {
+  if (!request.headers.contains(Header::IfRange)) return true;
+
+  std::string validator = request.headers.get(Header::IfRange).str();
+  if (validator.compare(0, 2, "W/") == 0) return false;  // Weak ETags never match
+  if (!validator.empty() && validator[0] == '"') {
+    return headers_.contains(Header::ETag) && headers_.get(Header::ETag) == validator;
   }
+  return headers_.contains(Header::LastModified) && headers_.get(Header::LastModified) == validator;
+}
 
-  // Convert to string
-  return response.str();
+/**
+  @brief Write a 206 Partial Content response containing the given ranges of the body to a string
+
+  A single range is sent with a Content-Range header, multiple ranges are sent as a multipart/byteranges body.
+
+  @param[in]   ranges  Satisfiable ranges of the body to send
+  @param[out]  out     String to store the status line and headers in, overwritten
+  @param[out]  body    Buffer to store the body in, overwritten. The ranges share the blocks of the response's body.
+**/
+void HTTPResponse::dump_ranges(const std::vector<ByteRange>& ranges, std::string& out, IOBuf& body) const {
+  std::string boundary;
+  bool        multipart = ranges.size() > 1;
+
+  out.clear();
+  body.clear();
+  out.append(version_).append(" ").append(std::to_string(static_cast<int>(ResponseCode::PartialContent))).append(" ");
+  out.append(to_string(ResponseCode::PartialContent)).append("\r\n");
+  dump_headers(out, multipart);
+
+  if (!multipart) {
+    out.append("Content-Range: ").append(content_range(ranges[0], body_.size())).append("\r\n");
+    out.append("Content-Length: ").append(std::to_string(ranges[0].length())).append("\r\n\r\n");
+    body.append(body_.buf(), ranges[0].first, ranges[0].length());
+    return;
+  }
+
+  // Build multipart body, the part headers are copied and the ranges shared
+  std::string part;
+  boundary = multipart_boundary();
+  for (const auto& range : ranges) {
+    part.assign("\r\n--").append(boundary).append("\r\n");
+    if (headers_.contains(Header::ContentType)) part.append("Content-Type: ").append(headers_.get(Header::ContentType).str()).append("\r\n");
+    part.append("Content-Range: ").append(content_range(range, body_.size())).append("\r\n\r\n");
+    body.append(part);
+    body.append(body_.buf(), range.first, range.length());
+  }
+  body.append("\r\n--" + boundary + "--\r\n");
+
+  out.append("Content-Type: multipart/byteranges; boundary=").append(boundary).append("\r\n");
+  out.append("Content-Length: ").append(std::to_string(body.size())).append("\r\n\r\n");
+}
+
+/**
+  @brief Write a 416 Range Not Satisfiable response for this response's body to a string
+
+  @param[out]  out   String to store the 416 response in, overwritten
+  @param[out]  body  Buffer to store the body in, cleared since the response has none
+**/
+void HTTPResponse::dump_range_not_satisfiable(std::string& out, IOBuf& body) const {
+  out.clear();
+  body.clear();
+  out.append(version_).append(" ").append(std::to_string(static_cast<int>(ResponseCode::RangeNotSatisfiable))).append(" ");
+  out.append(to_string(ResponseCode::RangeNotSatisfiable)).append("\r\n");
+  out.append("Content-Range: bytes */").append(std::to_string(body_.size())).append("\r\n");
+  out.append("Content-Length: 0\r\n\r\n");
 }
 
 /**
@@ -0,0 +1,328 @@
+#include "Handoff.h"
+#include "CachePolicy.h"
+#include "TinyLFU.h"
+
+#include <sys/stat.h>
+
+#include <csignal>
+#include <cstring>
+
+// Size of an encoded snapshot record without its URI and response
+static const size_t RECORD_HEADER_SIZE = 20;
+
+static bool write_all(int fd, const char *data, size_t n) {
+  while (n > 0) {
+    ssize_t sent = send(fd, data, n, MSG_NOSIGNAL);
+    if (sent < 0 && errno == EINTR) continue;
+    if (sent <= 0) return false;
+    data += sent;
+    n -= sent;
+  }
+  return true;
+}
+
+static bool read_all(int fd, char *data, size_t n) {
+  while (n > 0) {
+    ssize_t got = recv(fd, data, n, 0);
+    if (got < 0 && errno == EINTR) continue;
+    if (got <= 0) return false;
+    data += got;
+    n -= got;
+  }
+  return true;
+}
+
+/**
+  @brief Check that the process at the other end of the handoff socket runs as the same user as this one, which is
+  the only user allowed to pass listening sockets and cached pages to it
+
+  @param[in]  fd  Connected Unix socket
+
+  @return  True if the peer has the same effective uid
+**/
+static bool same_user(int fd) {
+  struct ucred cred;
+  socklen_t    len = sizeof(cred);
+  if (getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &cred, &len) < 0) {
+    log("Error getting handoff peer credentials: %s", strerror(errno));
+    return false;
+  }
+  if (cred.uid != geteuid()) {
+    log("Rejecting handoff with process %d of uid %u", cred.pid, cred.uid);
+    return false;
+  }
+  return true;
+}
+
+/**
+  @param[in]  path           Unix socket the running process listens on for handoffs
+  @param[in]  page_cache     Page cache to snapshot and restore
+  @param[in]  cache_timeout  Lifetime of a cached page, older pages are not passed on
+**/
+Handoff::Handoff(const std::string &path, std::shared_ptr<Cache<HTTPResponse, URIKey>> page_cache, std::chrono::seconds cache_timeout)
+    : path_(path), page_cache_(std::move(page_cache)), cache_timeout_(cache_timeout), main_thread_(pthread_self()) {}
+
+Handoff::~Handoff() { stop(); }
+
+/**
+  @brief Take over the listening socket and page cache of a running process, should be called before the page cache's
+  insertion callback is set so that restored pages are not prefetched again
+
+  @return  Listening socket, or -1 if no process is listening on the handoff socket
+**/
+int Handoff::take_over() {
+  struct sockaddr_un addr;
+  if (!address(addr)) return -1;
+  int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (fd < 0) return -1;
+  if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 || !same_user(fd)) {
+    close(fd);
+    return -1;
+  }
+
+  // The listening socket comes with a single byte of regular data
+  char           byte;
+  struct iovec   iov = {&byte, 1};
+  struct msghdr  msg;
+  char           control[CMSG_SPACE(sizeof(int))];
+  struct cmsghdr *cmsg;
+  memset(&msg, 0, sizeof(msg));
+  msg.msg_iov        = &iov;
+  msg.msg_iovlen     = 1;
+  msg.msg_control    = control;
+  msg.msg_controllen = sizeof(control);
+  if (recvmsg(fd, &msg, 0) <= 0 || !(cmsg = CMSG_FIRSTHDR(&msg)) || cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS) {
+    log("Error receiving listening socket from %s", path_.c_str());
+    close(fd);
+    return -1;
+  }
+  int listenfd;
+  memcpy(&listenfd, CMSG_DATA(cmsg), sizeof(int));
+
+  time_point start = myclock::now();
+  size_t     pages = read_snapshot(fd);
+  close(fd);
+  log("Took over listening socket %d and %zu cached pages in %lld ms", listenfd, pages,
+      (long long)std::chrono::duration_cast<std::chrono::milliseconds>(myclock::now() - start).count());
+  return listenfd;
+}
+
+/**
+  @brief Listen for a new process on the handoff socket, replacing the socket of the process that was taken over. The
+  socket is only accessible by the owner, who is the only user a handoff is accepted from.
+
+  @param[in]  listenfd  Listening socket to pass on
+
+  @return  True if the handoff socket is open
+**/
+bool Handoff::serve(int listenfd) {
+  struct sockaddr_un addr;
+  if (!address(addr)) return false;
+  unlink(path_.c_str());
+  sockfd_ = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (sockfd_ < 0) return false;
+  // The mode of the socket is given to the file created by bind(), so it is never accessible by other users
+  if (fchmod(sockfd_, S_IRUSR | S_IWUSR) < 0 || bind(sockfd_, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+      chmod(path_.c_str(), S_IRUSR | S_IWUSR) < 0 || ::listen(sockfd_, 1) < 0) {
+    log("Error opening handoff socket %s: %s", path_.c_str(), strerror(errno));
+    close(sockfd_);
+    sockfd_ = -1;
+    return false;
+  }
+  listenfd_ = listenfd;
+  thread_   = std::thread(&Handoff::run, this);
+  return true;
+}
+
+/**
+  @brief Remember a page inserted into the page cache, called from the cache's insertion callback
+
+  @param[in]  key  Key of the page
+**/
+void Handoff::inserted(const URIKey &key) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  auto                        it = index_.find(key);
+  if (it != index_.end()) pages_.erase(it->second);
+  pages_.emplace_front(key, myclock::now());
+  index_[key] = pages_.begin();
+  if (pages_.size() > HANDOFF_MAX_PAGES) {
+    index_.erase(pages_.back().first);
+    pages_.pop_back();
+  }
+}
+
+/**
+  @brief Close the handoff socket and wait for a handoff in progress to finish
+**/
+void Handoff::stop() {
+  stopped_accepting_ = true;
+  if (sockfd_ >= 0) shutdown(sockfd_, SHUT_RDWR);
+  if (thread_.joinable()) thread_.join();
+  if (sockfd_ >= 0) close(sockfd_);
+  sockfd_ = -1;
+}
+
+/**
+  @brief Wait for a new process, hand over to it, and start draining
+**/
+void Handoff::run() {
+  while (true) {
+    int fd = accept(sockfd_, nullptr, nullptr);
+    if (fd < 0) {
+      if (errno == EINTR || errno == ECONNABORTED) continue;
+      return;
+    }
+    if (Signaler::done || Signaler::draining || !same_user(fd) || !send_listener(fd)) {
+      close(fd);
+      continue;
+    }
+
+    // Both processes accept connections while the snapshot is sent, then the old one drains
+    time_point start = myclock::now();
+    write_snapshot(fd);
+    close(fd);
+    log("Handed over listening socket in %lld ms, draining",
+        (long long)std::chrono::duration_cast<std::chrono::milliseconds>(myclock::now() - start).count());
+    break;
+  }
+
+  // The main thread may be blocked in accept() with nobody connecting to this process any more, so interrupt it until
+  // it has stopped accepting
+  Signaler::draining = true;
+  while (!stopped_accepting_) {
+    pthread_kill(main_thread_, SIGTERM);
+    std::this_thread::sleep_for(std::chrono::milliseconds(100));
+  }
+}
+
+bool Handoff::send_listener(int fd) {
+  char           byte = 'L';
+  struct iovec   iov  = {&byte, 1};
+  struct msghdr  msg;
+  char           control[CMSG_SPACE(sizeof(int))];
+  memset(&msg, 0, sizeof(msg));
+  memset(control, 0, sizeof(control));
+  msg.msg_iov        = &iov;
+  msg.msg_iovlen     = 1;
+  msg.msg_control    = control;
+  msg.msg_controllen = sizeof(control);
+
+  struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+  cmsg->cmsg_level     = SOL_SOCKET;
+  cmsg->cmsg_type      = SCM_RIGHTS;
+  cmsg->cmsg_len       = CMSG_LEN(sizeof(int));
+  memcpy(CMSG_DATA(cmsg), &listenfd_, sizeof(int));
+  return sendmsg(fd, &msg, MSG_NOSIGNAL) == 1;
+}
+
+void Handoff::write_snapshot(int fd) {
+  std::list<Page> pages;
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    pages = pages_;
+  }
+
+  // Responses are sent uncompressed, and compressed again by the new process if it is configured to
+  std::string out;
+  size_t      sent = 0;
+  time_point  now  = myclock::now();
+  for (const auto &page : pages) {
+    if (now - page.second >= cache_timeout_) break;
+    // The next process does not know which request headers a variant was selected by
+    if (page.first.variant() != 0) continue;
+    auto response = page_cache_->get(page.first);
+    if (!response) continue;
+    response->decompressed().dump(out);
+
+    const URIKey &key  = page.first;
+    std::string   port = std::to_string(key.port());
+    char          buf[RECORD_HEADER_SIZE];
+    std::uint32_t age      = static_cast<std::uint32_t>(std::chrono::duration_cast<std::chrono::milliseconds>(now - page.second).count());
+    std::uint16_t host_len = static_cast<std::uint16_t>(key.host().size()), port_len = static_cast<std::uint16_t>(port.size());
+    std::uint32_t uri_len  = static_cast<std::uint32_t>(key.target().size());
+    std::uint64_t size     = out.size();
+    if (host_len == 0 || key.host().size() > UINT16_MAX) continue;
+    memcpy(buf, &age, 4);
+    memcpy(buf + 4, &host_len, 2);
+    memcpy(buf + 6, &port_len, 2);
+    memcpy(buf + 8, &uri_len, 4);
+    memcpy(buf + 12, &size, 8);
+    if (!write_all(fd, buf, sizeof(buf)) || !write_all(fd, key.host().data(), host_len) || !write_all(fd, port.data(), port_len) ||
+        !write_all(fd, key.target().data(), uri_len) || !write_all(fd, out.data(), out.size())) {
+      log("Error sending cache snapshot: %s", strerror(errno));
+      return;
+    }
+    sent++;
+  }
+
+  char end[RECORD_HEADER_SIZE] = {0};
+  write_all(fd, end, sizeof(end));
+  log("Sent %zu cached pages", sent);
+}
+
+/**
+  @brief Restore the pages of a snapshot into the page cache. Restored pages start a new lifetime in the cache, unless
+  the cache policy gives them a shorter TTL, and pages that would expire within a second are skipped.
+
+  @return  Number of pages restored
+**/
+size_t Handoff::read_snapshot(int fd) {
+  size_t restored = 0;
+  while (true) {
+    char          buf[RECORD_HEADER_SIZE];
+    std::uint32_t age, uri_len;
+    std::uint16_t host_len, port_len;
+    std::uint64_t size;
+    if (!read_all(fd, buf, sizeof(buf))) break;
+    memcpy(&age, buf, 4);
+    memcpy(&host_len, buf + 4, 2);
+    memcpy(&port_len, buf + 6, 2);
+    memcpy(&uri_len, buf + 8, 4);
+    memcpy(&size, buf + 12, 8);
+    if (host_len == 0) break;
+
+    ProxyURI    uri;
+    std::string page;
+    uri.host.resize(host_len);
+    uri.port.resize(port_len);
+    uri.uri.resize(uri_len);
+    page.resize(size);
+    if (!read_all(fd, &uri.host[0], host_len) || (port_len > 0 && !read_all(fd, &uri.port[0], port_len)) ||
+        (uri_len > 0 && !read_all(fd, &uri.uri[0], uri_len)) || (size > 0 && !read_all(fd, &page[0], size))) {
+      break;
+    }
+    if (std::chrono::milliseconds(age) + std::chrono::seconds(1) >= cache_timeout_) continue;
+
+    size_t header_end = page.find("\r\n\r\n");
+    if (header_end == std::string::npos) continue;
+    HTTPResponse response(page.substr(0, header_end + 4), uri);
+    std::string  body = page.substr(header_end + 4);
+    if (!response.append_to_body(body, body.size())) continue;
+
+    // Pages cached for less than the cache timeout keep their deadline, other pages start a new lifetime
+    std::chrono::seconds ttl = CachePolicy::global().ttl(response);
+    if (ttl < cache_timeout_) ttl = std::chrono::duration_cast<std::chrono::seconds>(ttl - std::chrono::milliseconds(age));
+    URIKey key(uri);
+    if (ttl.count() <= 0 || !CachePolicy::global().stored(key, ttl)) continue;
+    TinyLFU::global().put(*page_cache_, key, response.compressed());
+    restored++;
+
+    // Records arrive most recent first, and keep their original insertion time for the next handoff
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (index_.count(key)) continue;
+    pages_.emplace_back(key, myclock::now() - std::chrono::milliseconds(age));
+    index_[key] = std::prev(pages_.end());
+  }
+  return restored;
+}
+
+bool Handoff::address(struct sockaddr_un &addr) const {
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  if (path_.size() >= sizeof(addr.sun_path)) {
+    log("Handoff socket path %s is too long", path_.c_str());
+    return false;
+  }
+  memcpy(addr.sun_path, path_.c_str(), path_.size());
+  return true;
+}
@@ -0,0 +1,380 @@
+#include "HeaderTable.h"
+
+#include <array>
+
+#define HEADER_NAME(name) \
+  { name, sizeof(name) - 1 }
+// Slots of the perfect hash table of well-known header names
+#define HEADER_HASH_SLOTS 128
+// Bytes of a table's buffer no longer used by any field before set() compacts it, if they are half of the buffer
+#define HEADER_TABLE_MIN_DEAD 256
+
+struct HeaderName {
+  const char *name;
+  size_t      len;
+};
+
+// Canonical names of well-known headers, indexed by Header
+static constexpr HeaderName header_names[] = {
+    HEADER_NAME(""),
+    HEADER_NAME("Accept"),
+    HEADER_NAME("Accept-Encoding"),
+    HEADER_NAME("Accept-Language"),
+    HEADER_NAME("Accept-Ranges"),
+    HEADER_NAME("Age"),
+    HEADER_NAME("Authorization"),
+    HEADER_NAME("Cache-Control"),
+    HEADER_NAME("Connection"),
+    HEADER_NAME("Content-Encoding"),
+    HEADER_NAME("Content-Length"),
+    HEADER_NAME("Content-Range"),
+    HEADER_NAME("Content-Type"),
+    HEADER_NAME("Cookie"),
+    HEADER_NAME("Date"),
+    HEADER_NAME("ETag"),
+    HEADER_NAME("Expires"),
+    HEADER_NAME("Host"),
+    HEADER_NAME("If-Modified-Since"),
+    HEADER_NAME("If-None-Match"),
+    HEADER_NAME("If-Range"),
+    HEADER_NAME("Keep-Alive"),
+    HEADER_NAME("Last-Modified"),
+    HEADER_NAME("Location"),
+    HEADER_NAME("Pragma"),
+    HEADER_NAME("Proxy-Authorization"),
+    HEADER_NAME("Proxy-Connection"),
+    HEADER_NAME("Range"),
+    HEADER_NAME("Referer"),
+    HEADER_NAME("Server"),
+    HEADER_NAME("Set-Cookie"),
+    HEADER_NAME("Transfer-Encoding"),
+    HEADER_NAME("Upgrade"),
+    HEADER_NAME("Upgrade-Insecure-Requests"),
+    HEADER_NAME("User-Agent"),
+    HEADER_NAME("Vary"),
+    HEADER_NAME("Via"),
+};
+static_assert(sizeof(header_names) / sizeof(header_names[0]) == static_cast<size_t>(Header::NumHeaders), "header_names must match Header");
+
+/**
+  @brief Hash a header field name by its length and its first and last characters, ignoring case, which tells the
+  well-known names apart
+
+  @param[in]  name  Field name, not necessarily null-terminated
+  @param[in]  len   Length of the field name, at least 1
+
+  @return  Slot of the name in header_slots
+**/
+static constexpr size_t header_hash(const char *name, size_t len) {
+  return (len + (name[0] | 0x20) * 46 + (name[len - 1] | 0x20)) % HEADER_HASH_SLOTS;
+}
+
+// Header of each hash slot, Header::Other for empty slots, or Header::NumHeaders if two names collide
+static constexpr std::array<Header, HEADER_HASH_SLOTS> header_slots = [] {
+  std::array<Header, HEADER_HASH_SLOTS> slots{};
+  for (size_t i = 1; i < static_cast<size_t>(Header::NumHeaders); i++) {
+    Header &slot = slots[header_hash(header_names[i].name, header_names[i].len)];
+    slot         = slot == Header::Other ? static_cast<Header>(i) : Header::NumHeaders;
+  }
+  return slots;
+}();
+
+static constexpr bool header_hash_is_perfect() {
+  size_t used = 0;
+  for (Header slot : header_slots) {
+    if (slot == Header::NumHeaders) return false;
+    if (slot != Header::Other) used++;
+  }
+  return used == static_cast<size_t>(Header::NumHeaders) - 1;
+}
+static_assert(header_hash_is_perfect(), "header_hash must map every well-known header name to a slot of its own");
+
+/**
+  @brief Write a StrView to an output stream
+
+  @param[inout]  os    Output stream
+  @param[in]     view  View to write
+
+  @return std::ostream& Output stream
+**/
+std::ostream &operator<<(std::ostream &os, const StrView &view) {
+  if (view.data) os.write(view.data, view.size);
+  return os;
+}
+
+/**
+  @brief Get the canonical name of a well-known header
+
+  @param[in]  id  Header ID
+
+  @return  Header name, or an empty string for Header::Other
+**/
+const char *header_name(Header id) { return header_names[static_cast<size_t>(id)].name; }
+
+/**
+  @brief Intern a header field name, ignoring case
+
+  @param[in]  name  Field name, not necessarily null-terminated
+  @param[in]  len   Length of the field name
+
+  @return  ID of the header, or Header::Other if it is not a well-known header
+**/
+Header header_id(const char *name, size_t len) {
+  if (len == 0) return Header::Other;
+  Header            id    = header_slots[header_hash(name, len)];
+  const HeaderName &known = header_names[static_cast<size_t>(id)];
+  if (id != Header::Other && known.len == len && strncasecmp(known.name, name, len) == 0) return id;
+  return Header::Other;
+}
+
+HeaderTable::HeaderTable(Arena *arena) : buf_(ArenaAllocator<char>(arena)), entries_(ArenaAllocator<Entry>(arena)) {}
+
+/**
+  @brief Parse header fields from a message, starting after the request or status line
+
+  @param[in]  message  Message containing the header block
+  @param[in]  pos      Index of the first header line in `message`
+**/
+void HeaderTable::parse(const std::string &message, size_t pos) {
+  size_t end = message.find("\r\n\r\n", pos);
+  end        = end == std::string::npos ? message.size() : end + 2;
+
+  buf_.clear();
+  entries_.clear();
+  dead_ = 0;
+  if (pos >= end) return;
+
+  buf_.assign(message.data() + pos, end - pos);
+  entries_.reserve(16);
+
+  size_t line_start = 0;
+  while (line_start < buf_.size()) {
+    size_t line_end = buf_.find('\n', line_start);
+    if (line_end == Buffer::npos) line_end = buf_.size();
+    size_t next = line_end + 1;
+    if (line_end > line_start && buf_[line_end - 1] == '\r') line_end--;
+    if (line_end == line_start) break;
+
+    size_t colon_idx = buf_.find(':', line_start);
+    if (colon_idx != Buffer::npos && colon_idx < line_end) {
+      // Skip leading and trailing whitespace in value
+      size_t value_start = colon_idx + 1, value_end = line_end;
+      while (value_start < value_end && (buf_[value_start] == ' ' || buf_[value_start] == '\t')) value_start++;
+      while (value_end > value_start && (buf_[value_end - 1] == ' ' || buf_[value_end - 1] == '\t')) value_end--;
+
+      Entry entry;
+      entry.id        = header_id(&buf_[line_start], colon_idx - line_start);
+      entry.name_off  = line_start;
+      entry.name_len  = colon_idx - line_start;
+      entry.value_off = value_start;
+      entry.value_len = value_end - value_start;
+      entries_.push_back(entry);
+    }
+    line_start = next;
+  }
+}
+
+/**
+  @brief Get the value of a header field
+
+  @param[in]  id  Header ID
+
+  @return  View of the first value of the field, or an empty view if it is not present
+**/
+StrView HeaderTable::get(Header id) const {
+  auto it = find(id);
+  return it == entries_.end() ? StrView() : value(*it);
+}
+
+/**
+  @brief Get the value of a header field by name, ignoring case
+
+  @param[in]  name  Field name
+
+  @return  View of the first value of the field, or an empty view if it is not present
+**/
+StrView HeaderTable::get(const std::string &name) const {
+  auto it = find(name);
+  return it == entries_.end() ? StrView() : value(*it);
+}
+
+/**
+  @brief Set a header field, replacing any existing values. A new value that fits where the first old one is
+  overwrites it in place, keeping the field's position.
+
+  @param[in]  id     Header ID, must not be Header::Other
+  @param[in]  value  New value, which may point into the table's own buffer
+**/
+void HeaderTable::set(Header id, StrView value) {
+  auto it = entries_.begin() + (find(id) - entries_.cbegin());
+  if (it != entries_.end() && value.size <= it->value_len) {
+    overwrite(*it, value);
+    erase(id, it - entries_.begin() + 1);
+    return;
+  }
+  erase(id);
+  add(id, nullptr, 0, value);
+}
+
+/**
+  @brief Set a header field by name, replacing any existing values
+
+  @param[in]  name   Field name
+  @param[in]  value  New value
+**/
+void HeaderTable::set(const std::string &name, const std::string &value) {
+  Header id = header_id(name.data(), name.size());
+  if (id != Header::Other) return set(id, value);
+  auto it = entries_.begin() + (find(name) - entries_.cbegin());
+  if (it != entries_.end() && value.size() <= it->value_len) {
+    overwrite(*it, StrView(value.data(), value.size()));
+    erase(name, it - entries_.begin() + 1);
+    return;
+  }
+  erase(name);
+  add(Header::Other, name.data(), name.size(), StrView(value.data(), value.size()));
+}
+
+/**
+  @brief Remove all values of a header field
+
+  @param[in]  id     Header ID
+  @param[in]  first  Index of the first entry to check
+**/
+void HeaderTable::erase(Header id, size_t first) {
+  for (auto it = entries_.begin() + first; it != entries_.end();) {
+    it = it->id == id ? remove(it) : it + 1;
+  }
+}
+
+/**
+  @brief Remove all values of a header field by name, ignoring case
+
+  @param[in]  name   Field name
+  @param[in]  first  Index of the first entry to check
+**/
+void HeaderTable::erase(const std::string &name, size_t first) {
+  Header id = header_id(name.data(), name.size());
+  if (id != Header::Other) return erase(id, first);
+  for (auto it = entries_.begin() + first; it != entries_.end();) {
+    it = it->id == Header::Other && this->name(*it).iequals(name.c_str()) ? remove(it) : it + 1;
+  }
+}
+
+/**
+  @brief Get the name of a header field, canonical for well-known headers and as received otherwise
+
+  @param[in]  entry  Table entry
+
+  @return  View of the field name
+**/
+StrView HeaderTable::name(const Entry &entry) const {
+  if (entry.id != Header::Other) return StrView(header_names[static_cast<size_t>(entry.id)].name, header_names[static_cast<size_t>(entry.id)].len);
+  return StrView(&buf_[entry.name_off], entry.name_len);
+}
+
+/**
+  @brief Append all header fields to a string, as "Name: value\r\n" lines
+
+  @param[out]  out  String to append to
+**/
+void HeaderTable::dump(std::string &out) const {
+  for (const auto &entry : entries_) {
+    StrView field_name = name(entry), field_value = value(entry);
+    out.append(field_name.data, field_name.size).append(": ").append(field_value.data, field_value.size).append("\r\n");
+  }
+}
+
+HeaderTable::Entries::const_iterator HeaderTable::find(Header id) const {
+  for (auto it = entries_.begin(); it != entries_.end(); ++it) {
+    if (it->id == id) return it;
+  }
+  return entries_.end();
+}
+
+HeaderTable::Entries::const_iterator HeaderTable::find(const std::string &name) const {
+  Header id = header_id(name.data(), name.size());
+  if (id != Header::Other) return find(id);
+  for (auto it = entries_.begin(); it != entries_.end(); ++it) {
+    if (it->id == Header::Other && this->name(*it).iequals(name.c_str())) return it;
+  }
+  return entries_.end();
+}
+
+/**
+  @brief Remove an entry, counting its bytes as unused
+
+  @param[in]  it  Entry to remove
+
+  @return  Iterator to the next entry
+**/
+HeaderTable::Entries::iterator HeaderTable::remove(Entries::iterator it) {
+  dead_ += it->name_len + it->value_len;
+  return entries_.erase(it);
+}
+
+/**
+  @brief Replace the value of an entry in place
+
+  @param[inout]  entry  Entry to update
+  @param[in]     value  New value, no longer than the old one
+**/
+void HeaderTable::overwrite(Entry &entry, StrView value) {
+  memmove(&buf_[entry.value_off], value.data, value.size);
+  dead_ += entry.value_len - value.size;
+  entry.value_len = value.size;
+}
+
+/**
+  @brief Copy the names and values still in use to a new buffer, once most of the buffer is unused. Tables in an arena
+  are not compacted, since the old buffer would stay allocated until the arena is reset.
+**/
+void HeaderTable::compact() {
+  if (dead_ < HEADER_TABLE_MIN_DEAD || dead_ * 2 < buf_.size() || buf_.get_allocator().arena()) return;
+  Buffer buf(buf_.get_allocator());
+  buf.reserve(buf_.size() - dead_);
+  for (auto &entry : entries_) {
+    std::uint32_t name_off = buf.size();
+    if (entry.id == Header::Other) buf.append(&buf_[entry.name_off], entry.name_len);
+    entry.name_off  = entry.id == Header::Other ? name_off : 0;
+    entry.name_len  = entry.id == Header::Other ? entry.name_len : 0;
+    std::uint32_t value_off = buf.size();
+    buf.append(&buf_[entry.value_off], entry.value_len);
+    entry.value_off = value_off;
+  }
+  buf_.swap(buf);
+  dead_ = 0;
+}
+
+/**
+  @brief Append raw bytes to the table's buffer
+
+  @param[in]  data  Bytes to append
+  @param[in]  len   Number of bytes
+
+  @return  Offset of the appended bytes in the buffer
+**/
+std::uint32_t HeaderTable::append(const char *data, size_t len) {
+  std::uint32_t off = buf_.size();
+  buf_.append(data, len);
+  return off;
+}
+
+/**
+  @brief Add a new header field without checking for existing values
+
+  @param[in]  id        Header ID
+  @param[in]  name      Field name, only stored for Header::Other
+  @param[in]  name_len  Length of the field name
+  @param[in]  value     Field value
+**/
+void HeaderTable::add(Header id, const char *name, size_t name_len, StrView value) {
+  Entry entry;
+  entry.id        = id;
+  entry.name_off  = id == Header::Other ? append(name, name_len) : 0;
+  entry.name_len  = id == Header::Other ? name_len : 0;
+  entry.value_off = append(value.data, value.size);
+  entry.value_len = value.size;
+  entries_.push_back(entry);
+  compact();
+}
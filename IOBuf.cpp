@@ -0,0 +1,333 @@
+#include "IOBuf.h"
+
+#include <algorithm>
+#include <cstring>
+#include <new>
+
+std::mutex             IOBlockPool::mutex_;
+std::vector<IOBlock *> IOBlockPool::idle_;
+std::atomic<size_t>    IOBlockPool::allocated_{0};
+std::atomic<size_t>    IOBlockPool::allocated_bytes_{0};
+
+/**
+  @brief Allocate a block and its bytes in one allocation
+
+  @param[in]  capacity  Number of bytes of the block
+
+  @return  Empty block
+**/
+IOBlock *IOBlockPool::allocate(size_t capacity) {
+  IOBlock *block  = new (::operator new(sizeof(IOBlock) + capacity)) IOBlock();
+  block->capacity = static_cast<std::uint32_t>(capacity);
+  return block;
+}
+
+void IOBlockPool::free(IOBlock *block) {
+  block->~IOBlock();
+  ::operator delete(block);
+}
+
+/**
+  @brief Get an empty block, from the pool for full-size blocks unless none are idle
+
+  @param[in]  capacity  Number of bytes of the block, IOBUF_BLOCK_SIZE for a pooled block
+
+  @return  Block with a single reference
+**/
+IOBlock *IOBlockPool::acquire(size_t capacity) {
+  IOBlock *block = nullptr;
+  if (capacity == IOBUF_BLOCK_SIZE) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (!idle_.empty()) {
+      block = idle_.back();
+      idle_.pop_back();
+    }
+  }
+  if (!block) block = allocate(capacity);
+  block->refs.store(1, std::memory_order_relaxed);
+  block->size = 0;
+  allocated_.fetch_add(1, std::memory_order_relaxed);
+  allocated_bytes_.fetch_add(sizeof(IOBlock) + block->capacity, std::memory_order_relaxed);
+  return block;
+}
+
+/**
+  @brief Return a block whose last reference was dropped to the pool, or free it if the pool is full or the block is
+  not full-size
+
+  @param[in]  block  Block to return
+**/
+void IOBlockPool::release(IOBlock *block) {
+  allocated_.fetch_sub(1, std::memory_order_relaxed);
+  allocated_bytes_.fetch_sub(sizeof(IOBlock) + block->capacity, std::memory_order_relaxed);
+  if (block->capacity == IOBUF_BLOCK_SIZE) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (idle_.size() < IOBUF_POOL_MAX_IDLE) {
+      idle_.push_back(block);
+      return;
+    }
+  }
+  free(block);
+}
+
+/**
+  @return  Number of idle blocks held by the pool
+**/
+size_t IOBlockPool::num_idle() {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return idle_.size();
+}
+
+static inline void unref(IOBlock *block) {
+  if (block->refs.fetch_sub(1, std::memory_order_acq_rel) == 1) IOBlockPool::release(block);
+}
+
+IOBuf::IOBuf(const IOBuf &other) : segments_(other.segments_), size_(other.size_) {
+  for (const auto &segment : segments_) segment.block->refs.fetch_add(1, std::memory_order_relaxed);
+}
+
+IOBuf::IOBuf(IOBuf &&other) noexcept : segments_(std::move(other.segments_)), size_(other.size_) {
+  other.segments_.clear();
+  other.size_ = 0;
+}
+
+IOBuf::~IOBuf() { clear(); }
+
+IOBuf &IOBuf::operator=(const IOBuf &other) {
+  if (this != &other) *this = IOBuf(other);
+  return *this;
+}
+
+IOBuf &IOBuf::operator=(IOBuf &&other) noexcept {
+  if (this != &other) {
+    clear();
+    segments_ = std::move(other.segments_);
+    size_     = other.size_;
+    other.segments_.clear();
+    other.size_ = 0;
+  }
+  return *this;
+}
+
+/**
+  @brief Drop all bytes of the buffer, blocks no other buffer holds go back to the pool
+**/
+void IOBuf::clear() {
+  for (const auto &segment : segments_) unref(segment.block);
+  segments_.clear();
+  size_ = 0;
+}
+
+/**
+  @return  Bytes of the blocks the buffer holds, counting shared blocks in full
+**/
+size_t IOBuf::block_bytes() const {
+  size_t   bytes = 0;
+  IOBlock *last  = nullptr;
+  for (const auto &segment : segments_) {
+    if (segment.block != last) bytes += segment.block->capacity;
+    last = segment.block;
+  }
+  return bytes;
+}
+
+/**
+  @brief Copy the bytes of the buffer into a single block of their exact size if its blocks are mostly empty, e.g. a
+  small body about to be kept in a cache, so that it does not pin a full block for its lifetime
+**/
+void IOBuf::compact() {
+  if (size_ == 0 || block_bytes() < 2 * size_) return;
+  IOBlock *block = IOBlockPool::acquire(size_);
+  char    *dst   = block->data;
+  for_each([&](const char *p, size_t len) {
+    memcpy(dst, p, len);
+    dst += len;
+  });
+  block->size = static_cast<std::uint32_t>(size_);
+  size_t size = size_;
+  clear();
+  add_segment(block, 0, static_cast<std::uint32_t>(size));
+}
+
+/**
+  @brief Add a segment at the end of the buffer, merging it into the last one if it directly follows it
+
+  @param[in]  block   Block of the segment, the buffer takes over one reference to it
+  @param[in]  offset  Offset of the segment in the block
+  @param[in]  length  Length of the segment
+**/
+void IOBuf::add_segment(IOBlock *block, std::uint32_t offset, std::uint32_t length) {
+  if (!segments_.empty()) {
+    Segment &last = segments_.back();
+    if (last.block == block && last.offset + last.length == offset) {
+      last.length += length;
+      size_ += length;
+      unref(block);
+      return;
+    }
+  }
+  segments_.push_back(Segment{block, offset, length});
+  size_ += length;
+}
+
+/**
+  @brief Copy bytes to the end of the buffer, filling the last block before chaining new ones
+
+  @param[in]  data  Bytes to copy
+  @param[in]  size  Number of bytes
+**/
+void IOBuf::append(const char *data, size_t size) {
+  while (size > 0) {
+    size_t room;
+    char  *dst = prepare(room);
+    size_t n   = std::min(room, size);
+    memcpy(dst, data, n);
+    commit(n);
+    data += n;
+    size -= n;
+  }
+}
+
+/**
+  @brief Append the bytes of another buffer, sharing its blocks
+
+  @param[in]  other  Buffer to append
+**/
+void IOBuf::append(const IOBuf &other) {
+  if (&other == this) {
+    IOBuf copy(other);
+    return append(copy);
+  }
+  segments_.reserve(segments_.size() + other.segments_.size());
+  for (const auto &segment : other.segments_) {
+    segment.block->refs.fetch_add(1, std::memory_order_relaxed);
+    add_segment(segment.block, segment.offset, segment.length);
+  }
+}
+
+/**
+  @brief Append a range of the bytes of another buffer, sharing its blocks
+
+  @param[in]  other   Buffer to append from
+  @param[in]  offset  Offset of the first byte to append
+  @param[in]  length  Number of bytes to append, cut at the end of `other`
+**/
+void IOBuf::append(const IOBuf &other, size_t offset, size_t length) {
+  if (&other == this) {
+    IOBuf copy(other);
+    return append(copy, offset, length);
+  }
+  for (const auto &segment : other.segments_) {
+    if (length == 0) break;
+    if (offset >= segment.length) {
+      offset -= segment.length;
+      continue;
+    }
+    std::uint32_t n = static_cast<std::uint32_t>(std::min<size_t>(segment.length - offset, length));
+    segment.block->refs.fetch_add(1, std::memory_order_relaxed);
+    add_segment(segment.block, segment.offset + offset, n);
+    length -= n;
+    offset = 0;
+  }
+}
+
+/**
+  @brief Get a range of the buffer without copying it
+
+  @param[in]  offset  Offset of the first byte
+  @param[in]  length  Number of bytes, cut at the end of the buffer
+
+  @return  IOBuf  Buffer sharing the blocks of the range
+**/
+IOBuf IOBuf::slice(size_t offset, size_t length) const {
+  IOBuf ret;
+  ret.append(*this, offset, length);
+  return ret;
+}
+
+/**
+  @brief Get writable room at the end of the buffer, e.g. to receive into. The bytes written are added by commit().
+
+  @param[out]  room  Number of bytes that may be written, at least 1
+
+  @return  Start of the writable room
+**/
+char *IOBuf::prepare(size_t &room) {
+  if (!segments_.empty()) {
+    Segment &last  = segments_.back();
+    IOBlock *block = last.block;
+    // The tail of a block may only be written by its single holder, right after the bytes it holds
+    if (block->refs.load(std::memory_order_acquire) == 1 && last.offset + last.length == block->size && block->size < block->capacity) {
+      room = block->capacity - block->size;
+      return block->data + block->size;
+    }
+  }
+  IOBlock *block = IOBlockPool::acquire();
+  segments_.push_back(Segment{block, 0, 0});
+  room = IOBUF_BLOCK_SIZE;
+  return block->data;
+}
+
+/**
+  @brief Add bytes written to the room returned by prepare() to the buffer
+
+  @param[in]  size  Number of bytes written, at most the room returned by prepare()
+**/
+void IOBuf::commit(size_t size) {
+  Segment &last = segments_.back();
+  last.length += size;
+  last.block->size += size;
+  size_ += size;
+}
+
+/**
+  @brief Append an iovec for each contiguous run of bytes of the buffer, e.g. to send it with sendmsg(2)
+
+  @param[out]  iov  Vector to append to
+**/
+void IOBuf::iovecs(std::vector<struct iovec> &iov) const {
+  for (const auto &segment : segments_) {
+    if (segment.length > 0) iov.push_back(iovec{segment.block->data + segment.offset, segment.length});
+  }
+}
+
+/**
+  @brief Copy the bytes of the buffer to the end of a string
+
+  @param[out]  out  String to append to
+**/
+void IOBuf::copy_to(std::string &out) const {
+  out.reserve(out.size() + size_);
+  for (const auto &segment : segments_) out.append(segment.block->data + segment.offset, segment.length);
+}
+
+/**
+  @return  Copy of the bytes of the buffer in a contiguous string
+**/
+std::string IOBuf::str() const {
+  std::string out;
+  copy_to(out);
+  return out;
+}
+
+/**
+  @brief Compare the bytes of two buffers, however they are split into blocks
+
+  @param[in]  other  Buffer to compare with
+
+  @return  True if both buffers hold the same bytes
+**/
+bool IOBuf::operator==(const IOBuf &other) const {
+  if (size_ != other.size_) return false;
+  auto   a = segments_.begin(), b = other.segments_.begin();
+  size_t a_off = 0, b_off = 0;
+  while (a != segments_.end() && b != other.segments_.end()) {
+    size_t n = std::min(a->length - a_off, b->length - b_off);
+    if (n > 0 && memcmp(a->block->data + a->offset + a_off, b->block->data + b->offset + b_off, n) != 0) return false;
+    a_off += n;
+    b_off += n;
+    if (a_off == a->length) ++a, a_off = 0;
+    if (b_off == b->length) ++b, b_off = 0;
+  }
+  return true;
+}
@@ -0,0 +1,706 @@
+#include "IOUring.h"
+#include "Trace.h"
+
+#include <netinet/in.h>
+#include <sys/resource.h>
+
+#include <algorithm>
+
+/**
+  @brief Tag the prepared entry with the operation, which the kernel only sees once the reactor submits it
+**/
+void IOUring::Op::await_suspend(std::coroutine_handle<> handle) {
+  handle_         = handle;
+  trace_request_  = Trace::current_request();
+  sqe_->user_data = reinterpret_cast<std::uint64_t>(this) | IOURING_TAG_OP;
+}
+
+/**
+  @return  Result of the operation, or -errno
+**/
+int IOUring::Op::await_resume() {
+  if (sqe_) Trace::resume_request(trace_request_);
+  return res_;
+}
+
+IOUring::IOUring(unsigned entries, unsigned files) {
+  io_uring_params params;
+  memset(&params, 0, sizeof(params));
+
+  ring_fd_ = syscall(__NR_io_uring_setup, entries, &params);
+  if (ring_fd_ < 0) {
+    log("io_uring_setup failed: %s", strerror(errno));
+    return;
+  }
+
+  // Map submission and completion rings, which share one mapping on newer kernels
+  sq_size_ = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+  cq_size_ = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+  if (params.features & IORING_FEAT_SINGLE_MMAP) sq_size_ = cq_size_ = std::max(sq_size_, cq_size_);
+
+  sq_ptr_ = mmap(nullptr, sq_size_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd_, IORING_OFF_SQ_RING);
+  if (sq_ptr_ == MAP_FAILED) {
+    log("Error mapping io_uring submission queue: %s", strerror(errno));
+    sq_ptr_ = nullptr;
+    ::close(ring_fd_);
+    ring_fd_ = -1;
+    return;
+  }
+  if (params.features & IORING_FEAT_SINGLE_MMAP) {
+    cq_ptr_ = sq_ptr_;
+  } else {
+    cq_ptr_ = mmap(nullptr, cq_size_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd_, IORING_OFF_CQ_RING);
+    if (cq_ptr_ == MAP_FAILED) {
+      log("Error mapping io_uring completion queue: %s", strerror(errno));
+      cq_ptr_ = nullptr;
+      munmap(sq_ptr_, sq_size_);
+      sq_ptr_ = nullptr;
+      ::close(ring_fd_);
+      ring_fd_ = -1;
+      return;
+    }
+  }
+  sqes_size_ = params.sq_entries * sizeof(io_uring_sqe);
+  void *sqes = mmap(nullptr, sqes_size_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd_, IORING_OFF_SQES);
+  if (sqes == MAP_FAILED) {
+    log("Error mapping io_uring submission entries: %s", strerror(errno));
+    if (cq_ptr_ != sq_ptr_) munmap(cq_ptr_, cq_size_);
+    munmap(sq_ptr_, sq_size_);
+    sq_ptr_ = cq_ptr_ = nullptr;
+    ::close(ring_fd_);
+    ring_fd_ = -1;
+    return;
+  }
+
+  char *sq    = static_cast<char *>(sq_ptr_);
+  char *cq    = static_cast<char *>(cq_ptr_);
+  sq_head_    = reinterpret_cast<unsigned *>(sq + params.sq_off.head);
+  sq_tail_    = reinterpret_cast<unsigned *>(sq + params.sq_off.tail);
+  sq_mask_    = reinterpret_cast<unsigned *>(sq + params.sq_off.ring_mask);
+  sq_flags_   = reinterpret_cast<unsigned *>(sq + params.sq_off.flags);
+  sq_array_   = reinterpret_cast<unsigned *>(sq + params.sq_off.array);
+  sqes_       = static_cast<io_uring_sqe *>(sqes);
+  sq_entries_ = params.sq_entries;
+  sqe_tail_   = sqe_flushed_ = *sq_tail_;
+  cq_head_    = reinterpret_cast<unsigned *>(cq + params.cq_off.head);
+  cq_tail_    = reinterpret_cast<unsigned *>(cq + params.cq_off.tail);
+  cq_mask_    = reinterpret_cast<unsigned *>(cq + params.cq_off.ring_mask);
+  cqes_       = reinterpret_cast<io_uring_cqe *>(cq + params.cq_off.cqes);
+  features_   = params.features;
+
+  // Register a sparse fixed file table, filled in by register_file(). Older kernels cap the table at fewer files than
+  // a reactor asks for, the size is halved until it fits.
+  while (true) {
+    files_.assign(files, -1);
+    files_registered_ = syscall(__NR_io_uring_register, ring_fd_, IORING_REGISTER_FILES, files_.data(), files) == 0;
+    if (files_registered_ || files <= IOURING_MAX_FILES) break;
+    files /= 2;
+  }
+  if (!files_registered_) {
+    log("Error registering io_uring fixed files, using plain file descriptors: %s", strerror(errno));
+    files_.clear();
+  }
+  for (int slot = static_cast<int>(files_.size()) - 1; slot >= 0; slot--) free_files_.push_back(slot);
+}
+
+IOUring::~IOUring() {
+  if (!ok()) return;
+  munmap(sqes_, sqes_size_);
+  if (cq_ptr_ != sq_ptr_) munmap(cq_ptr_, cq_size_);
+  munmap(sq_ptr_, sq_size_);
+  ::close(ring_fd_);
+}
+
+/**
+  @brief Get the io_uring instance of the calling thread, creating it on first use
+
+  @param[in]  entries  Submission queue entries, used if the ring is created by this call
+  @param[in]  files    Fixed file slots, used if the ring is created by this call
+
+  @return  IOUring&  Ring for this thread, check `ok()` before use
+**/
+IOUring &IOUring::thread_ring(unsigned entries, unsigned files) {
+  static thread_local IOUring ring(entries, files);
+  return ring;
+}
+
+/**
+  @brief Size the fixed file table of a shared reactor's ring. Connections are spread over the reactors round-robin
+  but may pile up on one, so each table has room for two sockets, client and server, of every allowed connection.
+
+  @param[in]  connections  Connection limit, 0 if there is none
+
+  @return  Number of fixed file slots, capped by the file descriptor limit and IOURING_MAX_REACTOR_FILES
+**/
+unsigned IOUring::reactor_files(unsigned connections) {
+  unsigned      max = IOURING_MAX_REACTOR_FILES;
+  struct rlimit limit;
+  if (getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur < max) max = limit.rlim_cur;
+  if (connections == 0 || connections > max / 2) return std::max<unsigned>(max, IOURING_MAX_FILES);
+  return std::max<unsigned>(2 * connections, IOURING_MAX_FILES);
+}
+
+/**
+  @brief Check whether io_uring is available, i.e. not disabled by the kernel or a seccomp filter, and supports every
+  operation used by connections
+
+  @return  True if a ring can be created and the operations are supported
+**/
+bool IOUring::supported() {
+  static const bool is_supported = IOUring(4).ok() && supports(IORING_OP_RECV) && supports(IORING_OP_SEND) &&
+                                   supports(IORING_OP_SENDMSG) && supports(IORING_OP_ACCEPT) && supports(IORING_OP_ASYNC_CANCEL);
+  return is_supported;
+}
+
+/**
+  @brief Check whether the kernel supports an operation, as reported by IORING_REGISTER_PROBE
+
+  @param[in]  opcode  Operation to check
+
+  @return  True if the operation is supported, false if it is not or the kernel can not be probed
+**/
+bool IOUring::supports(std::uint8_t opcode) {
+  static const std::vector<bool> ops = [] {
+    std::vector<bool> ops(IORING_OP_LAST, false);
+    IOUring           ring(4);
+    if (!ring.ok()) return ops;
+    std::vector<char> buf(sizeof(io_uring_probe) + IORING_OP_LAST * sizeof(io_uring_probe_op), 0);
+    io_uring_probe   *probe = reinterpret_cast<io_uring_probe *>(buf.data());
+    if (syscall(__NR_io_uring_register, ring.ring_fd_, IORING_REGISTER_PROBE, probe, IORING_OP_LAST) < 0) {
+      log("Error probing io_uring operations: %s", strerror(errno));
+      return ops;
+    }
+    for (unsigned op = 0; op < probe->ops_len && op < IORING_OP_LAST; op++) ops[op] = probe->ops[op].flags & IO_URING_OP_SUPPORTED;
+    return ops;
+  }();
+  return opcode < ops.size() && ops[opcode];
+}
+
+/**
+  @brief Check whether the kernel supports multishot accepts (Linux 5.19), which older kernels fail with EINVAL
+
+  @return  True if accept() can arm a single multishot accept, false if it must arm one accept per connection
+**/
+bool IOUring::supports_multishot_accept() {
+  static const bool is_supported = [] {
+    int listenfd = socket(AF_INET, SOCK_STREAM, 0);
+    if (listenfd < 0) return false;
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family      = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    bool ok              = bind(listenfd, (struct sockaddr *)&addr, sizeof(addr)) == 0 && listen(listenfd, 1) == 0;
+    if (ok) {
+      io_uring_sqe op;
+      memset(&op, 0, sizeof(op));
+      op.opcode = IORING_OP_ACCEPT;
+      op.fd     = listenfd;
+      op.ioprio = IORING_ACCEPT_MULTISHOT;
+      ok        = test_op(op, true) != -EINVAL;
+    }
+    ::close(listenfd);
+    if (!ok) log("io_uring multishot accept is not supported, arming one accept per connection");
+    return ok;
+  }();
+  return is_supported;
+}
+
+/**
+  @brief Check whether the kernel supports what UringTunnel needs: provided buffers, multishot receives (Linux 6.0)
+  and cancelling all operations at once (Linux 5.19). Kernels before 5.19 ignore the multishot flag of a receive, so
+  both are tested.
+
+  @return  True if UringTunnel can be used, false if tunnels must use PollTunnel
+**/
+bool IOUring::supports_multishot_recv() {
+  static const bool is_supported = [] {
+    if (!supports(IORING_OP_PROVIDE_BUFFERS) || !supports(IORING_OP_REMOVE_BUFFERS) || !supports(IORING_OP_WRITE_FIXED) ||
+        !supports(IORING_OP_TIMEOUT)) {
+      return false;
+    }
+    int sv[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) < 0) return false;
+    io_uring_sqe op;
+    memset(&op, 0, sizeof(op));
+    op.opcode    = IORING_OP_RECV;
+    op.fd        = sv[0];
+    op.flags     = IOSQE_BUFFER_SELECT;
+    op.ioprio    = IORING_RECV_MULTISHOT;
+    bool ok      = test_op(op, true) != -EINVAL;
+    memset(&op, 0, sizeof(op));
+    op.opcode       = IORING_OP_ASYNC_CANCEL;
+    op.fd           = -1;
+    op.cancel_flags = IORING_ASYNC_CANCEL_ALL | IORING_ASYNC_CANCEL_ANY;
+    ok              = ok && test_op(op, false) != -EINVAL;
+    ::close(sv[0]);
+    ::close(sv[1]);
+    if (!ok) log("io_uring multishot receive is not supported, tunnels use system calls");
+    return ok;
+  }();
+  return is_supported;
+}
+
+/**
+  @brief Run an operation on a private ring to find out whether the kernel accepts it
+
+  @param[in]  op      Operation to run, its user_data is overwritten
+  @param[in]  cancel  Cancel the operation right after submitting it, for operations that would otherwise wait
+
+  @return  Result of the operation, or -EINVAL if it could not be run
+**/
+int IOUring::test_op(const io_uring_sqe &op, bool cancel) {
+  IOUring       ring(4);
+  io_uring_sqe *sqe = ring.get_sqe();
+  if (!sqe) return -EINVAL;
+  *sqe           = op;
+  sqe->user_data = IOURING_TAG_SYNC;
+  if (cancel) {
+    io_uring_sqe *cancel_sqe = ring.get_sqe();
+    cancel_sqe->opcode       = IORING_OP_ASYNC_CANCEL;
+    cancel_sqe->addr         = IOURING_TAG_SYNC;
+    cancel_sqe->user_data    = IOURING_TAG_CANCEL;
+  }
+
+  io_uring_cqe cqe;
+  while (true) {
+    if (!ring.wait_cqe(cqe)) {
+      if (errno == EINTR) continue;
+      return -EINVAL;
+    }
+    if (cqe.user_data == IOURING_TAG_SYNC && !(cqe.flags & IORING_CQE_F_MORE)) return cqe.res;
+  }
+}
+
+/**
+  @brief Get the next free submission queue entry
+
+  @return  Zeroed entry, or nullptr if the submission queue is full
+**/
+io_uring_sqe *IOUring::get_sqe() {
+  if (!ok()) return nullptr;
+  unsigned head = __atomic_load_n(sq_head_, __ATOMIC_ACQUIRE);
+  if (sqe_tail_ - head >= sq_entries_) return nullptr;
+
+  unsigned      idx = sqe_tail_ & *sq_mask_;
+  io_uring_sqe *sqe = &sqes_[idx];
+  memset(sqe, 0, sizeof(*sqe));
+  sq_array_[idx] = idx;
+  sqe_tail_++;
+  return sqe;
+}
+
+/**
+  @brief Make all prepared submission queue entries visible to the kernel
+**/
+void IOUring::flush() {
+  if (sqe_flushed_ == sqe_tail_) return;
+  __atomic_store_n(sq_tail_, sqe_tail_, __ATOMIC_RELEASE);
+}
+
+/**
+  @brief Submit all prepared entries in one system call, optionally waiting for completions
+
+  @param[in]  wait_nr  Minimum number of completions to wait for
+
+  @return  Number of entries submitted, or -1 on error with errno set
+**/
+int IOUring::submit(unsigned wait_nr) {
+  flush();
+  unsigned to_submit = sqe_tail_ - sqe_flushed_;
+  int      ret       = enter(to_submit, wait_nr, wait_nr > 0 ? IORING_ENTER_GETEVENTS : 0);
+  if (ret >= 0) sqe_flushed_ += ret;
+  return ret;
+}
+
+/**
+  @brief Get the next completion if one is available, without blocking
+
+  @param[out]  cqe  Copy of the completion
+
+  @return  True if a completion was available
+**/
+bool IOUring::peek_cqe(io_uring_cqe &cqe) {
+  unsigned head = *cq_head_;
+  if (head == __atomic_load_n(cq_tail_, __ATOMIC_ACQUIRE)) return false;
+  cqe = cqes_[head & *cq_mask_];
+  __atomic_store_n(cq_head_, head + 1, __ATOMIC_RELEASE);
+  return true;
+}
+
+/**
+  @brief Submit pending entries and wait for the next completion
+
+  @param[out]  cqe  Copy of the completion
+
+  @return  True if a completion was received, false on error (e.g. EINTR) with errno set
+**/
+bool IOUring::wait_cqe(io_uring_cqe &cqe) {
+  while (!peek_cqe(cqe)) {
+    if (submit(1) < 0) return false;
+  }
+  return true;
+}
+
+/**
+  @brief Add a file descriptor to the ring's fixed file table
+
+  @param[in]  fd  File descriptor to register
+
+  @return  Fixed file slot, or -1 if the table is full or fixed files are unavailable
+**/
+int IOUring::register_file(int fd) {
+  if (!files_registered_ || free_files_.empty()) return -1;
+  int slot = free_files_.back();
+
+  io_uring_files_update update;
+  memset(&update, 0, sizeof(update));
+  update.offset = slot;
+  update.fds    = reinterpret_cast<std::uint64_t>(&fd);
+  if (syscall(__NR_io_uring_register, ring_fd_, IORING_REGISTER_FILES_UPDATE, &update, 1) != 1) return -1;
+  free_files_.pop_back();
+  files_[slot] = fd;
+  return slot;
+}
+
+/**
+  @brief Remove a file descriptor from the ring's fixed file table
+
+  @param[in]  slot  Slot returned by `register_file()`
+**/
+void IOUring::unregister_file(int slot) {
+  if (slot < 0 || slot >= static_cast<int>(files_.size()) || files_[slot] == -1) return;
+
+  int                   fd = -1;
+  io_uring_files_update update;
+  memset(&update, 0, sizeof(update));
+  update.offset = slot;
+  update.fds    = reinterpret_cast<std::uint64_t>(&fd);
+  syscall(__NR_io_uring_register, ring_fd_, IORING_REGISTER_FILES_UPDATE, &update, 1);
+  files_[slot] = -1;
+  free_files_.push_back(slot);
+}
+
+/**
+  @brief Register buffers for use with IORING_OP_READ_FIXED/WRITE_FIXED
+
+  @param[in]  iovecs  Buffers to register
+  @param[in]  n       Number of buffers
+
+  @return  0 on success, -1 on error with errno set
+**/
+int IOUring::register_buffers(const struct iovec *iovecs, unsigned n) {
+  return syscall(__NR_io_uring_register, ring_fd_, IORING_REGISTER_BUFFERS, iovecs, n);
+}
+
+int IOUring::unregister_buffers() { return syscall(__NR_io_uring_register, ring_fd_, IORING_UNREGISTER_BUFFERS, nullptr, 0); }
+
+/**
+  @brief Receive from a socket through the ring
+
+  @param[in]   fd     File descriptor, or fixed file slot if `fixed` is true
+  @param[in]   fixed  True if `fd` is a fixed file slot
+  @param[out]  buf    Buffer to receive into
+  @param[in]   n      Maximum number of bytes to receive
+  @param[in]   flags  recv(2) flags
+
+  @return  Number of bytes received, or -1 on error with errno set
+**/
+int IOUring::recv(int fd, bool fixed, char *buf, size_t n, int flags) {
+  io_uring_sqe *sqe = get_sqe();
+  if (!sqe) {
+    errno = EBUSY;
+    return -1;
+  }
+  sqe->opcode    = IORING_OP_RECV;
+  sqe->fd        = fd;
+  sqe->flags     = fixed ? IOSQE_FIXED_FILE : 0;
+  sqe->addr      = reinterpret_cast<std::uint64_t>(buf);
+  sqe->len       = n;
+  sqe->msg_flags = flags;
+  sqe->user_data = next_sync_++;
+  return wait_for(sqe->user_data, sqe_tail_ - 1);
+}
+
+/**
+  @brief Send to a socket through the ring
+
+  @param[in]  fd     File descriptor, or fixed file slot if `fixed` is true
+  @param[in]  fixed  True if `fd` is a fixed file slot
+  @param[in]  buf    Data to send
+  @param[in]  n      Number of bytes to send
+  @param[in]  flags  send(2) flags
+
+  @return  Number of bytes sent, or -1 on error with errno set
+**/
+int IOUring::send(int fd, bool fixed, const char *buf, size_t n, int flags) {
+  io_uring_sqe *sqe = get_sqe();
+  if (!sqe) {
+    errno = EBUSY;
+    return -1;
+  }
+  sqe->opcode    = IORING_OP_SEND;
+  sqe->fd        = fd;
+  sqe->flags     = fixed ? IOSQE_FIXED_FILE : 0;
+  sqe->addr      = reinterpret_cast<std::uint64_t>(buf);
+  sqe->len       = n;
+  sqe->msg_flags = flags | MSG_NOSIGNAL;
+  sqe->user_data = next_sync_++;
+  return wait_for(sqe->user_data, sqe_tail_ - 1);
+}
+
+/**
+  @brief Send a message gathered from several buffers to a socket through the ring
+
+  @param[in]  fd     File descriptor, or fixed file slot if `fixed` is true
+  @param[in]  fixed  True if `fd` is a fixed file slot
+  @param[in]  msg    Message to send, its iovecs point to the data
+  @param[in]  flags  sendmsg(2) flags
+
+  @return  Number of bytes sent, or -1 on error with errno set
+**/
+int IOUring::sendmsg(int fd, bool fixed, const struct msghdr *msg, int flags) {
+  io_uring_sqe *sqe = get_sqe();
+  if (!sqe) {
+    errno = EBUSY;
+    return -1;
+  }
+  sqe->opcode    = IORING_OP_SENDMSG;
+  sqe->fd        = fd;
+  sqe->flags     = fixed ? IOSQE_FIXED_FILE : 0;
+  sqe->addr      = reinterpret_cast<std::uint64_t>(msg);
+  sqe->len       = 1;
+  sqe->msg_flags = flags | MSG_NOSIGNAL;
+  sqe->user_data = next_sync_++;
+  return wait_for(sqe->user_data, sqe_tail_ - 1);
+}
+
+/**
+  @brief Accept a connection using a multishot accept, which is armed once and produces a completion per connection.
+  On kernels without multishot accepts, a single accept is armed for each connection instead.
+
+  @param[in]  listenfd  Listening socket
+
+  @return  Accepted socket, or -1 on error with errno set
+**/
+int IOUring::accept(int listenfd) {
+  if (!accept_armed_) {
+    io_uring_sqe *sqe = get_sqe();
+    if (!sqe) {
+      errno = EBUSY;
+      return -1;
+    }
+    sqe->opcode    = IORING_OP_ACCEPT;
+    sqe->fd        = listenfd;
+    sqe->ioprio    = supports_multishot_accept() ? IORING_ACCEPT_MULTISHOT : 0;
+    sqe->user_data = IOURING_TAG_ACCEPT;
+    accept_armed_  = true;
+  }
+
+  io_uring_cqe cqe;
+  while (true) {
+    if (!wait_cqe(cqe)) return -1;
+    if (cqe.user_data == IOURING_TAG_ACCEPT) break;
+  }
+  // The kernel stops a multishot accept on errors, re-arm it on the next call. A single accept always ends here.
+  if (!(cqe.flags & IORING_CQE_F_MORE)) accept_armed_ = false;
+  if (cqe.res < 0) {
+    errno = -cqe.res;
+    return -1;
+  }
+  return cqe.res;
+}
+
+/**
+  @brief Cancel the multishot accept, e.g. when the server starts draining
+
+  The kernel may have accepted more connections before the cancellation takes effect. They are returned so that the
+  caller can still serve them.
+
+  @param[out]  accepted  Connections accepted before the cancellation
+**/
+void IOUring::cancel_accept(std::vector<int> &accepted) {
+  if (!accept_armed_) return;
+  io_uring_sqe *sqe = get_sqe();
+  if (!sqe) return;
+  sqe->opcode    = IORING_OP_ASYNC_CANCEL;
+  sqe->addr      = IOURING_TAG_ACCEPT;
+  sqe->user_data = IOURING_TAG_CANCEL;
+
+  io_uring_cqe cqe;
+  while (accept_armed_) {
+    if (!wait_cqe(cqe)) {
+      if (errno == EINTR) continue;
+      break;
+    }
+    if (cqe.user_data != IOURING_TAG_ACCEPT) continue;
+    if (cqe.res >= 0) accepted.push_back(cqe.res);
+    if (!(cqe.flags & IORING_CQE_F_MORE)) accept_armed_ = false;
+  }
+}
+
+int IOUring::enter(unsigned to_submit, unsigned min_complete, unsigned flags) {
+  return syscall(__NR_io_uring_enter, ring_fd_, to_submit, min_complete, flags, nullptr, 0);
+}
+
+/**
+  @brief Submit pending entries and wait for the completion with the given user_data
+
+  If io_uring_enter fails, for example because the wait is interrupted by a signal, before the kernel has taken the
+  operation, the operation is turned into a no-op and the error returned. Once the kernel has taken it, it may use the
+  operation's buffer until it completes: the operation is cancelled and its completion is still waited for, whatever
+  the error.
+
+  @param[in]  user_data  Tag of the operation to wait for
+  @param[in]  position   Position of the operation's entry in the submission queue
+
+  @return  Result of the operation, or -1 on error with errno set
+**/
+int IOUring::wait_for(std::uint64_t user_data, unsigned position) {
+  io_uring_cqe cqe;
+  bool         cancelled = false;
+
+  while (true) {
+    if (wait_cqe(cqe)) {
+      if (cqe.user_data == user_data) break;
+      continue;
+    }
+
+    int error = errno;
+    if (static_cast<int>(__atomic_load_n(sq_head_, __ATOMIC_ACQUIRE) - position) <= 0) {
+      io_uring_sqe &sqe = sqes_[position & *sq_mask_];
+      memset(&sqe, 0, sizeof(sqe));
+      sqe.opcode    = IORING_OP_NOP;
+      sqe.user_data = IOURING_TAG_CANCEL;
+      errno         = error;
+      return -1;
+    }
+    if (!cancelled) {
+      io_uring_sqe *sqe = get_sqe();
+      if (sqe) {
+        sqe->opcode    = IORING_OP_ASYNC_CANCEL;
+        sqe->addr      = user_data;
+        sqe->user_data = IOURING_TAG_CANCEL;
+        cancelled      = true;
+      }
+    }
+    // Back off on errors other than signals, which may fail every call until the kernel catches up
+    if (error != EINTR) usleep(1000);
+  }
+
+  if (cqe.res < 0) {
+    errno = -cqe.res == ECANCELED ? EINTR : -cqe.res;
+    return -1;
+  }
+  return cqe.res;
+}
+
+/**
+  @brief Get a submission queue entry for an asynchronous operation, submitting the prepared entries early if the
+  queue is full
+
+  @return  Zeroed entry, or nullptr if the queue is still full
+**/
+io_uring_sqe *IOUring::async_sqe() {
+  io_uring_sqe *sqe = get_sqe();
+  if (sqe || submit(0) < 0) return sqe;
+  return get_sqe();
+}
+
+/**
+  @brief Prepare an asynchronous receive, awaiting it suspends the coroutine until the receive completes
+
+  @param[in]   fd     File descriptor, or fixed file slot if `fixed` is true
+  @param[in]   fixed  True if `fd` is a fixed file slot
+  @param[out]  buf    Buffer to receive into, must stay valid until the operation completes
+  @param[in]   n      Maximum number of bytes to receive
+  @param[in]   flags  recv(2) flags
+
+  @return  Op  Operation to await, resumes with the number of bytes received or -errno
+**/
+IOUring::Op IOUring::async_recv(int fd, bool fixed, char *buf, size_t n, int flags) {
+  io_uring_sqe *sqe = async_sqe();
+  if (sqe) {
+    sqe->opcode    = IORING_OP_RECV;
+    sqe->fd        = fd;
+    sqe->flags     = fixed ? IOSQE_FIXED_FILE : 0;
+    sqe->addr      = reinterpret_cast<std::uint64_t>(buf);
+    sqe->len       = n;
+    sqe->msg_flags = flags;
+  }
+  return Op(sqe);
+}
+
+/**
+  @brief Prepare an asynchronous send, awaiting it suspends the coroutine until the send completes
+
+  @param[in]  fd     File descriptor, or fixed file slot if `fixed` is true
+  @param[in]  fixed  True if `fd` is a fixed file slot
+  @param[in]  buf    Data to send, must stay valid until the operation completes
+  @param[in]  n      Number of bytes to send
+  @param[in]  flags  send(2) flags
+
+  @return  Op  Operation to await, resumes with the number of bytes sent or -errno
+**/
+IOUring::Op IOUring::async_send(int fd, bool fixed, const char *buf, size_t n, int flags) {
+  io_uring_sqe *sqe = async_sqe();
+  if (sqe) {
+    sqe->opcode    = IORING_OP_SEND;
+    sqe->fd        = fd;
+    sqe->flags     = fixed ? IOSQE_FIXED_FILE : 0;
+    sqe->addr      = reinterpret_cast<std::uint64_t>(buf);
+    sqe->len       = n;
+    sqe->msg_flags = flags | MSG_NOSIGNAL;
+  }
+  return Op(sqe);
+}
+
+/**
+  @brief Prepare an asynchronous send of gathered buffers, awaiting it suspends the coroutine until the send completes
+
+  @param[in]  fd     File descriptor, or fixed file slot if `fixed` is true
+  @param[in]  fixed  True if `fd` is a fixed file slot
+  @param[in]  msg    Message to send, it and its iovecs must stay valid until the operation completes
+  @param[in]  flags  sendmsg(2) flags
+
+  @return  Op  Operation to await, resumes with the number of bytes sent or -errno
+**/
+IOUring::Op IOUring::async_sendmsg(int fd, bool fixed, const struct msghdr *msg, int flags) {
+  io_uring_sqe *sqe = async_sqe();
+  if (sqe) {
+    sqe->opcode    = IORING_OP_SENDMSG;
+    sqe->fd        = fd;
+    sqe->flags     = fixed ? IOSQE_FIXED_FILE : 0;
+    sqe->addr      = reinterpret_cast<std::uint64_t>(msg);
+    sqe->len       = 1;
+    sqe->msg_flags = flags | MSG_NOSIGNAL;
+  }
+  return Op(sqe);
+}
+
+/**
+  @brief Resume the coroutines of all completed asynchronous operations, without blocking
+
+  @return  Number of operations completed
+**/
+size_t IOUring::complete() {
+  io_uring_cqe cqe;
+  size_t       n = 0;
+
+  bool         flushed = false;
+
+  while (true) {
+    size_t reaped = 0;
+    for (; peek_cqe(cqe); reaped++) {
+      if (!(cqe.user_data & IOURING_TAG_OP)) continue;
+      Op *op   = reinterpret_cast<Op *>(cqe.user_data & ~IOURING_TAG_OP);
+      op->res_ = cqe.res;
+      op->handle_.resume();
+      n++;
+    }
+    // Completions that did not fit in the queue are held by the kernel until an io_uring_enter call asks for them
+    if (flushed && reaped == 0) return n;
+    if (!(__atomic_load_n(sq_flags_, __ATOMIC_ACQUIRE) & IORING_SQ_CQ_OVERFLOW)) return n;
+    if (enter(0, 0, IORING_ENTER_GETEVENTS) < 0) return n;
+    flushed = true;
+  }
+}
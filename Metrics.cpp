@@ -0,0 +1,349 @@
+#include "Metrics.h"
+#include "Admission.h"
+#include "BodyStore.h"
+#include "BufferPool.h"
+#include "CannedResponse.h"
+#include "SharedPageCache.h"
+#include "Task.h"
+#include "Trace.h"
+#include "Variants.h"
+
+Counter Metrics::connections;
+Counter Metrics::requests;
+Counter Metrics::cache_hits;
+Counter Metrics::cache_misses;
+Counter Metrics::error_responses;
+Counter Metrics::dns_cache_hits;
+Counter Metrics::tunnel_bytes_upstream;
+Counter Metrics::tunnel_bytes_downstream;
+Counter Metrics::tunnel_stalls_upstream;
+Counter Metrics::tunnel_stalls_downstream;
+Counter Metrics::rejected_overloaded;
+Counter Metrics::rejected_client_limit;
+Counter Metrics::rate_limited_requests;
+Counter Metrics::peer_requests;
+Counter Metrics::peer_failures;
+Counter Metrics::peer_requests_received;
+Counter Metrics::vary_uncacheable;
+Counter Metrics::body_dedup_hits;
+Counter Metrics::frame_bytes_allocated;
+Counter Metrics::frame_bytes_freed;
+
+Histogram Metrics::accept;
+Histogram Metrics::parse;
+Histogram Metrics::cache_lookup;
+Histogram Metrics::dns;
+Histogram Metrics::connect;
+Histogram Metrics::upstream_ttfb;
+Histogram Metrics::client_write;
+
+// Upper bounds of the exported Prometheus buckets, in seconds
+static const double PROMETHEUS_BUCKETS[] = {0.00001, 0.00005, 0.0001, 0.0005, 0.001, 0.005, 0.01, 0.05, 0.1, 0.5, 1, 5, 10};
+
+void *task_detail::allocate_frame(std::size_t size) {
+  Metrics::frame_bytes_allocated.add(size);
+  return ::operator new(size);
+}
+
+void task_detail::free_frame(void *frame, std::size_t size) {
+  Metrics::frame_bytes_freed.add(size);
+  ::operator delete(frame, size);
+}
+
+Counter::Counter() {
+  for (auto &shard : shards_) shard.value.store(0, std::memory_order_relaxed);
+}
+
+std::uint64_t Counter::value() const {
+  std::uint64_t total = 0;
+  for (const auto &shard : shards_) total += shard.value.load(std::memory_order_relaxed);
+  return total;
+}
+
+Histogram::Histogram() {
+  for (auto &shard : shards_) {
+    for (auto &count : shard.counts) count.store(0, std::memory_order_relaxed);
+    shard.sum.store(0, std::memory_order_relaxed);
+  }
+}
+
+/**
+  @brief Get the bucket a value is counted in
+
+  Values below HISTOGRAM_SUB_COUNT have a bucket each. Above that, every power of two is split into
+  HISTOGRAM_SUB_COUNT equal buckets.
+
+  @param[in]  value  Recorded value
+
+  @return  Bucket index
+**/
+size_t Histogram::bucket(std::uint64_t value) {
+  if (value < HISTOGRAM_SUB_COUNT) return value;
+  int exp = 63 - __builtin_clzll(value);
+  if (exp > HISTOGRAM_MAX_EXP) return HISTOGRAM_BUCKETS - 1;
+  return HISTOGRAM_SUB_COUNT + (exp - HISTOGRAM_SUB_BITS) * HISTOGRAM_SUB_COUNT + ((value >> (exp - HISTOGRAM_SUB_BITS)) - HISTOGRAM_SUB_COUNT);
+}
+
+/**
+  @brief Get the largest value counted in a bucket
+
+  @param[in]  bucket  Bucket index
+
+  @return  Inclusive upper bound of the bucket
+**/
+std::uint64_t Histogram::bucket_upper(size_t bucket) {
+  if (bucket < HISTOGRAM_SUB_COUNT) return bucket;
+  size_t        exp   = (bucket - HISTOGRAM_SUB_COUNT) / HISTOGRAM_SUB_COUNT + HISTOGRAM_SUB_BITS;
+  std::uint64_t sub   = (bucket - HISTOGRAM_SUB_COUNT) % HISTOGRAM_SUB_COUNT + HISTOGRAM_SUB_COUNT;
+  std::uint64_t width = std::uint64_t{1} << (exp - HISTOGRAM_SUB_BITS);
+  return sub * width + width - 1;
+}
+
+/**
+  @brief Merge the shards of the histogram
+
+  @param[out]  counts  Number of values per bucket
+  @param[out]  sum     Sum of all recorded values
+**/
+void Histogram::snapshot(std::vector<std::uint64_t> &counts, std::uint64_t &sum) const {
+  counts.assign(HISTOGRAM_BUCKETS, 0);
+  sum = 0;
+  for (const auto &shard : shards_) {
+    for (size_t i = 0; i < HISTOGRAM_BUCKETS; i++) counts[i] += shard.counts[i].load(std::memory_order_relaxed);
+    sum += shard.sum.load(std::memory_order_relaxed);
+  }
+}
+
+std::uint64_t Histogram::count() const {
+  std::vector<std::uint64_t> counts;
+  std::uint64_t              sum, total = 0;
+  snapshot(counts, sum);
+  for (auto count : counts) total += count;
+  return total;
+}
+
+/**
+  @brief Estimate a quantile of the recorded values
+
+  @param[in]  q  Quantile, between 0 and 1
+
+  @return  Upper bound of the bucket containing the quantile, or 0 if nothing was recorded
+**/
+std::uint64_t Histogram::quantile(double q) const {
+  std::vector<std::uint64_t> counts;
+  std::uint64_t              sum, total = 0, seen = 0;
+  snapshot(counts, sum);
+  for (auto count : counts) total += count;
+  if (total == 0) return 0;
+
+  std::uint64_t rank = std::max<std::uint64_t>(1, static_cast<std::uint64_t>(q * total + 0.5));
+  for (size_t i = 0; i < HISTOGRAM_BUCKETS; i++) {
+    seen += counts[i];
+    if (seen >= rank) return bucket_upper(i);
+  }
+  return bucket_upper(HISTOGRAM_BUCKETS - 1);
+}
+
+static void append_counter(std::string &out, const char *name, const char *help, const Counter &counter) {
+  out.append("# HELP ").append(name).append(" ").append(help).append("\n");
+  out.append("# TYPE ").append(name).append(" counter\n");
+  out.append(name).append(" ").append(std::to_string(counter.value())).append("\n");
+}
+
+static void append_histogram(std::string &out, const char *name, const char *help, const Histogram &histogram) {
+  std::vector<std::uint64_t> counts;
+  std::uint64_t              sum, cumulative = 0;
+  size_t                     bucket = 0;
+  char                       le[32];
+  histogram.snapshot(counts, sum);
+
+  out.append("# HELP ").append(name).append(" ").append(help).append("\n");
+  out.append("# TYPE ").append(name).append(" histogram\n");
+  for (double bound : PROMETHEUS_BUCKETS) {
+    std::uint64_t bound_ns = static_cast<std::uint64_t>(bound * 1e9);
+    for (; bucket < HISTOGRAM_BUCKETS && Histogram::bucket_upper(bucket) <= bound_ns; bucket++) cumulative += counts[bucket];
+    snprintf(le, sizeof(le), "%g", bound);
+    out.append(name).append("_bucket{le=\"").append(le).append("\"} ").append(std::to_string(cumulative)).append("\n");
+  }
+  for (; bucket < HISTOGRAM_BUCKETS; bucket++) cumulative += counts[bucket];
+  snprintf(le, sizeof(le), "%.9f", sum / 1e9);
+  out.append(name).append("_bucket{le=\"+Inf\"} ").append(std::to_string(cumulative)).append("\n");
+  out.append(name).append("_sum ").append(le).append("\n");
+  out.append(name).append("_count ").append(std::to_string(cumulative)).append("\n");
+}
+
+/**
+  @brief Write all metrics in the Prometheus text exposition format
+
+  @return  std::string  Metrics
+**/
+std::string Metrics::prometheus() {
+  std::string out;
+  out.reserve(MAXBUF);
+
+  append_counter(out, "webproxy_connections_accepted_total", "Client connections accepted", connections);
+  append_counter(out, "webproxy_requests_total", "Requests received from clients", requests);
+  append_counter(out, "webproxy_cache_hits_total", "Requests served from the page cache", cache_hits);
+  append_counter(out, "webproxy_cache_misses_total", "Requests not found in the page cache", cache_misses);
+  append_counter(out, "webproxy_error_responses_total", "Error responses sent to clients", error_responses);
+  append_counter(out, "webproxy_dns_cache_hits_total", "Upstream connections that used a cached address", dns_cache_hits);
+
+  out.append("# HELP webproxy_tunnel_bytes_total Bytes forwarded through CONNECT tunnels\n");
+  out.append("# TYPE webproxy_tunnel_bytes_total counter\n");
+  out.append("webproxy_tunnel_bytes_total{direction=\"upstream\"} ").append(std::to_string(tunnel_bytes_upstream.value())).append("\n");
+  out.append("webproxy_tunnel_bytes_total{direction=\"downstream\"} ").append(std::to_string(tunnel_bytes_downstream.value())).append("\n");
+  out.append("# HELP webproxy_tunnel_stalls_total Times a tunnel stopped reading because the receiving side had not taken its data\n");
+  out.append("# TYPE webproxy_tunnel_stalls_total counter\n");
+  out.append("webproxy_tunnel_stalls_total{direction=\"upstream\"} ").append(std::to_string(tunnel_stalls_upstream.value())).append("\n");
+  out.append("webproxy_tunnel_stalls_total{direction=\"downstream\"} ").append(std::to_string(tunnel_stalls_downstream.value())).append("\n");
+
+  out.append("# HELP webproxy_rejected_connections_total Connections rejected by admission control\n");
+  out.append("# TYPE webproxy_rejected_connections_total counter\n");
+  out.append("webproxy_rejected_connections_total{reason=\"overloaded\"} ").append(std::to_string(rejected_overloaded.value())).append("\n");
+  out.append("webproxy_rejected_connections_total{reason=\"client_limit\"} ").append(std::to_string(rejected_client_limit.value())).append("\n");
+  append_counter(out, "webproxy_rate_limited_requests_total", "Requests answered with 429 because the client exceeded its rate", rate_limited_requests);
+
+  append_counter(out, "webproxy_peer_requests_total", "Cache misses answered by the peer that owns the URL", peer_requests);
+  append_counter(out, "webproxy_peer_failures_total", "Cache misses fetched from the server because the owning peer failed", peer_failures);
+  append_counter(out, "webproxy_peer_requests_received_total", "Requests forwarded by peers to this proxy", peer_requests_received);
+
+  append_counter(out, "webproxy_vary_uncacheable_total", "Responses not cached because they have a Vary: * header", vary_uncacheable);
+  append_counter(out, "webproxy_body_dedup_hits_total", "Responses cached with a body that was already stored", body_dedup_hits);
+  out.append("# HELP webproxy_cache_varied_uris URIs whose cached responses vary on request headers\n");
+  out.append("# TYPE webproxy_cache_varied_uris gauge\n");
+  out.append("webproxy_cache_varied_uris ").append(std::to_string(Variants::global().size())).append("\n");
+
+  BodyStore &bodies = BodyStore::global();
+  char       ratio[32];
+  snprintf(ratio, sizeof(ratio), "%.3f", bodies.dedup_ratio());
+  out.append("# HELP webproxy_body_store_bodies Distinct bodies stored for the page cache\n");
+  out.append("# TYPE webproxy_body_store_bodies gauge\n");
+  out.append("webproxy_body_store_bodies ").append(std::to_string(bodies.bodies())).append("\n");
+  out.append("# HELP webproxy_body_store_bytes Bytes of the distinct bodies stored for the page cache\n");
+  out.append("# TYPE webproxy_body_store_bytes gauge\n");
+  out.append("webproxy_body_store_bytes ").append(std::to_string(bodies.stored_bytes())).append("\n");
+  out.append("# HELP webproxy_body_store_referenced_bytes Bytes the stored bodies would take if every response held its own copy\n");
+  out.append("# TYPE webproxy_body_store_referenced_bytes gauge\n");
+  out.append("webproxy_body_store_referenced_bytes ").append(std::to_string(bodies.referenced_bytes())).append("\n");
+  out.append("# HELP webproxy_body_store_dedup_ratio Referenced bytes per stored byte of the body store\n");
+  out.append("# TYPE webproxy_body_store_dedup_ratio gauge\n");
+  out.append("webproxy_body_store_dedup_ratio ").append(ratio).append("\n");
+
+  out.append("# HELP webproxy_active_connections Admitted client connections currently open\n");
+  out.append("# TYPE webproxy_active_connections gauge\n");
+  out.append("webproxy_active_connections ").append(std::to_string(Admission::global().active())).append("\n");
+
+  // Memory held by connections: the pooled buffers of the requests in progress and the frames of their coroutines.
+  // Idle keep-alive connections hold no buffers, so the average falls towards the size of a suspended frame.
+  std::uint64_t frame_bytes      = frame_bytes_allocated.value() - frame_bytes_freed.value();
+  std::uint64_t connection_bytes = (BufferPool::borrowed_bytes() + frame_bytes) / std::max<std::uint64_t>(Admission::global().active(), 1);
+  out.append("# HELP webproxy_buffer_pool_borrowed_bytes Bytes of pooled I/O buffers held by requests in progress\n");
+  out.append("# TYPE webproxy_buffer_pool_borrowed_bytes gauge\n");
+  out.append("webproxy_buffer_pool_borrowed_bytes ").append(std::to_string(BufferPool::borrowed_bytes())).append("\n");
+  out.append("# HELP webproxy_buffer_pool_idle_bytes Bytes of idle I/O buffers kept by the pool\n");
+  out.append("# TYPE webproxy_buffer_pool_idle_bytes gauge\n");
+  out.append("webproxy_buffer_pool_idle_bytes ").append(std::to_string(BufferPool::idle_bytes())).append("\n");
+  out.append("# HELP webproxy_iobuf_block_bytes Bytes of IOBuf blocks holding bodies, in flight or cached\n");
+  out.append("# TYPE webproxy_iobuf_block_bytes gauge\n");
+  out.append("webproxy_iobuf_block_bytes ").append(std::to_string(IOBlockPool::allocated_bytes())).append("\n");
+  out.append("# HELP webproxy_coroutine_frame_bytes Bytes of the frames of running and suspended coroutines\n");
+  out.append("# TYPE webproxy_coroutine_frame_bytes gauge\n");
+  out.append("webproxy_coroutine_frame_bytes ").append(std::to_string(frame_bytes)).append("\n");
+  out.append("# HELP webproxy_connection_memory_bytes Buffer and coroutine frame bytes per active connection\n");
+  out.append("# TYPE webproxy_connection_memory_bytes gauge\n");
+  out.append("webproxy_connection_memory_bytes ").append(std::to_string(connection_bytes)).append("\n");
+
+  // The shared page cache is counted once for all workers, every worker reports the same values
+  if (SharedPageCache::global().enabled()) {
+    SharedPageCache &shared = SharedPageCache::global();
+    out.append("# HELP webproxy_shared_cache_entries Responses in the page cache shared by all workers\n");
+    out.append("# TYPE webproxy_shared_cache_entries gauge\n");
+    out.append("webproxy_shared_cache_entries ").append(std::to_string(shared.entries())).append("\n");
+    out.append("# HELP webproxy_shared_cache_bytes Bytes of responses in the page cache shared by all workers\n");
+    out.append("# TYPE webproxy_shared_cache_bytes gauge\n");
+    out.append("webproxy_shared_cache_bytes ").append(std::to_string(shared.bytes())).append("\n");
+    out.append("# HELP webproxy_shared_cache_evictions_total Responses evicted from the shared page cache to make room\n");
+    out.append("# TYPE webproxy_shared_cache_evictions_total counter\n");
+    out.append("webproxy_shared_cache_evictions_total ").append(std::to_string(shared.evictions())).append("\n");
+    out.append("# HELP webproxy_shared_cache_slab_reassignments_total Slabs of the shared page cache moved to another size class\n");
+    out.append("# TYPE webproxy_shared_cache_slab_reassignments_total counter\n");
+    out.append("webproxy_shared_cache_slab_reassignments_total ").append(std::to_string(shared.reassignments())).append("\n");
+  }
+
+  out.append("# HELP webproxy_active_threads Connection and prefetcher threads currently running\n");
+  out.append("# TYPE webproxy_active_threads gauge\n");
+  out.append("webproxy_active_threads ").append(std::to_string(Signaler::num_threads.load())).append("\n");
+
+  append_histogram(out, "webproxy_accept_seconds", "Time from accepting a connection until its thread starts", accept);
+  append_histogram(out, "webproxy_parse_seconds", "Time to parse a request header", parse);
+  append_histogram(out, "webproxy_cache_lookup_seconds", "Time to look up a request in the page cache", cache_lookup);
+  append_histogram(out, "webproxy_dns_seconds", "Time to resolve an upstream host", dns);
+  append_histogram(out, "webproxy_connect_seconds", "Time to connect to an upstream server", connect);
+  append_histogram(out, "webproxy_upstream_ttfb_seconds", "Time until the response header is received from upstream", upstream_ttfb);
+  append_histogram(out, "webproxy_client_write_seconds", "Time to write a response to the client", client_write);
+  return out;
+}
+
+/**
+  @brief Serve the metrics on a local admin port, from a background thread that exits when the server shuts down
+
+  `GET /metrics` returns the metrics and `GET /trace` the spans of recent requests as Chrome trace-event JSON, every
+  connection is closed after one response.
+
+  @param[in]  port  Port to listen on, bound to the loopback interface
+
+  @return  True if the admin socket was opened
+**/
+bool Metrics::serve(int port) {
+  int                listenfd, optval = 1;
+  struct sockaddr_in addr;
+
+  if ((listenfd = socket(AF_INET, SOCK_STREAM, 0)) < 0) return false;
+  setsockopt(listenfd, SOL_SOCKET, SO_REUSEADDR, &optval, sizeof(optval));
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family      = AF_INET;
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  addr.sin_port        = htons((unsigned short)port);
+  if (bind(listenfd, (struct sockaddr *)&addr, sizeof(addr)) < 0 || listen(listenfd, LISTENQ) < 0) {
+    log("Error opening metrics port %d: %s", port, strerror(errno));
+    ::close(listenfd);
+    return false;
+  }
+  log("Serving metrics on 127.0.0.1:%d/metrics", port);
+
+  // A draining server closes the admin port, so that the process taking over can open it
+  std::thread([listenfd] {
+    struct pollfd pfd = {listenfd, POLLIN, 0};
+    char          buf[MAXLINE];
+    while (!Signaler::done && !Signaler::draining) {
+      if (poll(&pfd, 1, 200) <= 0) continue;
+      int connfd = ::accept(listenfd, nullptr, nullptr);
+      if (connfd < 0) continue;
+      struct timeval timeout = {1, 0};
+      setsockopt(connfd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+
+      // The request line is all that matters, it always fits in the first read
+      int         n = ::recv(connfd, buf, sizeof(buf) - 1, 0);
+      std::string response;
+      if (n > 0 && std::string(buf, n).compare(0, 13, "GET /metrics ") == 0) {
+        std::string body = prometheus();
+        response         = "HTTP/1.1 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\nConnection: close\r\nContent-Length: " +
+                   std::to_string(body.size()) + "\r\n\r\n" + body;
+      } else if (n > 0 && std::string(buf, n).compare(0, 11, "GET /trace ") == 0) {
+        std::string body = Trace::chrome_json();
+        response         = "HTTP/1.1 200 OK\r\nContent-Type: application/json\r\nConnection: close\r\nContent-Length: " +
+                   std::to_string(body.size()) + "\r\n\r\n" + body;
+      } else {
+        response = canned_response(ResponseCode::NotFound, "HTTP/1.0");
+      }
+      for (size_t sent = 0; sent < response.size();) {
+        ssize_t m = ::send(connfd, response.data() + sent, response.size() - sent, MSG_NOSIGNAL);
+        if (m <= 0) break;
+        sent += m;
+      }
+      ::close(connfd);
+    }
+    ::close(listenfd);
+  }).detach();
+  return true;
+}
@@ -0,0 +1,166 @@
+#include "PeerCache.h"
+#include "Metrics.h"
+
+#include <unistd.h>
+
+#include <algorithm>
+
+/**
+  @brief Add a member of the cluster, the list should be the same on every member
+
+  @param[in]  peer  Member of the form `<host>:<port>`, may be this proxy itself
+
+  @return  True if the member was valid
+**/
+bool PeerCache::add(const std::string &peer) {
+  size_t colon = peer.rfind(':');
+  if (colon == std::string::npos || colon == 0 || colon + 1 == peer.size()) return false;
+  if (peer.find_first_not_of("0123456789", colon + 1) != std::string::npos) return false;
+
+  auto member          = std::unique_ptr<Peer>(new Peer);
+  member->name         = peer;
+  member->address.host = peer.substr(0, colon);
+  member->address.port = peer.substr(colon + 1);
+  member->address.uri  = "/";
+  peers_.push_back(std::move(member));
+  return true;
+}
+
+/**
+  @brief Build the hash ring, should be called once after all members are added and before any request is served
+
+  @param[in]  self      This proxy as it appears in the member list, `<host>:<port>`
+  @param[in]  ip_cache  IP cache used to connect to peers
+**/
+void PeerCache::configure(const std::string &self, std::shared_ptr<Cache<AddrInfo, URIKey>> ip_cache) {
+  self_     = self;
+  ip_cache_ = ip_cache;
+  ring_.clear();
+  if (peers_.empty()) return;
+
+  // This proxy owns its points on the ring even if it is not in the list, the others are only reached over the network
+  peers_.erase(std::remove_if(peers_.begin(), peers_.end(), [&](const std::unique_ptr<Peer> &peer) { return peer->name == self; }),
+               peers_.end());
+  std::vector<std::pair<std::string, Peer *>> members = {{self, nullptr}};
+  for (auto &peer : peers_) members.emplace_back(peer->name, peer.get());
+  for (auto &member : members) {
+    for (int i = 0; i < PEER_CACHE_VNODES; i++) ring_.emplace_back(URIKey::hash(member.first + "#" + std::to_string(i)), member.second);
+  }
+  std::sort(ring_.begin(), ring_.end(), [](const std::pair<std::uint64_t, Peer *> &a, const std::pair<std::uint64_t, Peer *> &b) {
+    return a.first < b.first;
+  });
+  log("Peer cache with %zu members, this proxy is %s", members.size(), self.c_str());
+}
+
+/**
+  @brief Close the idle connections to all peers, should be called once no request is served anymore
+**/
+void PeerCache::close() {
+  for (auto &peer : peers_) {
+    std::lock_guard<std::mutex> lock(peer->mutex);
+    peer->idle.clear();
+  }
+  ip_cache_.reset();
+}
+
+/**
+  @brief Find the member that owns a URL
+
+  @param[in]  key  Key of the URL to look up, whose hash is its point on the ring
+
+  @return  Peer that owns the URL, or nullptr if this proxy owns it, the owner is down or there is no cluster
+**/
+Peer *PeerCache::owner(const URIKey &key) const {
+  if (ring_.empty()) return nullptr;
+  std::uint64_t point = key.hash();
+  auto          it    = std::lower_bound(ring_.begin(), ring_.end(), point,
+                                           [](const std::pair<std::uint64_t, Peer *> &entry, std::uint64_t p) { return entry.first < p; });
+  Peer         *peer  = it == ring_.end() ? ring_.front().second : it->second;
+  if (peer && peer->down_until.load() > myclock::now()) return nullptr;
+  return peer;
+}
+
+/**
+  @brief Fetch a URL from the peer that owns it, over a pooled keep-alive connection. A pooled connection the peer has
+  closed in the meantime is replaced by a new one. A peer that can not be reached is skipped for PEER_CACHE_RETRY_MS.
+
+  @param[in]   peer     Peer that owns the URL
+  @param[in]   request  Request from the client
+  @param[out]  buf      Buffer to temporarily store read data, may be garbage after call
+
+  @return  Complete response from the peer, or nullptr on error
+**/
+Task<std::unique_ptr<HTTPResponse>> PeerCache::fetch(Peer &peer, const HTTPRequest &request, std::string &buf) {
+  // The peer is a proxy, so the request carries the absolute URL. Range requests are served from the full response.
+  std::string out;
+  {
+    HTTPRequest peer_request   = request;
+    peer_request.proxy_uri.uri = request.proxy_uri.absolute();
+    peer_request.headers.erase(Header::Range);
+    peer_request.headers.erase(Header::IfRange);
+    peer_request.headers.set(PEER_CACHE_HEADER, self_);
+    peer_request.dump(out);
+  }
+
+  bool reused = true;
+  while (reused) {
+    Connection connection = acquire(peer, reused);
+    if (!reused) {
+      ProxyURI address = peer.address;
+      co_await connection.async_connect(&address);
+      if (!connection.is_connected()) break;
+    }
+    if (co_await connection.async_send_n(out) <= 0) continue;
+    auto response = co_await connection.async_read_http_response(buf, request.proxy_uri);
+    if (!response) continue;
+
+    if (connection.is_connected()) release(peer, std::move(connection));
+    Metrics::peer_requests.add();
+    co_return response;
+  }
+
+  log("Error fetching %s from peer %s, fetching it from the server", request.proxy_uri.absolute().c_str(), peer.name.c_str());
+  Metrics::peer_failures.add();
+  peer.down_until = myclock::now() + std::chrono::milliseconds{PEER_CACHE_RETRY_MS};
+  co_return nullptr;
+}
+
+/**
+  @brief Take an idle connection to a peer from its pool
+
+  @param[in]   peer    Peer to connect to
+  @param[out]  reused  True if the connection came from the pool, false if it is new and still has to be connected
+
+  @return  Connection to the peer
+**/
+Connection PeerCache::acquire(Peer &peer, bool &reused) {
+  std::lock_guard<std::mutex> lock(peer.mutex);
+  reused = !peer.idle.empty();
+  if (!reused) return Connection(ip_cache_);
+  Connection connection = std::move(peer.idle.back());
+  peer.idle.pop_back();
+  return connection;
+}
+
+/**
+  @brief Return a connection to its peer's pool, or close it if the pool is full. Pooled connections can be taken by
+  any thread, so nothing of this thread may stay attached to them: the pool keeps a duplicate of the socket, and
+  closing the original removes it from this thread's reactor and unregisters its fixed file from this thread's ring.
+**/
+void PeerCache::release(Peer &peer, Connection &&connection) {
+  std::lock_guard<std::mutex> lock(peer.mutex);
+  if (peer.idle.size() >= PEER_CACHE_MAX_IDLE || !connection.is_connected()) return;
+  int fd = dup(connection.fd());
+  connection.close();
+  if (fd >= 0) peer.idle.emplace_back(fd, ip_cache_);
+}
+
+/**
+  @brief Get the process-wide peer cache
+
+  @return  PeerCache&  Process-wide peer cache
+**/
+PeerCache &PeerCache::global() {
+  static PeerCache cache;
+  return cache;
+}
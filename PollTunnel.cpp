@@ -0,0 +1,112 @@
+#include "PollTunnel.h"
+#include "Metrics.h"
+
+#include <cstring>
+#include <optional>
+
+/**
+  @brief Set up a tunnel between two connected sockets. An idle tunnel is shut down by its timer, which wakes up both
+  directions.
+
+  @param[in]  client  Client side of the tunnel
+  @param[in]  server  Server side of the tunnel
+**/
+PollTunnel::PollTunnel(Connection &client, Connection &server)
+    : idle_timer_([client_fd = client.fd(), server_fd = server.fd()] {
+        shutdown(client_fd, SHUT_RDWR);
+        shutdown(server_fd, SHUT_RDWR);
+      }) {
+  conns_[0] = &client;
+  conns_[1] = &server;
+}
+
+/**
+  @brief Forward data in both directions until both are shut down, either side fails, the tunnel is idle or the
+  server shuts down
+
+  @param[in]  idle_timeout  Time without traffic after which the tunnel is closed
+**/
+Task<void> PollTunnel::run(std::chrono::milliseconds idle_timeout) {
+  time_point start = myclock::now();
+
+  TimerWheel::global().arm(idle_timer_, idle_timeout);
+  co_await when_all(pump(0), pump(1));
+  TimerWheel::global().cancel(idle_timer_);
+  if (idle_timer_.expired()) log("Tunnel idle for %lld ms", (long long)idle_timeout.count());
+
+  double seconds = std::chrono::duration<double>(myclock::now() - start).count();
+  Metrics::tunnel_bytes_upstream.add(dirs_[0].bytes);
+  Metrics::tunnel_bytes_downstream.add(dirs_[1].bytes);
+  Metrics::tunnel_stalls_upstream.add(dirs_[0].stalls);
+  Metrics::tunnel_stalls_downstream.add(dirs_[1].stalls);
+  log("Tunnel closed after %.1f s, forwarded %llu bytes to server (%.2f MB/s, %llu stalls) and %llu bytes to client "
+      "(%.2f MB/s, %llu stalls)",
+      seconds, (unsigned long long)dirs_[0].bytes, dirs_[0].bytes / seconds / 1e6, (unsigned long long)dirs_[0].stalls,
+      (unsigned long long)dirs_[1].bytes, dirs_[1].bytes / seconds / 1e6, (unsigned long long)dirs_[1].stalls);
+}
+
+/**
+  @brief Forward data from conns_[i] to conns_[1 - i] until conns_[i] shuts down its output or the tunnel fails. The
+  sockets are used without blocking and the coroutine waits for readiness, even on a private reactor, so that both
+  directions make progress on one thread. The buffer is returned to the pool while waiting for data, so an idle tunnel
+  holds none.
+**/
+Task<void> PollTunnel::pump(int i) {
+  Reactor                    &reactor = Reactor::current();
+  Direction                  &dir     = dirs_[i];
+  std::optional<PooledBuffer> pooled_buf;
+  int                         in = conns_[i]->fd(), out = conns_[1 - i]->fd();
+  bool                        ok = true;
+
+  while (ok && !failed_) {
+    if (!pooled_buf) pooled_buf.emplace(BufferPool::acquire(MAXBUF));
+    std::string &buf = **pooled_buf;
+    ssize_t      n   = ::recv(in, &buf[0], buf.size(), MSG_DONTWAIT);
+    if (n < 0) {
+      if (errno == EWOULDBLOCK || errno == EAGAIN || errno == EINTR) {
+        pooled_buf.reset();
+        ok = co_await reactor.readable(in);
+      } else {
+        log("Error reading from fd %d: %s", in, strerror(errno));
+        ok = false;
+      }
+      continue;
+    } else if (n == 0) {
+      log("Connection closed on fd %d", in);
+      // Pass the end of the stream on, the other direction may still have data to send
+      shutdown(out, SHUT_WR);
+      dir.closed = true;
+      co_return;
+    }
+    idle_timer_.touch();
+
+    // The socket is not read again until the other side has taken all of the data
+    for (ssize_t sent = 0; ok && sent < n;) {
+      ssize_t m = ::send(out, &buf[sent], n - sent, MSG_DONTWAIT | MSG_NOSIGNAL);
+      if (m < 0) {
+        if (errno == EWOULDBLOCK || errno == EAGAIN || errno == EINTR) {
+          dir.stalls++;
+          ok = co_await reactor.writable(out);
+        } else {
+          log("Error writing to fd %d: %s", out, strerror(errno));
+          ok = false;
+        }
+        continue;
+      }
+      sent += m;
+      dir.bytes += m;
+      idle_timer_.touch();
+    }
+  }
+  fail();
+}
+
+/**
+  @brief End the tunnel in both directions, waking up the direction that is still waiting
+**/
+void PollTunnel::fail() {
+  if (failed_) return;
+  failed_ = true;
+  shutdown(conns_[0]->fd(), SHUT_RDWR);
+  shutdown(conns_[1]->fd(), SHUT_RDWR);
+}
@@ -1,14 +1,46 @@
 #include "Prefetcher.h"
+#include "BufferPool.h"
+#include "CachePolicy.h"
+#include "TimerWheel.h"
+#include "TinyLFU.h"
+#include "URIKey.h"
+#include "Variants.h"
+
+#include <condition_variable>
+#include <mutex>
 
 void Prefetcher::operator()(const ProxyURI& proxy_uri, const HTTPResponse& response) {
   sigignore(SIGPIPE);
 
+  // Finished fetches and the deadline timer both wake the thread, which sleeps until all links are fetched or the
+  // deadline expires. The timer wheel fires the deadline early when the proxy stops. The futures are declared last,
+  // so their destructors wait for fetches still running before the state they signal is gone; each fetch has a
+  // deadline of its own that wakes its socket.
   std::vector<ProxyURI>          links = parse_links(response);
+  std::mutex                     mutex;
+  std::condition_variable        wake;
+  size_t                         pending = 0;
+  Timer                          deadline([&] {
+    { std::lock_guard<std::mutex> lock(mutex); }
+    wake.notify_all();
+  });
   std::vector<std::future<bool>> futures;
-  time_point                     start = myclock::now();
+  TimerWheel::global().arm(deadline, Timeouts::global().prefetch);
 
   for (auto& link : links) {
-    futures.push_back(std::async(std::launch::async, &Prefetcher::fetch, this, link));
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      pending++;
+    }
+    futures.push_back(std::async(std::launch::async, [&, link] {
+      bool fetched = fetch(link);
+      {
+        std::lock_guard<std::mutex> lock(mutex);
+        pending--;
+      }
+      wake.notify_all();
+      return fetched;
+    }));
     if (Signaler::done) break;
   }
   if (Signaler::done) {
@@ -16,30 +48,21 @@ void Prefetcher::operator()(const ProxyURI& proxy_uri, const HTTPResponse& respo
     return;
   }
 
-  while (!futures.empty() && (myclock::now() - start) < prefetch_timeout_ && !Signaler::done) {
-    for (auto future_it = futures.begin(); futures.size() > 0 && future_it < futures.end();) {
-      if (future_it->wait_for(std::chrono::milliseconds(1)) == std::future_status::ready) {
-        // Remove finished future
-        future_it = futures.erase(future_it);
-        links.erase(links.begin() + (future_it - futures.begin()));
-        if (Signaler::done) break;
-        continue;
-      }
-      future_it++;
-      if (Signaler::done) break;
-    }
+  {
+    std::unique_lock<std::mutex> lock(mutex);
+    wake.wait(lock, [&] { return pending == 0 || deadline.expired() || Signaler::done; });
   }
   Signaler::num_threads--;
 }
 
 bool Prefetcher::fetch(ProxyURI proxy_uri) {
-  std::string buf;
-  Connection  server(ip_cache_);
+  PooledBuffer pooled_buf = BufferPool::acquire(MAXLINE);
+  std::string &buf        = *pooled_buf;
+  Connection   server(ip_cache_);
+  URIKey       key(proxy_uri);
   server.set_name("Prefetcher for '" + proxy_uri.absolute() + "'");
 
-  buf.resize(MAXBUF);
-
-  if (page_cache_->contains(proxy_uri)) {
+  if (page_cache_->contains(key)) {
     log("Prefetcher: Cache hit for %s", proxy_uri.absolute().c_str());
     return true;
   }
@@ -47,18 +70,31 @@ bool Prefetcher::fetch(ProxyURI proxy_uri) {
   if (server.connect(&proxy_uri) > 0) {
     std::string request = "GET " + proxy_uri.uri + " HTTP/1.1\r\nHost: " + proxy_uri.host + ":" + proxy_uri.port + "\r\n\r\n";
     log("Prefetcher: Sending request to %s\n%s", proxy_uri.absolute().c_str(), request.c_str());
-    int n_sent = server.send_n(request);
+    // Past the prefetch deadline, the socket is shut down to wake a stalled server, as connection timers do
+    TimerWheel &wheel   = TimerWheel::global();
+    int         wake_fd = dup(server.fd());
+    Timer       deadline([wake_fd] { shutdown(wake_fd, SHUT_RDWR); });
+    wheel.arm(deadline, Timeouts::global().prefetch);
+    int                           n_sent = server.send_n(request);
+    std::unique_ptr<HTTPResponse> opt_response;
+    if (n_sent > 0) opt_response = server.read_http_response(buf, proxy_uri);
+    wheel.cancel(deadline);
+    if (wake_fd >= 0) ::close(wake_fd);
+
     if (n_sent <= 0) {
       log("Prefetcher: Error sending request to %s", proxy_uri.absolute().c_str());
       return false;
     }
-    auto opt_response = server.read_http_response(buf, proxy_uri);
     if (opt_response) {
-      if (opt_response->code() == ResponseCode::OK) {
-        page_cache_->put(proxy_uri, *opt_response);
+      // Responses that vary are not cached, the prefetcher's requests have none of the headers of a client's
+      URIKey               variant;
+      std::chrono::seconds ttl = CachePolicy::global().ttl(*opt_response);
+      if (ttl.count() > 0 && Variants::global().store(key, HeaderTable(), *opt_response, variant) && variant == key &&
+          CachePolicy::global().stored(key, ttl)) {
+        TinyLFU::global().put(*page_cache_, key, opt_response->compressed());
         log("Prefetcher: Cached %s", proxy_uri.absolute().c_str());
         return true;
-      } else {
+      } else if (opt_response->code() != ResponseCode::OK) {
         log("Prefetcher: Fetching %s returned code %lu", proxy_uri.absolute().c_str(), (size_t)opt_response->code());
       }
     } else {
@@ -74,7 +110,7 @@ std::vector<ProxyURI> Prefetcher::parse_links(const HTTPResponse& response) {
 
   // Only parse HTML pages
   if (response.content_type() != "text/html") return links;
-  const std::string& body = response.body();
+  const std::string body = response.decoded_body();
 
   while (start != std::string::npos && !Signaler::done) {
     start = body.find("href=\"", start);
@@ -86,7 +122,7 @@ std::vector<ProxyURI> Prefetcher::parse_links(const HTTPResponse& response) {
       if (link.find("https://") == std::string::npos) {
         // Don't waste time prefetching HTTPS links
         ProxyURI uri = parse_uri(link, response.proxy_uri());
-        if (!page_cache_->contains(uri)) links.push_back(uri);
+        if (!page_cache_->contains(URIKey(uri))) links.push_back(uri);
       }
       start = href_end;
     }
@@ -0,0 +1,92 @@
+#include "Prefork.h"
+
+#include <signal.h>
+#include <sys/prctl.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <thread>
+
+int Prefork::worker_ = -1;
+
+/**
+  @brief Fork the workers and supervise them. Must be called before any thread is started, since threads do not
+  survive fork().
+
+  @param[in]  workers  Number of worker processes
+
+  @return  Index of the worker in a worker process, or -1 in the main process once every worker has exited
+**/
+int Prefork::run(unsigned workers) {
+  std::vector<pid_t> pids(workers, -1);
+
+  // Buffered output would be written once by every worker
+  fflush(nullptr);
+  for (unsigned i = 0; i < workers; i++) {
+    if (spawn(pids, i) == 0) return worker_;
+  }
+  log("Started %u workers", workers);
+
+  bool interrupted = false, drained = false;
+  while (std::any_of(pids.begin(), pids.end(), [](pid_t pid) { return pid > 0; })) {
+    // Signals are passed on to the workers
+    if (Signaler::done && !interrupted) {
+      interrupted = true;
+      for (pid_t pid : pids) {
+        if (pid > 0) kill(pid, SIGINT);
+      }
+    } else if (Signaler::draining && !drained) {
+      drained = true;
+      for (pid_t pid : pids) {
+        if (pid > 0) kill(pid, SIGTERM);
+      }
+    }
+
+    // Poll, so a signal that arrives while waiting is passed on right away
+    int   status;
+    pid_t pid = waitpid(-1, &status, WNOHANG);
+    if (pid == 0 || (pid < 0 && errno == EINTR)) {
+      std::this_thread::sleep_for(std::chrono::milliseconds(PREFORK_POLL_MS));
+      continue;
+    }
+    if (pid < 0) {
+      log("Error waiting for workers: %s", strerror(errno));
+      break;
+    }
+    auto it = std::find(pids.begin(), pids.end(), pid);
+    if (it == pids.end()) continue;
+    *it = -1;
+    if (Signaler::done || Signaler::draining) continue;
+
+    if (WIFSIGNALED(status)) log("Worker %ld (pid %d) killed by signal %d, restarting it", (long)(it - pids.begin()), pid, WTERMSIG(status));
+    else log("Worker %ld (pid %d) exited with status %d, restarting it", (long)(it - pids.begin()), pid, WEXITSTATUS(status));
+    std::this_thread::sleep_for(std::chrono::milliseconds(PREFORK_RESPAWN_MS));
+    if (spawn(pids, it - pids.begin()) == 0) return worker_;
+  }
+  return -1;
+}
+
+/**
+  @brief Fork a worker
+
+  @param[out]  pids   Process IDs of the workers, updated in the main process
+  @param[in]   index  Index of the worker
+
+  @return  0 in the worker, its process ID in the main process, or -1 if it could not be forked
+**/
+int Prefork::spawn(std::vector<pid_t> &pids, unsigned index) {
+  pid_t pid = fork();
+  if (pid == 0) {
+    // Workers must not outlive the supervisor, which would leave nobody to restart or stop them
+    prctl(PR_SET_PDEATHSIG, SIGINT);
+    worker_ = static_cast<int>(index);
+    return 0;
+  }
+  if (pid < 0) log("Error forking worker %u: %s", index, strerror(errno));
+  pids[index] = pid;
+  return pid;
+}
@@ -1,28 +1,56 @@
 #include "ProxyConnection.h"
+#include "AccessLog.h"
+#include "Admission.h"
+#include "Arena.h"
+#include "BufferPool.h"
+#include "CachePolicy.h"
+#include "CannedResponse.h"
+#include "IOBuf.h"
+#include "Metrics.h"
+#include "PeerCache.h"
+#include "PollTunnel.h"
+#include "Reactor.h"
+#include "SharedPageCache.h"
+#include "TimerWheel.h"
+#include "TinyLFU.h"
+#include "Trace.h"
+#include "URIKey.h"
+#include "UringTunnel.h"
+#include "Variants.h"
+
+// Attempts at getting a response from the server per request, a failed attempt reconnects and resends the request
+#define UPSTREAM_MAX_ATTEMPTS 3
 
 std::unordered_map<std::string, bool> ProxyConnection::blacklist_;
 
-ProxyConnection::ProxyConnection(uint64_t id, int client_fd, std::shared_ptr<Cache<AddrInfo>> ip_cache,
-                                 std::shared_ptr<Cache<HTTPResponse, ProxyURI>> page_cache)
-    : id_(id), client_(client_fd, ip_cache), server_(ip_cache), ip_cache_(ip_cache), page_cache_(page_cache) {
+ProxyConnection::ProxyConnection(uint64_t id, int client_fd, std::shared_ptr<Cache<AddrInfo, URIKey>> ip_cache,
+                                 std::shared_ptr<Cache<HTTPResponse, URIKey>> page_cache)
+    : id_(id),
+      client_(client_fd, ip_cache),
+      server_(ip_cache),
+      timeouts_(Timeouts::global()),
+      accepted_(myclock::now()),
+      ip_cache_(ip_cache),
+      page_cache_(page_cache) {
   std::string name = "Proxy Connection " + std::to_string(id_);
   client_.set_name(name + " (client)");
   server_.set_name(name + " (server)");
 }
 
-ProxyConnection::ProxyConnection(uint64_t id, int client_fd, std::shared_ptr<Cache<AddrInfo>> ip_cache,
-                                 std::shared_ptr<Cache<HTTPResponse, ProxyURI>> page_cache, int connection_timeout_seconds)
+ProxyConnection::ProxyConnection(uint64_t id, int client_fd, std::shared_ptr<Cache<AddrInfo, URIKey>> ip_cache,
+                                 std::shared_ptr<Cache<HTTPResponse, URIKey>> page_cache, int connection_timeout_seconds)
     : ProxyConnection(id, client_fd, ip_cache, page_cache) {
-  proxy_timeout_   = std::chrono::seconds{connection_timeout_seconds};
-  gateway_timeout_ = std::chrono::seconds{std::max(connection_timeout_seconds / 4, 1)};
+  timeouts_.idle     = std::chrono::seconds{connection_timeout_seconds};
+  timeouts_.upstream = std::chrono::seconds{std::max(connection_timeout_seconds / 4, 1)};
 }
 
 ProxyConnection::ProxyConnection(ProxyConnection&& other)
     : id_(other.id_),
       client_(std::move(other.client_)),
       server_(std::move(other.server_)),
-      proxy_timeout_(other.proxy_timeout_),
-      gateway_timeout_(other.gateway_timeout_),
+      timeouts_(other.timeouts_),
+      accepted_(other.accepted_),
+      client_key_(other.client_key_),
       page_cache_(other.page_cache_),
       ip_cache_(other.ip_cache_) {
   client_.set_name(other.client_.name());
@@ -34,59 +62,130 @@ ProxyConnection::~ProxyConnection() {
   server_.close();
 }
 
+/**
+  @brief Serve the connection on the calling thread, blocking until it is closed
+**/
 void ProxyConnection::operator()() {
   sigignore(SIGPIPE);
+  Reactor::block_on(run());
+}
+
+/**
+  @brief Serve a connection on a shared reactor, which owns the connection until it is closed
 
+  @param[in]  connection  Connection to serve
+**/
+Task<void> ProxyConnection::serve(ProxyConnection connection) { co_await connection.run(); }
+
+/**
+  @brief Serve requests until the connection is closed. Each request is parsed, checked against the blacklist, and
+  answered from the cache or forwarded to the server.
+**/
+Task<void> ProxyConnection::run() {
   // Run the proxy connection
   int         num_messages = 0;
   int         n = MAXLINE, n_response = MAXLINE;
   std::string reason;
-  std::string request_buf, response_buf, header;
+  IOBuf       out_body;  // Body of the response being sent, sharing the blocks of the response
   ProxyURI    last_uri;
-  time_point  thread_start = myclock::now(), start = myclock::now();
-
-  header.reserve(MAXLINE);
-  request_buf.resize(MAXLINE);
-  response_buf.resize(MAXLINE);
+  Arena       arena;
+  time_point  thread_start = myclock::now();
+  Metrics::accept.record(thread_start - accepted_);
+
+  // Expired client timers shut down the socket to wake up a blocked read. They use a duplicate of the descriptor,
+  // which stays open until the timers are gone, so a timer can never hit a descriptor reused by another connection.
+  TimerWheel &wheel   = TimerWheel::global();
+  int         wake_fd = dup(client_.fd());
+  Timer       idle_timer([wake_fd] { shutdown(wake_fd, SHUT_RD); });
+  idle_timer.expire_on_drain();
+  Timer       header_timer([wake_fd] { shutdown(wake_fd, SHUT_RD); });
+  // The upstream timer wakes a stalled server the same way, through a duplicate of the server socket taken for each
+  // request. Reconnects point the duplicate at the new socket with dup2, so its number never changes while armed.
+  std::atomic<int> upstream_wake_fd{-1};
+  Timer            upstream_timer([&upstream_wake_fd] {
+    int fd = upstream_wake_fd.load();
+    if (fd >= 0) shutdown(fd, SHUT_RDWR);
+  });
 
   log("Starting proxy connection on socket %d", client_.fd());
 
   do {
-    start = myclock::now();
-
-    // Wait for request from client, or timeout
-    if (n > 0) bzero(&request_buf[0], n);
-    do {
-      n = client_.recv(request_buf, 1, MSG_PEEK | MSG_DONTWAIT);
-      if ((myclock::now() - start) > proxy_timeout_) {
-        reason = "Timeout";
-        break;
-      }
-      if (n <= 0 && !(errno == EWOULDBLOCK || errno == EAGAIN)) {
-        reason = std::string("read from client: ") + strerror(errno);
-        break;
-      }
-      std::this_thread::sleep_for(std::chrono::milliseconds(1));
-    } while (n <= 0 && !Signaler::done);
-    if (!reason.empty()) break;
+    // Wait for request from client, or timeout. The arena keeps its first block for a request that is already there.
+    arena.reset();
+    wheel.arm(idle_timer, timeouts_.idle);
+    // A draining server closes keep-alive connections once their current request is answered. The flag is checked
+    // after arming, since the drain only expires timers that are already armed.
+    if (Signaler::draining && num_messages > 0) {
+      wheel.cancel(idle_timer);
+      reason = "Draining";
+      break;
+    }
+    char peek;
+    n = co_await client_.async_recv(&peek, 1, MSG_PEEK | MSG_DONTWAIT, false);
+    if (n < 0 && (errno == EINTR || errno == EWOULDBLOCK || errno == EAGAIN)) {
+      // No request yet, the connection goes idle: it holds no buffers and no arena memory, only its suspended frame
+      arena.release();
+      do {
+        n = co_await client_.async_recv(&peek, 1, MSG_PEEK, false);
+      } while (n < 0 && (errno == EINTR || errno == EWOULDBLOCK || errno == EAGAIN) && !idle_timer.expired() && !Signaler::done);
+    }
+    wheel.cancel(idle_timer);
+    if (idle_timer.expired()) {
+      reason = Signaler::draining ? "Draining" : "Timeout";
+      break;
+    }
+    if (n <= 0) {
+      reason = std::string("read from client: ") + strerror(errno);
+      break;
+    }
 
-    // Read request from client
-    n = client_.read_http_header(request_buf, header);
+    // I/O buffers are borrowed from the shared pool once the request arrives, and returned when it is answered
+    PooledBuffer pooled_request_buf = BufferPool::acquire(MAXLINE), pooled_response_buf = BufferPool::acquire(MAXLINE);
+    PooledBuffer pooled_header = BufferPool::acquire(MAXLINE), pooled_out = BufferPool::acquire(MAXLINE),
+                 pooled_upstream_request = BufferPool::acquire(MAXLINE);
+    std::string &request_buf = *pooled_request_buf, &response_buf = *pooled_response_buf;
+    std::string &header = *pooled_header, &out = *pooled_out, &upstream_request = *pooled_upstream_request;
+    bzero(&request_buf[0], request_buf.size());
+
+    // Read request from client, the request is traced from its first byte until the response is written
+    TraceRequest trace_request;
+    request_start_ = myclock::now();
+    wheel.arm(header_timer, timeouts_.header);
+    n = co_await client_.async_read_http_header(request_buf, header);
+    wheel.cancel(header_timer);
+    Trace::record(TracePhase::RequestHeader, request_start_, myclock::now());
+    if (header_timer.expired()) {
+      reason = "Timeout reading request header";
+      break;
+    }
     if (n <= 0) {
       reason = std::string("read from client: ") + strerror(errno);
       break;
     }
     num_messages++;
 
-    // Parse request
-    HTTPRequest request(header);
+    // Parse request, per-request allocations come from the connection's arena
+    time_point  parse_start = myclock::now();
+    HTTPRequest request(header, &arena);
+    time_point  parse_end = myclock::now();
+    Metrics::parse.record(parse_end - parse_start);
+    Trace::record(TracePhase::Parse, parse_start, parse_end);
+    Metrics::requests.add();
     log("Received request from client:\n%s", request.dump().c_str());
 
+    // Check the client's request rate
+    if (!Admission::global().allow_request(client_key_)) {
+      Metrics::rate_limited_requests.add();
+      if (co_await send_canned_response(request, ResponseCode::TooManyRequests) <= 0) {
+        reason = std::string("write to client: ") + strerror(errno);
+        break;
+      }
+      continue;
+    }
+
     // Check blacklist, URL
     if (!allowed(request.proxy_uri.host)) {
-      HTTPResponse response(request, ResponseCode::Forbidden);
-      log("Sending response to client:", response);
-      if (client_.send_n(response.dump()) <= 0) {
+      if (co_await send_canned_response(request, ResponseCode::Forbidden) <= 0) {
         reason = std::string("write to client: ") + strerror(errno);
         break;
       }
@@ -95,9 +194,7 @@ void ProxyConnection::operator()() {
 
     // Check request type
     if (request.method != RequestMethod::GET && request.method != RequestMethod::CONNECT) {
-      HTTPResponse response(request, ResponseCode::BadRequest);
-      log("Sending response to client:", response);
-      if (client_.send_n(response.dump()) <= 0) {
+      if (co_await send_canned_response(request, ResponseCode::BadRequest) <= 0) {
         reason = std::string("write to client: ") + strerror(errno);
         break;
       }
@@ -105,43 +202,113 @@ void ProxyConnection::operator()() {
     }
     if (request.method == RequestMethod::CONNECT) {
       log("CONNECT Request, initializing tunnel");
-      tunnel(request);
+      // A tunnel may stay open for long, it borrows its own buffers only while it forwards data
+      pooled_request_buf.release();
+      pooled_response_buf.release();
+      pooled_header.release();
+      pooled_out.release();
+      pooled_upstream_request.release();
+      time_point    tunnel_start = myclock::now();
+      std::uint64_t forwarded    = co_await tunnel(request);
+      Trace::record(TracePhase::Tunnel, tunnel_start, myclock::now());
+      if (forwarded > 0) AccessLog::record(request, 200, forwarded, AccessOutcome::Tunnel, request_start_);
       reason = "CONNECT Tunneling Complete";
       break;
     }
 
-    // Check cache
-    auto response = page_cache_->get(request.proxy_uri);
-    if (response) {
-      if (client_.send_n(response->dump()) <= 0) {
+    // Check cache, then the cache shared by all workers in prefork mode. The key is built once for every lookup, and
+    // selects the variant the request gets if the URI's responses vary on request headers.
+    URIKey key(request.proxy_uri);
+    URIKey variant = Variants::global().lookup(key, request.headers);
+    TinyLFU::global().access(variant);
+    time_point            lookup_start = myclock::now();
+    auto                  response     = page_cache_->get(variant);
+    if (response && !CachePolicy::global().fresh(variant)) {
+      // Cached for less than the cache timeout, and past its deadline
+      page_cache_->remove(variant);
+      TinyLFU::global().remove(variant, lookup_start);
+      response.reset();
+    }
+    SharedPageCache::Page shared_page  = response ? SharedPageCache::Page() : SharedPageCache::global().get(variant);
+    time_point            lookup_end   = myclock::now();
+    Metrics::cache_lookup.record(lookup_end - lookup_start);
+    Trace::record(TracePhase::CacheLookup, lookup_start, lookup_end);
+    if (response || shared_page) {
+      Metrics::cache_hits.add();
+      // Shared responses are sent straight from shared memory, unless the request needs a response built for it
+      bool direct = !response && shared_page.sendable(request);
+      if (response) response->dump(request, out, out_body);
+      else if (!direct) shared_page.response(request.proxy_uri).dump(request, out, out_body);
+      time_point write_start = myclock::now();
+      if (direct) n_response = co_await client_.async_send_n(shared_page.data(), shared_page.size());
+      else n_response = co_await client_.async_send_n(out, out_body);
+      out_body.clear();
+      time_point write_end = myclock::now();
+      Metrics::client_write.record(write_end - write_start);
+      Trace::record(TracePhase::ClientWrite, write_start, write_end);
+      int status = response ? static_cast<int>(response->code()) : shared_page.status();
+      AccessLog::record(request, status, std::max(n_response, 0), AccessOutcome::Hit, request_start_);
+      if (n_response <= 0) {
         reason = std::string("write to client: ") + strerror(errno);
         break;
       }
       log("Sending cached response to client for '%s'", request.proxy_uri.absolute().c_str());
       continue;
     }
+    Metrics::cache_misses.add();
+
+    // Fetch from the peer that owns the URL, requests forwarded by a peer are never forwarded again
+    bool from_peer = request.headers.contains(PEER_CACHE_HEADER);
+    if (from_peer) Metrics::peer_requests_received.add();
+    Peer *peer = from_peer ? nullptr : PeerCache::global().owner(key);
+    if (peer) {
+      auto peer_response = co_await PeerCache::global().fetch(*peer, request, response_buf);
+      if (peer_response) {
+        peer_response->dump(request, out, out_body);
+        time_point write_start = myclock::now();
+        n_response             = co_await client_.async_send_n(out, out_body);
+        out_body.clear();
+        time_point write_end   = myclock::now();
+        Metrics::client_write.record(write_end - write_start);
+        Trace::record(TracePhase::ClientWrite, write_start, write_end);
+        AccessLog::record(request, static_cast<int>(peer_response->code()), std::max(n_response, 0), AccessOutcome::Peer, request_start_);
+        if (n_response <= 0) {
+          reason = std::string("write to client: ") + strerror(errno);
+          break;
+        }
+        log("Sending response of peer %s to client for '%s'", peer->name.c_str(), request.proxy_uri.absolute().c_str());
+        continue;
+      }
+    }
+
+    // Always fetch complete bodies, range requests are served from the full response
+    {
+      HTTPRequest full_request = request;
+      full_request.headers.erase(Header::Range);
+      full_request.headers.erase(Header::IfRange);
+      full_request.headers.erase(PEER_CACHE_HEADER);
+      full_request.dump(upstream_request);
+    }
 
     // Forward request to server, send cached response, or send error to client
-    bool       response_sent     = false;
-    time_point server_conn_start = myclock::now();
+    bool response_sent = false;
+    int  attempts      = 0;
+    wheel.arm(upstream_timer, timeouts_.upstream);
     do {
+      attempts++;
       // Reuse connection if possible
       if (!server_.is_connected() || request.proxy_uri.host != last_uri.host || request.proxy_uri.port != last_uri.port) {
         server_.close();
-        server_.connect(&request.proxy_uri);
+        co_await server_.async_connect(&request.proxy_uri);
         if (!server_.is_connected()) {
-          HTTPResponse response(request, ResponseCode::NotFound);
-          log("Sending response to client:", response);
-          if (client_.send_n(response.dump()) <= 0) {
+          if (co_await send_canned_response(request, ResponseCode::NotFound) <= 0) {
             reason = std::string("write to client: ") + strerror(errno);
           } else response_sent = true;
           break;
         }
         // Check blacklist, IP
         if (!allowed(request.proxy_uri.ip)) {
-          HTTPResponse response(request, ResponseCode::Forbidden);
-          log("Sending response to client:", response);
-          if (client_.send_n(response.dump()) <= 0) {
+          if (co_await send_canned_response(request, ResponseCode::Forbidden) <= 0) {
             reason = std::string("write to client: ") + strerror(errno);
           } else response_sent = true;
           break;
@@ -149,9 +316,16 @@ void ProxyConnection::operator()() {
         last_uri = request.proxy_uri;
       }
 
+      // Let the upstream timer reach the socket the request is sent on
+      if (int fd = upstream_wake_fd.load(); fd < 0) {
+        upstream_wake_fd = dup(server_.fd());
+      } else dup2(server_.fd(), fd);
+
       // Send request to server
       log("Sending request to server");
-      n_response = server_.send_n(request.dump());
+      time_point send_start = myclock::now();
+      n_response            = co_await server_.async_send_n(upstream_request);
+      Trace::record(TracePhase::UpstreamSend, send_start, myclock::now());
       if (n_response <= 0) {
         log("Server closed connection, reconnecting...");
         server_.close();
@@ -162,7 +336,7 @@ void ProxyConnection::operator()() {
       bzero(&response_buf[0], response_buf.capacity());
 
       // Read response header
-      auto opt_response = server_.read_http_response(response_buf, request.proxy_uri);
+      auto opt_response = co_await server_.async_read_http_response(response_buf, request.proxy_uri);
       if (!opt_response) {
         log("Error reading response from server");
         server_.close();
@@ -171,157 +345,122 @@ void ProxyConnection::operator()() {
 
       // Send (and cache) response
       log("Sending server response to client");
-      n_response = client_.send_n(opt_response->dump());
-      if (opt_response->code() == ResponseCode::OK) {
+      opt_response->dump(request, out, out_body);
+      time_point write_start = myclock::now();
+      n_response             = co_await client_.async_send_n(out, out_body);
+      out_body.clear();
+      time_point write_end   = myclock::now();
+      Metrics::client_write.record(write_end - write_start);
+      Trace::record(TracePhase::ClientWrite, write_start, write_end);
+      AccessLog::record(request, static_cast<int>(opt_response->code()), std::max(n_response, 0), AccessOutcome::Miss, request_start_);
+      std::chrono::seconds ttl = CachePolicy::global().ttl(*opt_response);
+      if (ttl.count() > 0) {
+        if (!Variants::global().store(key, request.headers, *opt_response, variant)) {
+          Metrics::vary_uncacheable.add();
+        } else if (SharedPageCache::global().enabled()) {
+          SharedPageCache::global().put(variant, *opt_response, ttl);
+        } else if (CachePolicy::global().stored(variant, ttl)) {
+          TinyLFU::global().put(*page_cache_, variant, opt_response->compressed());
+        }
         log("Added response to cache.");
-        page_cache_->put(opt_response->proxy_uri(), *opt_response);
       }
       if (n_response <= 0) {
         reason = std::string("write to client: ") + strerror(errno);
         break;
       } else response_sent = true;
 
-    } while (!response_sent && (myclock::now() - server_conn_start < gateway_timeout_) && !Signaler::done);
+    } while (!response_sent && attempts < UPSTREAM_MAX_ATTEMPTS && !upstream_timer.expired() && !Signaler::done);
+    wheel.cancel(upstream_timer);
+    if (int fd = upstream_wake_fd.exchange(-1); fd >= 0) ::close(fd);
+    if (upstream_timer.expired()) {
+      log("Timed out waiting for server");
+      server_.close();
+    }
     if (!response_sent) {
-      HTTPResponse response(request, ResponseCode::GatewayTimeout);
-      log("Sending response to client:", response);
-      if (client_.send_n(response.dump()) <= 0) {
+      if (co_await send_canned_response(request, ResponseCode::GatewayTimeout) <= 0) {
         reason = std::string("write to client: ") + strerror(errno);
       }
     }
-  } while (reason.empty() && (myclock::now() - start < proxy_timeout_) && !Signaler::done);
+  } while (reason.empty() && !Signaler::done);
   if (Signaler::done) {
     reason = "User terminated proxy server";
   }
+  wheel.cancel(idle_timer);
+  wheel.cancel(header_timer);
+  if (wake_fd >= 0) ::close(wake_fd);
+  Admission::global().release(client_key_);
   log("Closing proxy connection on socket %d\nReason: %s\nProcessed %d messages\nAlive for %f seconds", client_.fd(), reason.c_str(), num_messages,
       std::chrono::duration<double>(myclock::now() - thread_start).count());
   Signaler::num_threads--;
 }
 
-void ProxyConnection::tunnel(HTTPRequest& request) {
+Task<std::uint64_t> ProxyConnection::tunnel(HTTPRequest& request) {
   // Should have a CONNECT request
   if (request.method != RequestMethod::CONNECT) {
     log("Error: tunnel() called with non-CONNECT request");
-    return;
+    co_return 0;
   }
 
   // Connect to server
-  server_.connect(&request.proxy_uri);
+  co_await server_.async_connect(&request.proxy_uri);
   if (!server_.is_connected()) {
-    HTTPResponse response(request, ResponseCode::NotFound);
-    log("Sending response to client:", response);
-    client_.send_n(response.dump());
-    return;
+    co_await send_canned_response(request, ResponseCode::NotFound);
+    co_return 0;
   }
   // Check blacklist, IP
   if (!allowed(request.proxy_uri.ip)) {
-    HTTPResponse response(request, ResponseCode::Forbidden);
-    log("Sending response to client:", response);
-    client_.send_n(response.dump());
-    return;
+    co_await send_canned_response(request, ResponseCode::Forbidden);
+    co_return 0;
   }
 
   // Send OK response to client
-  std::string response = "HTTP/1.1 200 OK\r\n\r\n";
-  // HTTPResponse response(request, ResponseCode::OK);
-  // log("Sending response to client:\n%s", response.c_str());
-  client_.send_n(response);
-
-  // Enter tunneling mode
-  log("Entering tunneling mode");
-  std::string buf;
-  buf.resize(MAXBUF);
-
-  struct pollfd fds[2];
-  Connection*   conns[2];
-  conns[0]       = &client_;
-  conns[1]       = &server_;
-  const int nfds = 2;
-  memset(fds, 0, sizeof(fds));
-  for (int i = 0; i < nfds; i++) {
-    fds[i].fd     = conns[i]->fd();
-    fds[i].events = POLLIN;
-  };
-
-  time_point start = myclock::now();
-  while (!Signaler::done && client_.is_connected() && server_.is_connected() && myclock::now() - start < std::chrono::seconds{50}) {
-    bool close[2] = {false, false};
-    // Poll fds
-    int err       = poll(fds, nfds, 200);
-
-    // Check for errors
-    if (err < 0) {
-      log("Error polling fds");
-      break;
-    } else if (err == 0) {
-      // Check for closed connections
-      for (int i = 0; i < nfds; i++) {
-        int n = conns[i]->recv(buf, 1, MSG_PEEK | MSG_DONTWAIT, false);
-        if (n == 0 || n < 0 && !(errno == EWOULDBLOCK || errno == EAGAIN)) {
-          log("Client closed connection");
-          conns[i]->close();
-          conns[1 - i]->close();
-          break;
-        }
-      }
-      continue;
-    }
-
-    // log("Poll returned %d", err);
-
-    // Check for events
-    for (int i = 0; !Signaler::done && i < nfds; i++) {
-      int total_sent = 0;
-      if (!(fds[i].revents)) continue;
-      if (fds[i].revents & POLLIN) {
-        // log("Tunneling data from %s to %s", i == 0 ? "client" : "server", i == 0 ? "server" : "client");
-        do {
-          // Read from fd[i]
-          int n_read = conns[i]->recv(buf, buf.capacity(), MSG_DONTWAIT, false);
-          if (n_read == 0) {
-            // Connection closed
-            log("Connection closed on fd %d", fds[i].fd);
-            close[i] = true;
-            break;
-          } else if (n_read < 0 && (errno == EWOULDBLOCK || errno == EAGAIN)) {
-            // Finished reading
-            break;
-          } else if (n_read < 0) {
-            // EOF
-            log("Error reading from fd %d: %s", fds[i].fd, strerror(errno));
-            close[i] = true;
-            break;
-          }
-
-          // Write to fd[1-i]
-          int n_sent = conns[1 - i]->send_n(buf, n_read, false);
-          if (n_sent <= 0) {
-            log("Error writing to fd %d", fds[1 - i].fd);
-            close[1 - i] = true;
-          }
-          start = myclock::now();
-          total_sent += n_sent;
-        } while (!Signaler::done);
-      }
-      // if (total_sent > 0) log("Sent %d bytes from %s to %s", total_sent, i == 0 ? "client" : "server", i == 0 ? "server" : "client");
-      if (fds[i].revents & POLLHUP) {
-        log("Connection closed on fd %d", fds[i].fd);
-        close[i] = true;
-        break;
-      }
-      if (fds[i].revents != POLLIN) {
-        log("Unhandled event on fd %d: %d", fds[i].fd, fds[i].revents);
-        close[i] = true;
-      }
-    }
-    if (close[0] || close[1]) {
-      server_.close();
+  static const std::string response = TUNNEL_ESTABLISHED_RESPONSE;
+  co_await client_.async_send_n(response);
+
+  // UringTunnel blocks in io_uring_enter, which only a connection's own thread may do
+  if (Connection::backend() == IOBackend::IOUring && !Reactor::current().shared()) {
+    UringTunnel uring_tunnel(IOUring::thread_ring(), client_, server_);
+    if (uring_tunnel.ok()) {
+      log("Entering tunneling mode (io_uring)");
+      uring_tunnel.run(timeouts_.tunnel_idle);
+      log("Exiting tunneling mode");
+      co_return uring_tunnel.bytes();
     }
   }
+
+  log("Entering tunneling mode");
+  PollTunnel poll_tunnel(client_, server_);
+  co_await poll_tunnel.run(timeouts_.tunnel_idle);
   log("Exiting tunneling mode");
-  return;
+  co_return poll_tunnel.bytes();
+}
+
+/**
+  @brief Send a pre-serialized response with no body to the client
+
+  @param[in]  request  Request being answered
+  @param[in]  code     Response code to send
+
+  @return  Number of bytes sent, or <= 0 on error
+**/
+Task<int> ProxyConnection::send_canned_response(const HTTPRequest& request, ResponseCode code) {
+  log("Sending %d response to client", static_cast<int>(code));
+  Metrics::error_responses.add();
+  int           n       = co_await client_.async_send_n(canned_response(code, request.version));
+  AccessOutcome outcome = code == ResponseCode::Forbidden || code == ResponseCode::BadRequest || code == ResponseCode::TooManyRequests
+                              ? AccessOutcome::Rejected
+                              : AccessOutcome::Error;
+  AccessLog::record(request, static_cast<int>(code), std::max(n, 0), outcome, request_start_);
+  co_return n;
 }
 
+/**
+  @brief Set the admission key of the client, the connection is released from admission control when it ends
+
+  @param[in]  key  Client key from Admission::admit()
+**/
+void ProxyConnection::set_client_key(std::uint64_t key) { client_key_ = key; }
+
 /**
   @brief Check if a host is allowed by the proxy blacklist
 
@@ -0,0 +1,125 @@
+#include "Range.h"
+
+#include <charconv>
+
+/**
+  @brief Parse a decimal number of a range spec
+
+  @param[in]   str    Digits to parse
+  @param[out]  value  Parsed number
+
+  @return  True if the whole string is a number that fits in 64 bits
+**/
+static bool parse_uint64(const std::string &str, std::uint64_t &value) {
+  auto [end, ec] = std::from_chars(str.data(), str.data() + str.size(), value);
+  return ec == std::errc() && end == str.data() + str.size();
+}
+
+/**
+  @brief Parse a single byte-range-spec ("first-last", "first-" or "-suffix")
+
+  @param[in]   spec    Range spec to parse
+  @param[in]   length  Length of the full body
+  @param[out]  range   Parsed range, clamped to the body length
+  @param[out]  valid   Set to false if the spec is syntactically invalid
+
+  @return  True if the range is satisfiable, false otherwise
+**/
+static bool parse_range_spec(const std::string &spec, std::uint64_t length, ByteRange &range, bool &valid) {
+  size_t dash_idx = spec.find('-');
+  valid           = false;
+  if (dash_idx == std::string::npos) return false;
+
+  std::string first = strip(spec.substr(0, dash_idx), " \t"), last = strip(spec.substr(dash_idx + 1), " \t");
+  if (first.find_first_not_of("0123456789") != std::string::npos || last.find_first_not_of("0123456789") != std::string::npos) return false;
+  if (first.empty() && last.empty()) return false;
+  // Numbers too large for 64 bits make the spec invalid, so the header is ignored
+  std::uint64_t first_pos = 0, last_pos = 0;
+  if ((!first.empty() && !parse_uint64(first, first_pos)) || (!last.empty() && !parse_uint64(last, last_pos))) return false;
+  valid = true;
+
+  if (first.empty()) {
+    // Suffix range, the last N bytes of the body
+    std::uint64_t suffix = last_pos;
+    if (suffix == 0 || length == 0) return false;
+    range.first = suffix >= length ? 0 : length - suffix;
+    range.last  = length - 1;
+    return true;
+  }
+
+  range.first = first_pos;
+  range.last  = last.empty() ? length - 1 : std::min<std::uint64_t>(last_pos, length - 1);
+  if (!last.empty() && last_pos < range.first) {
+    valid = false;
+    return false;
+  }
+  return range.first < length;
+}
+
+/**
+  @brief Parse the value of a Range request header against a body of known length
+
+  @param[in]   value   Value of the Range header, e.g. "bytes=0-499,1000-"
+  @param[in]   length  Length of the full body
+  @param[out]  ranges  Satisfiable ranges, in the order they were requested
+
+  @return  RangeStatus::None if the header should be ignored, RangeStatus::Unsatisfiable if no range overlaps the
+           body, and RangeStatus::Satisfiable otherwise
+**/
+RangeStatus parse_range(const std::string &value, std::uint64_t length, std::vector<ByteRange> &ranges) {
+  std::string str = strip(value, " \t");
+  ranges.clear();
+
+  // Only byte ranges are supported
+  size_t eq_idx = str.find('=');
+  if (eq_idx == std::string::npos || lower(strip(str.substr(0, eq_idx), " \t")) != "bytes") return RangeStatus::None;
+
+  std::stringstream stream(str.substr(eq_idx + 1));
+  std::string       spec;
+  int               num_specs = 0;
+  while (std::getline(stream, spec, ',')) {
+    if (strip(spec, " \t").empty()) continue;
+    if (++num_specs > MAX_RANGES) {
+      log("Ignoring Range header with more than %d ranges", MAX_RANGES);
+      ranges.clear();
+      return RangeStatus::None;
+    }
+
+    ByteRange range;
+    bool      valid;
+    if (parse_range_spec(spec, length, range, valid)) {
+      ranges.push_back(range);
+    } else if (!valid) {
+      // A syntactically invalid header is ignored entirely
+      ranges.clear();
+      return RangeStatus::None;
+    }
+  }
+  if (num_specs == 0) return RangeStatus::None;
+  return ranges.empty() ? RangeStatus::Unsatisfiable : RangeStatus::Satisfiable;
+}
+
+/**
+  @brief Format the value of a Content-Range header
+
+  @param[in]  range   Range being sent
+  @param[in]  length  Length of the full body
+
+  @return  std::string  Content-Range value, e.g. "bytes 0-499/1234"
+**/
+std::string content_range(const ByteRange &range, std::uint64_t length) {
+  return "bytes " + std::to_string(range.first) + "-" + std::to_string(range.last) + "/" + std::to_string(length);
+}
+
+/**
+  @brief Generate a random boundary string for a multipart/byteranges body
+
+  @return  std::string  Boundary string
+**/
+std::string multipart_boundary() {
+  static thread_local std::mt19937_64 rng{std::random_device{}()};
+  char                                boundary[32];
+
+  snprintf(boundary, sizeof(boundary), "webproxy_%016llx", static_cast<unsigned long long>(rng()));
+  return std::string(boundary);
+}
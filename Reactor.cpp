@@ -0,0 +1,353 @@
+#include "Reactor.h"
+#include "Trace.h"
+
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cstring>
+
+std::vector<std::unique_ptr<Reactor>> Reactor::reactors_;
+std::atomic<unsigned>                 Reactor::next_{0};
+unsigned                              Reactor::ring_files_ = 0;
+std::mutex                            Reactor::offload_mutex_;
+std::condition_variable               Reactor::offload_ready_;
+std::deque<std::function<void()>>     Reactor::offload_queue_;
+std::vector<std::thread>              Reactor::offload_threads_;
+bool                                  Reactor::offload_stop_ = false;
+
+// Shared reactor running on the calling thread, if any
+static thread_local Reactor *thread_reactor = nullptr;
+
+// Key of the eventfd in epoll events, sockets are keyed by their generation and descriptor
+static const std::uint64_t EVENTFD_KEY = ~0ULL;
+// Key of the io_uring's descriptor, readable while completions are queued
+static const std::uint64_t RING_KEY = ~0ULL - 1;
+
+/**
+  @brief Check if the socket is ready, without suspending if readiness was reported while nobody was waiting
+**/
+bool Reactor::Wait::await_ready() {
+  Waiters *waiters = Signaler::done ? nullptr : reactor_.waiters(fd_);
+  if (!waiters) {
+    ok_ = false;
+    return true;
+  }
+  bool &ready = write_ ? waiters->writable : waiters->readable;
+  if (!ready) return false;
+  ready = false;
+  return true;
+}
+
+void Reactor::Wait::await_suspend(std::coroutine_handle<> handle) {
+  trace_request_   = Trace::current_request();
+  Waiters *waiters = reactor_.waiters(fd_);
+  (write_ ? waiters->writer : waiters->reader) = handle;
+}
+
+/**
+  @return  False if the socket can not be waited on or the proxy is shutting down, true if the operation should be
+           retried
+**/
+bool Reactor::Wait::await_resume() {
+  Trace::resume_request(trace_request_);
+  return ok_ && !Signaler::done;
+}
+
+/**
+  @brief Run the function right away on a private reactor, where blocking is fine
+**/
+bool Reactor::Offload::await_ready() {
+  if (reactor_.shared()) return false;
+  fn_();
+  return true;
+}
+
+/**
+  @brief Queue the function for the offload pool, whose thread posts the coroutine back to the reactor once it returns
+**/
+void Reactor::Offload::await_suspend(std::coroutine_handle<> handle) {
+  suspended_     = true;
+  trace_request_ = Trace::current_request();
+  {
+    std::lock_guard<std::mutex> lock(offload_mutex_);
+    offload_queue_.emplace_back([this, handle] {
+      fn_();
+      reactor_.post(handle);
+    });
+  }
+  offload_ready_.notify_one();
+}
+
+void Reactor::Offload::await_resume() {
+  if (suspended_) Trace::resume_request(trace_request_);
+}
+
+Reactor::Reactor(bool shared) : shared_(shared) {}
+
+Reactor::~Reactor() {
+  if (epollfd_ >= 0) ::close(epollfd_);
+  if (eventfd_ >= 0) ::close(eventfd_);
+}
+
+/**
+  @brief Create the epoll instance on first use, so threads that never wait on several sockets never create one
+
+  @return  True if the reactor can wait on sockets
+**/
+bool Reactor::open() {
+  if (epollfd_ >= 0) return true;
+  epollfd_ = epoll_create1(EPOLL_CLOEXEC);
+  eventfd_ = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+
+  struct epoll_event event = {};
+  event.events             = EPOLLIN | EPOLLET;
+  event.data.u64           = EVENTFD_KEY;
+  if (epollfd_ < 0 || eventfd_ < 0 || epoll_ctl(epollfd_, EPOLL_CTL_ADD, eventfd_, &event) < 0) {
+    log("Error creating reactor: %s", strerror(errno));
+    if (epollfd_ >= 0) ::close(epollfd_);
+    if (eventfd_ >= 0) ::close(eventfd_);
+    epollfd_ = eventfd_ = -1;
+    return false;
+  }
+  return true;
+}
+
+/**
+  @brief Create the io_uring of a shared reactor on its thread, and watch it for completions. Kernels that drop
+  completions when the completion queue overflows would leave coroutines suspended forever, they are not used.
+**/
+void Reactor::open_ring() {
+  IOUring &ring = IOUring::thread_ring(IOURING_REACTOR_ENTRIES, ring_files_);
+  if (!ring.ok() || !ring.no_drop()) {
+    log("io_uring can not be used by reactors, falling back to system calls");
+    return;
+  }
+  struct epoll_event event = {};
+  event.events             = EPOLLIN;
+  event.data.u64           = RING_KEY;
+  if (epoll_ctl(epollfd_, EPOLL_CTL_ADD, ring.fd(), &event) < 0) {
+    log("Error adding io_uring to reactor, falling back to system calls: %s", strerror(errno));
+    return;
+  }
+  ring_ = &ring;
+}
+
+/**
+  @brief Get the waiters of a socket, registering it with epoll on first use
+
+  @param[in]  fd  Socket
+
+  @return  Waiters of the socket, or nullptr if it can not be registered
+**/
+Reactor::Waiters *Reactor::waiters(int fd) {
+  auto it = waiters_.find(fd);
+  if (it != waiters_.end()) return &it->second;
+  if (!open()) return nullptr;
+
+  Waiters waiters;
+  waiters.generation       = ++generation_;
+  struct epoll_event event = {};
+  event.events             = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+  event.data.u64           = static_cast<std::uint64_t>(waiters.generation) << 32 | static_cast<std::uint32_t>(fd);
+  if (epoll_ctl(epollfd_, EPOLL_CTL_ADD, fd, &event) < 0) {
+    log("Error adding fd %d to reactor: %s", fd, strerror(errno));
+    return nullptr;
+  }
+  return &waiters_.emplace(fd, waiters).first->second;
+}
+
+/**
+  @brief Stop watching a socket, must be called before it is closed, since its descriptor may be reused right away
+
+  @param[in]  fd  Socket
+**/
+void Reactor::forget(int fd) {
+  auto it = waiters_.find(fd);
+  if (it == waiters_.end()) return;
+  epoll_ctl(epollfd_, EPOLL_CTL_DEL, fd, nullptr);
+  waiters_.erase(it);
+}
+
+/**
+  @brief Resume a coroutine on the reactor's thread, may be called from any thread
+
+  @param[in]  handle  Suspended coroutine
+**/
+void Reactor::post(std::coroutine_handle<> handle) {
+  {
+    std::lock_guard<std::mutex> lock(posted_mutex_);
+    posted_.push_back(handle);
+  }
+  std::uint64_t one = 1;
+  if (eventfd_ >= 0 && write(eventfd_, &one, sizeof(one)) < 0 && errno != EAGAIN) {
+    log("Error waking up reactor: %s", strerror(errno));
+  }
+}
+
+/**
+  @brief Run a task on the reactor's thread, which owns it until it finishes. May be called from any thread.
+
+  @param[in]  task  Task to run
+**/
+void Reactor::spawn(Task<void> task) { run_detached(*this, std::move(task)); }
+
+Detached Reactor::run_detached(Reactor &reactor, Task<void> task) {
+  co_await reactor.schedule();
+  reactor.tasks_++;
+  co_await task;
+  reactor.tasks_--;
+}
+
+/**
+  @brief Submit the io_uring operations prepared since the last call, wait for ready sockets, completed operations and
+  posted coroutines, and resume the coroutines waiting for them
+
+  @param[in]  timeout_ms  Maximum time to wait if nothing is ready
+**/
+void Reactor::run_once(int timeout_ms) {
+  struct epoll_event events[REACTOR_MAX_EVENTS];
+  int                n = 0;
+
+  if (open()) {
+    if (ring_ && ring_->pending() && ring_->submit(0) < 0) log("Error submitting io_uring operations: %s", strerror(errno));
+    n = epoll_wait(epollfd_, events, REACTOR_MAX_EVENTS, timeout_ms);
+    if (n < 0 && errno != EINTR) log("Error waiting for events: %s", strerror(errno));
+  }
+  for (int i = 0; i < n; i++) {
+    if (events[i].data.u64 == EVENTFD_KEY) {
+      std::uint64_t count;
+      while (read(eventfd_, &count, sizeof(count)) > 0) continue;
+      continue;
+    }
+    if (events[i].data.u64 == RING_KEY) continue;
+
+    // Events of a socket that was forgotten, or of a new socket with the same descriptor, are stale
+    int  fd = static_cast<int>(events[i].data.u64 & 0xFFFFFFFF);
+    auto it = waiters_.find(fd);
+    if (it == waiters_.end() || it->second.generation != events[i].data.u64 >> 32) continue;
+
+    // Take both waiters first, resuming the reader may forget the socket
+    Waiters                &waiters = it->second;
+    std::coroutine_handle<> reader, writer;
+    std::uint32_t           flags = events[i].events;
+    if (flags & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR)) {
+      if (waiters.reader) reader = std::exchange(waiters.reader, nullptr);
+      else waiters.readable = true;
+    }
+    if (flags & (EPOLLOUT | EPOLLHUP | EPOLLERR)) {
+      if (waiters.writer) writer = std::exchange(waiters.writer, nullptr);
+      else waiters.writable = true;
+    }
+    if (reader) reader.resume();
+    if (writer) writer.resume();
+  }
+
+  if (ring_) ring_->complete();
+
+  // Shutting down, every waiting coroutine is resumed to find out
+  if (Signaler::done) wake_all();
+
+  {
+    std::lock_guard<std::mutex> lock(posted_mutex_);
+    running_.swap(posted_);
+  }
+  for (auto handle : running_) handle.resume();
+  running_.clear();
+}
+
+void Reactor::wake_all() {
+  std::vector<std::coroutine_handle<>> handles;
+  for (auto &entry : waiters_) {
+    if (entry.second.reader) handles.push_back(std::exchange(entry.second.reader, nullptr));
+    if (entry.second.writer) handles.push_back(std::exchange(entry.second.writer, nullptr));
+  }
+  for (auto handle : handles) handle.resume();
+}
+
+/**
+  @brief Run queued offloaded functions until the reactors are stopped. Functions still queued then are dropped, their
+  coroutines are abandoned with the reactors.
+**/
+void Reactor::offload_run() {
+  std::unique_lock<std::mutex> lock(offload_mutex_);
+  while (true) {
+    offload_ready_.wait(lock, [] { return offload_stop_ || !offload_queue_.empty(); });
+    if (offload_stop_) return;
+    std::function<void()> fn = std::move(offload_queue_.front());
+    offload_queue_.pop_front();
+    lock.unlock();
+    fn();
+    lock.lock();
+  }
+}
+
+void Reactor::run() {
+  thread_reactor = this;
+  if (ring_files_ > 0) open_ring();
+  while (!stop_) run_once(REACTOR_TICK_MS);
+  log("Reactor stopped with %zu tasks left", tasks_.load());
+}
+
+/**
+  @brief Get the reactor of the calling thread: the shared reactor it runs, or else its private reactor
+
+  @return  Reactor&  Reactor of the calling thread
+**/
+Reactor &Reactor::current() {
+  static thread_local Reactor private_reactor;
+  return thread_reactor ? *thread_reactor : private_reactor;
+}
+
+/**
+  @brief Start the shared reactors, each on a thread of its own, and the offload pool they share
+
+  @param[in]  threads     Number of reactors, 0 for one per core
+  @param[in]  ring_files  Fixed file slots of each reactor's io_uring, 0 to use system calls
+**/
+void Reactor::start(unsigned threads, unsigned ring_files) {
+  ring_files_ = ring_files;
+  if (threads == 0) threads = std::max(1u, std::thread::hardware_concurrency());
+  for (unsigned i = 0; i < threads; i++) {
+    reactors_.emplace_back(new Reactor(true));
+    Reactor &reactor = *reactors_.back();
+    if (!reactor.open()) {
+      reactors_.pop_back();
+      continue;
+    }
+    reactor.thread_ = std::thread(&Reactor::run, &reactor);
+  }
+  offload_stop_ = false;
+  for (unsigned i = 0; i < REACTOR_OFFLOAD_THREADS && !reactors_.empty(); i++) {
+    offload_threads_.emplace_back(&Reactor::offload_run);
+  }
+  log("Started %zu reactors", reactors_.size());
+}
+
+/**
+  @brief Stop the shared reactors and the offload pool. Coroutines still running on them are abandoned, like detached
+  connection threads. A helper thread in the middle of a blocking call is waited for.
+**/
+void Reactor::stop() {
+  for (auto &reactor : reactors_) {
+    reactor->stop_ = true;
+    std::uint64_t one = 1;
+    if (write(reactor->eventfd_, &one, sizeof(one)) < 0) log("Error waking up reactor: %s", strerror(errno));
+  }
+  for (auto &reactor : reactors_) reactor->thread_.join();
+  {
+    std::lock_guard<std::mutex> lock(offload_mutex_);
+    offload_stop_ = true;
+    offload_queue_.clear();
+  }
+  offload_ready_.notify_all();
+  for (auto &thread : offload_threads_) thread.join();
+  offload_threads_.clear();
+}
+
+/**
+  @brief Pick the shared reactor for a new connection, round-robin
+
+  @return  Reactor&  Shared reactor
+**/
+Reactor &Reactor::next() { return *reactors_[next_++ % reactors_.size()]; }
@@ -0,0 +1,589 @@
+#include "SharedPageCache.h"
+#include "HeaderTable.h"
+#include "IOBuf.h"
+
+#include <sys/mman.h>
+
+#include <algorithm>
+#include <cstring>
+#include <new>
+#include <utility>
+
+// Most size classes between SHARED_CACHE_MIN_CHUNK and SHARED_CACHE_SLAB_SIZE
+#define SHARED_CACHE_MAX_CLASSES 64
+// Attempts to read a slot that is being written before it is treated as a miss
+#define SHARED_CACHE_READ_RETRIES 64
+// Most chunks in a slab, those of the smallest size class
+#define SHARED_CACHE_SLAB_CHUNKS (SHARED_CACHE_SLAB_SIZE / SHARED_CACHE_MIN_CHUNK)
+
+struct SharedPageCache::Segment {
+  pthread_mutex_t mutex;
+  std::uint64_t   slots;         // Number of slots in the index, a power of two
+  std::uint64_t   slots_offset;  // Offset of the index in the segment
+  std::uint64_t   slabs;         // Number of slabs
+  std::uint64_t   slabs_offset;  // Offset of the slab table in the segment
+  std::uint64_t   arena_offset;  // Offset of the first slab in the segment
+  std::uint64_t   slabs_carved;  // Slabs split into chunks, the others are not used yet
+  std::uint64_t   clock_hand;    // Next slot to look at when evicting
+  std::uint64_t   slab_hand;     // Next slab to look at when reassigning one
+  unsigned        classes;
+  std::uint32_t   class_size[SHARED_CACHE_MAX_CLASSES];
+  std::uint32_t   class_slabs[SHARED_CACHE_MAX_CLASSES];  // Slabs of each class
+  std::uint64_t   pressure[SHARED_CACHE_MAX_CLASSES];     // Bytes evicted from each class since it last took a slab
+  std::uint64_t   free_list[SHARED_CACHE_MAX_CLASSES];    // First free chunk of each class, SHARED_CACHE_NO_CHUNK if none
+
+  std::atomic<std::uint64_t> entries{0}, bytes{0}, evictions{0}, reassignments{0};
+};
+
+// Entry of the index, every field but `referenced` is only written under the mutex and inside the seqlock
+struct SharedPageCache::Slot {
+  std::atomic<std::uint32_t> seq{0};         // Odd while the slot is written
+  std::atomic<std::uint32_t> referenced{0};  // Set on every hit, cleared by the eviction sweep
+  std::atomic<std::uint64_t> key{0};         // Hash of the canonical URI, 0 if the slot is free
+  std::atomic<std::uint64_t> chunk{0};       // Handle of the chunk holding the response
+  std::atomic<std::uint64_t> expires{0};     // Expiry time, in nanoseconds of the steady clock
+  std::atomic<std::uint32_t> generation{0};  // Generation of the chunk when it was stored
+  std::atomic<std::uint32_t> cls{0};         // Size class of the chunk
+};
+
+// Reference count and generation of a chunk. They live in the slab table rather than in the chunk, so a reader holding
+// the handle of a chunk whose slab was split for another class since pins whatever chunk has the handle now, never
+// response bytes, and then sees that the generation changed.
+struct SharedPageCache::Pin {
+  std::atomic<std::uint32_t> refs{0};        // One for the index, one per reader, 0 if the chunk is free
+  std::atomic<std::uint32_t> generation{0};  // Incremented every time the chunk is allocated
+};
+
+// Entry of the slab table. A chunk's handle is its slab's index times SHARED_CACHE_SLAB_CHUNKS plus its rank in the slab
+struct SharedPageCache::Slab {
+  std::uint32_t cls = 0;                         // Size class the slab is split for, only valid once carved
+  Pin           pins[SHARED_CACHE_SLAB_CHUNKS];  // Pins of the chunks, those past the last chunk of the class stay free
+};
+
+// Chunk header, followed by the host and target of the key and the serialized response
+struct SharedPageCache::Chunk {
+  std::uint64_t next        = 0;  // Next free chunk of the class
+  std::uint64_t slot        = 0;  // Slot of the index the chunk was stored in
+  std::uint64_t variant     = 0;
+  std::uint32_t host_size   = 0;
+  std::uint32_t target_size = 0;
+  std::uint32_t size        = 0;
+  std::uint32_t status      = 0;
+  std::uint16_t port        = 0;
+
+  bool stored_under(const URIKey &uri) const;
+};
+
+static_assert(SHARED_CACHE_SLAB_SIZE % SHARED_CACHE_MIN_CHUNK == 0, "slabs must hold whole chunks of the smallest class");
+
+static std::uint64_t now_ns() {
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(myclock::now().time_since_epoch()).count();
+}
+
+static std::uint64_t key_of(const URIKey &uri) {
+  std::uint64_t key = uri.hash();
+  return key == 0 ? 1 : key;
+}
+
+static std::uint64_t align_up(std::uint64_t n, std::uint64_t alignment) { return (n + alignment - 1) / alignment * alignment; }
+
+SharedPageCache::Page::Page(Page &&other) noexcept
+    : cache_(other.cache_), handle_(std::exchange(other.handle_, SHARED_CACHE_NO_CHUNK)) {}
+
+SharedPageCache::Page &SharedPageCache::Page::operator=(Page &&other) noexcept {
+  if (this != &other) {
+    if (*this) cache_->release(handle_);
+    cache_  = other.cache_;
+    handle_ = std::exchange(other.handle_, SHARED_CACHE_NO_CHUNK);
+  }
+  return *this;
+}
+
+SharedPageCache::Page::~Page() {
+  if (*this) cache_->release(handle_);
+}
+
+/**
+  @brief Check if the chunk holds the response of a key, whose hash is known to match
+
+  @param[in]  uri  Key of the response
+
+  @return  True if the chunk was stored under the key
+**/
+bool SharedPageCache::Chunk::stored_under(const URIKey &uri) const {
+  const char        *bytes  = reinterpret_cast<const char *>(this + 1);
+  const std::string &host   = uri.host();
+  const std::string &target = uri.target();
+  return port == uri.port() && variant == uri.variant() && host_size == host.size() && target_size == target.size() &&
+         memcmp(bytes, host.data(), host.size()) == 0 && memcmp(bytes + host.size(), target.data(), target.size()) == 0;
+}
+
+const char *SharedPageCache::Page::data() const {
+  const Chunk *c = cache_->chunk(handle_);
+  return reinterpret_cast<const char *>(c + 1) + c->host_size + c->target_size;
+}
+
+size_t SharedPageCache::Page::size() const { return cache_->chunk(handle_)->size; }
+
+int SharedPageCache::Page::status() const { return static_cast<int>(cache_->chunk(handle_)->status); }
+
+/**
+  @brief Check if the stored response can be sent to a client as is. Responses are stored uncompressed, so only range
+  requests need a response built for them.
+
+  @param[in]  request  Request from the client
+
+  @return  True if `data()` is the response to the request
+**/
+bool SharedPageCache::Page::sendable(const HTTPRequest &request) const { return !request.headers.contains(Header::Range); }
+
+/**
+  @brief Parse the stored response, for requests it can not be sent to as is
+
+  @param[in]  uri  URI of the response
+
+  @return  HTTPResponse  Copy of the response
+**/
+HTTPResponse SharedPageCache::Page::response(const ProxyURI &uri) const {
+  std::string_view page(data(), size());
+  size_t           header_end = page.find("\r\n\r\n");
+  HTTPResponse     response(std::string(page.substr(0, header_end + 4)), uri);
+  IOBuf            body;
+  body.append(page.substr(header_end + 4));
+  response.append_to_body(body);
+  return response;
+}
+
+SharedPageCache::~SharedPageCache() {
+  if (base_) munmap(base_, size_);
+}
+
+/**
+  @brief Map the shared memory segment, must be called before the workers are forked so all of them share it
+
+  @param[in]  bytes    Memory for cached responses, rounded down to whole slabs
+  @param[in]  timeout  Time a response stays cached
+
+  @return  True if the segment was mapped
+**/
+bool SharedPageCache::open(size_t bytes, std::chrono::seconds timeout) {
+  std::uint64_t slabs = std::max<std::uint64_t>(1, bytes / SHARED_CACHE_SLAB_SIZE);
+  std::uint64_t slots = 1024;
+  while (slots < slabs * SHARED_CACHE_SLAB_SIZE / SHARED_CACHE_AVG_PAGE) slots <<= 1;
+
+  std::uint64_t slots_offset = align_up(sizeof(Segment), 64);
+  std::uint64_t slabs_offset = align_up(slots_offset + slots * sizeof(Slot), 64);
+  std::uint64_t arena_offset = align_up(slabs_offset + slabs * sizeof(Slab), 4096);
+  size_                      = arena_offset + slabs * SHARED_CACHE_SLAB_SIZE;
+  void *base                 = mmap(nullptr, size_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+  if (base == MAP_FAILED) {
+    log("Error mapping %zu bytes of shared memory: %s", size_, strerror(errno));
+    return false;
+  }
+  base_    = static_cast<char *>(base);
+  timeout_ = timeout;
+
+  Segment *segment      = new (base_) Segment;
+  segment->slots        = slots;
+  segment->slots_offset = slots_offset;
+  segment->slabs        = slabs;
+  segment->slabs_offset = slabs_offset;
+  segment->arena_offset = arena_offset;
+  segment->slabs_carved = 0;
+  segment->clock_hand   = 0;
+  segment->slab_hand    = 0;
+  segment->classes      = 0;
+  for (std::uint64_t size = SHARED_CACHE_MIN_CHUNK; segment->classes < SHARED_CACHE_MAX_CLASSES; size = align_up(size * 5 / 4, 64)) {
+    segment->free_list[segment->classes]    = SHARED_CACHE_NO_CHUNK;
+    segment->class_slabs[segment->classes]  = 0;
+    segment->pressure[segment->classes]     = 0;
+    segment->class_size[segment->classes++] = static_cast<std::uint32_t>(std::min<std::uint64_t>(size, SHARED_CACHE_SLAB_SIZE));
+    if (size >= SHARED_CACHE_SLAB_SIZE) break;
+  }
+  for (std::uint64_t i = 0; i < slots; i++) new (base_ + slots_offset + i * sizeof(Slot)) Slot;
+  for (std::uint64_t i = 0; i < slabs; i++) new (base_ + slabs_offset + i * sizeof(Slab)) Slab;
+
+  // A worker that dies holding the mutex hands it to the next one instead of blocking every other worker
+  pthread_mutexattr_t attr;
+  pthread_mutexattr_init(&attr);
+  pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+  pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+  pthread_mutex_init(&segment->mutex, &attr);
+  pthread_mutexattr_destroy(&attr);
+
+  segment_ = segment;
+  log("Shared page cache of %llu slabs, %llu slots and %u size classes", (unsigned long long)slabs, (unsigned long long)slots,
+      segment->classes);
+  return true;
+}
+
+/**
+  @brief Look up a response without taking a lock. The key is compared field by field with the one stored in the
+  chunk, no string is built.
+
+  @param[in]  uri  Key of the response
+
+  @return  Response pinned in shared memory, or an empty page if it is not cached or has expired
+**/
+SharedPageCache::Page SharedPageCache::get(const URIKey &uri) {
+  if (!segment_) return Page();
+  std::uint64_t key = key_of(uri);
+  std::uint64_t now = now_ns();
+
+  for (std::uint64_t probe = 0; probe < SHARED_CACHE_PROBES; probe++) {
+    Slot &s = *slot(key + probe);
+
+    // Read the slot under its seqlock, retrying while it is written
+    std::uint64_t slot_key = 0, handle = 0, expires = 0;
+    std::uint32_t generation = 0;
+    bool          consistent = false;
+    for (int retry = 0; retry < SHARED_CACHE_READ_RETRIES && !consistent; retry++) {
+      std::uint32_t seq = s.seq.load(std::memory_order_acquire);
+      if (seq & 1) continue;
+      slot_key   = s.key.load(std::memory_order_relaxed);
+      handle     = s.chunk.load(std::memory_order_relaxed);
+      expires    = s.expires.load(std::memory_order_relaxed);
+      generation = s.generation.load(std::memory_order_relaxed);
+      std::atomic_thread_fence(std::memory_order_acquire);
+      consistent = s.seq.load(std::memory_order_relaxed) == seq;
+    }
+    if (!consistent || slot_key != key) continue;
+    if (expires <= now) return Page();
+
+    // Pin the chunk, unless it was freed or reused since the slot was read
+    Pin          &p    = pin(handle);
+    std::uint32_t refs = p.refs.load(std::memory_order_relaxed);
+    do {
+      if (refs == 0) return Page();
+    } while (!p.refs.compare_exchange_weak(refs, refs + 1, std::memory_order_acquire, std::memory_order_relaxed));
+    Page page(this, handle);
+    if (p.generation.load(std::memory_order_relaxed) != generation) return Page();
+    if (!chunk(handle)->stored_under(uri)) continue;
+
+    s.referenced.store(1, std::memory_order_relaxed);
+    return page;
+  }
+  return Page();
+}
+
+/**
+  @brief Store a response, replacing the one cached for the same URI. A chunk is reserved under the mutex, the
+  response is copied into it without holding the mutex, and the chunk is then published in the index under the mutex
+  again, through the slot's seqlock. The reserved chunk is pinned while it is copied into, so it is neither evicted
+  nor reassigned; a worker that dies while copying loses it until the proxy restarts.
+
+  @param[in]  uri       Key of the response
+  @param[in]  response  Complete response
+  @param[in]  ttl       Time the response is cached for, at most the cache timeout
+
+  @return  True if the response was stored, false if it is too large or its size class is pinned by readers
+**/
+bool SharedPageCache::put(const URIKey &uri, const HTTPResponse &response, std::chrono::seconds ttl) {
+  if (!segment_) return false;
+  // The body is gathered into shared memory straight from its blocks
+  const std::string &host = uri.host(), &target = uri.target();
+  std::string        head;
+  IOBuf              body;
+  if (response.is_compressed()) response.decompressed().dump(head, body);
+  else response.dump(head, body);
+
+  std::uint64_t need = sizeof(Chunk) + host.size() + target.size() + head.size() + body.size();
+  unsigned      cls  = 0;
+  while (cls < segment_->classes && segment_->class_size[cls] < need) cls++;
+  if (cls == segment_->classes) return false;
+
+  lock();
+  std::uint64_t handle = allocate(cls);
+  unlock();
+  if (handle == SHARED_CACHE_NO_CHUNK) return false;
+
+  std::uint32_t generation = pin(handle).generation.load(std::memory_order_relaxed);
+  Chunk        *c          = chunk(handle);
+  c->variant               = uri.variant();
+  c->host_size             = static_cast<std::uint32_t>(host.size());
+  c->target_size           = static_cast<std::uint32_t>(target.size());
+  c->size                  = static_cast<std::uint32_t>(head.size() + body.size());
+  c->status                = static_cast<std::uint32_t>(response.code());
+  c->port                  = uri.port();
+  char *dst                = reinterpret_cast<char *>(c + 1);
+  memcpy(dst, host.data(), host.size());
+  memcpy(dst + host.size(), target.data(), target.size());
+  memcpy(dst + host.size() + target.size(), head.data(), head.size());
+  dst += host.size() + target.size() + head.size();
+  body.for_each([&dst](const char *data, size_t len) {
+    memcpy(dst, data, len);
+    dst += len;
+  });
+
+  lock();
+  // Take the key's own slot, else a free or expired one, else the one closest to expiry
+  std::uint64_t key = key_of(uri), now = now_ns();
+  Slot         *target_slot = nullptr, *vacant = nullptr, *oldest = nullptr;
+  for (std::uint64_t probe = 0; probe < SHARED_CACHE_PROBES && !target_slot; probe++) {
+    Slot         &s        = *slot(key + probe);
+    std::uint64_t slot_key = s.key.load(std::memory_order_relaxed);
+    if (slot_key == key) target_slot = &s;
+    else if (!vacant && (slot_key == 0 || s.expires.load(std::memory_order_relaxed) <= now)) vacant = &s;
+    else if (!oldest || s.expires.load(std::memory_order_relaxed) < oldest->expires.load(std::memory_order_relaxed)) oldest = &s;
+  }
+  Slot &s = target_slot ? *target_slot : vacant ? *vacant : *oldest;
+  if (s.key.load(std::memory_order_relaxed) != 0) {
+    if (&s == oldest) segment_->evictions++;
+    remove(s);
+  }
+  c->slot = &s - slot(0);
+
+  // The fence also publishes the contents of the chunk to readers that see its handle in the slot
+  std::uint32_t seq = s.seq.load(std::memory_order_relaxed);
+  s.seq.store(seq + 1, std::memory_order_relaxed);
+  std::atomic_thread_fence(std::memory_order_release);
+  s.key.store(key, std::memory_order_relaxed);
+  s.chunk.store(handle, std::memory_order_relaxed);
+  s.expires.store(now + std::chrono::duration_cast<std::chrono::nanoseconds>(std::min(ttl, timeout_)).count(), std::memory_order_relaxed);
+  s.generation.store(generation, std::memory_order_relaxed);
+  s.cls.store(cls, std::memory_order_relaxed);
+  s.referenced.store(0, std::memory_order_relaxed);
+  s.seq.store(seq + 2, std::memory_order_release);
+
+  segment_->entries++;
+  segment_->bytes += c->size;
+  unlock();
+  return true;
+}
+
+/**
+  @brief Take a free chunk of a size class, carving a new slab, taking a slab from another class or evicting chunks of
+  the class if there is none. The chunk is returned pinned once, the reference the index takes over when it is stored.
+  Must be called with the mutex held.
+
+  @param[in]  cls  Size class
+
+  @return  Handle of the chunk, or SHARED_CACHE_NO_CHUNK if every chunk of the class is pinned by readers
+**/
+std::uint64_t SharedPageCache::allocate(unsigned cls) {
+  bool reassigned = false;
+  while (true) {
+    if (segment_->free_list[cls] != SHARED_CACHE_NO_CHUNK) {
+      std::uint64_t handle     = segment_->free_list[cls];
+      Pin          &p          = pin(handle);
+      segment_->free_list[cls] = chunk(handle)->next;
+      p.generation.store(p.generation.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+      p.refs.store(1, std::memory_order_release);
+      return handle;
+    }
+    if (segment_->slabs_carved < segment_->slabs) {
+      carve(segment_->slabs_carved++, cls);
+      continue;
+    }
+    // A class with no slab, or one that evicted a slab's worth of chunks, takes a slab from another class first
+    if (!reassigned && (segment_->class_slabs[cls] == 0 || segment_->pressure[cls] >= SHARED_CACHE_SLAB_SIZE)) {
+      reassigned               = true;
+      bool taken               = reassign(cls);
+      segment_->pressure[cls] = 0;
+      if (taken) continue;
+    }
+    if (evict(cls)) continue;
+    if (reassigned || !reassign(cls)) return SHARED_CACHE_NO_CHUNK;
+    reassigned = true;
+  }
+}
+
+/**
+  @brief Evict entries of a size class until one of its chunks is free. The sweep clears the referenced bit of entries
+  hit since it last passed them, and evicts the first expired or unreferenced one. Must be called with the mutex held.
+
+  @param[in]  cls  Size class
+
+  @return  True if a chunk of the class is free
+**/
+bool SharedPageCache::evict(unsigned cls) {
+  std::uint64_t now = now_ns();
+  for (std::uint64_t step = 0; step < 2 * segment_->slots; step++) {
+    Slot &s = *slot(segment_->clock_hand++);
+    if (s.key.load(std::memory_order_relaxed) == 0 || s.cls.load(std::memory_order_relaxed) != cls) continue;
+    if (s.expires.load(std::memory_order_relaxed) > now && s.referenced.exchange(0, std::memory_order_relaxed)) continue;
+    segment_->evictions++;
+    segment_->pressure[cls] += segment_->class_size[cls];
+    remove(s);
+    if (segment_->free_list[cls] != SHARED_CACHE_NO_CHUNK) return true;
+  }
+  return segment_->free_list[cls] != SHARED_CACHE_NO_CHUNK;
+}
+
+/**
+  @brief Move a slab to a size class from one that has more than one slab and evicted less since it last took one.
+  Must be called with the mutex held.
+
+  @param[in]  cls  Size class taking the slab
+
+  @return  True if a slab was split into free chunks of the class
+**/
+bool SharedPageCache::reassign(unsigned cls) {
+  for (std::uint64_t step = 0; step < segment_->slabs_carved; step++) {
+    std::uint64_t index = segment_->slab_hand++ % segment_->slabs_carved;
+    unsigned      from  = slab(index)->cls;
+    if (from == cls || segment_->class_slabs[from] <= 1) continue;
+    if (segment_->class_slabs[cls] != 0 && segment_->pressure[from] >= segment_->pressure[cls]) continue;
+    if (!vacate(index)) continue;
+
+    // Unlink the slab's chunks from the free list of its class, they all are on it now
+    std::uint64_t *link = &segment_->free_list[from];
+    while (*link != SHARED_CACHE_NO_CHUNK) {
+      if (*link / SHARED_CACHE_SLAB_CHUNKS == index) *link = chunk(*link)->next;
+      else link = &chunk(*link)->next;
+    }
+    segment_->class_slabs[from]--;
+    carve(index, cls);
+    segment_->reassignments++;
+    // Older evictions weigh less in the next choice
+    for (unsigned c = 0; c < segment_->classes; c++) segment_->pressure[c] /= 2;
+    return true;
+  }
+  return false;
+}
+
+/**
+  @brief Evict every entry stored in a slab, unless one of its chunks is pinned by a reader or by a store copying into
+  it. Must be called with the mutex held.
+
+  @param[in]  index  Index of the slab
+
+  @return  True if every chunk of the slab is free
+**/
+bool SharedPageCache::vacate(std::uint64_t index) {
+  std::uint64_t first  = index * SHARED_CACHE_SLAB_CHUNKS;
+  std::uint64_t chunks = SHARED_CACHE_SLAB_SIZE / segment_->class_size[slab(index)->cls];
+
+  // A chunk in use must only be referenced by the slot it was stored in
+  for (std::uint64_t i = 0; i < chunks; i++) {
+    Pin          &p    = pin(first + i);
+    std::uint32_t refs = p.refs.load(std::memory_order_relaxed);
+    if (refs == 0) continue;
+    Slot &s = *slot(chunk(first + i)->slot);
+    if (refs > 1 || s.key.load(std::memory_order_relaxed) == 0 || s.chunk.load(std::memory_order_relaxed) != first + i ||
+        s.generation.load(std::memory_order_relaxed) != p.generation.load(std::memory_order_relaxed))
+      return false;
+  }
+  for (std::uint64_t i = 0; i < chunks; i++) {
+    if (pin(first + i).refs.load(std::memory_order_relaxed) == 0) continue;
+    segment_->evictions++;
+    remove(*slot(chunk(first + i)->slot));
+  }
+  // A reader may have pinned a chunk before its slot was cleared, the chunk is freed when it is done
+  for (std::uint64_t i = 0; i < chunks; i++) {
+    if (pin(first + i).refs.load(std::memory_order_acquire) != 0) return false;
+  }
+  return true;
+}
+
+/**
+  @brief Split a slab into free chunks of a size class. Must be called with the mutex held.
+
+  @param[in]  index  Index of the slab, with no chunk in use
+  @param[in]  cls    Size class
+**/
+void SharedPageCache::carve(std::uint64_t index, unsigned cls) {
+  slab(index)->cls = cls;
+  segment_->class_slabs[cls]++;
+  for (std::uint64_t i = SHARED_CACHE_SLAB_SIZE / segment_->class_size[cls]; i-- > 0;) {
+    std::uint64_t handle     = index * SHARED_CACHE_SLAB_CHUNKS + i;
+    Chunk        *c          = new (chunk(handle)) Chunk;
+    c->next                  = segment_->free_list[cls];
+    segment_->free_list[cls] = handle;
+  }
+}
+
+/**
+  @brief Clear a slot and drop the index's reference to its chunk. Must be called with the mutex held.
+**/
+void SharedPageCache::remove(Slot &s) {
+  std::uint64_t handle = s.chunk.load(std::memory_order_relaxed);
+  std::uint32_t seq    = s.seq.load(std::memory_order_relaxed);
+  s.seq.store(seq + 1, std::memory_order_relaxed);
+  std::atomic_thread_fence(std::memory_order_release);
+  s.key.store(0, std::memory_order_relaxed);
+  s.seq.store(seq + 2, std::memory_order_release);
+
+  segment_->entries--;
+  segment_->bytes -= chunk(handle)->size;
+  release_locked(handle);
+}
+
+/**
+  @brief Drop a reader's reference to a chunk, freeing it if it was evicted in the meantime. The last reference is only
+  dropped under the mutex, so a chunk with no reference is always on its free list.
+**/
+void SharedPageCache::release(std::uint64_t handle) {
+  Pin          &p    = pin(handle);
+  std::uint32_t refs = p.refs.load(std::memory_order_relaxed);
+  while (refs > 1) {
+    if (p.refs.compare_exchange_weak(refs, refs - 1, std::memory_order_acq_rel, std::memory_order_relaxed)) return;
+  }
+  lock();
+  release_locked(handle);
+  unlock();
+}
+
+void SharedPageCache::release_locked(std::uint64_t handle) {
+  if (pin(handle).refs.fetch_sub(1, std::memory_order_acq_rel) != 1) return;
+  unsigned cls             = slab(handle / SHARED_CACHE_SLAB_CHUNKS)->cls;
+  chunk(handle)->next      = segment_->free_list[cls];
+  segment_->free_list[cls] = handle;
+}
+
+/**
+  @brief Lock the mutex. If its previous owner died while writing a slot, the slot is cleared; its chunk is lost
+  until the proxy restarts.
+**/
+void SharedPageCache::lock() {
+  if (pthread_mutex_lock(&mutex()) != EOWNERDEAD) return;
+  log("A worker died holding the shared page cache lock, recovering");
+  for (std::uint64_t i = 0; i < segment_->slots; i++) {
+    Slot         &s   = *slot(i);
+    std::uint32_t seq = s.seq.load(std::memory_order_relaxed);
+    if (!(seq & 1)) continue;
+    s.key.store(0, std::memory_order_relaxed);
+    s.seq.store(seq + 1, std::memory_order_release);
+  }
+  pthread_mutex_consistent(&mutex());
+}
+
+pthread_mutex_t &SharedPageCache::mutex() const { return segment_->mutex; }
+
+SharedPageCache::Slot *SharedPageCache::slot(std::uint64_t index) const {
+  return reinterpret_cast<Slot *>(base_ + segment_->slots_offset) + (index & (segment_->slots - 1));
+}
+
+SharedPageCache::Slab *SharedPageCache::slab(std::uint64_t index) const {
+  return reinterpret_cast<Slab *>(base_ + segment_->slabs_offset) + index;
+}
+
+SharedPageCache::Pin &SharedPageCache::pin(std::uint64_t handle) const {
+  return slab(handle / SHARED_CACHE_SLAB_CHUNKS)->pins[handle % SHARED_CACHE_SLAB_CHUNKS];
+}
+
+// The slab of a pinned chunk keeps its size class, so the chunk stays where its handle says
+SharedPageCache::Chunk *SharedPageCache::chunk(std::uint64_t handle) const {
+  std::uint64_t index = handle / SHARED_CACHE_SLAB_CHUNKS;
+  std::uint64_t rank  = handle % SHARED_CACHE_SLAB_CHUNKS;
+  return reinterpret_cast<Chunk *>(base_ + segment_->arena_offset + index * SHARED_CACHE_SLAB_SIZE +
+                                   rank * segment_->class_size[slab(index)->cls]);
+}
+
+std::uint64_t SharedPageCache::entries() const { return segment_ ? segment_->entries.load() : 0; }
+
+std::uint64_t SharedPageCache::bytes() const { return segment_ ? segment_->bytes.load() : 0; }
+
+std::uint64_t SharedPageCache::evictions() const { return segment_ ? segment_->evictions.load() : 0; }
+
+std::uint64_t SharedPageCache::reassignments() const { return segment_ ? segment_->reassignments.load() : 0; }
+
+/**
+  @brief Get the process-wide shared page cache, which is disabled until it is opened
+
+  @return  SharedPageCache&  Process-wide shared page cache
+**/
+SharedPageCache &SharedPageCache::global() {
+  static SharedPageCache cache;
+  return cache;
+}
@@ -1,5 +1,6 @@
 #include "Signaler.h"
 
 volatile std::atomic<bool> Signaler::done{false};
+volatile std::atomic<bool> Signaler::draining{false};
 volatile std::atomic<int>  Signaler::num_threads{0};
 std::recursive_mutex       Signaler::io_mutex{};
@@ -0,0 +1,97 @@
+#include "SocketOptions.h"
+
+#include <cstdlib>
+#include <cstring>
+
+const char *to_string(SocketRole role) {
+  switch (role) {
+    case SocketRole::Listener: return "listener";
+    case SocketRole::Client: return "client";
+    case SocketRole::Upstream: return "upstream";
+  }
+  return "unknown";
+}
+
+SocketOptions::SocketOptions() {
+  profiles_[static_cast<int>(SocketRole::Client)].nodelay   = true;
+  profiles_[static_cast<int>(SocketRole::Upstream)].nodelay = true;
+}
+
+/**
+  @brief Set a socket option from a command line option
+
+  @param[in]  option  Option of the form `<role>.<name>=<value>`, where role is one of listener, client or upstream,
+                      and name is one of nodelay, fastopen (listener and upstream), defer_accept (listener),
+                      notsent_lowat, rcvbuf, sndbuf, keepalive, keepalive_interval or keepalive_count
+
+  @return  True if the option was valid
+**/
+bool SocketOptions::parse(const std::string &option) {
+  size_t dot = option.find('.'), eq = option.find('=');
+  if (dot == std::string::npos || eq == std::string::npos || dot > eq) return false;
+
+  std::string role_name = option.substr(0, dot), name = option.substr(dot + 1, eq - dot - 1);
+  char       *end       = nullptr;
+  long        value     = std::strtol(option.c_str() + eq + 1, &end, 10);
+  if (end == option.c_str() + eq + 1 || *end != '\0' || value < 0 || value > INT32_MAX) return false;
+
+  SocketRole role;
+  if (role_name == "listener") role = SocketRole::Listener;
+  else if (role_name == "client") role = SocketRole::Client;
+  else if (role_name == "upstream") role = SocketRole::Upstream;
+  else return false;
+
+  SocketProfile &p = profiles_[static_cast<int>(role)];
+  int            v = static_cast<int>(value);
+  if (name == "nodelay") p.nodelay = v != 0;
+  else if (name == "fastopen" && role != SocketRole::Client) p.fastopen = v;
+  else if (name == "defer_accept" && role == SocketRole::Listener) p.defer_accept = v;
+  else if (name == "notsent_lowat") p.notsent_lowat = v;
+  else if (name == "rcvbuf") p.rcvbuf = v;
+  else if (name == "sndbuf") p.sndbuf = v;
+  else if (name == "keepalive") p.keepalive = v;
+  else if (name == "keepalive_interval") p.keepalive_interval = v;
+  else if (name == "keepalive_count") p.keepalive_count = v;
+  else return false;
+  return true;
+}
+
+/**
+  @brief Apply the profile of a role to a socket. Listener options must be applied before listen(), and upstream
+  options before connect(). Failures are logged and otherwise ignored, since every option is only an optimization.
+
+  @param[in]  fd    Socket
+  @param[in]  role  Role of the socket
+**/
+void SocketOptions::apply(int fd, SocketRole role) const {
+  const SocketProfile &p   = profile(role);
+  auto                 set = [fd, role](int level, int name, int value, const char *what) {
+    if (setsockopt(fd, level, name, &value, sizeof(value)) < 0) {
+      log("Error setting %s on %s socket %d: %s", what, to_string(role), fd, strerror(errno));
+    }
+  };
+
+  if (p.nodelay) set(IPPROTO_TCP, TCP_NODELAY, 1, "TCP_NODELAY");
+  if (p.fastopen > 0 && role == SocketRole::Listener) set(IPPROTO_TCP, TCP_FASTOPEN, p.fastopen, "TCP_FASTOPEN");
+  if (p.fastopen > 0 && role == SocketRole::Upstream) set(IPPROTO_TCP, TCP_FASTOPEN_CONNECT, 1, "TCP_FASTOPEN_CONNECT");
+  if (p.defer_accept > 0) set(IPPROTO_TCP, TCP_DEFER_ACCEPT, p.defer_accept, "TCP_DEFER_ACCEPT");
+  if (p.notsent_lowat > 0) set(IPPROTO_TCP, TCP_NOTSENT_LOWAT, p.notsent_lowat, "TCP_NOTSENT_LOWAT");
+  if (p.rcvbuf > 0) set(SOL_SOCKET, SO_RCVBUF, p.rcvbuf, "SO_RCVBUF");
+  if (p.sndbuf > 0) set(SOL_SOCKET, SO_SNDBUF, p.sndbuf, "SO_SNDBUF");
+  if (p.keepalive > 0) {
+    set(SOL_SOCKET, SO_KEEPALIVE, 1, "SO_KEEPALIVE");
+    set(IPPROTO_TCP, TCP_KEEPIDLE, p.keepalive, "TCP_KEEPIDLE");
+  }
+  if (p.keepalive_interval > 0) set(IPPROTO_TCP, TCP_KEEPINTVL, p.keepalive_interval, "TCP_KEEPINTVL");
+  if (p.keepalive_count > 0) set(IPPROTO_TCP, TCP_KEEPCNT, p.keepalive_count, "TCP_KEEPCNT");
+}
+
+/**
+  @brief Get the process-wide socket options, used for every socket the proxy opens or accepts
+
+  @return  SocketOptions&  Process-wide socket options
+**/
+SocketOptions &SocketOptions::global() {
+  static SocketOptions options;
+  return options;
+}
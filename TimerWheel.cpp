@@ -0,0 +1,258 @@
+#include "TimerWheel.h"
+
+/**
+  @brief Set a timeout from a command line option
+
+  @param[in]  option  Option of the form `<name>=<seconds>`, where name is one of idle, header, upstream, tunnel,
+                      prefetch or drain
+
+  @return  True if the option was valid
+**/
+bool Timeouts::parse(const std::string &option) {
+  size_t eq = option.find('=');
+  if (eq == std::string::npos) return false;
+
+  std::string name    = option.substr(0, eq);
+  char       *end     = nullptr;
+  double      seconds = std::strtod(option.c_str() + eq + 1, &end);
+  if (end == option.c_str() + eq + 1 || *end != '\0' || seconds <= 0) return false;
+
+  std::chrono::milliseconds value{static_cast<std::int64_t>(seconds * 1000)};
+  if (name == "idle") idle = value;
+  else if (name == "header") header = value;
+  else if (name == "upstream") upstream = value;
+  else if (name == "tunnel") tunnel_idle = value;
+  else if (name == "prefetch") prefetch = value;
+  else if (name == "drain") drain = value;
+  else return false;
+  return true;
+}
+
+/**
+  @brief Get the process-wide timeouts, used by every connection and prefetcher
+
+  @return  Timeouts&  Process-wide timeouts
+**/
+Timeouts &Timeouts::global() {
+  static Timeouts timeouts;
+  return timeouts;
+}
+
+Timer::~Timer() {
+  if (wheel_) wheel_->cancel(*this);
+}
+
+TimerWheel::TimerWheel(std::chrono::milliseconds tick) : tick_(tick), start_(myclock::now()) {}
+
+TimerWheel::~TimerWheel() { stop(); }
+
+/**
+  @brief Get the process-wide timer wheel, starting its thread on first use
+
+  The wheel is never destroyed, so detached connection threads can still cancel their timers while the process exits.
+
+  @return  TimerWheel&  Process-wide timer wheel
+**/
+TimerWheel &TimerWheel::global() {
+  static TimerWheel *wheel = [] {
+    TimerWheel *w = new TimerWheel();
+    w->start();
+    return w;
+  }();
+  return *wheel;
+}
+
+/**
+  @brief Arm a timer, or re-arm it if it is already armed
+
+  May be called from a timer callback, e.g. to extend the timer that is firing.
+
+  @param[in]  timer    Timer to arm
+  @param[in]  timeout  Time from now until the timer expires, rounded up to the next tick
+**/
+void TimerWheel::arm(Timer &timer, std::chrono::milliseconds timeout) {
+  std::lock_guard<std::recursive_mutex> lock(mutex_);
+  if (timer.armed_) {
+    unlink(timer);
+    size_--;
+  }
+  std::uint64_t ticks = (std::max<std::int64_t>(timeout.count(), 0) + tick_.count() - 1) / tick_.count();
+  timer.wheel_        = this;
+  timer.armed_        = true;
+  timer.timeout_      = timeout;
+  timer.expires_      = current_ + std::max<std::uint64_t>(ticks, 1);
+  timer.expired_      = false;
+  timer.touched_      = false;
+  insert(timer);
+  size_++;
+}
+
+/**
+  @brief Cancel a timer. Once this returns, the timer's callback is not running and will not run.
+
+  @param[in]  timer  Timer to cancel, may already have expired
+**/
+void TimerWheel::cancel(Timer &timer) {
+  std::lock_guard<std::recursive_mutex> lock(mutex_);
+  if (!timer.armed_) return;
+  unlink(timer);
+  timer.armed_ = false;
+  size_--;
+}
+
+/**
+  @brief Turn the wheel up to the given time, firing every timer that is due
+
+  @param[in]  now  Current time
+**/
+void TimerWheel::advance(time_point now) {
+  std::lock_guard<std::recursive_mutex> lock(mutex_);
+  std::uint64_t                         target = (now - start_) / tick_;
+
+  while (current_ < target) {
+    current_++;
+    // Move timers down from higher levels whenever the level below wraps around
+    for (int level = 1; level < TIMER_WHEEL_LEVELS; level++) {
+      if (current_ & ((std::uint64_t{1} << (TIMER_WHEEL_BITS * level)) - 1)) break;
+      cascade(level, (current_ >> (TIMER_WHEEL_BITS * level)) & (TIMER_WHEEL_SLOTS - 1));
+    }
+    fire(slots_[0][current_ & (TIMER_WHEEL_SLOTS - 1)]);
+  }
+}
+
+/**
+  @brief Fire every armed timer immediately, used to wake up all connections when the server shuts down
+**/
+void TimerWheel::expire_all() {
+  std::lock_guard<std::recursive_mutex> lock(mutex_);
+  for (auto &level : slots_) {
+    for (auto &slot : level) {
+      for (TimerNode *node = slot.next; node != &slot; node = node->next) static_cast<Timer *>(node)->touched_ = false;
+      fire(slot);
+    }
+  }
+}
+
+/**
+  @brief Fire every armed timer marked with `expire_on_drain()`, used when the server starts draining
+**/
+void TimerWheel::drain() {
+  std::lock_guard<std::recursive_mutex> lock(mutex_);
+  TimerNode                             draining;
+  for (auto &level : slots_) {
+    for (auto &slot : level) {
+      for (TimerNode *node = slot.next, *next; node != &slot; node = next) {
+        next = node->next;
+        if (!static_cast<Timer *>(node)->drain_) continue;
+        static_cast<Timer *>(node)->touched_ = false;
+        unlink(*node);
+        push_back(draining, *node);
+      }
+    }
+  }
+  fire(draining);
+}
+
+size_t TimerWheel::size() const {
+  std::lock_guard<std::recursive_mutex> lock(mutex_);
+  return size_;
+}
+
+void TimerWheel::start() {
+  if (thread_.joinable()) return;
+  stop_   = false;
+  thread_ = std::thread(&TimerWheel::run, this);
+}
+
+void TimerWheel::stop() {
+  stop_ = true;
+  if (thread_.joinable()) thread_.join();
+}
+
+/**
+  @brief Put a timer in the slot for its expiry time, on the lowest level whose range covers it
+**/
+void TimerWheel::insert(Timer &timer) {
+  const std::uint64_t range = std::uint64_t{1} << (TIMER_WHEEL_BITS * TIMER_WHEEL_LEVELS);
+  if (timer.expires_ < current_) timer.expires_ = current_;
+  if (timer.expires_ - current_ >= range) timer.expires_ = current_ + range - 1;
+
+  std::uint64_t delta = timer.expires_ - current_;
+  int           level = 0;
+  while (level < TIMER_WHEEL_LEVELS - 1 && delta >= (std::uint64_t{1} << (TIMER_WHEEL_BITS * (level + 1)))) level++;
+  size_t slot = (timer.expires_ >> (TIMER_WHEEL_BITS * level)) & (TIMER_WHEEL_SLOTS - 1);
+  push_back(slots_[level][slot], timer);
+}
+
+/**
+  @brief Re-insert the timers of a slot, which moves them to a lower level now that they are closer to expiring
+**/
+void TimerWheel::cascade(int level, size_t slot) {
+  TimerNode &list = slots_[level][slot];
+  TimerNode  pending;
+  if (list.next == &list) return;
+
+  // Detach the whole list first, since timers may be re-inserted into the same slot
+  pending.next       = list.next;
+  pending.prev       = list.prev;
+  pending.next->prev = &pending;
+  pending.prev->next = &pending;
+  list.next = list.prev = &list;
+
+  while (pending.next != &pending) {
+    Timer &timer = static_cast<Timer &>(*pending.next);
+    unlink(timer);
+    insert(timer);
+  }
+}
+
+/**
+  @brief Expire all timers in a list and run their callbacks
+**/
+void TimerWheel::fire(TimerNode &list) {
+  TimerNode expired;
+  if (list.next == &list) return;
+
+  // Callbacks may arm or cancel other timers, so take the timers from a detached list one at a time
+  expired.next       = list.next;
+  expired.prev       = list.prev;
+  expired.next->prev = &expired;
+  expired.prev->next = &expired;
+  list.next = list.prev = &list;
+
+  while (expired.next != &expired) {
+    Timer &timer = static_cast<Timer &>(*expired.next);
+    unlink(timer);
+    if (timer.touched_.exchange(false)) {
+      // Active since it was armed, start another period
+      timer.expires_ = current_ + std::max<std::uint64_t>((timer.timeout_.count() + tick_.count() - 1) / tick_.count(), 1);
+      insert(timer);
+      continue;
+    }
+    timer.armed_   = false;
+    timer.expired_ = true;
+    size_--;
+    if (timer.callback_) timer.callback_();
+  }
+}
+
+void TimerWheel::run() {
+  while (!stop_) {
+    std::this_thread::sleep_for(tick_);
+    if (Signaler::done) expire_all();
+    advance(myclock::now());
+  }
+}
+
+void TimerWheel::unlink(TimerNode &node) {
+  node.prev->next = node.next;
+  node.next->prev = node.prev;
+  node.prev = node.next = &node;
+}
+
+void TimerWheel::push_back(TimerNode &list, TimerNode &node) {
+  node.prev       = list.prev;
+  node.next       = &list;
+  list.prev->next = &node;
+  list.prev       = &node;
+}
@@ -0,0 +1,244 @@
+#include "TinyLFU.h"
+
+#include <algorithm>
+
+// Rows of the sketch, each indexed by its own hash of the key
+#define SKETCH_DEPTH 4
+// Largest value of a 4-bit counter
+#define SKETCH_MAX_COUNT 15
+
+static const std::uint64_t SKETCH_SEEDS[SKETCH_DEPTH] = {0xc3a5c85c97cb3127ULL, 0xb492b66fbe98f273ULL, 0x9ae16a3b2f90404fULL,
+                                                         0xcbf29ce484222325ULL};
+
+/**
+  @brief Size the sketch for a cache, resetting every counter
+
+  @param[in]  capacity  Number of pages of the cache
+**/
+void FrequencySketch::resize(size_t capacity) {
+  width_ = 16;
+  while (width_ < capacity) width_ <<= 1;
+  table_.assign(SKETCH_DEPTH * width_ / 2, 0);
+  samples_     = 0;
+  sample_size_ = TINYLFU_SAMPLE_FACTOR * std::max<size_t>(capacity, 1);
+}
+
+/**
+  @brief Count an access to a key
+
+  @param[in]  hash  Hash of the key
+**/
+void FrequencySketch::increment(std::uint64_t hash) {
+  if (table_.empty()) return;
+  for (unsigned row = 0; row < SKETCH_DEPTH; row++) {
+    size_t        i     = counter(hash, row);
+    std::uint8_t &byte  = table_[i >> 1];
+    unsigned      shift = (i & 1) * 4;
+    if (((byte >> shift) & 0xF) < SKETCH_MAX_COUNT) byte += 1 << shift;
+  }
+  if (++samples_ >= sample_size_) age();
+}
+
+/**
+  @brief Estimate how often a key was accessed recently
+
+  @param[in]  hash  Hash of the key
+
+  @return  Estimated number of accesses, at most 15
+**/
+unsigned FrequencySketch::frequency(std::uint64_t hash) const {
+  if (table_.empty()) return 0;
+  unsigned frequency = SKETCH_MAX_COUNT;
+  for (unsigned row = 0; row < SKETCH_DEPTH; row++) {
+    size_t i  = counter(hash, row);
+    frequency = std::min<unsigned>(frequency, (table_[i >> 1] >> ((i & 1) * 4)) & 0xF);
+  }
+  return frequency;
+}
+
+size_t FrequencySketch::counter(std::uint64_t hash, unsigned row) const {
+  std::uint64_t h = (hash + SKETCH_SEEDS[row]) * SKETCH_SEEDS[row];
+  h ^= h >> 32;
+  return row * width_ + (h & (width_ - 1));
+}
+
+// Halve every counter, both counters of a byte at once
+void FrequencySketch::age() {
+  for (auto &byte : table_) byte = (byte >> 1) & 0x77;
+  samples_ /= 2;
+}
+
+/**
+  @brief Enable the policy, should be called once before any ProxyConnection objects are created
+
+  @param[in]  capacity  Most pages in the page cache, 0 to cache every page until it expires
+  @param[in]  timeout   Cache timeout, after which the page cache expires a page, 0 if pages do not expire
+**/
+void TinyLFU::configure(size_t capacity, std::chrono::seconds timeout) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  capacity_           = capacity;
+  timeout_            = timeout;
+  window_capacity_    = std::max<size_t>(1, capacity * TINYLFU_WINDOW_PERCENT / 100);
+  protected_capacity_ = (capacity - std::min(capacity, window_capacity_)) * TINYLFU_PROTECTED_PERCENT / 100;
+  sketch_.resize(capacity);
+  window_.clear();
+  probation_.clear();
+  protected_.clear();
+  index_.clear();
+  insertions_.clear();
+}
+
+/**
+  @brief Count a request for a page, and mark the page as recently used if it is cached
+
+  @param[in]  key  Key of the requested page
+**/
+void TinyLFU::access(const URIKey &key) {
+  if (!enabled()) return;
+  std::lock_guard<std::mutex> lock(mutex_);
+  sketch_.increment(key.hash());
+  auto it = index_.find(key);
+  if (it != index_.end()) promote(it->second);
+}
+
+/**
+  @brief Add a page to the window, and pick the pages to evict to stay within the capacity
+
+  @param[in]   key      Key of the page to insert
+  @param[out]  evicted  Keys of the pages to remove from the cache, appended to. May be the page pushed out of the
+                        window, if it lost against the main region's victim.
+**/
+void TinyLFU::admit(const URIKey &key, std::vector<URIKey> &evicted) {
+  if (!enabled()) return;
+  std::lock_guard<std::mutex> lock(mutex_);
+  time_point                  now = myclock::now();
+  expire(now);
+  if (timeout_.count() > 0) insertions_.push_back({key, now});
+  auto it = index_.find(key);
+  if (it != index_.end()) {
+    it->second->admitted = now;
+    promote(it->second);
+    return;
+  }
+  window_.push_front({key, Region::Window, now});
+  index_.emplace(key, window_.begin());
+  if (window_.size() > window_capacity_) evict_window(evicted);
+}
+
+/**
+  @brief Insert a page into the page cache through the policy, or straight into the cache if the policy is disabled
+
+  @param[in]  cache     Page cache
+  @param[in]  key       Key of the page
+  @param[in]  response  Page to insert
+**/
+void TinyLFU::put(Cache<HTTPResponse, URIKey> &cache, const URIKey &key, const HTTPResponse &response) {
+  std::vector<URIKey> evicted;
+  admit(key, evicted);
+  for (const auto &victim : evicted) cache.remove(victim);
+  cache.put(key, response);
+}
+
+/**
+  @brief Forget a page that left the cache without being evicted by the policy, because it expired or was removed
+
+  @param[in]  key     Key of the page
+  @param[in]  before  Time the page was found gone, the page is kept if it was inserted again since
+**/
+void TinyLFU::remove(const URIKey &key, time_point before) {
+  if (!enabled()) return;
+  std::lock_guard<std::mutex> lock(mutex_);
+  auto                        it = index_.find(key);
+  if (it != index_.end() && it->second->admitted < before) erase(it);
+}
+
+/**
+  @return  Number of pages tracked by the policy
+**/
+size_t TinyLFU::size() {
+  std::lock_guard<std::mutex> lock(mutex_);
+  expire(myclock::now());
+  return index_.size();
+}
+
+// Move an entry to the front of its segment, a hit in probation moves it to the protected segment
+void TinyLFU::promote(List::iterator it) {
+  switch (it->region) {
+    case Region::Window:
+      window_.splice(window_.begin(), window_, it);
+      break;
+    case Region::Protected:
+      protected_.splice(protected_.begin(), protected_, it);
+      break;
+    case Region::Probation:
+      it->region = Region::Protected;
+      protected_.splice(protected_.begin(), probation_, it);
+      if (protected_.size() > protected_capacity_) {
+        auto demoted    = std::prev(protected_.end());
+        demoted->region = Region::Probation;
+        probation_.splice(probation_.begin(), protected_, demoted);
+      }
+      break;
+  }
+}
+
+// Forget the pages the page cache expired, those inserted a cache timeout ago and not inserted again since
+void TinyLFU::expire(time_point now) {
+  while (!insertions_.empty() && insertions_.front().admitted + timeout_ <= now) {
+    auto it = index_.find(insertions_.front().key);
+    if (it != index_.end() && it->second->admitted == insertions_.front().admitted) erase(it);
+    insertions_.pop_front();
+  }
+}
+
+void TinyLFU::erase(std::unordered_map<URIKey, List::iterator>::iterator it) {
+  segment(it->second->region).erase(it->second);
+  index_.erase(it);
+}
+
+TinyLFU::List &TinyLFU::segment(Region region) {
+  switch (region) {
+    case Region::Window:
+      return window_;
+    case Region::Probation:
+      return probation_;
+    case Region::Protected:
+      break;
+  }
+  return protected_;
+}
+
+// Move the window's least recently used entry to the main region, if it is accessed more often than the main region's
+void TinyLFU::evict_window(std::vector<URIKey> &evicted) {
+  auto   candidate     = std::prev(window_.end());
+  size_t main_capacity = capacity_ - std::min(capacity_, window_capacity_);
+  if (probation_.size() + protected_.size() < main_capacity) {
+    candidate->region = Region::Probation;
+    probation_.splice(probation_.begin(), window_, candidate);
+    return;
+  }
+
+  List &victims = probation_.empty() ? protected_ : probation_;
+  if (!victims.empty() && sketch_.frequency(candidate->key.hash()) > sketch_.frequency(victims.back().key.hash())) {
+    auto victim = std::prev(victims.end());
+    evicted.push_back(victim->key);
+    index_.erase(victim->key);
+    victims.erase(victim);
+    candidate->region = Region::Probation;
+    probation_.splice(probation_.begin(), window_, candidate);
+    return;
+  }
+  evicted.push_back(candidate->key);
+  index_.erase(candidate->key);
+  window_.erase(candidate);
+}
+
+/**
+  @brief Get the process-wide admission policy of the page cache, disabled until it is configured
+
+  @return  TinyLFU&  Process-wide admission policy
+**/
+TinyLFU &TinyLFU::global() {
+  static TinyLFU policy;
+  return policy;
+}
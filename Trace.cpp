@@ -0,0 +1,233 @@
+#include "Trace.h"
+
+#include <condition_variable>
+#include <deque>
+#include <fstream>
+#include <thread>
+
+bool                      Trace::enabled = false;
+std::chrono::milliseconds Trace::threshold{0};
+std::string               Trace::dump_dir = ".";
+
+// Span times are relative to this point, so they fit Chrome's microsecond timestamps
+static const time_point          trace_epoch = myclock::now();
+static std::atomic<std::uint64_t> next_request{1};
+static thread_local std::uint64_t thread_request = 0;
+
+static std::mutex               rings_mutex;
+static std::vector<TraceRing *> all_rings, free_rings;
+
+// Spans of a slow request, copied out of its thread's ring to be written to a file
+struct TraceDump {
+  std::uint64_t          request;
+  unsigned               tid;
+  double                 seconds;
+  std::vector<TraceSpan> spans;
+};
+
+/**
+  Thread that writes the trace files of slow requests, so connection threads and reactors never block on the disk
+**/
+struct TraceWriter {
+  std::mutex              mutex;
+  std::condition_variable ready;
+  std::deque<TraceDump>   pending;
+
+  /**
+    @brief Get the writer, starting its thread on first use. Like the timer wheel, it is never destroyed, so the
+    detached thread can outlive static destructors; trace files still pending when the process exits are not written.
+  **/
+  static TraceWriter &global() {
+    static TraceWriter *writer = [] {
+      TraceWriter *w = new TraceWriter();
+      std::thread(&TraceWriter::run, w).detach();
+      return w;
+    }();
+    return *writer;
+  }
+
+  void run() {
+    std::unique_lock<std::mutex> lock(mutex);
+    while (true) {
+      ready.wait(lock, [this] { return !pending.empty(); });
+      TraceDump dump = std::move(pending.front());
+      pending.pop_front();
+      lock.unlock();
+
+      std::string   filename = Trace::dump_dir + "/trace-" + std::to_string(dump.request) + ".json";
+      std::ofstream file(filename);
+      file << Trace::chrome_json(dump.spans, dump.tid);
+      log("Slow request %llu took %f seconds, trace written to %s", (unsigned long long)dump.request, dump.seconds, filename.c_str());
+      lock.lock();
+    }
+  }
+};
+
+const char *to_string(TracePhase phase) {
+  static const char *names[] = {"request",      "request_header",  "parse",         "cache_lookup", "dns",   "connect",
+                                "upstream_send", "response_header", "response_body", "client_write", "tunnel"};
+  static_assert(sizeof(names) / sizeof(names[0]) == static_cast<size_t>(TracePhase::NumPhases), "missing phase name");
+  return phase < TracePhase::NumPhases ? names[static_cast<size_t>(phase)] : "unknown";
+}
+
+/**
+  @brief Start a new request on the calling thread, spans recorded until the next call belong to it
+
+  @return  ID of the request
+**/
+std::uint64_t Trace::begin_request() { return thread_request = next_request++; }
+
+/**
+  @brief Get the request the calling thread is recording spans for, to be restored when a coroutine that suspended
+  during the request is resumed
+
+  @return  ID of the request, 0 if there is none
+**/
+std::uint64_t Trace::current_request() { return thread_request; }
+
+/**
+  @brief Continue recording spans for a request on the calling thread, after another request ran on it
+
+  @param[in]  request  ID of the request from current_request()
+**/
+void Trace::resume_request(std::uint64_t request) { thread_request = request; }
+
+/**
+  @brief Record the whole-request span, and hand a copy of the request's spans to the writer thread if it took longer
+  than the threshold
+
+  @param[in]  start  Time the request started
+**/
+void Trace::end_request(time_point start) {
+  time_point end = myclock::now();
+  record_span(TracePhase::Request, start, end);
+  if (threshold.count() == 0 || end - start < threshold) return;
+
+  TraceDump    dump{thread_request, thread_ring().id, std::chrono::duration<double>(end - start).count(), request_spans(thread_request)};
+  TraceWriter &writer = TraceWriter::global();
+  bool         queued = false;
+  {
+    std::lock_guard<std::mutex> lock(writer.mutex);
+    if (writer.pending.size() < TRACE_MAX_PENDING_DUMPS) {
+      writer.pending.push_back(std::move(dump));
+      queued = true;
+    }
+  }
+  if (!queued) {
+    log("Slow request %llu took %f seconds, too many traces pending to write it", (unsigned long long)dump.request, dump.seconds);
+    return;
+  }
+  writer.ready.notify_one();
+}
+
+/**
+  @brief Write the spans of all threads as Chrome trace-event JSON, for chrome://tracing or Perfetto
+
+  Threads keep writing while the rings are read, so a span that is being overwritten may be reported inconsistently.
+
+  @return  std::string  Trace-event JSON
+**/
+std::string Trace::chrome_json() {
+  std::string out = "{\"traceEvents\":[";
+  bool        first = true;
+
+  std::lock_guard<std::mutex> lock(rings_mutex);
+  for (TraceRing *ring : all_rings) {
+    std::uint64_t head = ring->head.load(std::memory_order_acquire);
+    for (std::uint64_t i = head > TRACE_RING_SIZE ? head - TRACE_RING_SIZE : 0; i < head; i++) {
+      append_json(out, ring->spans[i % TRACE_RING_SIZE], ring->id, first);
+    }
+  }
+  out.append("]}\n");
+  return out;
+}
+
+/**
+  @brief Write the spans of one request recorded by the calling thread as Chrome trace-event JSON
+
+  @param[in]  request  ID of the request
+
+  @return  std::string  Trace-event JSON
+**/
+std::string Trace::chrome_json(std::uint64_t request) { return chrome_json(request_spans(request), thread_ring().id); }
+
+/**
+  @brief Write spans copied out of a ring as Chrome trace-event JSON
+
+  @param[in]  spans  Spans to write
+  @param[in]  tid    ID of the ring they were recorded in
+
+  @return  std::string  Trace-event JSON
+**/
+std::string Trace::chrome_json(const std::vector<TraceSpan> &spans, unsigned tid) {
+  std::string out = "{\"traceEvents\":[";
+  bool        first = true;
+  for (const TraceSpan &span : spans) append_json(out, span, tid, first);
+  out.append("]}\n");
+  return out;
+}
+
+/**
+  @brief Copy the spans of one request recorded by the calling thread out of its ring
+
+  @param[in]  request  ID of the request
+
+  @return  std::vector<TraceSpan>  Spans of the request, oldest first
+**/
+std::vector<TraceSpan> Trace::request_spans(std::uint64_t request) {
+  std::vector<TraceSpan> spans;
+  TraceRing             &ring = thread_ring();
+
+  std::uint64_t head = ring.head.load(std::memory_order_relaxed);
+  for (std::uint64_t i = head > TRACE_RING_SIZE ? head - TRACE_RING_SIZE : 0; i < head; i++) {
+    const TraceSpan &span = ring.spans[i % TRACE_RING_SIZE];
+    if (span.request == request) spans.push_back(span);
+  }
+  return spans;
+}
+
+void Trace::record_span(TracePhase phase, time_point start, time_point end) {
+  TraceRing    &ring = thread_ring();
+  std::uint64_t head = ring.head.load(std::memory_order_relaxed);
+  TraceSpan    &span = ring.spans[head % TRACE_RING_SIZE];
+  span.request       = thread_request;
+  span.start         = std::chrono::duration_cast<std::chrono::nanoseconds>(start - trace_epoch).count();
+  span.end           = std::chrono::duration_cast<std::chrono::nanoseconds>(end - trace_epoch).count();
+  span.phase         = phase;
+  ring.head.store(head + 1, std::memory_order_release);
+}
+
+/**
+  @brief Get the ring of the calling thread, taking one from the pool on first use and returning it on thread exit
+**/
+TraceRing &Trace::thread_ring() {
+  struct Holder {
+    TraceRing *ring;
+    Holder() {
+      std::lock_guard<std::mutex> lock(rings_mutex);
+      if (!free_rings.empty()) {
+        ring = free_rings.back();
+        free_rings.pop_back();
+      } else {
+        ring     = new TraceRing();
+        ring->id = all_rings.size() + 1;
+        all_rings.push_back(ring);
+      }
+    }
+    ~Holder() {
+      std::lock_guard<std::mutex> lock(rings_mutex);
+      free_rings.push_back(ring);
+    }
+  };
+  static thread_local Holder holder;
+  return *holder.ring;
+}
+
+void Trace::append_json(std::string &out, const TraceSpan &span, unsigned tid, bool &first) {
+  char buf[256];
+  snprintf(buf, sizeof(buf),
+           "%s\n{\"name\":\"%s\",\"cat\":\"webproxy\",\"ph\":\"X\",\"ts\":%.3f,\"dur\":%.3f,\"pid\":1,\"tid\":%u,\"args\":{\"request\":%llu}}",
+           first ? "" : ",", to_string(span.phase), span.start / 1e3, (span.end - span.start) / 1e3, tid, (unsigned long long)span.request);
+  out.append(buf);
+  first = false;
+}
@@ -0,0 +1,266 @@
+#include "URIKey.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cctype>
+#include <charconv>
+#include <cstdio>
+#include <mutex>
+#include <shared_mutex>
+#include <unordered_set>
+#include <vector>
+
+const std::string URIKey::empty_host_;
+
+static std::atomic<bool> sort_query_{false};
+
+// Hash of string_views and strings alike, so interned hosts are looked up without copying them
+struct HostHash {
+  using is_transparent = void;
+  size_t operator()(std::string_view host) const { return std::hash<std::string_view>()(host); }
+};
+
+/**
+  @brief Get the interned copy of a host, which lives as long as the process
+
+  @param[in]  host  Lowercased host
+
+  @return  Interned host, equal hosts always get the same pointer
+**/
+static const std::string *intern(std::string_view host) {
+  static std::shared_mutex                                          mutex;
+  static std::unordered_set<std::string, HostHash, std::equal_to<>> hosts;
+  // Requests of a connection usually go to the same host
+  thread_local const std::string                                   *last = nullptr;
+  if (last && *last == host) return last;
+
+  {
+    std::shared_lock<std::shared_mutex> lock(mutex);
+    auto                                it = hosts.find(host);
+    if (it != hosts.end()) return last = &*it;
+  }
+  std::unique_lock<std::shared_mutex> lock(mutex);
+  return last = &*hosts.emplace(host).first;
+}
+
+// 64-bit FNV-1a, fed a piece at a time
+static void fnv(std::uint64_t &h, std::string_view bytes) {
+  for (unsigned char c : bytes) {
+    h ^= c;
+    h *= 1099511628211ULL;
+  }
+}
+
+// Spread similar hashes apart, so their low bits differ too
+static std::uint64_t finalize(std::uint64_t h) {
+  h ^= h >> 33;
+  h *= 0xff51afd7ed558ccdULL;
+  h ^= h >> 33;
+  h *= 0xc4ceb9fe1a85ec53ULL;
+  h ^= h >> 33;
+  return h;
+}
+
+static int hex_value(char c) {
+  if (c >= '0' && c <= '9') return c - '0';
+  if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+  if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+  return -1;
+}
+
+static bool is_unreserved(char c) { return isalnum(static_cast<unsigned char>(c)) || c == '-' || c == '.' || c == '_' || c == '~'; }
+
+/**
+  @brief Append part of a URI with its percent-encoding normalized: escaped unreserved characters are decoded, and the
+  hex digits of the other escapes uppercased
+
+  @param[out]  out   String to append to
+  @param[in]   part  Part of the URI
+**/
+static void append_unescaped(std::string &out, std::string_view part) {
+  static const char *digits = "0123456789ABCDEF";
+  for (size_t i = 0; i < part.size(); i++) {
+    int high, low;
+    if (part[i] != '%' || i + 2 >= part.size() || (high = hex_value(part[i + 1])) < 0 || (low = hex_value(part[i + 2])) < 0) {
+      out += part[i];
+      continue;
+    }
+    char c = static_cast<char>(high * 16 + low);
+    if (is_unreserved(c)) out += c;
+    else {
+      out += '%';
+      out += digits[high];
+      out += digits[low];
+    }
+    i += 2;
+  }
+}
+
+/**
+  @brief Remove the "." and ".." segments of a path, as in RFC 3986 section 5.2.4
+
+  @param[in]  path  Path, with its percent-encoding normalized
+
+  @return  Path without dot segments
+**/
+static std::string remove_dot_segments(std::string_view path) {
+  std::string out;
+  out.reserve(path.size());
+  auto pop_segment = [&out]() {
+    size_t slash = out.rfind('/');
+    out.erase(slash == std::string::npos ? 0 : slash);
+  };
+  while (!path.empty()) {
+    if (path.starts_with("../")) path.remove_prefix(3);
+    else if (path.starts_with("./")) path.remove_prefix(2);
+    else if (path.starts_with("/./")) path.remove_prefix(2);
+    else if (path == "/.") path = "/";
+    else if (path.starts_with("/../")) {
+      path.remove_prefix(3);
+      pop_segment();
+    } else if (path == "/..") {
+      path = "/";
+      pop_segment();
+    } else if (path == "." || path == "..") path = {};
+    else {
+      size_t end = path.find('/', 1);
+      if (end == std::string_view::npos) end = path.size();
+      out.append(path.substr(0, end));
+      path.remove_prefix(end);
+    }
+  }
+  return out;
+}
+
+/**
+  @brief Build the key of a URI, normalizing it
+
+  @param[in]  uri  URI, as parsed from the request
+**/
+URIKey::URIKey(const ProxyURI &uri) : URIKey(uri, true) {}
+
+/**
+  @brief Build the key of the server of a URI, made of its host and port only, as used by the IP cache
+
+  @param[in]  uri  URI of a request to the server
+
+  @return  Key of the server
+**/
+URIKey URIKey::origin(const ProxyURI &uri) { return URIKey(uri, false); }
+
+URIKey::URIKey(const ProxyURI &uri, bool with_target) {
+  // Host: lowercased, without the trailing dot of a fully qualified name
+  std::string_view host = uri.host;
+  if (!host.empty() && host.back() == '.') host.remove_suffix(1);
+  if (std::any_of(host.begin(), host.end(), [](char c) { return c >= 'A' && c <= 'Z'; })) {
+    host_ = intern(lower(std::string(host)));
+  } else {
+    host_ = intern(host);
+  }
+
+  // Port: the default one if missing, 0 if invalid
+  port_ = URIKEY_DEFAULT_PORT;
+  if (!uri.port.empty()) {
+    auto result = std::from_chars(uri.port.data(), uri.port.data() + uri.port.size(), port_);
+    if (result.ec != std::errc() || result.ptr != uri.port.data() + uri.port.size()) port_ = 0;
+  }
+
+  // Path and query: percent-encoding, dot segments and optionally the order of the parameters
+  if (with_target) {
+    std::string_view target = uri.uri;
+    size_t           split  = std::min(target.find('?'), target.size());
+    std::string      path;
+    path.reserve(split);
+    append_unescaped(path, target.substr(0, split));
+    target_ = path.find("/.") == std::string::npos && !path.starts_with(".") ? std::move(path) : remove_dot_segments(path);
+    if (target_.empty() || target_[0] != '/') target_.insert(target_.begin(), '/');
+
+    if (split < target.size()) {
+      std::string_view query = target.substr(split + 1);
+      target_ += '?';
+      if (sort_query_.load(std::memory_order_relaxed) && query.find('&') != std::string_view::npos) {
+        std::vector<std::string_view> params;
+        for (size_t start = 0; start <= query.size();) {
+          size_t end = std::min(query.find('&', start), query.size());
+          if (end > start) params.push_back(query.substr(start, end - start));
+          start = end + 1;
+        }
+        std::sort(params.begin(), params.end());
+        for (size_t i = 0; i < params.size(); i++) {
+          if (i > 0) target_ += '&';
+          append_unescaped(target_, params[i]);
+        }
+      } else {
+        append_unescaped(target_, query);
+      }
+    }
+  }
+
+  rehash();
+}
+
+/**
+  @brief Build the key of a variant of the response to this key
+
+  @param[in]  variant  Hash of the values of the request headers the response varies on, not 0
+
+  @return  Key of the variant
+**/
+URIKey URIKey::with_variant(std::uint64_t variant) const {
+  URIKey key(*this);
+  key.variant_ = variant;
+  key.rehash();
+  return key;
+}
+
+// The hash is that of str(), fed a piece at a time
+void URIKey::rehash() {
+  char          port[8], variant[17];
+  char         *port_end = std::to_chars(port, port + sizeof(port), port_).ptr;
+  std::uint64_t h        = 14695981039346656037ULL;
+  fnv(h, "http://");
+  fnv(h, *host_);
+  fnv(h, ":");
+  fnv(h, std::string_view(port, port_end - port));
+  fnv(h, target_);
+  if (variant_ != 0) {
+    snprintf(variant, sizeof(variant), "%016llx", (unsigned long long)variant_);
+    fnv(h, "#");
+    fnv(h, std::string_view(variant, 16));
+  }
+  hash_ = finalize(h);
+}
+
+/**
+  @brief Sort the query parameters of the keys built from now on, set from the command line with `-q`
+
+  @param[in]  enabled  Whether to sort query parameters
+**/
+void URIKey::sort_query(bool enabled) { sort_query_.store(enabled, std::memory_order_relaxed); }
+
+/**
+  @return  Canonical absolute URI of the key, followed by `#` and the hex variant for a variant
+**/
+std::string URIKey::str() const {
+  std::string out = "http://" + *host_ + ":" + std::to_string(port_) + target_;
+  if (variant_ != 0) {
+    char variant[18];
+    snprintf(variant, sizeof(variant), "#%016llx", (unsigned long long)variant_);
+    out += variant;
+  }
+  return out;
+}
+
+/**
+  @brief Hash bytes the way keys are hashed: 64-bit FNV-1a, followed by a finalizer. The hash must not change between
+  builds, since it is shared by processes and by the members of a cache cluster.
+
+  @param[in]  bytes  Bytes to hash
+
+  @return  Hash of the bytes, equal to the hash of a key whose str() they are
+**/
+std::uint64_t URIKey::hash(std::string_view bytes) {
+  std::uint64_t h = 14695981039346656037ULL;
+  fnv(h, bytes);
+  return finalize(h);
+}
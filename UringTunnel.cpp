@@ -0,0 +1,284 @@
+#include "UringTunnel.h"
+#include "Metrics.h"
+
+// user_data tags, the direction is stored in the low byte
+#define TUNNEL_TAG_RECV (1 << 8)
+#define TUNNEL_TAG_SEND (2 << 8)
+#define TUNNEL_TAG_TICK (3 << 8)
+#define TUNNEL_TAG_PROVIDE (4 << 8)
+#define TUNNEL_TAG_REMOVE (5 << 8)
+
+/**
+  @brief Set up buffers and fixed files for a tunnel between two connected sockets
+
+  @param[in]  ring    Ring of the calling thread
+  @param[in]  client  Client side of the tunnel
+  @param[in]  server  Server side of the tunnel
+**/
+UringTunnel::UringTunnel(IOUring &ring, Connection &client, Connection &server) : ring_(ring) {
+  conns_[0] = &client;
+  conns_[1] = &server;
+  if (!ring_.ok() || !IOUring::supports_multishot_recv()) return;
+
+  slots_[0] = client.ring_slot();
+  slots_[1] = server.ring_slot();
+  if (slots_[0] < 0 || slots_[1] < 0) return;
+
+  // Buffers of both directions, in one mapping so they can be registered as a single fixed buffer
+  mem_size_ = 2 * TUNNEL_BUFS * TUNNEL_BUF_SIZE;
+  void *mem = mmap(nullptr, mem_size_, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (mem == MAP_FAILED) {
+    log("Error allocating tunnel buffers: %s", strerror(errno));
+    return;
+  }
+  mem_ = static_cast<char *>(mem);
+
+  // Registering the buffers lets the kernel skip pinning pages on every write
+  struct iovec iov;
+  iov.iov_base = mem_;
+  iov.iov_len  = mem_size_;
+  if (ring_.register_buffers(&iov, 1) < 0) {
+    log("Error registering tunnel buffers: %s", strerror(errno));
+    return;
+  }
+
+  ok_ = true;
+  for (int i = 0; i < 2; i++) {
+    dirs_[i].bufs = mem_ + i * TUNNEL_BUFS * TUNNEL_BUF_SIZE;
+    provide(i, 0, TUNNEL_BUFS);
+  }
+}
+
+UringTunnel::~UringTunnel() {
+  if (ok_) {
+    cancel_all();
+    ring_.unregister_buffers();
+  }
+  if (mem_) munmap(mem_, mem_size_);
+}
+
+/**
+  @brief Forward data in both directions until either side closes, the tunnel is idle or the server shuts down
+
+  @param[in]  idle_timeout  Time without traffic after which the tunnel is closed
+**/
+void UringTunnel::run(std::chrono::milliseconds idle_timeout) {
+  if (!ok_) return;
+
+  time_point start = myclock::now();
+  TimerWheel::global().arm(idle_timer_, idle_timeout);
+  arm_recv(0);
+  arm_recv(1);
+  arm_timeout();
+
+  io_uring_cqe cqe;
+  while (!done_ && !Signaler::done) {
+    // Submits everything queued by the previous batch of completions, then waits
+    if (!ring_.wait_cqe(cqe)) {
+      if (errno == EINTR) continue;
+      log("Error waiting for tunnel completions: %s", strerror(errno));
+      break;
+    }
+    handle(cqe);
+    while (!done_ && ring_.peek_cqe(cqe)) handle(cqe);
+  }
+  double seconds = std::chrono::duration<double>(myclock::now() - start).count();
+  Metrics::tunnel_bytes_upstream.add(dirs_[0].bytes);
+  Metrics::tunnel_bytes_downstream.add(dirs_[1].bytes);
+  Metrics::tunnel_stalls_upstream.add(dirs_[0].stalls);
+  Metrics::tunnel_stalls_downstream.add(dirs_[1].stalls);
+  log("Tunnel closed after %.1f s, forwarded %llu bytes to server (%.2f MB/s, %llu stalls) and %llu bytes to client "
+      "(%.2f MB/s, %llu stalls)",
+      seconds, (unsigned long long)dirs_[0].bytes, dirs_[0].bytes / seconds / 1e6, (unsigned long long)dirs_[0].stalls,
+      (unsigned long long)dirs_[1].bytes, dirs_[1].bytes / seconds / 1e6, (unsigned long long)dirs_[1].stalls);
+}
+
+void UringTunnel::arm_recv(int i) {
+  if (done_) return;
+  io_uring_sqe *sqe = ring_.get_sqe();
+  if (!sqe) {
+    done_ = true;
+    return;
+  }
+  sqe->opcode    = IORING_OP_RECV;
+  sqe->fd        = slots_[i];
+  sqe->flags     = IOSQE_FIXED_FILE | IOSQE_BUFFER_SELECT;
+  sqe->ioprio    = IORING_RECV_MULTISHOT;
+  sqe->buf_group = i;
+  sqe->user_data = TUNNEL_TAG_RECV | i;
+  dirs_[i].recv_armed = true;
+  inflight_++;
+}
+
+void UringTunnel::arm_send(int i) {
+  if (done_) return;
+  Direction &dir = dirs_[i];
+  if (dir.sending || dir.count == 0) return;
+
+  io_uring_sqe *sqe = ring_.get_sqe();
+  if (!sqe) {
+    done_ = true;
+    return;
+  }
+  const Pending &pending = dir.queue[dir.head];
+  sqe->opcode            = IORING_OP_WRITE_FIXED;
+  sqe->fd                = slots_[1 - i];
+  sqe->flags             = IOSQE_FIXED_FILE;
+  sqe->addr              = reinterpret_cast<std::uint64_t>(dir.bufs + pending.bid * TUNNEL_BUF_SIZE + pending.off);
+  sqe->len               = pending.len;
+  sqe->buf_index         = 0;
+  sqe->user_data         = TUNNEL_TAG_SEND | i;
+  dir.sending            = true;
+  inflight_++;
+}
+
+void UringTunnel::arm_timeout() {
+  if (done_) return;
+  io_uring_sqe *sqe = ring_.get_sqe();
+  if (!sqe) {
+    done_ = true;
+    return;
+  }
+  tick_.tv_sec   = 0;
+  tick_.tv_nsec  = TUNNEL_TICK_MS * 1000000LL;
+  sqe->opcode    = IORING_OP_TIMEOUT;
+  sqe->fd        = -1;
+  sqe->addr      = reinterpret_cast<std::uint64_t>(&tick_);
+  sqe->len       = 1;
+  sqe->user_data = TUNNEL_TAG_TICK;
+  inflight_++;
+}
+
+/**
+  @brief Hand buffers to the kernel's buffer group for a direction, for use by its multishot receive
+
+  @param[in]  i      Direction the buffers belong to
+  @param[in]  first  ID of the first buffer
+  @param[in]  n      Number of consecutive buffers
+**/
+void UringTunnel::provide(int i, unsigned short first, unsigned n) {
+  if (done_) return;
+  io_uring_sqe *sqe = ring_.get_sqe();
+  if (!sqe) {
+    done_ = true;
+    return;
+  }
+  sqe->opcode    = IORING_OP_PROVIDE_BUFFERS;
+  sqe->fd        = n;
+  sqe->addr      = reinterpret_cast<std::uint64_t>(dirs_[i].bufs + first * TUNNEL_BUF_SIZE);
+  sqe->len       = TUNNEL_BUF_SIZE;
+  sqe->off       = first;
+  sqe->buf_group = i;
+  sqe->user_data = TUNNEL_TAG_PROVIDE | i;
+  inflight_++;
+}
+
+void UringTunnel::handle(const io_uring_cqe &cqe) {
+  int  tag   = cqe.user_data & ~0xff;
+  int  i     = cqe.user_data & 0xff;
+  bool final = !(cqe.flags & IORING_CQE_F_MORE);
+  if (final) inflight_--;
+
+  switch (tag) {
+    case TUNNEL_TAG_RECV: {
+      Direction &dir = dirs_[i];
+      if (final) dir.recv_armed = false;
+      if (cqe.res == -ENOBUFS) {
+        // All buffers are queued for sending, receiving resumes when one is provided again
+        dir.stalls++;
+        return;
+      } else if (cqe.res == 0) {
+        log("Connection closed on fd %d", conns_[i]->fd());
+        done_ = true;
+        return;
+      } else if (cqe.res < 0) {
+        if (cqe.res != -ECANCELED) log("Error reading from fd %d: %s", conns_[i]->fd(), strerror(-cqe.res));
+        done_ = true;
+        return;
+      }
+      dir.queue[(dir.head + dir.count) % TUNNEL_BUFS] = Pending{(unsigned short)(cqe.flags >> IORING_CQE_BUFFER_SHIFT), 0, (unsigned)cqe.res};
+      dir.count++;
+      idle_timer_.touch();
+      arm_send(i);
+      if (final && !done_) arm_recv(i);
+      return;
+    }
+    case TUNNEL_TAG_SEND: {
+      Direction &dir = dirs_[i];
+      dir.sending    = false;
+      if (cqe.res <= 0) {
+        if (cqe.res != -ECANCELED) log("Error writing to fd %d: %s", conns_[1 - i]->fd(), strerror(-cqe.res));
+        done_ = true;
+        return;
+      }
+      Pending &pending = dir.queue[dir.head];
+      dir.bytes += cqe.res;
+      pending.off += cqe.res;
+      pending.len -= cqe.res;
+      if (pending.len == 0) {
+        provide(i, pending.bid, 1);
+        dir.head = (dir.head + 1) % TUNNEL_BUFS;
+        dir.count--;
+        if (!dir.recv_armed && !done_) arm_recv(i);
+      }
+      arm_send(i);
+      return;
+    }
+    case TUNNEL_TAG_TICK:
+      if (Signaler::done || idle_timer_.expired()) {
+        done_ = true;
+        return;
+      }
+      arm_timeout();
+      return;
+    case TUNNEL_TAG_PROVIDE:
+      if (cqe.res < 0) {
+        log("Error providing tunnel buffers: %s", strerror(-cqe.res));
+        done_ = true;
+      }
+      return;
+  }
+}
+
+/**
+  @brief Cancel all outstanding operations and take back the provided buffers, so no buffer is in use by the kernel
+**/
+void UringTunnel::cancel_all() {
+  io_uring_sqe *sqe = ring_.get_sqe();
+  if (sqe) {
+    sqe->opcode       = IORING_OP_ASYNC_CANCEL;
+    sqe->fd           = -1;
+    sqe->cancel_flags = IORING_ASYNC_CANCEL_ALL | IORING_ASYNC_CANCEL_ANY;
+    sqe->user_data    = IOURING_TAG_CANCEL;
+  }
+  done_ = true;
+  drain();
+
+  // Buffer groups outlive the tunnel, remove whatever the receives did not consume
+  for (int i = 0; i < 2; i++) {
+    sqe = ring_.get_sqe();
+    if (!sqe) break;
+    sqe->opcode    = IORING_OP_REMOVE_BUFFERS;
+    sqe->fd        = TUNNEL_BUFS;
+    sqe->buf_group = i;
+    sqe->user_data = TUNNEL_TAG_REMOVE | i;
+    inflight_++;
+  }
+  drain();
+}
+
+/**
+  @brief Wait until every submitted operation has completed
+**/
+void UringTunnel::drain() {
+  io_uring_cqe cqe;
+  while (inflight_ > 0) {
+    if (!ring_.wait_cqe(cqe)) {
+      if (errno == EINTR) continue;
+      log("Error draining tunnel completions: %s", strerror(errno));
+      break;
+    }
+    if (cqe.user_data == IOURING_TAG_CANCEL) continue;
+    handle(cqe);
+  }
+}
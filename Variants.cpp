@@ -0,0 +1,110 @@
+#include "Variants.h"
+
+#include <algorithm>
+#include <cctype>
+#include <mutex>
+
+/**
+  @brief Find the key a request's response is cached under
+
+  @param[in]  key              Key of the requested URI
+  @param[in]  request_headers  Headers of the request
+
+  @return  Key of the variant selected by the request, or the key itself if the URI does not vary
+**/
+URIKey Variants::lookup(const URIKey &key, const HeaderTable &request_headers) {
+  if (size() == 0) return key;
+  std::shared_lock<std::shared_mutex> lock(mutex_);
+  auto                                it = fields_.find(key);
+  if (it == fields_.end()) return key;
+  return key.with_variant(hash(it->second, request_headers));
+}
+
+/**
+  @brief Remember the headers a response varies on, and find the key to cache it under
+
+  @param[in]   key              Key of the requested URI
+  @param[in]   request_headers  Headers of the request the response was selected for
+  @param[in]   response         Response from the server
+  @param[out]  variant          Key to cache the response under, the key itself if the response does not vary
+
+  @return  False if the response must not be cached, since it varies on more than request headers
+**/
+bool Variants::store(const URIKey &key, const HeaderTable &request_headers, const HTTPResponse &response, URIKey &variant) {
+  Fields fields;
+  if (!parse(response.header(Header::Vary), fields)) return false;
+
+  std::unique_lock<std::shared_mutex> lock(mutex_);
+  if (fields.empty()) {
+    if (fields_.erase(key)) size_.store(fields_.size(), std::memory_order_relaxed);
+    variant = key;
+    return true;
+  }
+  variant = key.with_variant(hash(fields, request_headers));
+  auto it = fields_.find(key);
+  if (it != fields_.end()) {
+    it->second = std::move(fields);
+    return true;
+  }
+  if (fields_.size() >= VARIANTS_MAX_URIS) fields_.erase(fields_.begin());
+  fields_.emplace(key, std::move(fields));
+  size_.store(fields_.size(), std::memory_order_relaxed);
+  return true;
+}
+
+/**
+  @brief Parse the request headers named by a Vary header
+
+  @param[in]   vary    Value of the Vary header, may be empty
+  @param[out]  fields  Headers named, lowercased, sorted and without duplicates
+
+  @return  False if the header is `*`
+**/
+bool Variants::parse(StrView vary, Fields &fields) {
+  std::string value = vary.str();
+  for (size_t start = 0; start < value.size();) {
+    size_t      end  = std::min(value.find(',', start), value.size());
+    std::string name = lower(strip(value.substr(start, end - start), " \t"));
+    start            = end + 1;
+    if (name.empty()) continue;
+    if (name == "*") return false;
+    fields.emplace_back(header_id(name.data(), name.size()), std::move(name));
+  }
+  std::sort(fields.begin(), fields.end(), [](const auto &a, const auto &b) { return a.second < b.second; });
+  fields.erase(std::unique(fields.begin(), fields.end(), [](const auto &a, const auto &b) { return a.second == b.second; }), fields.end());
+  return true;
+}
+
+/**
+  @brief Hash the values of the request headers a URI varies on, ignoring whitespace
+
+  @param[in]  fields           Headers the URI varies on
+  @param[in]  request_headers  Headers of the request
+
+  @return  Hash of the values, never 0
+**/
+std::uint64_t Variants::hash(const Fields &fields, const HeaderTable &request_headers) {
+  std::string values;
+  for (const auto &field : fields) {
+    bool    present = field.first != Header::Other ? request_headers.contains(field.first) : request_headers.contains(field.second);
+    StrView value   = field.first != Header::Other ? request_headers.get(field.first) : request_headers.get(field.second);
+    // A missing header differs from an empty one
+    values += present ? '\1' : '\0';
+    for (size_t i = 0; i < value.size; i++) {
+      if (!isspace(static_cast<unsigned char>(value.data[i]))) values += value.data[i];
+    }
+    values += '\n';
+  }
+  std::uint64_t h = URIKey::hash(values);
+  return h == 0 ? 1 : h;
+}
+
+/**
+  @brief Get the process-wide variants of the page cache
+
+  @return  Variants&  Process-wide variants
+**/
+Variants &Variants::global() {
+  static Variants variants;
+  return variants;
+}
@@ -0,0 +1,380 @@
+#pragma once
+
+/*
+ * Harness.h - Local origin server, proxy client and proxy process helpers shared by the load benchmarks
+ */
+
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "types.h"
+#include "utils.h"
+
+/**
+  @brief Write a buffer to a socket, retrying on short writes
+
+  @param[in]  fd    Socket to write to
+  @param[in]  data  Data to write
+  @param[in]  len   Number of bytes to write
+
+  @return  True if everything was written
+**/
+inline bool write_all(int fd, const char *data, size_t len) {
+  while (len > 0) {
+    ssize_t n = ::send(fd, data, len, MSG_NOSIGNAL);
+    if (n <= 0) return false;
+    data += n;
+    len -= n;
+  }
+  return true;
+}
+
+inline bool write_all(int fd, const std::string &data) { return write_all(fd, data.data(), data.size()); }
+
+/**
+  @brief Open a listening socket on the loopback interface
+
+  @param[in]  port  Port to listen on, or 0 for any free port
+
+  @return  Listening socket, or -1 on error
+**/
+inline int listen_loopback(int port) {
+  int                fd = socket(AF_INET, SOCK_STREAM, 0), optval = 1;
+  struct sockaddr_in addr;
+  if (fd < 0) return -1;
+  setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &optval, sizeof(optval));
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family      = AF_INET;
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  addr.sin_port        = htons((unsigned short)port);
+  if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 || listen(fd, 1024) < 0) {
+    ::close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+inline int local_port(int fd) {
+  struct sockaddr_in addr;
+  socklen_t          len = sizeof(addr);
+  getsockname(fd, (struct sockaddr *)&addr, &len);
+  return ntohs(addr.sin_port);
+}
+
+inline int connect_loopback(int port) {
+  int                fd = socket(AF_INET, SOCK_STREAM, 0), optval = 1;
+  struct sockaddr_in addr;
+  if (fd < 0) return -1;
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family      = AF_INET;
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  addr.sin_port        = htons((unsigned short)port);
+  if (::connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+    ::close(fd);
+    return -1;
+  }
+  // A stuck proxy shows up as errors instead of hanging the benchmark
+  struct timeval timeout = {5, 0};
+  setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &optval, sizeof(optval));
+  setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+  return fd;
+}
+
+/**
+  @brief Get a query parameter from a request target
+
+  @param[in]  target  Request target, e.g. `/obj/100?delay=5`
+  @param[in]  name    Name of the parameter
+  @param[in]  def     Value if the parameter is missing
+
+  @return  Value of the parameter
+**/
+inline long query_param(const std::string &target, const std::string &name, long def) {
+  size_t pos = target.find('?');
+  while (pos != std::string::npos) {
+    pos++;
+    if (target.compare(pos, name.size(), name) == 0 && target[pos + name.size()] == '=') {
+      return strtol(target.c_str() + pos + name.size() + 1, nullptr, 10);
+    }
+    pos = target.find('&', pos);
+  }
+  return def;
+}
+
+/**
+  Multi-threaded origin server, one thread per connection like the proxy itself. Serves
+  - `/obj/<size>[?chunked=1][&delay=<ms>]`: an object of the given size, optionally with chunked encoding
+  - `/page/<id>?links=<n>&size=<size>[&delay=<ms>]`: an HTML page linking to n objects of the given size
+
+  A second port echoes everything it receives, as the target of CONNECT tunnels.
+**/
+class OriginServer {
+ public:
+  bool start(int port = 0) {
+    if ((http_fd_ = listen_loopback(port)) < 0 || (echo_fd_ = listen_loopback(0)) < 0) return false;
+    threads_.emplace_back(&OriginServer::accept_loop, this, http_fd_, &OriginServer::serve_http);
+    threads_.emplace_back(&OriginServer::accept_loop, this, echo_fd_, &OriginServer::serve_echo);
+    return true;
+  }
+
+  void stop() {
+    done_ = true;
+    shutdown(http_fd_, SHUT_RDWR);
+    shutdown(echo_fd_, SHUT_RDWR);
+    for (auto &thread : threads_) thread.join();
+    ::close(http_fd_);
+    ::close(echo_fd_);
+  }
+
+  int           http_port() const { return local_port(http_fd_); }
+  int           echo_port() const { return local_port(echo_fd_); }
+  std::uint64_t requests() const { return requests_; }
+
+ private:
+  int                        http_fd_ = -1, echo_fd_ = -1;
+  std::atomic<bool>          done_{false};
+  std::atomic<std::uint64_t> requests_{0};
+  std::vector<std::thread>   threads_;
+
+  void accept_loop(int listenfd, void (OriginServer::*serve)(int)) {
+    while (!done_) {
+      int fd = ::accept(listenfd, nullptr, nullptr);
+      if (fd < 0) continue;
+      std::thread(serve, this, fd).detach();
+    }
+  }
+
+  void serve_http(int fd) {
+    std::string in, header, body;
+    char        buf[MAXLINE];
+    in.reserve(MAXLINE);
+
+    while (true) {
+      size_t end;
+      while ((end = in.find("\r\n\r\n")) == std::string::npos) {
+        ssize_t n = ::recv(fd, buf, sizeof(buf), 0);
+        if (n <= 0) {
+          ::close(fd);
+          return;
+        }
+        in.append(buf, n);
+      }
+      std::string request = in.substr(0, end + 4);
+      in.erase(0, end + 4);
+      requests_++;
+
+      size_t      target_start = request.find(' ') + 1;
+      std::string target       = request.substr(target_start, request.find(' ', target_start) - target_start);
+      long        delay        = query_param(target, "delay", 0);
+      bool        chunked      = query_param(target, "chunked", 0) != 0;
+      const char *type         = "application/octet-stream";
+      if (delay > 0) std::this_thread::sleep_for(std::chrono::milliseconds(delay));
+
+      if (target.compare(0, 5, "/obj/") == 0) {
+        body.assign(strtoul(target.c_str() + 5, nullptr, 10), 'x');
+      } else if (target.compare(0, 6, "/page/") == 0) {
+        long links = query_param(target, "links", 0), size = query_param(target, "size", 1024);
+        type       = "text/html";
+        body       = "<html><body>\n";
+        for (long i = 0; i < links; i++) {
+          body.append("<a href=\"/obj/").append(std::to_string(size)).append("?page=");
+          body.append(target, 6, target.find('?') - 6).append("&link=").append(std::to_string(i)).append("\">link</a>\n");
+        }
+        body.append("</body></html>\n");
+      } else {
+        write_all(fd, "HTTP/1.1 404 Not Found\r\nContent-Length: 0\r\n\r\n");
+        continue;
+      }
+
+      header = std::string("HTTP/1.1 200 OK\r\nContent-Type: ") + type + "\r\n";
+      if (!chunked) {
+        header.append("Content-Length: ").append(std::to_string(body.size())).append("\r\n\r\n");
+        if (!write_all(fd, header) || !write_all(fd, body)) break;
+        continue;
+      }
+      header.append("Transfer-Encoding: chunked\r\n\r\n");
+      bool ok = write_all(fd, header);
+      for (size_t pos = 0; ok && pos < body.size(); pos += 4096) {
+        size_t len  = std::min<size_t>(4096, body.size() - pos);
+        char   size[32];
+        snprintf(size, sizeof(size), "%zx\r\n", len);
+        ok = write_all(fd, size, strlen(size)) && write_all(fd, body.data() + pos, len) && write_all(fd, "\r\n", 2);
+      }
+      if (!ok || !write_all(fd, "0\r\n\r\n")) break;
+    }
+    ::close(fd);
+  }
+
+  void serve_echo(int fd) {
+    char    buf[MAXBUF];
+    ssize_t n;
+    while ((n = ::recv(fd, buf, sizeof(buf), 0)) > 0) {
+      if (!write_all(fd, buf, n)) break;
+    }
+    ::close(fd);
+  }
+};
+
+/**
+  Client connection to the proxy, reads complete responses with a content length or chunked encoding
+**/
+class Client {
+ public:
+  ~Client() { close(); }
+
+  bool connect(int port) {
+    close();
+    in_.clear();
+    return (fd_ = connect_loopback(port)) >= 0;
+  }
+  void close() {
+    if (fd_ >= 0) ::close(fd_);
+    fd_ = -1;
+  }
+  bool connected() const { return fd_ >= 0; }
+
+  /**
+    @brief Send a request and read the whole response
+
+    @param[in]   request  Request to send
+    @param[out]  status   Status code of the response
+    @param[out]  bytes    Bytes received, header included
+
+    @return  True if a complete response was received
+  **/
+  bool exchange(const std::string &request, int &status, size_t &bytes) {
+    std::string header;
+    if (!write_all(fd_, request) || !read_until("\r\n\r\n", header)) return false;
+    status = atoi(header.c_str() + header.find(' ') + 1);
+    bytes  = header.size();
+
+    std::string lower = header;
+    for (auto &c : lower) c = tolower(c);
+    size_t pos = lower.find("\r\ncontent-length:");
+    if (pos != std::string::npos) {
+      size_t length = strtoul(lower.c_str() + pos + 17, nullptr, 10);
+      bytes += length;
+      return read_exact(length);
+    }
+    if (lower.find("\r\ntransfer-encoding: chunked") == std::string::npos) return true;
+    std::string line;
+    while (read_until("\r\n", line)) {
+      size_t length = strtoul(line.c_str(), nullptr, 16);
+      bytes += line.size() + length + 2;
+      if (!read_exact(length + 2)) return false;
+      if (length == 0) return true;
+    }
+    return false;
+  }
+
+  /**
+    @brief Send data through a tunnel and wait until all of it is echoed back
+
+    @param[in]  data  Data to send
+
+    @return  True if everything came back
+  **/
+  bool echo(const std::string &data) { return write_all(fd_, data) && read_exact(data.size()); }
+
+ private:
+  int         fd_ = -1;
+  std::string in_;
+
+  bool fill() {
+    char    buf[MAXBUF];
+    ssize_t n = ::recv(fd_, buf, sizeof(buf), 0);
+    if (n <= 0) return false;
+    in_.append(buf, n);
+    return true;
+  }
+
+  bool read_until(const char *delim, std::string &out) {
+    size_t pos;
+    while ((pos = in_.find(delim)) == std::string::npos) {
+      if (!fill()) return false;
+    }
+    out.assign(in_, 0, pos + strlen(delim));
+    in_.erase(0, pos + strlen(delim));
+    return true;
+  }
+
+  bool read_exact(size_t len) {
+    while (in_.size() < len) {
+      if (in_.size() > 0) {
+        len -= in_.size();
+        in_.clear();
+      }
+      if (!fill()) return false;
+    }
+    in_.erase(0, len);
+    return true;
+  }
+};
+
+
+/**
+  @brief Start the proxy on a free port, with its output discarded
+
+  @param[in]   path        Proxy binary
+  @param[in]   extra_args  Options for the proxy, separated by spaces
+  @param[out]  pid         Process ID of the proxy
+
+  @return  Port of the proxy, or -1 if it did not come up
+**/
+inline int start_proxy(const std::string &path, const std::string &extra_args, pid_t &pid) {
+  int fd   = listen_loopback(0);
+  int port = local_port(fd);
+  ::close(fd);
+
+  std::vector<std::string> args = {path};
+  std::istringstream       extra(extra_args);
+  for (std::string arg; extra >> arg;) args.push_back(arg);
+  args.push_back(std::to_string(port));
+
+  if ((pid = fork()) == 0) {
+    std::vector<char *> argv;
+    for (auto &arg : args) argv.push_back(&arg[0]);
+    argv.push_back(nullptr);
+    int null = open("/dev/null", O_WRONLY);
+    dup2(null, STDOUT_FILENO);
+    dup2(null, STDERR_FILENO);
+    execv(argv[0], argv.data());
+    _exit(127);
+  }
+
+  for (int i = 0; i < 100; i++) {
+    int probe = connect_loopback(port);
+    if (probe >= 0) {
+      ::close(probe);
+      return port;
+    }
+    std::this_thread::sleep_for(std::chrono::milliseconds(50));
+  }
+  kill(pid, SIGKILL);
+  waitpid(pid, nullptr, 0);
+  return -1;
+}
+
+inline void stop_proxy(pid_t pid) {
+  kill(pid, SIGINT);
+  for (int i = 0; i < 40; i++) {
+    if (waitpid(pid, nullptr, WNOHANG) == pid) return;
+    std::this_thread::sleep_for(std::chrono::milliseconds(50));
+  }
+  kill(pid, SIGKILL);
+  waitpid(pid, nullptr, 0);
+}
@@ -0,0 +1,247 @@
+/*
+ * admission_bench.cpp - Trace-driven simulation of the page cache hit ratio with plain LRU and with TinyLFU admission
+ *
+ * Each trace is replayed against an LRU cache and against the TinyLFU policy of the same capacity, in pages. Traces are
+ * synthetic by default: Zipf-distributed requests, alone, mixed with scans of pages requested once, and mixed with
+ * prefetched pages that are inserted but never requested. Access logs captured with `webproxy -L` can be replayed too.
+ */
+
+#include <unistd.h>
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <list>
+#include <random>
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+#include "AccessLog.h"
+#include "TinyLFU.h"
+#include "URIKey.h"
+
+// Event of a trace: a request for a page, or a page inserted by the prefetcher without being requested
+struct Event {
+  std::uint32_t object;
+  bool          prefetch;
+};
+
+struct Trace {
+  std::string           name;
+  std::vector<URIKey> objects;
+  std::vector<Event>  events;
+  size_t              working_set = 0;  // Objects the default capacities are a share of
+};
+
+// Plain LRU cache of page URIs, the baseline
+class LRU {
+ public:
+  explicit LRU(size_t capacity) : capacity_(capacity) {}
+
+  bool access(std::uint32_t object) {
+    auto it = index_.find(object);
+    if (it == index_.end()) return false;
+    order_.splice(order_.begin(), order_, it->second);
+    return true;
+  }
+  void insert(std::uint32_t object) {
+    if (index_.count(object)) return;
+    order_.push_front(object);
+    index_[object] = order_.begin();
+    if (order_.size() > capacity_) {
+      index_.erase(order_.back());
+      order_.pop_back();
+    }
+  }
+
+ private:
+  size_t                                                                 capacity_;
+  std::list<std::uint32_t>                                               order_;
+  std::unordered_map<std::uint32_t, std::list<std::uint32_t>::iterator> index_;
+};
+
+// Page cache behind the TinyLFU policy, only holding the pages the policy keeps
+class Admitted {
+ public:
+  explicit Admitted(size_t capacity) { policy_.configure(capacity); }
+
+  bool access(const Trace &trace, std::uint32_t object) {
+    policy_.access(trace.objects[object]);
+    return cached_.count(trace.objects[object]) > 0;
+  }
+  void insert(const Trace &trace, std::uint32_t object) {
+    std::vector<URIKey> evicted;
+    policy_.admit(trace.objects[object], evicted);
+    cached_.insert(trace.objects[object]);
+    for (const auto &key : evicted) cached_.erase(key);
+  }
+
+ private:
+  TinyLFU                    policy_;
+  std::unordered_set<URIKey> cached_;
+};
+
+static std::vector<URIKey> make_objects(size_t n, const std::string &prefix) {
+  std::vector<URIKey> objects;
+  objects.reserve(n);
+  for (size_t i = 0; i < n; i++) objects.emplace_back(parse_uri("http://origin.test:80/" + prefix + "/" + std::to_string(i)));
+  return objects;
+}
+
+/**
+  @brief Generate a trace of Zipf-distributed requests, optionally mixed with one-off scans and prefetched pages
+
+  @param[in]  name         Name of the trace
+  @param[in]  objects      Number of popular objects
+  @param[in]  requests     Number of requests
+  @param[in]  skew         Zipf exponent
+  @param[in]  scan_every   Requests between scans, 0 for none
+  @param[in]  scan_length  Pages requested once per scan
+  @param[in]  prefetched   Pages prefetched per request, that are never requested
+
+  @return  Trace
+**/
+static Trace zipf_trace(const std::string &name, size_t objects, size_t requests, double skew, size_t scan_every, size_t scan_length,
+                        size_t prefetched) {
+  Trace trace;
+  trace.name        = name;
+  trace.objects     = make_objects(objects, "obj");
+  trace.working_set = objects;
+
+  std::vector<double> cdf(objects);
+  double              sum = 0;
+  for (size_t i = 0; i < objects; i++) cdf[i] = sum += 1 / std::pow(i + 1, skew);
+  for (auto &p : cdf) p /= sum;
+
+  std::mt19937_64                        rng(42);
+  std::uniform_real_distribution<double> uniform(0, 1);
+  for (size_t r = 0; r < requests; r++) {
+    std::uint32_t object = static_cast<std::uint32_t>(std::lower_bound(cdf.begin(), cdf.end(), uniform(rng)) - cdf.begin());
+    trace.events.push_back({std::min<std::uint32_t>(object, objects - 1), false});
+    for (size_t p = 0; p < prefetched; p++) {
+      trace.objects.emplace_back(parse_uri("http://origin.test:80/prefetch/" + std::to_string(trace.objects.size())));
+      trace.events.push_back({static_cast<std::uint32_t>(trace.objects.size() - 1), true});
+    }
+    if (scan_every > 0 && r % scan_every == scan_every - 1) {
+      for (size_t s = 0; s < scan_length; s++) {
+        trace.objects.emplace_back(parse_uri("http://origin.test:80/scan/" + std::to_string(trace.objects.size())));
+        trace.events.push_back({static_cast<std::uint32_t>(trace.objects.size() - 1), false});
+      }
+    }
+  }
+  return trace;
+}
+
+/**
+  @brief Read the cacheable requests of an access log as a trace
+
+  @param[in]  path  Access log captured with `webproxy -L`
+
+  @return  Trace, without events if the log could not be read
+**/
+static Trace log_trace(const std::string &path) {
+  Trace                                     trace;
+  std::unordered_map<URIKey, std::uint32_t> ids;  // Normalized URIs are the same page, as in the page cache
+  AccessLogReader                           reader(path);
+  trace.name = path;
+  for (AccessLogRecord record; reader.next(record);) {
+    bool cacheable = record.method == RequestMethod::GET &&
+                     (record.outcome == AccessOutcome::Hit || record.outcome == AccessOutcome::Miss || record.outcome == AccessOutcome::Peer);
+    if (!cacheable) continue;
+    URIKey key(parse_uri(record.uri));
+    auto   it = ids.find(key);
+    if (it == ids.end()) {
+      it = ids.emplace(key, static_cast<std::uint32_t>(trace.objects.size())).first;
+      trace.objects.push_back(key);
+    }
+    trace.events.push_back({it->second, false});
+  }
+  trace.working_set = trace.objects.size();
+  return trace;
+}
+
+/**
+  @brief Replay a trace against both caches and print their hit ratios
+
+  @param[in]  trace     Trace to replay
+  @param[in]  capacity  Capacity of both caches, in pages
+**/
+static void simulate(const Trace &trace, size_t capacity) {
+  LRU           lru(capacity);
+  Admitted      tinylfu(capacity);
+  std::uint64_t requests = 0, lru_hits = 0, tinylfu_hits = 0;
+
+  for (const auto &event : trace.events) {
+    if (event.prefetch) {
+      lru.insert(event.object);
+      tinylfu.insert(trace, event.object);
+      continue;
+    }
+    requests++;
+    if (lru.access(event.object)) lru_hits++;
+    else lru.insert(event.object);
+    if (tinylfu.access(trace, event.object)) tinylfu_hits++;
+    else tinylfu.insert(trace, event.object);
+  }
+
+  double lru_ratio = requests ? 100.0 * lru_hits / requests : 0, tinylfu_ratio = requests ? 100.0 * tinylfu_hits / requests : 0;
+  printf("%-24s %8zu pages %10llu requests  LRU %6.2f%%  TinyLFU %6.2f%%  gain %+6.2f points\n", trace.name.c_str(), capacity,
+         (unsigned long long)requests, lru_ratio, tinylfu_ratio, tinylfu_ratio - lru_ratio);
+}
+
+static void usage(const char *name) {
+  fprintf(stderr, "usage: %s [-n requests] [-o objects] [-s zipf_skew] [-c capacity]... [access_log]...\n", name);
+  exit(1);
+}
+
+int main(int argc, char **argv) {
+  size_t              requests = 1000000, objects = 100000;
+  double              skew = 0.9;
+  std::vector<size_t> capacities;
+
+  int opt;
+  while ((opt = getopt(argc, argv, "n:o:s:c:")) != -1) {
+    switch (opt) {
+      case 'n':
+        requests = strtoull(optarg, nullptr, 10);
+        break;
+      case 'o':
+        objects = strtoull(optarg, nullptr, 10);
+        break;
+      case 's':
+        skew = atof(optarg);
+        break;
+      case 'c':
+        capacities.push_back(strtoull(optarg, nullptr, 10));
+        break;
+      default:
+        usage(argv[0]);
+    }
+  }
+
+  std::vector<Trace> traces;
+  for (int i = optind; i < argc; i++) {
+    traces.push_back(log_trace(argv[i]));
+    if (traces.back().events.empty()) {
+      fprintf(stderr, "no cacheable requests in '%s'\n", argv[i]);
+      return 1;
+    }
+  }
+  if (traces.empty()) {
+    traces.push_back(zipf_trace("zipf", objects, requests, skew, 0, 0, 0));
+    traces.push_back(zipf_trace("zipf+scans", objects, requests, skew, 1000, 2000, 0));
+    traces.push_back(zipf_trace("zipf+prefetch", objects, requests, skew, 0, 0, 2));
+  }
+
+  for (const auto &trace : traces) {
+    std::vector<size_t> sizes = capacities;
+    if (sizes.empty()) {
+      for (size_t percent : {1, 5, 10}) sizes.push_back(std::max<size_t>(16, trace.working_set * percent / 100));
+    }
+    for (size_t capacity : sizes) simulate(trace, capacity);
+  }
+  return 0;
+}
@@ -0,0 +1,100 @@
+/*
+ * alloc_bench.cpp - Counts global heap allocations on the per-request parse/dump path
+ */
+
+#include <atomic>
+#include <cstdio>
+#include <cstdlib>
+#include <new>
+
+#include "Arena.h"
+#include "BufferPool.h"
+#include "HTTPRequest.h"
+#include "HTTPResponse.h"
+
+static std::atomic<std::uint64_t> num_allocs{0};
+
+void *operator new(size_t n) {
+  num_allocs++;
+  void *p = std::malloc(n ? n : 1);
+  if (!p) throw std::bad_alloc();
+  return p;
+}
+void operator delete(void *p) noexcept { std::free(p); }
+void operator delete(void *p, size_t) noexcept { std::free(p); }
+
+static const std::string request_header =
+    "GET http://example.com:80/static/css/site.css?v=1234 HTTP/1.1\r\n"
+    "Host: example.com\r\n"
+    "User-Agent: Mozilla/5.0 (X11; Linux x86_64; rv:109.0) Gecko/20100101 Firefox/115.0\r\n"
+    "Accept: text/css,*/*;q=0.1\r\n"
+    "Accept-Language: en-US,en;q=0.5\r\n"
+    "Accept-Encoding: gzip, deflate\r\n"
+    "Referer: http://example.com/index.html\r\n"
+    "Connection: keep-alive\r\n"
+    "\r\n";
+
+static const std::string response_header =
+    "HTTP/1.1 200 OK\r\n"
+    "Content-Type: text/css\r\n"
+    "Content-Length: 2048\r\n"
+    "Cache-Control: max-age=3600\r\n"
+    "Server: Apache\r\n"
+    "\r\n";
+
+/**
+  @brief Run a benchmark case and report heap allocations and time per iteration
+
+  @param[in]  name        Name of the case
+  @param[in]  iterations  Number of iterations to run
+  @param[in]  fn          Function to run each iteration
+**/
+template <typename Fn>
+void run_case(const char *name, int iterations, Fn fn) {
+  // Warm up pools and arenas so that only steady-state allocations are counted
+  fn();
+
+  std::uint64_t start_allocs = num_allocs;
+  time_point    start        = myclock::now();
+  for (int i = 0; i < iterations; i++) {
+    fn();
+  }
+  double elapsed = std::chrono::duration<double, std::nano>(myclock::now() - start).count();
+  double allocs  = static_cast<double>(num_allocs - start_allocs) / iterations;
+  printf("%-40s %10.2f allocs/iter %12.1f ns/iter\n", name, allocs, elapsed / iterations);
+}
+
+int main(int argc, char **argv) {
+  int          iterations = argc > 1 ? atoi(argv[1]) : 100000;
+  Arena        arena;
+  std::string  out;
+  HTTPResponse response(response_header, ProxyURI());
+  response.append_to_body(std::string(2048, 'x'), 2048);
+
+  printf("Running %d iterations per case\n", iterations);
+
+  run_case("HTTPRequest parse (heap)", iterations, [&]() { HTTPRequest request(request_header); });
+  run_case("HTTPRequest parse (arena)", iterations, [&]() {
+    arena.reset();
+    HTTPRequest request(request_header, &arena);
+  });
+
+  HTTPRequest request(request_header);
+  printf("HTTPRequest header table: %lu fields in %lu bytes\n", request.headers.size(), request.headers.memory_usage());
+  run_case("HTTPRequest dump (new string)", iterations, [&]() { std::string str = request.dump(); });
+  run_case("HTTPRequest dump (reused string)", iterations, [&]() { request.dump(out); });
+
+  run_case("HTTPResponse dump (new string)", iterations, [&]() { std::string str = response.dump(); });
+  run_case("HTTPResponse dump (reused string)", iterations, [&]() { response.dump(request, out); });
+
+  run_case("I/O buffers (new strings)", iterations, [&]() {
+    std::string request_buf, response_buf;
+    request_buf.resize(MAXLINE);
+    response_buf.resize(MAXLINE);
+  });
+  run_case("I/O buffers (pooled)", iterations, [&]() {
+    PooledBuffer request_buf = BufferPool::acquire(MAXLINE), response_buf = BufferPool::acquire(MAXLINE);
+  });
+
+  return 0;
+}
@@ -0,0 +1,225 @@
+/*
+ * idle_bench.cpp - Measures the memory the proxy holds per idle keep-alive connection
+ *
+ * Starts an origin server and the proxy, opens many keep-alive connections that each make one cached request and
+ * then stay idle, and reports the growth of the proxy's resident set per connection next to its memory metrics.
+ */
+
+#include <netinet/in.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "Harness.h"
+
+// Client connections per loopback source address, below the number of ephemeral ports
+#define CONNECTIONS_PER_SOURCE 20000
+
+struct Options {
+  std::string proxy_path  = "bin/webproxy";      // Proxy binary to start
+  std::string proxy_args  = "-r 2 -t idle=600";  // Extra options for the proxy, separated by spaces
+  int         connections = 50000;               // Idle connections to open
+  size_t      size        = 1024;                // Size of the object every connection requests
+};
+
+static Options opts;
+
+/**
+  @brief Connect to a port on the loopback interface from a given loopback source address, so that more connections
+  can be opened than there are ephemeral ports
+
+  @param[in]  port    Port to connect to
+  @param[in]  source  Index of the source address, 127.0.0.(1 + source)
+
+  @return  Connected socket, or -1 on error
+**/
+static int connect_from(int port, int source) {
+  int                fd = socket(AF_INET, SOCK_STREAM, 0), optval = 1;
+  struct sockaddr_in addr;
+  if (fd < 0) return -1;
+  setsockopt(fd, IPPROTO_IP, IP_BIND_ADDRESS_NO_PORT, &optval, sizeof(optval));
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family      = AF_INET;
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK + source);
+  if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+    ::close(fd);
+    return -1;
+  }
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  addr.sin_port        = htons((unsigned short)port);
+  if (::connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+    ::close(fd);
+    return -1;
+  }
+  struct timeval timeout = {5, 0};
+  setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &optval, sizeof(optval));
+  setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+  return fd;
+}
+
+/**
+  @brief Send a request and read its response, which must have a Content-Length
+
+  @param[in]  fd       Connected socket
+  @param[in]  request  Request to send
+
+  @return  True if a complete 200 response was received
+**/
+static bool fetch(int fd, const std::string &request) {
+  std::string in;
+  char        buf[MAXBUF];
+  size_t      end;
+  if (!write_all(fd, request)) return false;
+  while ((end = in.find("\r\n\r\n")) == std::string::npos) {
+    ssize_t n = ::recv(fd, buf, sizeof(buf), 0);
+    if (n <= 0) return false;
+    in.append(buf, n);
+  }
+  std::string lower = in.substr(0, end);
+  for (auto &c : lower) c = tolower(c);
+  size_t pos = lower.find("\r\ncontent-length:");
+  if (pos == std::string::npos || atoi(in.c_str() + in.find(' ') + 1) != 200) return false;
+  size_t length = strtoul(lower.c_str() + pos + 17, nullptr, 10);
+  while (in.size() < end + 4 + length) {
+    ssize_t n = ::recv(fd, buf, sizeof(buf), 0);
+    if (n <= 0) return false;
+    in.append(buf, n);
+  }
+  return true;
+}
+
+/**
+  @brief Get the resident set size of a process
+
+  @param[in]  pid  Process ID
+
+  @return  Resident bytes, or 0 if unknown
+**/
+static size_t resident_bytes(pid_t pid) {
+  std::ifstream status("/proc/" + std::to_string(pid) + "/status");
+  for (std::string line; std::getline(status, line);) {
+    if (line.compare(0, 6, "VmRSS:") == 0) return strtoul(line.c_str() + 6, nullptr, 10) * 1024;
+  }
+  return 0;
+}
+
+/**
+  @brief Get the memory metrics of the proxy from its metrics port
+
+  @param[in]  port  Metrics port
+
+  @return  Lines of the memory gauges
+**/
+static std::string memory_metrics(int port) {
+  static const char *names[] = {"webproxy_active_connections ",       "webproxy_buffer_pool_borrowed_bytes ",
+                                "webproxy_buffer_pool_idle_bytes ",   "webproxy_coroutine_frame_bytes ",
+                                "webproxy_connection_memory_bytes "};
+  std::string        in, out;
+  char               buf[MAXBUF];
+  int                fd = connect_loopback(port);
+  if (fd < 0 || !write_all(fd, "GET /metrics HTTP/1.0\r\n\r\n")) return "  metrics unavailable\n";
+  for (ssize_t n; (n = ::recv(fd, buf, sizeof(buf), 0)) > 0;) in.append(buf, n);
+  ::close(fd);
+  std::istringstream lines(in);
+  for (std::string line; std::getline(lines, line);) {
+    for (const char *name : names) {
+      if (line.compare(0, strlen(name), name) == 0) out.append("  ").append(line).append("\n");
+    }
+  }
+  return out;
+}
+
+static void usage(const char *name) {
+  fprintf(stderr, "usage: %s [-x proxy_binary] [-a proxy_args] [-c connections] [-s size]\n", name);
+  exit(1);
+}
+
+int main(int argc, char **argv) {
+  int opt;
+  while ((opt = getopt(argc, argv, "x:a:c:s:")) != -1) {
+    switch (opt) {
+      case 'x': opts.proxy_path = optarg; break;
+      case 'a': opts.proxy_args = optarg; break;
+      case 'c': opts.connections = atoi(optarg); break;
+      case 's': opts.size = strtoul(optarg, nullptr, 10); break;
+      default: usage(argv[0]);
+    }
+  }
+
+  // The proxy inherits the descriptor limit, and holds two descriptors per connection: its socket and the duplicate
+  // its timers shut down
+  struct rlimit limit;
+  getrlimit(RLIMIT_NOFILE, &limit);
+  limit.rlim_cur = limit.rlim_max;
+  setrlimit(RLIMIT_NOFILE, &limit);
+  if (limit.rlim_cur < 2 * (rlim_t)opts.connections + 256) {
+    int connections = (limit.rlim_cur - 256) / 2;
+    fprintf(stderr, "descriptor limit %lu is too low for %d connections, using %d\n", (unsigned long)limit.rlim_cur, opts.connections,
+            connections);
+    opts.connections = connections;
+  }
+
+  OriginServer origin;
+  if (!origin.start()) {
+    fprintf(stderr, "could not start origin server\n");
+    return 1;
+  }
+  int   probe        = listen_loopback(0);
+  int   metrics_port = local_port(probe), port;
+  pid_t pid;
+  ::close(probe);
+  if ((port = start_proxy(opts.proxy_path, opts.proxy_args + " -m " + std::to_string(metrics_port), pid)) < 0) {
+    fprintf(stderr, "could not start %s\n", opts.proxy_path.c_str());
+    origin.stop();
+    return 1;
+  }
+
+  // Every connection requests the same object, which is cached by the first request so no upstream connection is kept
+  std::string url     = "http://127.0.0.1:" + std::to_string(origin.http_port()) + "/obj/" + std::to_string(opts.size);
+  std::string request = "GET " + url + " HTTP/1.1\r\nHost: 127.0.0.1\r\n\r\n";
+  int         warm    = connect_loopback(port);
+  if (warm < 0 || !fetch(warm, request)) {
+    fprintf(stderr, "could not fetch %s through the proxy\n", url.c_str());
+    stop_proxy(pid);
+    origin.stop();
+    return 1;
+  }
+  ::close(warm);
+  std::this_thread::sleep_for(std::chrono::milliseconds(500));
+  size_t baseline = resident_bytes(pid);
+
+  printf("Opening %d keep-alive connections to '%s %s', one request each\n", opts.connections, opts.proxy_path.c_str(), opts.proxy_args.c_str());
+  std::vector<int> fds;
+  int              errors = 0;
+  time_point       start  = myclock::now();
+  fds.reserve(opts.connections);
+  for (int i = 0; i < opts.connections; i++) {
+    int fd = connect_from(port, i / CONNECTIONS_PER_SOURCE);
+    if (fd < 0 || !fetch(fd, request)) {
+      if (fd >= 0) ::close(fd);
+      errors++;
+      continue;
+    }
+    fds.push_back(fd);
+  }
+  double elapsed = std::chrono::duration<double>(myclock::now() - start).count();
+  std::this_thread::sleep_for(std::chrono::seconds(1));
+  size_t resident = resident_bytes(pid);
+
+  printf("%zu idle connections open after %.1f s, %d errors\n", fds.size(), elapsed, errors);
+  printf("Proxy resident set: %.1f MB before, %.1f MB with idle connections, %.0f bytes per connection\n", baseline / 1e6,
+         resident / 1e6, fds.empty() ? 0.0 : ((double)resident - baseline) / fds.size());
+  printf("Proxy memory metrics:\n%s", memory_metrics(metrics_port).c_str());
+
+  for (int fd : fds) ::close(fd);
+  stop_proxy(pid);
+  origin.stop();
+  return 0;
+}
@@ -0,0 +1,194 @@
+/*
+ * iobuf_bench.cpp - Compares reading a chunked body into a growing string with reading it into a chained IOBuf
+ */
+
+#include <sys/uio.h>
+
+#include <atomic>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <new>
+#include <string>
+#include <vector>
+
+#include "IOBuf.h"
+#include "types.h"
+#include "utils.h"
+
+// Size of the chunks the body arrives in, as a server sending chunked encoding
+#define CHUNK_SIZE 1000
+
+// Heap allocations and bytes allocated, counted the same way for every path
+static std::atomic<std::uint64_t> num_allocs{0}, allocated_bytes{0};
+
+void *operator new(size_t n) {
+  num_allocs++;
+  allocated_bytes += n;
+  void *p = std::malloc(n ? n : 1);
+  if (!p) throw std::bad_alloc();
+  return p;
+}
+void operator delete(void *p) noexcept { std::free(p); }
+void operator delete(void *p, size_t) noexcept { std::free(p); }
+
+struct Result {
+  double        ns;         // Time to build and serialize the body
+  std::uint64_t allocs;     // Heap allocations
+  std::uint64_t allocated;  // Bytes allocated, each reallocation of a string copies what it held
+};
+
+/**
+  @brief Start measuring a path
+
+  @param[out]  result  Result to fill in by `finish()`
+
+  @return  time_point  Start time
+**/
+static time_point begin(Result &result) {
+  result.allocs    = num_allocs;
+  result.allocated = allocated_bytes;
+  return myclock::now();
+}
+
+/**
+  @brief Stop measuring a path
+
+  @param[in,out]  result  Result started by `begin()`
+  @param[in]      start   Start time
+**/
+static void finish(Result &result, time_point start) {
+  result.ns        = std::chrono::duration<double, std::nano>(myclock::now() - start).count();
+  result.allocs    = num_allocs - result.allocs;
+  result.allocated = allocated_bytes - result.allocated;
+}
+
+/**
+  @brief Build a body chunk by chunk in a string, as before, and serialize it behind its head
+
+  @param[in]  chunk  One chunk of the body
+  @param[in]  size   Size of the body
+
+  @return  Result  Time and allocations
+**/
+static Result string_body(const std::string &chunk, size_t size) {
+  Result      result;
+  time_point  start = begin(result);
+  std::string body, out;
+  for (size_t n = 0; n < size; n += chunk.size()) body.append(chunk);
+  out.reserve(MAXLINE + body.size());
+  out.append("HTTP/1.1 200 OK\r\n\r\n").append(body);
+  finish(result, start);
+  if (out.size() < size) abort();
+  return result;
+}
+
+/**
+  @brief Build a body chunk by chunk in an IOBuf, and gather it behind its head into iovecs, or flatten it into a
+  string as gzip compression and `HTTPResponse::dump(request, std::string&)` do
+
+  @param[in]  chunk    One chunk of the body
+  @param[in]  size     Size of the body
+  @param[in]  flatten  True to copy the body into a string instead of gathering it
+
+  @return  Result  Time and allocations
+**/
+static Result iobuf_body(const std::string &chunk, size_t size, bool flatten = false) {
+  Result                    result;
+  time_point                start = begin(result);
+  IOBuf                     body;
+  std::string               head = "HTTP/1.1 200 OK\r\n\r\n";
+  std::vector<struct iovec> iov;
+  for (size_t n = 0; n < size; n += chunk.size()) {
+    // Receiving into the tail of the last block, as Connection does
+    size_t room;
+    for (size_t done = 0; done < chunk.size();) {
+      char  *dst = body.prepare(room);
+      size_t len = std::min(room, chunk.size() - done);
+      memcpy(dst, chunk.data() + done, len);
+      body.commit(len);
+      done += len;
+    }
+  }
+  IOBuf cached = body;  // Shared with the page cache
+  if (flatten) {
+    std::string flat = cached.str();
+    finish(result, start);
+    if (flat.size() < size) abort();
+    return result;
+  }
+  iov.push_back(iovec{head.data(), head.size()});
+  cached.iovecs(iov);
+  finish(result, start);
+  if (cached.size() < size) abort();
+  return result;
+}
+
+/**
+  @brief Keep many small bodies, as the page cache keeps redirects and error pages, and print the memory held per body
+  in a string, in an IOBuf as it was read, and in a compacted IOBuf
+
+  @param[in]  size   Size of each body
+  @param[in]  count  Number of bodies kept
+**/
+static void small_bodies(size_t size, int count) {
+  std::string              chunk(size, 'x');
+  std::vector<std::string> strings(count);
+  std::vector<IOBuf>       bufs(count);
+  size_t                   string_bytes = 0;
+  for (auto &str : strings) {
+    str = chunk;
+    string_bytes += str.capacity() + 1;
+  }
+
+  size_t before = IOBlockPool::allocated_bytes(), room;
+  for (auto &buf : bufs) {
+    char *dst = buf.prepare(room);
+    memcpy(dst, chunk.data(), size);
+    buf.commit(size);
+  }
+  size_t read_bytes = IOBlockPool::allocated_bytes() - before;
+  for (auto &buf : bufs) buf.compact();
+  size_t compacted_bytes = IOBlockPool::allocated_bytes() - before;
+
+  char label[32];
+  snprintf(label, sizeof(label), "%zu B", size);
+  printf("%-10s %-10s %14.0f\n", label, "string", (double)string_bytes / count);
+  printf("%-10s %-10s %14.0f\n", label, "IOBuf", (double)read_bytes / count);
+  printf("%-10s %-10s %14.0f\n", label, "compacted", (double)compacted_bytes / count);
+}
+
+int main(int argc, char **argv) {
+  int         iterations = argc > 1 ? atoi(argv[1]) : 20;
+  std::string chunk(CHUNK_SIZE, 'x');
+
+  printf("Building chunked bodies from %d byte chunks, %d iterations per size\n", CHUNK_SIZE, iterations);
+  printf("%-10s %-12s %14s %10s %16s\n", "size", "buffer", "us/body", "allocs", "bytes allocated");
+  for (size_t size : {64UL << 10, 1UL << 20, 16UL << 20, 64UL << 20}) {
+    // Warm up the block pool, as a running proxy would
+    iobuf_body(chunk, std::min<size_t>(size, IOBUF_POOL_MAX_IDLE * IOBUF_BLOCK_SIZE));
+
+    Result totals[3] = {};
+    for (int i = 0; i < iterations; i++) {
+      Result results[3] = {string_body(chunk, size), iobuf_body(chunk, size), iobuf_body(chunk, size, true)};
+      for (int j = 0; j < 3; j++) {
+        totals[j].ns += results[j].ns;
+        totals[j].allocs += results[j].allocs;
+        totals[j].allocated += results[j].allocated;
+      }
+    }
+    char label[32];
+    snprintf(label, sizeof(label), "%zu KB", size >> 10);
+    const char *names[3] = {"string", "IOBuf", "IOBuf str()"};
+    for (int j = 0; j < 3; j++) {
+      printf("%-10s %-12s %14.1f %10lu %16lu\n", label, names[j], totals[j].ns / iterations / 1000, totals[j].allocs / iterations,
+             totals[j].allocated / iterations);
+    }
+  }
+  printf("Idle blocks in pool: %zu, blocks in use: %zu\n", IOBlockPool::num_idle(), IOBlockPool::num_allocated());
+
+  printf("\nKeeping 10000 small bodies, as cached redirects and error pages\n");
+  printf("%-10s %-10s %14s\n", "size", "buffer", "bytes/body");
+  for (size_t size : {100UL, 300UL, 1000UL, 4000UL}) small_bodies(size, 10000);
+  return 0;
+}
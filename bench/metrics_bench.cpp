@@ -0,0 +1,59 @@
+/*
+ * metrics_bench.cpp - Measures the cost of recording metrics from many threads
+ */
+
+#include <atomic>
+#include <cstdio>
+#include <cstdlib>
+#include <thread>
+#include <vector>
+
+#include "Metrics.h"
+
+static std::atomic<std::uint64_t> shared_counter{0};
+static Counter                    sharded_counter;
+static Histogram                  histogram;
+
+/**
+  @brief Run a recording function on several threads at once and report the cost per call
+
+  @param[in]  name        Name of the case
+  @param[in]  threads     Number of threads
+  @param[in]  iterations  Number of calls per thread
+  @param[in]  fn          Function that records one value
+**/
+template <typename Fn>
+void run_case(const char *name, int threads, int iterations, Fn fn) {
+  std::vector<std::thread> workers;
+  std::atomic<bool>        go{false};
+
+  for (int t = 0; t < threads; t++) {
+    workers.emplace_back([&, t]() {
+      while (!go) {
+      }
+      for (int i = 0; i < iterations; i++) fn(t, i);
+    });
+  }
+  time_point start = myclock::now();
+  go               = true;
+  for (auto &worker : workers) worker.join();
+  double elapsed = std::chrono::duration<double>(myclock::now() - start).count();
+
+  printf("%-28s %2d threads %8.2f ns/record\n", name, threads, elapsed * 1e9 / iterations);
+}
+
+int main(int argc, char **argv) {
+  int      iterations = argc > 1 ? atoi(argv[1]) : 10000000;
+  unsigned cores      = std::max(1u, std::thread::hardware_concurrency());
+
+  printf("Recording %d values per thread\n", iterations);
+  for (unsigned threads = 1; threads <= cores; threads *= 2) {
+    run_case("shared std::atomic", threads, iterations, [](int, int) { shared_counter.fetch_add(1, std::memory_order_relaxed); });
+    run_case("Counter::add()", threads, iterations, [](int, int) { sharded_counter.add(); });
+    run_case("Histogram::record()", threads, iterations, [](int t, int i) { histogram.record(1000 + (i & 0xffff) * (t + 1)); });
+  }
+
+  printf("\nHistogram p50=%llu ns p99=%llu ns p999=%llu ns (%llu values)\n", (unsigned long long)histogram.quantile(0.5),
+         (unsigned long long)histogram.quantile(0.99), (unsigned long long)histogram.quantile(0.999), (unsigned long long)histogram.count());
+  return 0;
+}
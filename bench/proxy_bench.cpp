@@ -0,0 +1,223 @@
+/*
+ * proxy_bench.cpp - Load generator for webproxy, with a local origin server standing in for the internet
+ *
+ * Starts an origin server and an echo server on the loopback interface, starts the proxy (or uses one that is already
+ * running), and drives each scenario through the proxy with closed-loop or open-loop load.
+ */
+
+#include <algorithm>
+#include <atomic>
+#include <cstdio>
+#include <cstdlib>
+#include <functional>
+#include <thread>
+#include <vector>
+
+#include "Harness.h"
+#include "Metrics.h"
+
+struct Options {
+  std::string proxy_path  = "bin/webproxy";  // Proxy binary to start
+  std::string proxy_args;                    // Extra options for the proxy, separated by spaces
+  int         proxy_port  = 0;               // Port of an already running proxy, or 0 to start one
+  int         connections = 8;               // Concurrent client connections
+  double      duration    = 5;               // Seconds per scenario
+  double      rate        = 0;               // Requests per second over all connections, 0 for closed-loop load
+  size_t      size        = 16384;           // Size of each object, and of each tunnel round trip
+  int         latency_ms  = 0;               // Delay of the origin server before each response
+  int         links       = 16;              // Links per page in the prefetch storm
+};
+
+static Options opts;
+
+
+/**
+  Load scenario. The `warm` request is sent once beforehand, then every worker thread opens a connection with `open`
+  and calls `step` until the scenario ends.
+**/
+struct Scenario {
+  const char                                                                 *name;
+  const char                                                                 *description;
+  bool                                                                        keep_alive;
+  std::string                                                                 warm;
+  std::function<bool(Client &)>                                               open;
+  std::function<bool(Client &, int worker, std::uint64_t seq, size_t &bytes)> step;
+};
+
+/**
+  @brief Run a scenario and print its throughput and latency percentiles
+
+  With a rate, the load is open-loop: every worker sends at fixed intervals and latency is measured from the time a
+  request was due, so a slow proxy is not hidden by a client that waits for it.
+
+  @param[in]  scenario  Scenario to run
+  @param[in]  port      Port of the proxy
+**/
+static void run_scenario(const Scenario &scenario, int port) {
+  Histogram                  latency;
+  std::atomic<std::uint64_t> requests{0}, errors{0}, bytes{0};
+  std::vector<std::thread>   workers;
+  time_point                 start    = myclock::now();
+  time_point                 deadline = start + std::chrono::microseconds(static_cast<std::int64_t>(opts.duration * 1e6));
+  myclock::duration          interval = opts.rate > 0 ? std::chrono::duration_cast<myclock::duration>(std::chrono::duration<double>(opts.connections / opts.rate))
+                                                      : myclock::duration::zero();
+
+  for (int w = 0; w < opts.connections; w++) {
+    workers.emplace_back([&, w] {
+      Client     client;
+      time_point due = start + interval * w / opts.connections;
+      for (std::uint64_t seq = 0;; seq++) {
+        if (interval > myclock::duration::zero()) {
+          std::this_thread::sleep_until(due);
+        }
+        time_point sent = interval > myclock::duration::zero() ? due : myclock::now();
+        if (sent >= deadline) break;
+        due += interval;
+
+        size_t n  = 0;
+        bool   ok = (client.connected() || (client.connect(port) && (!scenario.open || scenario.open(client)))) &&
+                  scenario.step(client, w, seq, n);
+        if (!ok || !scenario.keep_alive) client.close();
+        if (!ok) {
+          errors++;
+          continue;
+        }
+        latency.record(myclock::now() - sent);
+        requests++;
+        bytes += n;
+      }
+    });
+  }
+  for (auto &worker : workers) worker.join();
+
+  double elapsed = std::chrono::duration<double>(myclock::now() - start).count();
+  printf("%-16s %9.0f req/s %9.1f MB/s  p50 %8.1f us  p99 %8.1f us  p999 %8.1f us  %llu errors\n", scenario.name,
+         requests / elapsed, bytes / elapsed / 1e6, latency.quantile(0.5) / 1e3, latency.quantile(0.99) / 1e3,
+         latency.quantile(0.999) / 1e3, (unsigned long long)errors.load());
+}
+
+static void usage(const char *name) {
+  fprintf(stderr,
+          "usage: %s [-x proxy_binary] [-a proxy_args] [-P proxy_port] [-c connections] [-d seconds] [-r rate] [-s size]\n"
+          "          [-l origin_latency_ms] [-k links] [scenario...]\n"
+          "       %s -O port   (run only the origin server)\n",
+          name, name);
+  exit(1);
+}
+
+int main(int argc, char **argv) {
+  int opt, origin_port = -1;
+  while ((opt = getopt(argc, argv, "x:a:P:c:d:r:s:l:k:O:")) != -1) {
+    switch (opt) {
+      case 'x': opts.proxy_path = optarg; break;
+      case 'a': opts.proxy_args = optarg; break;
+      case 'P': opts.proxy_port = atoi(optarg); break;
+      case 'c': opts.connections = std::max(1, atoi(optarg)); break;
+      case 'd': opts.duration = atof(optarg); break;
+      case 'r': opts.rate = atof(optarg); break;
+      case 's': opts.size = strtoul(optarg, nullptr, 10); break;
+      case 'l': opts.latency_ms = atoi(optarg); break;
+      case 'k': opts.links = atoi(optarg); break;
+      case 'O': origin_port = atoi(optarg); break;
+      default: usage(argv[0]);
+    }
+  }
+  signal(SIGPIPE, SIG_IGN);
+
+  OriginServer origin;
+  if (!origin.start(std::max(origin_port, 0))) {
+    perror("origin server");
+    return 1;
+  }
+  if (origin_port >= 0) {
+    printf("Origin server on 127.0.0.1:%d, echo server on 127.0.0.1:%d\n", origin.http_port(), origin.echo_port());
+    fflush(stdout);
+    pause();
+  }
+
+  std::string origin_host = "127.0.0.1:" + std::to_string(origin.http_port());
+  std::string echo_host   = "127.0.0.1:" + std::to_string(origin.echo_port());
+  std::string object      = "/obj/" + std::to_string(opts.size) + "?delay=" + std::to_string(opts.latency_ms);
+  std::string tunnel_data(opts.size, 't');
+
+  // Every scenario requests its own URLs, so they do not see each other's cache entries
+  auto get = [&](const std::string &target, bool keep_alive) {
+    return "GET http://" + origin_host + target + " HTTP/1.1\r\nHost: " + origin_host +
+           (keep_alive ? "\r\n\r\n" : "\r\nConnection: close\r\n\r\n");
+  };
+  auto fetch = [](Client &client, const std::string &request, size_t &bytes) {
+    int status = 0;
+    return client.exchange(request, status, bytes) && status == 200;
+  };
+  auto unique = [](const char *scenario, int worker, std::uint64_t seq) {
+    return std::string("&") + scenario + "=" + std::to_string(worker) + "-" + std::to_string(seq);
+  };
+
+  std::vector<Scenario> scenarios = {
+      {"cache-hit", "Every request is served from the page cache", true, get(object + "&hit", true), nullptr,
+       [&](Client &c, int, std::uint64_t, size_t &bytes) { return fetch(c, get(object + "&hit", true), bytes); }},
+      {"cache-miss", "Every request goes to the origin", true, "", nullptr,
+       [&](Client &c, int w, std::uint64_t seq, size_t &bytes) { return fetch(c, get(object + unique("miss", w, seq), true), bytes); }},
+      {"chunked-miss", "Cache misses answered with chunked encoding", true, "", nullptr,
+       [&](Client &c, int w, std::uint64_t seq, size_t &bytes) {
+         return fetch(c, get(object + "&chunked=1" + unique("chunked", w, seq), true), bytes);
+       }},
+      {"keepalive", "Cache hits, many requests per client connection", true, get(object + "&reuse", true), nullptr,
+       [&](Client &c, int, std::uint64_t, size_t &bytes) { return fetch(c, get(object + "&reuse", true), bytes); }},
+      {"no-keepalive", "Cache hits, a new client connection per request", false, get(object + "&reuse", true), nullptr,
+       [&](Client &c, int, std::uint64_t, size_t &bytes) { return fetch(c, get(object + "&reuse", false), bytes); }},
+      {"tunnel", "Round trips of -s bytes through a CONNECT tunnel", true, "",
+       [&](Client &c) {
+         int    status = 0;
+         size_t bytes;
+         return c.exchange("CONNECT " + echo_host + " HTTP/1.1\r\nHost: " + echo_host + "\r\n\r\n", status, bytes) && status == 200;
+       },
+       [&](Client &c, int, std::uint64_t, size_t &bytes) {
+         bytes = 2 * tunnel_data.size();
+         return c.echo(tunnel_data);
+       }},
+      {"prefetch-storm", "New HTML pages with -k uncached links each", true, "", nullptr,
+       [&](Client &c, int w, std::uint64_t seq, size_t &bytes) {
+         std::string page = "/page/" + std::to_string(w) + "-" + std::to_string(seq) + "?links=" + std::to_string(opts.links) +
+                            "&size=" + std::to_string(opts.size) + "&delay=" + std::to_string(opts.latency_ms);
+         return fetch(c, get(page, true), bytes);
+       }},
+  };
+
+  std::vector<std::string> selected(argv + optind, argv + argc);
+  for (auto &name : selected) {
+    bool found = false;
+    for (auto &scenario : scenarios) found |= name == scenario.name;
+    if (!found) {
+      fprintf(stderr, "unknown scenario '%s', available:\n", name.c_str());
+      for (auto &scenario : scenarios) fprintf(stderr, "  %-16s %s\n", scenario.name, scenario.description);
+      origin.stop();
+      return 1;
+    }
+  }
+
+  pid_t pid  = 0;
+  int   port = opts.proxy_port;
+  if (port <= 0 && (port = start_proxy(opts.proxy_path, opts.proxy_args, pid)) < 0) {
+    fprintf(stderr, "could not start %s\n", opts.proxy_path.c_str());
+    origin.stop();
+    return 1;
+  }
+
+  printf("%d connections, %s, %.1f s per scenario, %zu byte objects, %d ms origin latency\n", opts.connections,
+         opts.rate > 0 ? ("open loop at " + std::to_string((int)opts.rate) + " req/s").c_str() : "closed loop", opts.duration, opts.size,
+         opts.latency_ms);
+  for (auto &scenario : scenarios) {
+    if (!selected.empty() && std::find(selected.begin(), selected.end(), scenario.name) == selected.end()) continue;
+    if (!scenario.warm.empty()) {
+      Client client;
+      size_t bytes;
+      if (client.connect(port)) fetch(client, scenario.warm, bytes);
+    }
+    run_scenario(scenario, port);
+  }
+
+  if (pid > 0) stop_proxy(pid);
+  origin.stop();
+  return 0;
+}
@@ -0,0 +1,89 @@
+/*
+ * reject_bench.cpp - Measures throughput of sending 403 rejections to a client
+ */
+
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <cstdio>
+#include <cstdlib>
+#include <thread>
+
+#include "CannedResponse.h"
+#include "HTTPRequest.h"
+#include "HTTPResponse.h"
+
+static const std::string request_header =
+    "GET http://blocked.example.com/ HTTP/1.1\r\n"
+    "Host: blocked.example.com\r\n"
+    "User-Agent: scanner/1.0\r\n"
+    "\r\n";
+
+/**
+  @brief Write a response to a socket, retrying on short writes
+
+  @param[in]  fd    Socket to write to
+  @param[in]  data  Response to write
+
+  @return  True if the whole response was written
+**/
+static bool write_all(int fd, const std::string &data) {
+  size_t total = 0;
+  while (total < data.size()) {
+    ssize_t n = write(fd, data.data() + total, data.size() - total);
+    if (n <= 0) return false;
+    total += n;
+  }
+  return true;
+}
+
+/**
+  @brief Send rejections over a socket pair and report the rejection rate
+
+  @param[in]  name        Name of the case
+  @param[in]  iterations  Number of rejections to send
+  @param[in]  fn          Function that sends one rejection to the given socket
+**/
+template <typename Fn>
+void run_case(const char *name, int iterations, Fn fn) {
+  int fds[2];
+  if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) < 0) {
+    perror("socketpair");
+    exit(1);
+  }
+
+  // Drain the client side so that writes never block for long
+  std::thread reader([&]() {
+    char buf[MAXBUF];
+    while (read(fds[1], buf, sizeof(buf)) > 0) {
+    }
+  });
+
+  time_point start = myclock::now();
+  for (int i = 0; i < iterations; i++) {
+    if (!fn(fds[0])) break;
+  }
+  double elapsed = std::chrono::duration<double>(myclock::now() - start).count();
+
+  shutdown(fds[0], SHUT_WR);
+  reader.join();
+  close(fds[0]);
+  close(fds[1]);
+  printf("%-32s %12.0f rejections/s %10.1f ns/rejection\n", name, iterations / elapsed, elapsed * 1e9 / iterations);
+}
+
+int main(int argc, char **argv) {
+  int         iterations = argc > 1 ? atoi(argv[1]) : 1000000;
+  HTTPRequest request(request_header);
+
+  printf("Sending %d rejections per case\n", iterations);
+
+  run_case("HTTPResponse::dump()", iterations, [&](int fd) {
+    HTTPResponse response(request, ResponseCode::Forbidden);
+    return write_all(fd, response.dump());
+  });
+  run_case("canned_response()", iterations, [&](int fd) { return write_all(fd, canned_response(ResponseCode::Forbidden, request.version)); });
+
+  return 0;
+}
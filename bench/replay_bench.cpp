@@ -0,0 +1,203 @@
+/*
+ * replay_bench.cpp - Replays an access log captured with `webproxy -L` through the proxy, against a local origin server
+ *
+ * Every URI of the log is mapped to an object of the recorded size on the origin server, so the replay keeps the URL
+ * popularity and object size mix of the captured traffic. Requests are sent at the recorded times, optionally scaled.
+ */
+
+#include <algorithm>
+#include <atomic>
+#include <cstdio>
+#include <cstdlib>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include "AccessLog.h"
+#include "Harness.h"
+#include "Metrics.h"
+
+struct Options {
+  std::string proxy_path  = "bin/webproxy";  // Proxy binary to start
+  std::string proxy_args;                    // Extra options for the proxy, separated by spaces
+  int         proxy_port  = 0;               // Port of an already running proxy, or 0 to start one
+  int         connections = 64;              // Client connections, the most requests that can be in flight
+  double      speed       = 1;               // Replay speed, 2 replays twice as fast as recorded
+  bool        latency     = false;           // Delay origin responses by the latency recorded for cache misses
+  size_t      max_tunnel  = 1 << 20;         // Most bytes sent through a replayed tunnel
+  bool        print       = false;           // Print the log instead of replaying it
+};
+
+static Options opts;
+
+// Request to replay
+struct Replay {
+  std::uint64_t offset_us;  // Time since the first request of the log
+  bool          connect;
+  std::string   request;
+  size_t        size;
+};
+
+// Replay settings of a URI, taken from its first successful request
+struct Object {
+  std::uint64_t id;
+  std::uint64_t size;
+  std::uint64_t delay_ms;
+};
+
+static void print_log(AccessLogReader &reader) {
+  AccessLogRecord record;
+  while (reader.next(record)) {
+    printf("%llu.%06llu %8u us %3u %-8s %-7s %10llu %s\n", (unsigned long long)(record.timestamp_us / 1000000),
+           (unsigned long long)(record.timestamp_us % 1000000), record.latency_us, record.status, to_string(record.outcome),
+           to_string(record.method).c_str(), (unsigned long long)record.size, record.uri.c_str());
+  }
+}
+
+static void usage(const char *name) {
+  fprintf(stderr,
+          "usage: %s [-x proxy_binary] [-a proxy_args] [-P proxy_port] [-c connections] [-s speed] [-l] [-t max_tunnel_bytes] access_log\n"
+          "       %s -p access_log   (print the log)\n",
+          name, name);
+  exit(1);
+}
+
+int main(int argc, char **argv) {
+  int opt;
+  while ((opt = getopt(argc, argv, "x:a:P:c:s:lt:p")) != -1) {
+    switch (opt) {
+      case 'x': opts.proxy_path = optarg; break;
+      case 'a': opts.proxy_args = optarg; break;
+      case 'P': opts.proxy_port = atoi(optarg); break;
+      case 'c': opts.connections = std::max(1, atoi(optarg)); break;
+      case 's': opts.speed = atof(optarg); break;
+      case 'l': opts.latency = true; break;
+      case 't': opts.max_tunnel = strtoul(optarg, nullptr, 10); break;
+      case 'p': opts.print = true; break;
+      default: usage(argv[0]);
+    }
+  }
+  if (argc - optind != 1 || opts.speed <= 0) usage(argv[0]);
+  signal(SIGPIPE, SIG_IGN);
+
+  AccessLogReader reader(argv[optind]);
+  if (!reader.ok()) {
+    fprintf(stderr, "could not read access log '%s'\n", argv[optind]);
+    return 1;
+  }
+  if (opts.print) {
+    print_log(reader);
+    return 0;
+  }
+
+  // Only requests that were answered by the cache, a peer, the server or a tunnel are replayed
+  std::vector<AccessLogRecord> records;
+  size_t                       skipped = 0, recorded_hits = 0, recorded_gets = 0;
+  for (AccessLogRecord record; reader.next(record);) {
+    bool replayable = record.outcome == AccessOutcome::Hit || record.outcome == AccessOutcome::Miss || record.outcome == AccessOutcome::Peer ||
+                      record.outcome == AccessOutcome::Tunnel;
+    if (!replayable) {
+      skipped++;
+      continue;
+    }
+    if (record.outcome != AccessOutcome::Tunnel) {
+      recorded_gets++;
+      recorded_hits += record.outcome == AccessOutcome::Hit;
+    }
+    records.push_back(std::move(record));
+  }
+  if (records.empty()) {
+    fprintf(stderr, "no requests to replay in '%s'\n", argv[optind]);
+    return 1;
+  }
+
+  OriginServer origin;
+  if (!origin.start()) {
+    perror("origin server");
+    return 1;
+  }
+  std::string origin_host = "127.0.0.1:" + std::to_string(origin.http_port());
+  std::string echo_host   = "127.0.0.1:" + std::to_string(origin.echo_port());
+
+  std::unordered_map<std::string, Object> objects;
+  for (auto &record : records) {
+    if (record.outcome == AccessOutcome::Tunnel) continue;
+    auto it = objects.find(record.uri);
+    if (it == objects.end()) it = objects.emplace(record.uri, Object{objects.size(), record.size, 0}).first;
+    if (record.outcome == AccessOutcome::Miss && it->second.delay_ms == 0) it->second.delay_ms = record.latency_us / 1000;
+  }
+
+  std::vector<Replay> replays;
+  std::uint64_t       first = records.front().timestamp_us;
+  for (auto &record : records) {
+    std::uint64_t offset = record.timestamp_us > first ? record.timestamp_us - first : 0;
+    if (record.outcome == AccessOutcome::Tunnel) {
+      replays.push_back({offset, true, "CONNECT " + echo_host + " HTTP/1.1\r\nHost: " + echo_host + "\r\n\r\n",
+                         std::min<size_t>(record.size / 2, opts.max_tunnel)});
+      continue;
+    }
+    const Object &object = objects[record.uri];
+    std::string   target = "/obj/" + std::to_string(object.size) + "?id=" + std::to_string(object.id);
+    if (opts.latency && object.delay_ms > 0) target += "&delay=" + std::to_string(object.delay_ms);
+    replays.push_back({offset, false, "GET http://" + origin_host + target + " HTTP/1.1\r\nHost: " + origin_host + "\r\n\r\n", 0});
+  }
+
+  pid_t pid  = 0;
+  int   port = opts.proxy_port;
+  if (port <= 0 && (port = start_proxy(opts.proxy_path, opts.proxy_args, pid)) < 0) {
+    fprintf(stderr, "could not start %s\n", opts.proxy_path.c_str());
+    origin.stop();
+    return 1;
+  }
+
+  // Workers take the next request in log order and send it when it is due, latency is measured from that time
+  Histogram                  latency;
+  std::atomic<size_t>        next{0};
+  std::atomic<std::uint64_t> errors{0}, bytes{0};
+  std::vector<std::thread>   workers;
+  std::string                tunnel_data(16384, 't');
+  time_point                 start = myclock::now();
+  for (int w = 0; w < opts.connections; w++) {
+    workers.emplace_back([&] {
+      Client client;
+      for (size_t i; (i = next++) < replays.size();) {
+        const Replay &replay = replays[i];
+        time_point    due    = start + std::chrono::microseconds(static_cast<std::int64_t>(replay.offset_us / opts.speed));
+        std::this_thread::sleep_until(due);
+
+        int    status = 0;
+        size_t n      = 0;
+        bool   ok     = client.connected() || client.connect(port);
+        ok            = ok && client.exchange(replay.request, status, n) && status == 200;
+        for (size_t sent = 0; ok && replay.connect && sent < replay.size; sent += tunnel_data.size()) {
+          ok = client.echo(sent + tunnel_data.size() <= replay.size ? tunnel_data : tunnel_data.substr(0, replay.size - sent));
+        }
+        // A tunnel uses up its connection
+        if (!ok || replay.connect) client.close();
+        if (!ok) {
+          errors++;
+          continue;
+        }
+        latency.record(myclock::now() - due);
+        bytes += replay.connect ? 2 * replay.size : n;
+      }
+    });
+  }
+  for (auto &worker : workers) worker.join();
+  double elapsed = std::chrono::duration<double>(myclock::now() - start).count();
+  double span    = (records.back().timestamp_us - first) / 1e6;
+
+  // Every origin request is a cache miss or a prefetch, so this is a lower bound of the hit ratio
+  std::uint64_t fetches = origin.requests();
+  double        gets    = static_cast<double>(recorded_gets);
+  printf("Replayed %zu requests (%zu skipped) for %zu URIs in %.1f s, recorded over %.1f s\n", replays.size(), skipped, objects.size(),
+         elapsed, span);
+  printf("%9.0f req/s %9.1f MB/s  p50 %8.1f us  p99 %8.1f us  p999 %8.1f us  %llu errors\n", replays.size() / elapsed, bytes / elapsed / 1e6,
+         latency.quantile(0.5) / 1e3, latency.quantile(0.99) / 1e3, latency.quantile(0.999) / 1e3, (unsigned long long)errors.load());
+  printf("Origin fetches %llu, hit ratio >= %.1f%% (recorded %.1f%%)\n", (unsigned long long)fetches,
+         gets > 0 ? std::max(0.0, 100 * (1 - fetches / gets)) : 0.0, gets > 0 ? 100 * recorded_hits / gets : 0.0);
+
+  if (pid > 0) stop_proxy(pid);
+  origin.stop();
+  return 0;
+}
@@ -0,0 +1,198 @@
+/*
+ * sockopt_bench.cpp - Latency of webproxy under each socket option profile
+ *
+ * Starts the proxy once per profile, with the profile's `-s` options, and measures small request/response workloads
+ * through it against a local origin server. Small exchanges on few connections are where Nagle's algorithm, delayed
+ * ACKs, deferred accepts and fast open show up, so every workload runs closed-loop and reports latency percentiles.
+ */
+
+#include <algorithm>
+#include <atomic>
+#include <cstdio>
+#include <cstdlib>
+#include <functional>
+#include <thread>
+#include <vector>
+
+#include "Harness.h"
+#include "Metrics.h"
+
+struct Options {
+  std::string proxy_path  = "bin/webproxy";  // Proxy binary to start
+  std::string proxy_args;                    // Extra options for the proxy, added to every profile
+  int         connections = 1;               // Concurrent client connections
+  double      duration    = 2;               // Seconds per workload
+  size_t      size        = 1000;            // Size of a small object and of a tunnel round trip
+  size_t      large       = 100000;          // Size of a large object
+  int         latency_ms  = 0;               // Delay of the origin server before each response
+};
+
+static Options opts;
+
+// Proxy options to compare
+struct Profile {
+  const char *name;
+  const char *args;
+  const char *description;
+};
+
+static const Profile profiles[] = {
+    {"default", "", "TCP_NODELAY on client and upstream sockets"},
+    {"nagle", "-s client.nodelay=0 -s upstream.nodelay=0", "Nagle's algorithm on every socket"},
+    {"defer-accept", "-s listener.defer_accept=1", "Accept only once the request has arrived"},
+    {"fastopen", "-s listener.fastopen=256 -s upstream.fastopen=1", "TCP fast open, needs net.ipv4.tcp_fastopen=3"},
+    {"notsent-lowat", "-s client.notsent_lowat=16384 -s upstream.notsent_lowat=16384", "At most 16 KB of unsent data per socket"},
+    {"small-buffers", "-s client.sndbuf=8192 -s upstream.rcvbuf=8192", "8 KB socket buffers towards the client and server"},
+    {"keepalive", "-s client.keepalive=10 -s client.keepalive_interval=5 -s upstream.keepalive=10", "TCP keepalive probes"},
+};
+
+// Request pattern, run on every connection until the workload ends
+struct Workload {
+  const char                                                  *name;
+  bool                                                         keep_alive;
+  std::function<bool(Client &)>                                open;
+  std::function<bool(Client &, int worker, std::uint64_t seq)> step;
+};
+
+/**
+  @brief Run a workload against a proxy and print its latency percentiles
+
+  @param[in]  workload  Workload to run
+  @param[in]  port      Port of the proxy
+**/
+static void run_workload(const Workload &workload, int port) {
+  Histogram                  latency;
+  std::atomic<std::uint64_t> requests{0}, errors{0};
+  std::vector<std::thread>   workers;
+  time_point                 start    = myclock::now();
+  time_point                 deadline = start + std::chrono::microseconds(static_cast<std::int64_t>(opts.duration * 1e6));
+
+  for (int w = 0; w < opts.connections; w++) {
+    workers.emplace_back([&, w] {
+      Client client;
+      for (std::uint64_t seq = 0; myclock::now() < deadline; seq++) {
+        // Connection setup is part of the latency, which is what deferred accepts and fast open change
+        time_point sent = myclock::now();
+        bool       ok   = (client.connected() || (client.connect(port) && (!workload.open || workload.open(client)))) &&
+                  workload.step(client, w, seq);
+        if (!ok || !workload.keep_alive) client.close();
+        if (!ok) {
+          errors++;
+          continue;
+        }
+        latency.record(myclock::now() - sent);
+        requests++;
+      }
+    });
+  }
+  for (auto &worker : workers) worker.join();
+
+  double elapsed = std::chrono::duration<double>(myclock::now() - start).count();
+  printf("  %-14s %9.0f req/s  p50 %8.1f us  p99 %8.1f us  p999 %8.1f us  %llu errors\n", workload.name, requests / elapsed,
+         latency.quantile(0.5) / 1e3, latency.quantile(0.99) / 1e3, latency.quantile(0.999) / 1e3, (unsigned long long)errors.load());
+  fflush(stdout);
+}
+
+static void usage(const char *name) {
+  fprintf(stderr,
+          "usage: %s [-x proxy_binary] [-a proxy_args] [-c connections] [-d seconds] [-s size] [-S large_size] [-l origin_latency_ms]\n"
+          "          [profile...]\n",
+          name);
+  exit(1);
+}
+
+int main(int argc, char **argv) {
+  int opt;
+  while ((opt = getopt(argc, argv, "x:a:c:d:s:S:l:")) != -1) {
+    switch (opt) {
+      case 'x': opts.proxy_path = optarg; break;
+      case 'a': opts.proxy_args = optarg; break;
+      case 'c': opts.connections = std::max(1, atoi(optarg)); break;
+      case 'd': opts.duration = atof(optarg); break;
+      case 's': opts.size = strtoul(optarg, nullptr, 10); break;
+      case 'S': opts.large = strtoul(optarg, nullptr, 10); break;
+      case 'l': opts.latency_ms = atoi(optarg); break;
+      default: usage(argv[0]);
+    }
+  }
+  signal(SIGPIPE, SIG_IGN);
+
+  std::vector<std::string> selected(argv + optind, argv + argc);
+  for (auto &name : selected) {
+    if (std::none_of(std::begin(profiles), std::end(profiles), [&](const Profile &p) { return name == p.name; })) {
+      fprintf(stderr, "unknown profile '%s', available:\n", name.c_str());
+      for (auto &profile : profiles) fprintf(stderr, "  %-14s %s\n", profile.name, profile.description);
+      return 1;
+    }
+  }
+
+  OriginServer origin;
+  if (!origin.start()) {
+    perror("origin server");
+    return 1;
+  }
+  std::string origin_host = "127.0.0.1:" + std::to_string(origin.http_port());
+  std::string echo_host   = "127.0.0.1:" + std::to_string(origin.echo_port());
+  std::string delay       = "?delay=" + std::to_string(opts.latency_ms);
+  std::string small       = "/obj/" + std::to_string(opts.size) + delay, large = "/obj/" + std::to_string(opts.large) + delay;
+  std::string tunnel_data(opts.size, 't');
+  const char *profile_name = "";
+
+  auto get = [&](const std::string &target, bool keep_alive) {
+    return "GET http://" + origin_host + target + " HTTP/1.1\r\nHost: " + origin_host +
+           (keep_alive ? "\r\n\r\n" : "\r\nConnection: close\r\n\r\n");
+  };
+  auto fetch = [](Client &client, const std::string &request) {
+    int    status = 0;
+    size_t bytes;
+    return client.exchange(request, status, bytes) && status == 200;
+  };
+
+  // Cache misses use URLs of their own for every profile, so no profile sees another's cache entries
+  std::vector<Workload> workloads = {
+      {"small-hit", true, nullptr, [&](Client &c, int, std::uint64_t) { return fetch(c, get(small + "&hit", true)); }},
+      {"large-hit", true, nullptr, [&](Client &c, int, std::uint64_t) { return fetch(c, get(large + "&hit", true)); }},
+      {"small-miss", true, nullptr,
+       [&](Client &c, int w, std::uint64_t seq) {
+         return fetch(c, get(small + "&" + profile_name + "=" + std::to_string(w) + "-" + std::to_string(seq), true));
+       }},
+      {"chunked-miss", true, nullptr,
+       [&](Client &c, int w, std::uint64_t seq) {
+         return fetch(c, get(large + "&chunked=1&" + profile_name + "=" + std::to_string(w) + "-" + std::to_string(seq), true));
+       }},
+      {"new-connection", false, nullptr, [&](Client &c, int, std::uint64_t) { return fetch(c, get(small + "&hit", false)); }},
+      {"tunnel", true,
+       [&](Client &c) {
+         int    status = 0;
+         size_t bytes;
+         return c.exchange("CONNECT " + echo_host + " HTTP/1.1\r\nHost: " + echo_host + "\r\n\r\n", status, bytes) && status == 200;
+       },
+       [&](Client &c, int, std::uint64_t) { return c.echo(tunnel_data); }},
+  };
+
+  printf("%d connections, %.1f s per workload, %zu and %zu byte objects, %d ms origin latency\n", opts.connections, opts.duration,
+         opts.size, opts.large, opts.latency_ms);
+  for (auto &profile : profiles) {
+    if (!selected.empty() && std::find(selected.begin(), selected.end(), profile.name) == selected.end()) continue;
+    pid_t pid;
+    int   port = start_proxy(opts.proxy_path, opts.proxy_args + " " + profile.args, pid);
+    if (port < 0) {
+      fprintf(stderr, "could not start %s with %s\n", opts.proxy_path.c_str(), profile.args);
+      continue;
+    }
+    printf("%s: %s\n", profile.name, profile.description);
+    fflush(stdout);
+
+    // Warm the cache for the hit workloads
+    Client client;
+    if (client.connect(port)) fetch(client, get(small + "&hit", true)) && fetch(client, get(large + "&hit", true));
+    client.close();
+
+    profile_name = profile.name;
+    for (auto &workload : workloads) run_workload(workload, port);
+    stop_proxy(pid);
+  }
+
+  origin.stop();
+  return 0;
+}
@@ -0,0 +1,79 @@
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <mutex>
+#include <string>
+
+#include "HTTPRequest.h"
+#include "types.h"
+#include "utils.h"
+
+// Identifies an access log file, followed by a format version
+#define ACCESS_LOG_MAGIC "WPAL"
+#define ACCESS_LOG_VERSION 1
+// Size of the write buffer. Records are written in blocks of whole records of at most this size
+#define ACCESS_LOG_BUFFER_SIZE (1 << 20)
+
+// How a request was answered
+enum class AccessOutcome : std::uint8_t {
+  Hit,       // Served from the page cache
+  Miss,      // Fetched from the server
+  Tunnel,    // CONNECT tunnel, the size is the number of bytes forwarded in both directions
+  Rejected,  // Blacklisted or unsupported request
+  Error,     // Server unreachable or timed out
+  Peer,      // Fetched from the peer cache that owns the URL
+};
+
+const char *to_string(AccessOutcome outcome);
+
+/**
+  One request of the access log. On disk, the fields are stored in this order in host byte order, followed by the
+  absolute URI, with its length as a 16-bit prefix, i.e. 26 bytes plus the URI per request.
+**/
+struct AccessLogRecord {
+  std::uint64_t timestamp_us;  // Wall clock time the request started, in microseconds since the epoch
+  std::uint32_t latency_us;    // Time until the response was written
+  std::uint64_t size;          // Bytes written to the client
+  std::uint16_t status;        // Response status code
+  AccessOutcome outcome;
+  RequestMethod method;
+  std::string   uri;  // Absolute URI, host:port for CONNECT
+};
+
+/**
+  Optional binary access log, written by every connection thread to one file. The file is appended to, and each
+  write(2) holds whole records, so a process that takes over with `-H` continues the log of the process it replaces,
+  even while that one drains and still writes to it.
+**/
+class AccessLog {
+ public:
+  static bool open(const std::string &path);
+  static void close();
+  static bool enabled() { return file_ != nullptr; }
+
+  static void record(const HTTPRequest &request, int status, std::uint64_t size, AccessOutcome outcome, time_point start);
+
+ private:
+  static std::FILE *file_;
+  static std::mutex mutex_;
+  static size_t     buffered_;  // Bytes in the write buffer
+};
+
+/**
+  Reads the records of an access log in order
+**/
+class AccessLogReader {
+ public:
+  explicit AccessLogReader(const std::string &path);
+  AccessLogReader(const AccessLogReader &other) = delete;
+  AccessLogReader &operator=(const AccessLogReader &other) = delete;
+  ~AccessLogReader();
+
+  bool ok() const { return file_ != nullptr; }
+  bool next(AccessLogRecord &record);
+
+ private:
+  std::FILE *file_ = nullptr;
+};
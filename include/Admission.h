@@ -0,0 +1,92 @@
+#pragma once
+
+#include <netinet/in.h>
+#include <sys/socket.h>
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+
+#include "Signaler.h"
+#include "types.h"
+#include "utils.h"
+
+// Number of independently locked shards of the client table
+#define ADMISSION_SHARDS 64
+// Longest probe sequence in a shard, a client that does not fit is admitted without per-client limits
+#define ADMISSION_MAX_PROBE 32
+// Tokens are stored in fixed point with this many fractional bits
+#define ADMISSION_TOKEN_SHIFT 4
+
+/**
+  Admission limits, set from the command line with `-a <name>=<value>`. A limit of 0 disables it.
+**/
+struct AdmissionLimits {
+  std::uint32_t             connections = 0;        // Concurrent connections over all clients
+  std::uint32_t             per_client  = 0;        // Concurrent connections per client IP
+  double                    rate        = 0;        // Requests per second per client IP
+  std::uint32_t             burst       = 0;        // Requests a client IP can send at once, defaults to one second's worth
+  std::chrono::milliseconds queue{0};               // Time a new connection may wait for a free slot at the global limit
+  std::uint32_t             clients     = 1 << 20;  // Client IPs tracked at once
+
+  bool parse(const std::string &option);
+};
+
+enum class AdmissionDecision {
+  Admit,
+  Overloaded,   // Global connection limit, answered with 503
+  ClientLimit,  // Per-client connection or rate limit, answered with 429
+};
+
+/**
+  Connection and request admission. Decides at accept time whether a connection is served, and before every request
+  whether the client is within its rate.
+
+  Per-client state lives in a fixed-size sharded hash table of 16-byte entries, allocated once when the limits are set,
+  so a million clients take 16 MB. An entry can be reused by another client once it has no connections and a full
+  bucket, since it is then the same as a new entry.
+**/
+class Admission {
+ public:
+  void configure(const AdmissionLimits &limits);
+
+  AdmissionDecision admit(std::uint64_t &client);
+  bool              allow_request(std::uint64_t client);
+  void              release(std::uint64_t client);
+  bool              limits_clients() const { return shards_ != nullptr; }
+  std::uint32_t     active() const { return active_; }
+
+  static std::uint64_t client_key(int fd);
+  static Admission    &global();
+
+ private:
+  struct Entry {
+    std::uint64_t key;          // Client key, 0 if the entry was never used
+    std::uint32_t refilled_ms;  // Time of the last refill, in milliseconds since the table was created
+    std::uint16_t tokens;       // Fixed-point tokens left in the bucket
+    std::uint16_t connections;  // Open connections
+  };
+  struct Shard {
+    std::mutex               mutex;
+    std::unique_ptr<Entry[]> entries;
+  };
+
+  Shard        &shard(std::uint64_t client, size_t &start) const;
+  Entry        *find(Shard &shard, size_t start, std::uint64_t client, std::uint32_t now_ms, bool create);
+  void          refill(Entry &entry, std::uint32_t now_ms) const;
+  bool          reusable(const Entry &entry, std::uint32_t now_ms) const;
+  std::uint32_t now_ms() const;
+
+  AdmissionLimits            limits_;
+  std::atomic<std::uint32_t> active_{0};
+  std::mutex                 wait_mutex_;
+  std::condition_variable    slot_freed_;
+  std::unique_ptr<Shard[]>   shards_;
+  size_t                     shard_size_ = 0;
+  std::uint32_t              burst_      = 0;  // Bucket size in fixed point
+  time_point                 created_    = myclock::now();
+};
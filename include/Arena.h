@@ -0,0 +1,79 @@
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <new>
+#include <vector>
+
+// Size of each block allocated by an Arena
+#define ARENA_BLOCK_SIZE 16384
+// Blocks of ARENA_BLOCK_SIZE bytes kept by each thread after the arenas that used them released them
+#define ARENA_THREAD_BLOCKS 16
+
+/**
+  Bump allocator for short-lived, per-request data. Memory is only released in bulk by `reset()`, which keeps the
+  first block so that steady-state requests do not touch the global heap, or by `release()`, which gives up all blocks
+  while the owner has nothing to allocate. Released blocks are kept by the thread for the next arena that needs one.
+**/
+class Arena {
+ public:
+  Arena(size_t block_size = ARENA_BLOCK_SIZE);
+  Arena(const Arena &other) = delete;
+  Arena &operator=(const Arena &other) = delete;
+  ~Arena();
+
+  void  *allocate(size_t n, size_t align = alignof(std::max_align_t));
+  void   reset();
+  void   release();
+  size_t bytes_used() const { return bytes_used_; }
+  size_t num_blocks() const { return blocks_.size(); }
+
+ private:
+  struct Block {
+    char  *data;
+    size_t size;
+  };
+
+  std::vector<Block> blocks_;
+  size_t             block_size_;
+  size_t             offset_     = 0;
+  size_t             bytes_used_ = 0;
+};
+
+/**
+  Standard allocator that draws from an Arena, or from the global heap if no arena is given
+**/
+template <typename T>
+class ArenaAllocator {
+ public:
+  using value_type = T;
+
+  ArenaAllocator(Arena *arena = nullptr) : arena_(arena) {}
+  template <typename U>
+  ArenaAllocator(const ArenaAllocator<U> &other) : arena_(other.arena()) {}
+
+  T *allocate(size_t n) {
+    if (arena_) return static_cast<T *>(arena_->allocate(n * sizeof(T), alignof(T)));
+    return static_cast<T *>(::operator new(n * sizeof(T)));
+  }
+  void deallocate(T *p, size_t) {
+    // Arena memory is released by Arena::reset()
+    if (!arena_) ::operator delete(p);
+  }
+
+  Arena *arena() const { return arena_; }
+
+ private:
+  Arena *arena_;
+};
+
+template <typename T, typename U>
+bool operator==(const ArenaAllocator<T> &a, const ArenaAllocator<U> &b) {
+  return a.arena() == b.arena();
+}
+
+template <typename T, typename U>
+bool operator!=(const ArenaAllocator<T> &a, const ArenaAllocator<U> &b) {
+  return a.arena() != b.arena();
+}
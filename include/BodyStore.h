@@ -0,0 +1,85 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+
+#include "IOBuf.h"
+#include "utils.h"
+
+// Bodies smaller than this are not interned, sharing them saves less than their digest and entry cost
+#define BODY_STORE_MIN_SIZE 512
+
+/**
+  Body of a HTTPResponse, in an IOBuf. A body is private to its response while it is read from the server, and copies
+  of the response copy its IOBuf, which shares its blocks. Once interned in the BodyStore it is immutable, and copies
+  of the response share it instead.
+**/
+class Body {
+ public:
+  Body() = default;
+  Body(const Body &other);
+  Body(Body &&other) noexcept;
+  ~Body();
+
+  Body &operator=(const Body &other);
+  Body &operator=(Body &&other) noexcept;
+  Body &operator=(IOBuf &&data);
+
+  const IOBuf  &buf() const;
+  size_t        size() const { return data_ ? data_->size() : 0; }
+  bool          empty() const { return size() == 0; }
+  bool          interned() const { return digest_ != 0; }
+  std::uint64_t digest() const { return digest_; }
+
+  void append(const char *data, size_t size);
+  void append(const IOBuf &data);
+
+ private:
+  friend class BodyStore;
+
+  IOBuf &mutate();
+  void   release();
+
+  std::shared_ptr<IOBuf> data_;        // Null for an empty body
+  std::uint64_t          digest_ = 0;  // Digest of an interned body, 0 for a private one
+};
+
+/**
+  Content-addressed store of the bodies in the page cache. A body is hashed with XXH64 when its response is inserted
+  into the cache, and all cached responses with the same body share one copy of it, such as the pages served under
+  many URIs with cache-busting query strings, or the same asset mirrored by several hosts. A digest match is confirmed
+  by comparing the bodies, so a collision only costs the sharing.
+
+  Bodies are reference counted by the responses holding them, and leave the store when the last one is freed. The
+  store counts the bytes of the bodies it holds and the bytes the responses holding them would take unshared, whose
+  ratio is the deduplication ratio reported in the metrics.
+**/
+class BodyStore {
+ public:
+  void intern(Body &body);
+
+  size_t        bodies() const { return count_.load(std::memory_order_relaxed); }
+  std::uint64_t stored_bytes() const { return stored_bytes_.load(std::memory_order_relaxed); }
+  std::uint64_t referenced_bytes() const { return referenced_bytes_.load(std::memory_order_relaxed); }
+  double        dedup_ratio() const;
+
+  static std::uint64_t digest(const IOBuf &data);
+  static BodyStore    &global();
+
+ private:
+  friend class Body;
+
+  void release(std::uint64_t digest, const IOBuf *data);
+  void reference(size_t size) { referenced_bytes_.fetch_add(size, std::memory_order_relaxed); }
+  void unreference(size_t size) { referenced_bytes_.fetch_sub(size, std::memory_order_relaxed); }
+
+  std::mutex                                              mutex_;
+  std::unordered_map<std::uint64_t, std::weak_ptr<IOBuf>> bodies_;  // Stored bodies by digest
+  std::atomic<size_t>                                     count_{0};
+  std::atomic<std::uint64_t>                              stored_bytes_{0};
+  std::atomic<std::uint64_t>                              referenced_bytes_{0};
+};
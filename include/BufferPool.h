@@ -0,0 +1,76 @@
+#pragma once
+
+#include <atomic>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "types.h"
+
+// Maximum number of idle buffers kept per size class
+#define BUFFER_POOL_MAX_IDLE 256
+// Idle buffers kept per size class by each thread, enough for the buffers of one request
+#define BUFFER_POOL_THREAD_IDLE 8
+
+/**
+  Process-wide pool of I/O buffers, in two size classes (MAXLINE and MAXBUF). Buffers are handed out as
+  `PooledBuffer` handles, which return the buffer to the pool when destroyed. The pool counts the bytes of the buffers
+  that are handed out, so the memory held by connections shows in the metrics.
+
+  Each thread keeps a few idle buffers of its own in front of the shared pool, so a request borrows and returns its
+  buffers without taking the pool's lock. They go back to the shared pool when the thread exits.
+**/
+class BufferPool {
+ public:
+  class PooledBuffer {
+   public:
+    PooledBuffer(std::string &&buf, size_t bytes) : buf_(std::move(buf)), bytes_(bytes) {}
+    PooledBuffer(PooledBuffer &&other) : buf_(std::move(other.buf_)), bytes_(other.bytes_) { other.bytes_ = 0; }
+    PooledBuffer(const PooledBuffer &other) = delete;
+    ~PooledBuffer() { BufferPool::release(std::move(buf_), bytes_); }
+
+    // Return the buffer to the pool before the handle is destroyed, leaving it empty
+    void release() {
+      BufferPool::release(std::move(buf_), bytes_);
+      buf_   = std::string();
+      bytes_ = 0;
+    }
+
+    std::string       &operator*() { return buf_; }
+    std::string       *operator->() { return &buf_; }
+    const std::string &operator*() const { return buf_; }
+
+   private:
+    std::string buf_;
+    size_t      bytes_;  // Bytes counted as borrowed when the buffer was handed out
+  };
+
+  static PooledBuffer acquire(size_t size);
+  static void         release(std::string &&buf, size_t bytes = 0);
+  static size_t       num_idle() { return idle_.load(std::memory_order_relaxed); }
+  static size_t       idle_bytes() { return idle_bytes_.load(std::memory_order_relaxed); }
+  static size_t       num_borrowed() { return borrowed_.load(std::memory_order_relaxed); }
+  static size_t       borrowed_bytes() { return borrowed_bytes_.load(std::memory_order_relaxed); }
+
+ private:
+  // Idle buffers of one thread
+  struct ThreadBuffers {
+    std::vector<std::string> small, large;
+
+    ThreadBuffers();
+    ~ThreadBuffers();
+  };
+
+  static ThreadBuffers *thread_buffers();
+  static bool           release_shared(std::string &&buf);
+
+  static std::mutex               mutex_;
+  static std::vector<std::string> small_;
+  static std::vector<std::string> large_;
+  static std::atomic<size_t>      idle_;
+  static std::atomic<size_t>      idle_bytes_;
+  static std::atomic<size_t>      borrowed_;
+  static std::atomic<size_t>      borrowed_bytes_;
+};
+
+using PooledBuffer = BufferPool::PooledBuffer;
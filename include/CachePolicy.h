@@ -0,0 +1,63 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+
+#include "HTTPResponse.h"
+#include "URIKey.h"
+#include "types.h"
+#include "utils.h"
+
+// Most pages cached for less than the cache timeout at once, further ones are not cached
+#define CACHE_POLICY_MAX_TRACKED 65536
+// Shards of the tracked deadlines, each with its own mutex
+#define CACHE_POLICY_SHARDS 64
+
+/**
+  Freshness of the responses in the page cache, by status code and `Cache-Control`. The TTLs of responses without
+  explicit freshness are set from the command line with `-e <name>=<seconds>`:
+  - `200` responses are cached until the cache timeout, as before.
+  - `301` and `308` redirects are permanent, and get a heuristic freshness of `redirect` seconds.
+  - `404` and `410` responses are cached for `negative` seconds, so requests for missing assets stop reaching the
+    server without hiding a page that reappears for long.
+  - `302` and `307` redirects are only cached with explicit freshness, and other statuses never.
+
+  `s-maxage`, `max-age` and `Expires` replace these TTLs, and `no-store`, `no-cache` and `private` keep a response out
+  of the cache. No response is cached for longer than the cache timeout.
+
+  The page cache expires all its pages after the cache timeout, so the policy tracks the deadlines of the pages cached
+  for less, and a hit on a page past its deadline is a miss. The deadlines are sharded by key, each shard with its own
+  mutex, and a hit on a page whose shard tracks no deadline takes no lock at all.
+**/
+class CachePolicy {
+ public:
+  std::chrono::seconds redirect{300};  // Permanent redirects without explicit freshness
+  std::chrono::seconds negative{10};   // 404 and 410 responses without explicit freshness
+  std::chrono::seconds timeout{60};    // Cache timeout, the longest any response is cached
+
+  bool parse(const std::string &option);
+
+  std::chrono::seconds ttl(const HTTPResponse &response) const;
+  bool                 stored(const URIKey &key, std::chrono::seconds ttl);
+  bool                 fresh(const URIKey &key);
+  size_t               tracked() const { return tracked_.load(std::memory_order_relaxed); }
+
+  static CachePolicy &global();
+
+ private:
+  struct Shard {
+    std::mutex                             mutex;
+    std::unordered_map<URIKey, time_point> deadlines;
+    std::atomic<size_t>                    size{0};  // Size of `deadlines`, read without the mutex
+  };
+
+  Shard &shard(const URIKey &key) { return shards_[(key.hash() >> 32) % CACHE_POLICY_SHARDS]; }
+  void   resized(Shard &shard);
+
+  Shard               shards_[CACHE_POLICY_SHARDS];
+  std::atomic<size_t> tracked_{0};
+};
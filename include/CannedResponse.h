@@ -0,0 +1,10 @@
+#pragma once
+
+#include <string>
+
+#include "types.h"
+
+// Response sent to the client once a CONNECT tunnel is established
+#define TUNNEL_ESTABLISHED_RESPONSE "HTTP/1.1 200 OK\r\n\r\n"
+
+const std::string &canned_response(ResponseCode code, const std::string &version);
@@ -0,0 +1,15 @@
+#pragma once
+
+#include <zlib.h>
+
+#include <string>
+
+#include "types.h"
+#include "utils.h"
+
+// Bodies smaller than this are not worth the gzip header and CPU time
+#define MIN_COMPRESS_SIZE 256
+
+bool gzip_compress(const std::string &in, std::string &out, int level = Z_BEST_SPEED);
+bool gzip_decompress(const std::string &in, std::string &out, size_t size_hint = 0);
+bool accepts_encoding(const std::string &accept_encoding, const std::string &coding);
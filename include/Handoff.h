@@ -0,0 +1,72 @@
+#pragma once
+
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <utility>
+
+#include "Cache.h"
+#include "HTTPResponse.h"
+#include "Signaler.h"
+#include "URIKey.h"
+#include "types.h"
+#include "utils.h"
+
+// Most recently inserted pages that are passed to the next process
+#define HANDOFF_MAX_PAGES 65536
+
+/**
+  Zero-downtime restart. A new process started with `-H <path>` connects to the Unix socket at path, and the running
+  process passes it the listening socket with SCM_RIGHTS, followed by a snapshot of its page cache. The old process
+  then drains: it stops accepting, lets open connections finish their current request, and exits. The listening socket
+  is never closed, so no connection is refused during the restart. The handoff socket is created with mode 0600, and
+  both processes check with SO_PEERCRED that the other one runs as the same user.
+
+  The snapshot holds the most recently inserted pages that are still cached. Each one is sent as a record of
+  `uint32 age_ms, uint16 host_len, uint16 port_len, uint32 uri_len, uint64 size`, in host byte order, followed by the
+  host, port and path of its normalized URI and the uncompressed response. A record with an empty host ends the snapshot.
+**/
+class Handoff {
+ public:
+  Handoff(const std::string &path, std::shared_ptr<Cache<HTTPResponse, URIKey>> page_cache, std::chrono::seconds cache_timeout);
+  Handoff(const Handoff &other) = delete;
+  Handoff &operator=(const Handoff &other) = delete;
+  ~Handoff();
+
+  int  take_over();
+  bool serve(int listenfd);
+  void inserted(const URIKey &key);
+  void stopped_accepting() { stopped_accepting_ = true; }
+  void stop();
+
+ private:
+  using Page = std::pair<URIKey, time_point>;
+
+  void   run();
+  bool   send_listener(int fd);
+  void   write_snapshot(int fd);
+  size_t read_snapshot(int fd);
+  bool   address(struct sockaddr_un &addr) const;
+
+  std::string                                           path_;
+  std::shared_ptr<Cache<HTTPResponse, URIKey>>          page_cache_;
+  std::chrono::seconds                                  cache_timeout_;
+  int                                                   listenfd_ = -1;
+  int                                                   sockfd_   = -1;
+  pthread_t                                             main_thread_;
+  std::thread                                           thread_;
+  std::atomic<bool>                                     stopped_accepting_{false};
+  std::mutex                                            mutex_;
+  std::list<Page>                                       pages_;  // Inserted pages, most recent first
+  std::unordered_map<URIKey, std::list<Page>::iterator> index_;
+};
@@ -0,0 +1,134 @@
+#pragma once
+
+#include <strings.h>
+
+#include <cstdint>
+#include <cstring>
+#include <ostream>
+#include <string>
+#include <vector>
+
+#include "Arena.h"
+
+/**
+  Well-known header fields, interned to small integer IDs. Field names not in this list are stored as `Other` and
+  looked up by name.
+**/
+enum class Header : std::uint8_t {
+  Other = 0,
+  Accept,
+  AcceptEncoding,
+  AcceptLanguage,
+  AcceptRanges,
+  Age,
+  Authorization,
+  CacheControl,
+  Connection,
+  ContentEncoding,
+  ContentLength,
+  ContentRange,
+  ContentType,
+  Cookie,
+  Date,
+  ETag,
+  Expires,
+  Host,
+  IfModifiedSince,
+  IfNoneMatch,
+  IfRange,
+  KeepAlive,
+  LastModified,
+  Location,
+  Pragma,
+  ProxyAuthorization,
+  ProxyConnection,
+  Range,
+  Referer,
+  Server,
+  SetCookie,
+  TransferEncoding,
+  Upgrade,
+  UpgradeInsecureRequests,
+  UserAgent,
+  Vary,
+  Via,
+  NumHeaders
+};
+
+/**
+  Non-owning view of a string, used to refer to header names and values inside a HeaderTable's buffer
+**/
+struct StrView {
+  const char *data = nullptr;
+  size_t      size = 0;
+
+  StrView() {}
+  StrView(const char *data, size_t size) : data(data), size(size) {}
+
+  bool        empty() const { return size == 0; }
+  std::string str() const { return data ? std::string(data, size) : std::string(); }
+  bool        operator==(const char *other) const { return strlen(other) == size && strncmp(data, other, size) == 0; }
+  bool        operator==(const std::string &other) const { return other.size() == size && other.compare(0, size, data, size) == 0; }
+  bool        operator!=(const char *other) const { return !(*this == other); }
+  bool        iequals(const char *other) const { return strlen(other) == size && strncasecmp(data, other, size) == 0; }
+};
+
+std::ostream &operator<<(std::ostream &os, const StrView &view);
+
+const char *header_name(Header id);
+Header      header_id(const char *name, size_t len);
+
+/**
+  Compact table of HTTP header fields. The raw header block is copied once into the table's buffer, and each field is
+  stored as an ID plus offsets into that buffer. A value set after parsing overwrites the old value in place if it fits,
+  and is appended to the buffer otherwise. Once most of the buffer is no longer used, it is compacted.
+**/
+class HeaderTable {
+ public:
+  struct Entry {
+    Header        id;
+    std::uint32_t name_off;
+    std::uint32_t name_len;
+    std::uint32_t value_off;
+    std::uint32_t value_len;
+  };
+  using Buffer  = std::basic_string<char, std::char_traits<char>, ArenaAllocator<char>>;
+  using Entries = std::vector<Entry, ArenaAllocator<Entry>>;
+
+  HeaderTable(Arena *arena = nullptr);
+
+  void parse(const std::string &message, size_t pos);
+
+  bool    contains(Header id) const { return find(id) != entries_.end(); }
+  bool    contains(const std::string &name) const { return find(name) != entries_.end(); }
+  StrView get(Header id) const;
+  StrView get(const std::string &name) const;
+  void    set(Header id, StrView value);
+  void    set(Header id, const std::string &value) { set(id, StrView(value.data(), value.size())); }
+  void    set(const std::string &name, const std::string &value);
+  void    erase(Header id, size_t first = 0);
+  void    erase(const std::string &name, size_t first = 0);
+
+  StrView name(const Entry &entry) const;
+  StrView value(const Entry &entry) const { return StrView(&buf_[entry.value_off], entry.value_len); }
+  size_t  size() const { return entries_.size(); }
+  size_t  memory_usage() const { return buf_.capacity() + entries_.capacity() * sizeof(Entry); }
+
+  Entries::const_iterator begin() const { return entries_.begin(); }
+  Entries::const_iterator end() const { return entries_.end(); }
+
+  void dump(std::string &out) const;
+
+ private:
+  Entries::const_iterator find(Header id) const;
+  Entries::const_iterator find(const std::string &name) const;
+  Entries::iterator       remove(Entries::iterator it);
+  void                    overwrite(Entry &entry, StrView value);
+  void                    compact();
+  std::uint32_t           append(const char *data, size_t len);
+  void                    add(Header id, const char *name, size_t name_len, StrView value);
+
+  Buffer        buf_;
+  Entries       entries_;
+  std::uint32_t dead_ = 0;  // Bytes of the buffer no longer used by any field
+};
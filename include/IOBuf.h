@@ -0,0 +1,111 @@
+#pragma once
+
+#include <sys/uio.h>
+
+#include <atomic>
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <vector>
+
+// Size of the blocks I/O buffers are chained from
+#define IOBUF_BLOCK_SIZE 16384
+// Maximum number of idle blocks kept by the pool
+#define IOBUF_POOL_MAX_IDLE 1024
+
+/**
+  Block of an IOBuf, reference counted by the buffers sharing it. Bytes up to `size` are immutable once written, the
+  rest of the block is only written while a single buffer holds it. Blocks are IOBUF_BLOCK_SIZE bytes, except the
+  exact-size blocks small bodies are compacted into. The bytes are allocated right behind the block.
+**/
+struct IOBlock {
+  std::atomic<std::uint32_t> refs{1};
+  std::uint32_t              size     = 0;
+  std::uint32_t              capacity = IOBUF_BLOCK_SIZE;
+  char                      *data     = reinterpret_cast<char *>(this + 1);
+};
+
+/**
+  Process-wide pool of the blocks of I/O buffers, so that reading a body does not allocate from the global heap once
+  the pool is warm. Only full-size blocks are pooled, exact-size blocks are freed when released.
+**/
+class IOBlockPool {
+ public:
+  static IOBlock *acquire(size_t capacity = IOBUF_BLOCK_SIZE);
+  static void     release(IOBlock *block);
+  static size_t   num_idle();
+  static size_t   num_allocated() { return allocated_.load(std::memory_order_relaxed); }
+  static size_t   allocated_bytes() { return allocated_bytes_.load(std::memory_order_relaxed); }
+
+ private:
+  static IOBlock *allocate(size_t capacity);
+  static void     free(IOBlock *block);
+
+  static std::mutex             mutex_;
+  static std::vector<IOBlock *> idle_;
+  static std::atomic<size_t>    allocated_;
+  static std::atomic<size_t>    allocated_bytes_;
+};
+
+/**
+  Chained I/O buffer. The bytes are held in a list of segments of pooled, reference counted blocks, so a buffer grows
+  without reallocating or copying what it holds, and copies, slices and appended buffers share blocks instead of
+  copying bytes. A buffer is sent with a single sendmsg(2) through iovecs(), and read into with prepare() and commit().
+
+  Only the tail of the last block is ever written, and only while the buffer is its single holder, so shared bytes are
+  never modified and a buffer may be shared between threads once it is no longer written.
+**/
+class IOBuf {
+ public:
+  IOBuf() = default;
+  IOBuf(const IOBuf &other);
+  IOBuf(IOBuf &&other) noexcept;
+  ~IOBuf();
+
+  IOBuf &operator=(const IOBuf &other);
+  IOBuf &operator=(IOBuf &&other) noexcept;
+
+  size_t size() const { return size_; }
+  bool   empty() const { return size_ == 0; }
+  size_t num_blocks() const { return segments_.size(); }
+  size_t block_bytes() const;
+  void   clear();
+  void   compact();
+
+  void  append(const char *data, size_t size);
+  void  append(std::string_view data) { append(data.data(), data.size()); }
+  void  append(const IOBuf &other);
+  void  append(const IOBuf &other, size_t offset, size_t length);
+  IOBuf slice(size_t offset, size_t length) const;
+
+  char *prepare(size_t &room);
+  void  commit(size_t size);
+
+  void        iovecs(std::vector<struct iovec> &iov) const;
+  void        copy_to(std::string &out) const;
+  std::string str() const;
+  bool        operator==(const IOBuf &other) const;
+
+  /**
+    @brief Call a function on each contiguous run of bytes of the buffer, in order
+
+    @param[in]  f  Function called with a pointer and a length
+  **/
+  template <typename F>
+  void for_each(F &&f) const {
+    for (const auto &segment : segments_) f(segment.block->data + segment.offset, segment.length);
+  }
+
+ private:
+  struct Segment {
+    IOBlock      *block;
+    std::uint32_t offset;
+    std::uint32_t length;
+  };
+
+  void add_segment(IOBlock *block, std::uint32_t offset, std::uint32_t length);
+
+  std::vector<Segment> segments_;
+  size_t               size_ = 0;
+};
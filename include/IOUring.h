@@ -0,0 +1,149 @@
+#pragma once
+
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <coroutine>
+#include <cstdint>
+#include <cstring>
+#include <vector>
+
+#include "Signaler.h"
+#include "types.h"
+#include "utils.h"
+
+// Number of submission queue entries per ring
+#define IOURING_ENTRIES 64
+// Number of submission queue entries of a shared reactor's ring, the most operations it submits in one call
+#define IOURING_REACTOR_ENTRIES 256
+// Number of fixed file slots registered per ring of a connection thread, which uses one or two
+#define IOURING_MAX_FILES 16
+// Upper bound of the fixed file table of a shared reactor's ring, which is sized from the connection limit
+#define IOURING_MAX_REACTOR_FILES 32768
+
+// user_data tags for operations that do not belong to a Connection
+#define IOURING_TAG_ACCEPT 1
+#define IOURING_TAG_CANCEL 2
+// First user_data used for synchronous operations, each gets a unique tag
+#define IOURING_TAG_SYNC 1024
+// Set in the user_data of asynchronous operations, whose other bits are the address of the awaiting Op
+#define IOURING_TAG_OP (1ULL << 63)
+
+enum class IOBackend { Syscall, IOUring };
+
+/**
+  Minimal io_uring wrapper built directly on the io_uring_setup/io_uring_enter/io_uring_register system calls. Each
+  thread gets its own ring through `thread_ring()`, with a sparse table of fixed files.
+
+  Connection threads run synchronous operations, each submitted and waited for in one io_uring_enter call. Shared
+  reactors run asynchronous ones instead: a coroutine prepares its operation and suspends, the reactor submits the
+  operations of all its coroutines in one io_uring_enter call per loop and resumes each coroutine from its completion.
+**/
+class IOUring {
+ public:
+  // Awaitable asynchronous operation, resumes with its result, or -errno
+  class Op {
+   public:
+    Op(io_uring_sqe *sqe) : sqe_(sqe) {}
+
+    bool await_ready() const { return !sqe_; }
+    void await_suspend(std::coroutine_handle<> handle);
+    int  await_resume();
+
+   private:
+    friend class IOUring;
+
+    io_uring_sqe           *sqe_;
+    std::coroutine_handle<> handle_;
+    int                     res_           = -EBUSY;
+    std::uint64_t           trace_request_ = 0;
+  };
+
+  IOUring(unsigned entries = IOURING_ENTRIES, unsigned files = IOURING_MAX_FILES);
+  IOUring(const IOUring &other) = delete;
+  IOUring &operator=(const IOUring &other) = delete;
+  ~IOUring();
+
+  static IOUring &thread_ring(unsigned entries = IOURING_ENTRIES, unsigned files = IOURING_MAX_FILES);
+  static unsigned reactor_files(unsigned connections);
+  static bool     supported();
+  static bool     supports(std::uint8_t opcode);
+  static bool     supports_multishot_accept();
+  static bool     supports_multishot_recv();
+
+  bool ok() const { return ring_fd_ >= 0; }
+  int  fd() const { return ring_fd_; }
+  bool no_drop() const { return features_ & IORING_FEAT_NODROP; }
+  bool pending() const { return sqe_tail_ != sqe_flushed_; }
+
+  io_uring_sqe *get_sqe();
+  int           submit(unsigned wait_nr = 0);
+  bool          peek_cqe(io_uring_cqe &cqe);
+  bool          wait_cqe(io_uring_cqe &cqe);
+
+  // Fixed files
+  int  register_file(int fd);
+  void unregister_file(int slot);
+
+  // Registered buffers
+  int register_buffers(const struct iovec *iovecs, unsigned n);
+  int unregister_buffers();
+
+  // Synchronous operations, submitted and waited for in one io_uring_enter call
+  int  recv(int fd, bool fixed, char *buf, size_t n, int flags);
+  int  send(int fd, bool fixed, const char *buf, size_t n, int flags);
+  int  sendmsg(int fd, bool fixed, const struct msghdr *msg, int flags);
+  int  accept(int listenfd);
+  void cancel_accept(std::vector<int> &accepted);
+
+  // Asynchronous operations, submitted with the next `submit()` and resumed by `complete()`
+  Op     async_recv(int fd, bool fixed, char *buf, size_t n, int flags);
+  Op     async_send(int fd, bool fixed, const char *buf, size_t n, int flags);
+  Op     async_sendmsg(int fd, bool fixed, const struct msghdr *msg, int flags);
+  size_t complete();
+
+ private:
+  int           enter(unsigned to_submit, unsigned min_complete, unsigned flags);
+  int           wait_for(std::uint64_t user_data, unsigned position);
+  io_uring_sqe *async_sqe();
+  void       flush();
+  static int test_op(const io_uring_sqe &op, bool cancel);
+
+  int ring_fd_ = -1;
+
+  // Submission queue
+  void         *sq_ptr_      = nullptr;
+  size_t        sq_size_     = 0;
+  unsigned     *sq_head_     = nullptr;
+  unsigned     *sq_tail_     = nullptr;
+  unsigned     *sq_mask_     = nullptr;
+  unsigned     *sq_flags_    = nullptr;
+  unsigned     *sq_array_    = nullptr;
+  io_uring_sqe *sqes_        = nullptr;
+  size_t        sqes_size_   = 0;
+  unsigned      sqe_tail_    = 0;
+  unsigned      sqe_flushed_ = 0;
+  unsigned      sq_entries_  = 0;
+
+  // Completion queue
+  void         *cq_ptr_  = nullptr;
+  size_t        cq_size_ = 0;
+  unsigned     *cq_head_ = nullptr;
+  unsigned     *cq_tail_ = nullptr;
+  unsigned     *cq_mask_ = nullptr;
+  io_uring_cqe *cqes_    = nullptr;
+
+  std::uint64_t next_sync_ = IOURING_TAG_SYNC;
+  unsigned      features_  = 0;
+
+  // Sparse fixed file table, and its free slots
+  std::vector<int> files_;
+  std::vector<int> free_files_;
+  bool             files_registered_ = false;
+  bool             accept_armed_     = false;
+};
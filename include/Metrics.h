@@ -0,0 +1,122 @@
+#pragma once
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "Signaler.h"
+#include "types.h"
+#include "utils.h"
+
+// Number of shards per metric, threads are spread over the shards round-robin
+#define METRICS_SHARDS 16
+// Histograms keep 2^HISTOGRAM_SUB_BITS linear sub-buckets per power of two, i.e. ~6% relative precision
+#define HISTOGRAM_SUB_BITS 4
+#define HISTOGRAM_SUB_COUNT (1 << HISTOGRAM_SUB_BITS)
+// Values with a higher exponent (~2.4 hours in nanoseconds) are counted in the last bucket
+#define HISTOGRAM_MAX_EXP 43
+#define HISTOGRAM_BUCKETS (HISTOGRAM_SUB_COUNT + (HISTOGRAM_MAX_EXP - HISTOGRAM_SUB_BITS + 1) * HISTOGRAM_SUB_COUNT)
+
+/**
+  @brief Get the metrics shard of the calling thread
+
+  @return  Shard index, fixed for the lifetime of the thread
+**/
+inline unsigned metrics_shard() {
+  static std::atomic<unsigned> next{0};
+  static thread_local unsigned shard = next++ % METRICS_SHARDS;
+  return shard;
+}
+
+/**
+  Monotonic counter, sharded so that threads increment different cache lines
+**/
+class Counter {
+ public:
+  Counter();
+
+  void          add(std::uint64_t n = 1) { shards_[metrics_shard()].value.fetch_add(n, std::memory_order_relaxed); }
+  std::uint64_t value() const;
+
+ private:
+  struct alignas(64) Shard {
+    std::atomic<std::uint64_t> value;
+  };
+  Shard shards_[METRICS_SHARDS];
+};
+
+/**
+  Log-linear (HDR-style) histogram of nanosecond values. Recording is a relaxed increment of one bucket in the thread's
+  shard, the shards are only merged when the histogram is read.
+**/
+class Histogram {
+ public:
+  Histogram();
+
+  void record(std::uint64_t value) {
+    Shard &shard = shards_[metrics_shard()];
+    shard.counts[bucket(value)].fetch_add(1, std::memory_order_relaxed);
+    shard.sum.fetch_add(value, std::memory_order_relaxed);
+  }
+  void record(myclock::duration duration) { record(std::chrono::duration_cast<std::chrono::nanoseconds>(duration).count()); }
+
+  void          snapshot(std::vector<std::uint64_t> &counts, std::uint64_t &sum) const;
+  std::uint64_t count() const;
+  std::uint64_t quantile(double q) const;
+
+  static size_t        bucket(std::uint64_t value);
+  static std::uint64_t bucket_upper(size_t bucket);
+
+ private:
+  struct alignas(64) Shard {
+    std::atomic<std::uint64_t> counts[HISTOGRAM_BUCKETS];
+    std::atomic<std::uint64_t> sum;
+  };
+  Shard shards_[METRICS_SHARDS];
+};
+
+/**
+  Process-wide metrics, exported in the Prometheus text format
+**/
+struct Metrics {
+  static Counter connections;
+  static Counter requests;
+  static Counter cache_hits;
+  static Counter cache_misses;
+  static Counter error_responses;
+  static Counter dns_cache_hits;
+  static Counter tunnel_bytes_upstream;
+  static Counter tunnel_bytes_downstream;
+  static Counter tunnel_stalls_upstream;
+  static Counter tunnel_stalls_downstream;
+  static Counter rejected_overloaded;
+  static Counter rejected_client_limit;
+  static Counter rate_limited_requests;
+  static Counter peer_requests;
+  static Counter peer_failures;
+  static Counter peer_requests_received;
+  static Counter vary_uncacheable;
+  static Counter body_dedup_hits;
+  static Counter frame_bytes_allocated;
+  static Counter frame_bytes_freed;
+
+  static Histogram accept;
+  static Histogram parse;
+  static Histogram cache_lookup;
+  static Histogram dns;
+  static Histogram connect;
+  static Histogram upstream_ttfb;
+  static Histogram client_write;
+
+  static std::string prometheus();
+  static bool        serve(int port);
+};
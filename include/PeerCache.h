@@ -0,0 +1,67 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "Cache.h"
+#include "Connection.h"
+#include "HTTPRequest.h"
+#include "HTTPResponse.h"
+#include "Task.h"
+#include "URIKey.h"
+#include "types.h"
+#include "utils.h"
+
+// Points of each member on the hash ring, more points spread the URLs more evenly
+#define PEER_CACHE_VNODES 160
+// Idle keep-alive connections kept open to each peer
+#define PEER_CACHE_MAX_IDLE 64
+// Time a peer that could not be reached is skipped, its URLs are fetched from the server meanwhile
+#define PEER_CACHE_RETRY_MS 5000
+// Header of requests forwarded by a peer, which are answered from the cache or the server and never forwarded again
+#define PEER_CACHE_HEADER "X-Peer-Cache"
+
+/**
+  Sibling proxy in the cache cluster, with a pool of idle keep-alive connections to it
+**/
+struct Peer {
+  std::string             name;     // host:port, as given on the command line
+  ProxyURI                address;  // Host and port to connect to
+  std::mutex              mutex;
+  std::vector<Connection> idle;
+  std::atomic<time_point> down_until{time_point()};
+};
+
+/**
+  Cache cluster of sibling proxies, set from the command line with `-P <host>:<port>` for every member and
+  `-I <host>:<port>` for this proxy. Each URL is owned by one member, picked by consistent hashing of the URL on a ring
+  with PEER_CACHE_VNODES points per member, so adding or removing a member only moves the URLs it owns. A cache miss for
+  a URL owned by another member is fetched from that member, which answers from its cache or fetches the URL from the
+  server and caches it, so each object is fetched from the server and stored once in the cluster.
+**/
+class PeerCache {
+ public:
+  bool add(const std::string &peer);
+  void configure(const std::string &self, std::shared_ptr<Cache<AddrInfo, URIKey>> ip_cache);
+  void close();
+  bool enabled() const { return !ring_.empty(); }
+
+  Peer                               *owner(const URIKey &key) const;
+  Task<std::unique_ptr<HTTPResponse>> fetch(Peer &peer, const HTTPRequest &request, std::string &buf);
+
+  static PeerCache &global();
+
+ private:
+  Connection acquire(Peer &peer, bool &reused);
+  void       release(Peer &peer, Connection &&connection);
+
+  std::string                                   self_;
+  std::shared_ptr<Cache<AddrInfo, URIKey>>      ip_cache_;
+  std::vector<std::unique_ptr<Peer>>            peers_;
+  std::vector<std::pair<std::uint64_t, Peer *>> ring_;  // Sorted by point, nullptr is this proxy
+};
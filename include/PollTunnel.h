@@ -0,0 +1,48 @@
+#pragma once
+
+#include <sys/socket.h>
+
+#include <chrono>
+#include <cstdint>
+
+#include "BufferPool.h"
+#include "Connection.h"
+#include "Reactor.h"
+#include "Signaler.h"
+#include "Task.h"
+#include "TimerWheel.h"
+#include "utils.h"
+
+/**
+  CONNECT tunnel driven by socket readiness on the calling thread's reactor, used with the system call backend and on
+  shared reactors. Each direction is a coroutine with a bounded buffer of MAXBUF bytes, borrowed from the BufferPool
+  only while it has data to forward, which writes what it read to the other side before reading again, so a slow
+  receiver stops its peer from being read instead of stalling the other direction.
+  When one side shuts down its output, the other side's output is shut down once the buffer is flushed, and the tunnel
+  stays open in the other direction.
+**/
+class PollTunnel {
+ public:
+  PollTunnel(Connection &client, Connection &server);
+  PollTunnel(const PollTunnel &other) = delete;
+  PollTunnel &operator=(const PollTunnel &other) = delete;
+
+  Task<void>    run(std::chrono::milliseconds idle_timeout);
+  std::uint64_t bytes() const { return dirs_[0].bytes + dirs_[1].bytes; }
+
+ private:
+  // Data read from conns_[i] and written to conns_[1 - i]
+  struct Direction {
+    bool          closed = false;  // Output of conns_[1 - i] was shut down after conns_[i] shut down its output
+    std::uint64_t bytes  = 0;
+    std::uint64_t stalls = 0;  // Times reading stopped until the receiver made room
+  };
+
+  Task<void> pump(int i);
+  void       fail();
+
+  Connection *conns_[2];
+  Direction   dirs_[2];
+  bool        failed_ = false;
+  Timer       idle_timer_;
+};
@@ -0,0 +1,31 @@
+#pragma once
+
+#include <sys/types.h>
+
+#include <vector>
+
+#include "Signaler.h"
+#include "utils.h"
+
+// Delay before a worker that exited is replaced, so a worker that crashes on startup does not spin
+#define PREFORK_RESPAWN_MS 100
+// Interval at which the supervisor checks for exited workers and signals to pass on
+#define PREFORK_POLL_MS 100
+
+/**
+  Prefork mode, set from the command line with `-w <workers>`. The main process opens the listening socket and the
+  shared page cache, then forks the workers, which accept connections from the same socket and serve them as a single
+  process would. A worker that crashes only takes down its own connections, and is replaced.
+
+  The main process becomes a supervisor: it forwards SIGINT and SIGTERM to the workers, and exits once all of them have.
+**/
+class Prefork {
+ public:
+  static int run(unsigned workers);
+  static int worker() { return worker_; }
+
+ private:
+  static int spawn(std::vector<pid_t> &pids, unsigned index);
+
+  static int worker_;
+};
@@ -0,0 +1,28 @@
+#pragma once
+
+#include <cstdint>
+#include <random>
+#include <string>
+#include <vector>
+
+#include "types.h"
+#include "utils.h"
+
+// Requests with more ranges than this are served the full body instead
+#define MAX_RANGES 16
+
+/**
+  Inclusive byte range [first, last] of a response body
+**/
+struct ByteRange {
+  std::uint64_t first;
+  std::uint64_t last;
+
+  std::uint64_t length() const { return last - first + 1; }
+};
+
+enum class RangeStatus { None, Satisfiable, Unsatisfiable };
+
+RangeStatus parse_range(const std::string &value, std::uint64_t length, std::vector<ByteRange> &ranges);
+std::string content_range(const ByteRange &range, std::uint64_t length);
+std::string multipart_boundary();
@@ -0,0 +1,171 @@
+#pragma once
+
+#include <sys/epoll.h>
+
+#include <atomic>
+#include <condition_variable>
+#include <coroutine>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include "IOUring.h"
+#include "Signaler.h"
+#include "Task.h"
+#include "utils.h"
+
+// Interval at which a reactor checks for shutdown when no socket is ready
+#define REACTOR_TICK_MS 200
+// Maximum number of events handled per epoll_wait call
+#define REACTOR_MAX_EVENTS 256
+// Number of helper threads running the blocking calls offloaded by shared reactors
+#define REACTOR_OFFLOAD_THREADS 4
+
+/**
+  Event loop that runs coroutines on one thread. A coroutine that would block on a socket awaits `readable()` or
+  `writable()` and is resumed by the reactor once epoll reports the socket ready; sockets are registered edge-triggered
+  on their first wait, so a connection costs one epoll_ctl for its lifetime.
+
+  Shared reactors run on threads of their own, one per core, and serve thousands of connections each: socket
+  operations of their coroutines wait for readiness, and blocking calls such as getaddrinfo() are offloaded to a small
+  pool of helper threads. With io_uring, a shared reactor's coroutines hand their socket operations to the reactor's
+  ring instead, which submits them all in one call per loop and resumes each coroutine from its completion. Every
+  other thread has a private reactor, used by `block_on()`: there, socket operations
+  just block, and only coroutines that wait on several sockets at once, such as tunnels, use epoll.
+**/
+class Reactor {
+ public:
+  // Awaitable readiness of a socket, resumes with false if the reactor is shutting down
+  class Wait {
+   public:
+    Wait(Reactor &reactor, int fd, bool write) : reactor_(reactor), fd_(fd), write_(write) {}
+
+    bool await_ready();
+    void await_suspend(std::coroutine_handle<> handle);
+    bool await_resume();
+
+   private:
+    Reactor      &reactor_;
+    int           fd_;
+    bool          write_;
+    bool          ok_            = true;
+    std::uint64_t trace_request_ = 0;
+  };
+
+  // Awaitable that runs a blocking function on a helper thread of the offload pool and resumes on the reactor
+  class Offload {
+   public:
+    Offload(Reactor &reactor, std::function<void()> fn) : reactor_(reactor), fn_(std::move(fn)) {}
+
+    bool await_ready();
+    void await_suspend(std::coroutine_handle<> handle);
+    void await_resume();
+
+   private:
+    Reactor              &reactor_;
+    std::function<void()> fn_;
+    bool                  suspended_     = false;
+    std::uint64_t         trace_request_ = 0;
+  };
+
+  // Awaitable that moves the awaiting coroutine onto the reactor's thread
+  class Schedule {
+   public:
+    Schedule(Reactor &reactor) : reactor_(reactor) {}
+
+    bool await_ready() const { return false; }
+    void await_suspend(std::coroutine_handle<> handle) { reactor_.post(handle); }
+    void await_resume() {}
+
+   private:
+    Reactor &reactor_;
+  };
+
+  Reactor(bool shared = false);
+  Reactor(const Reactor &other) = delete;
+  Reactor &operator=(const Reactor &other) = delete;
+  ~Reactor();
+
+  Wait     readable(int fd) { return Wait(*this, fd, false); }
+  Wait     writable(int fd) { return Wait(*this, fd, true); }
+  Offload  offload(std::function<void()> fn) { return Offload(*this, std::move(fn)); }
+  Schedule schedule() { return Schedule(*this); }
+  void     forget(int fd);
+
+  void     post(std::coroutine_handle<> handle);
+  void     spawn(Task<void> task);
+  void     run_once(int timeout_ms);
+  bool     shared() const { return shared_; }
+  IOUring *ring() const { return ring_; }
+  size_t   tasks() const { return tasks_; }
+
+  template <typename T>
+  static T block_on(Task<T> task);
+
+  static Reactor &current();
+  static void     start(unsigned threads, unsigned ring_files = 0);
+  static void     stop();
+  static Reactor &next();
+  static bool     running() { return !reactors_.empty(); }
+
+ private:
+  // Coroutines waiting on a socket, and readiness reported while none was waiting
+  struct Waiters {
+    std::uint32_t           generation = 0;
+    std::coroutine_handle<> reader, writer;
+    bool                    readable = false, writable = false;
+  };
+
+  bool     open();
+  void     open_ring();
+  Waiters *waiters(int fd);
+  void     wake_all();
+  void     run();
+
+  static Detached run_detached(Reactor &reactor, Task<void> task);
+  static void     offload_run();
+
+  bool                                 shared_;
+  int                                  epollfd_    = -1;
+  int                                  eventfd_    = -1;
+  std::uint32_t                        generation_ = 0;
+  std::unordered_map<int, Waiters>     waiters_;
+  std::mutex                           posted_mutex_;
+  std::vector<std::coroutine_handle<>> posted_, running_;
+  std::atomic<size_t>                  tasks_{0};
+  std::atomic<bool>                    stop_{false};
+  std::thread                          thread_;
+  IOUring                             *ring_ = nullptr;
+
+  static std::vector<std::unique_ptr<Reactor>> reactors_;
+  static std::atomic<unsigned>                 next_;
+  static unsigned                              ring_files_;
+
+  // Offload pool shared by all reactors
+  static std::mutex                        offload_mutex_;
+  static std::condition_variable           offload_ready_;
+  static std::deque<std::function<void()>> offload_queue_;
+  static std::vector<std::thread>          offload_threads_;
+  static bool                              offload_stop_;
+};
+
+/**
+  @brief Run a task to completion on the calling thread's private reactor. Must not be called on a shared reactor's
+  thread, which would stall every other coroutine on it.
+
+  @param[in]  task  Task to run
+
+  @return  Result of the task
+**/
+template <typename T>
+T Reactor::block_on(Task<T> task) {
+  Reactor &reactor = current();
+  task.start();
+  while (!task.done()) reactor.run_once(REACTOR_TICK_MS);
+  return task.result();
+}
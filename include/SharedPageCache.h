@@ -0,0 +1,116 @@
+#pragma once
+
+#include <pthread.h>
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <string>
+
+#include "HTTPRequest.h"
+#include "HTTPResponse.h"
+#include "URIKey.h"
+#include "types.h"
+#include "utils.h"
+
+// Default size of the shared memory segment
+#define SHARED_CACHE_DEFAULT_MB 256
+// Size of a slab, also the largest response that can be cached
+#define SHARED_CACHE_SLAB_SIZE (1 << 20)
+// Size of the smallest chunk, each size class is 1.25 times the previous one
+#define SHARED_CACHE_MIN_CHUNK 512
+// Slots of the index probed for a key, a key is not found beyond them
+#define SHARED_CACHE_PROBES 16
+// Expected average size of a cached response, used to size the index
+#define SHARED_CACHE_AVG_PAGE 4096
+// Handle of no chunk
+#define SHARED_CACHE_NO_CHUNK (~0ULL)
+
+/**
+  Page cache shared by the worker processes of prefork mode, in an anonymous shared memory segment mapped before the
+  workers are forked. Responses are stored serialized and uncompressed, and a hit is sent straight from shared memory.
+
+  The index is an open-addressed hash table of slots, each protected by a seqlock, so lookups take no lock: a reader
+  retries if the slot's sequence number was odd or changed while it read the slot. Allocations, evictions and updates
+  of the index are serialized by a robust process-shared mutex, so a worker that dies while holding it does not block
+  the others. A store only holds it to reserve a chunk and then to publish it, the response is copied in between.
+
+  Responses live in chunks carved out of 1 MB slabs, in size classes 1.25 times apart. Each chunk is reference counted:
+  the index holds one reference and every reader sending it holds another, so a chunk evicted while it is sent is only
+  reused once the last reader is done. A full size class evicts its own chunks, with a CLOCK sweep over the index that
+  spares recently hit entries. Once a class has evicted a slab's worth of them, it takes a slab from a class that
+  evicted less instead, so the slabs follow the sizes of the responses cached.
+**/
+class SharedPageCache {
+ public:
+  // Cached response, pinned in shared memory until the page is destroyed
+  class Page {
+   public:
+    Page() = default;
+    Page(Page &&other) noexcept;
+    Page &operator=(Page &&other) noexcept;
+    Page(const Page &other) = delete;
+    Page &operator=(const Page &other) = delete;
+    ~Page();
+
+    explicit operator bool() const { return handle_ != SHARED_CACHE_NO_CHUNK; }
+    const char  *data() const;
+    size_t       size() const;
+    int          status() const;
+    bool         sendable(const HTTPRequest &request) const;
+    HTTPResponse response(const ProxyURI &uri) const;
+
+   private:
+    friend class SharedPageCache;
+    Page(SharedPageCache *cache, std::uint64_t handle) : cache_(cache), handle_(handle) {}
+
+    SharedPageCache *cache_  = nullptr;
+    std::uint64_t    handle_ = SHARED_CACHE_NO_CHUNK;
+  };
+
+  SharedPageCache() = default;
+  SharedPageCache(const SharedPageCache &other) = delete;
+  SharedPageCache &operator=(const SharedPageCache &other) = delete;
+  ~SharedPageCache();
+
+  bool open(size_t bytes, std::chrono::seconds timeout);
+  bool enabled() const { return segment_ != nullptr; }
+  Page get(const URIKey &uri);
+  bool put(const URIKey &uri, const HTTPResponse &response, std::chrono::seconds ttl);
+
+  std::uint64_t entries() const;
+  std::uint64_t bytes() const;
+  std::uint64_t evictions() const;
+  std::uint64_t reassignments() const;
+
+  static SharedPageCache &global();
+
+ private:
+  struct Segment;
+  struct Slot;
+  struct Slab;
+  struct Pin;
+  struct Chunk;
+
+  Slot         *slot(std::uint64_t index) const;
+  Slab         *slab(std::uint64_t index) const;
+  Pin          &pin(std::uint64_t handle) const;
+  Chunk        *chunk(std::uint64_t handle) const;
+  std::uint64_t allocate(unsigned cls);
+  bool          evict(unsigned cls);
+  bool          reassign(unsigned cls);
+  bool          vacate(std::uint64_t index);
+  void          carve(std::uint64_t index, unsigned cls);
+  void          remove(Slot &slot);
+  void          release(std::uint64_t handle);
+  void          release_locked(std::uint64_t handle);
+  void          lock();
+  void          unlock() { pthread_mutex_unlock(&mutex()); }
+
+  pthread_mutex_t &mutex() const;
+
+  Segment             *segment_ = nullptr;
+  char                *base_   = nullptr;
+  size_t               size_   = 0;
+  std::chrono::seconds timeout_{0};
+};
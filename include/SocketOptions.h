@@ -0,0 +1,52 @@
+#pragma once
+
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+
+#include <string>
+
+#include "utils.h"
+
+// Role of a socket, each role has its own profile of options
+enum class SocketRole {
+  Listener,  // Listening socket of the proxy
+  Client,    // Connection accepted from a client
+  Upstream,  // Connection to a server
+};
+
+const char *to_string(SocketRole role);
+
+/**
+  Kernel options of a socket. A value of 0 leaves the kernel default, except for nodelay, which is applied as set.
+**/
+struct SocketProfile {
+  bool nodelay            = false;  // TCP_NODELAY, sends small writes right away instead of waiting for an ACK
+  int  fastopen           = 0;      // Listener: TCP_FASTOPEN queue length. Upstream: 1 for TCP_FASTOPEN_CONNECT
+  int  defer_accept       = 0;      // Listener: seconds TCP_DEFER_ACCEPT waits for the first data of a connection
+  int  notsent_lowat      = 0;      // TCP_NOTSENT_LOWAT, bytes of unsent data below which the socket is writable
+  int  rcvbuf             = 0;      // SO_RCVBUF in bytes
+  int  sndbuf             = 0;      // SO_SNDBUF in bytes
+  int  keepalive          = 0;      // SO_KEEPALIVE with TCP_KEEPIDLE, seconds of idle time before the first probe
+  int  keepalive_interval = 0;      // TCP_KEEPINTVL, seconds between probes
+  int  keepalive_count    = 0;      // TCP_KEEPCNT, unanswered probes before the connection is dropped
+};
+
+/**
+  Socket option profiles for each socket role, set from the command line with `-s <role>.<name>=<value>`. By default
+  client and upstream sockets use TCP_NODELAY, since the proxy writes whole responses and requests at once, and Nagle's
+  algorithm would hold back their last segment until the peer's delayed ACK.
+**/
+class SocketOptions {
+ public:
+  SocketOptions();
+
+  bool                 parse(const std::string &option);
+  void                 apply(int fd, SocketRole role) const;
+  const SocketProfile &profile(SocketRole role) const { return profiles_[static_cast<int>(role)]; }
+
+  static SocketOptions &global();
+
+ private:
+  SocketProfile profiles_[3];
+};
@@ -0,0 +1,164 @@
+#pragma once
+
+#include <coroutine>
+#include <cstddef>
+#include <exception>
+#include <utility>
+
+/**
+  Lazily started coroutine returning a T, the unit of work of a connection on a Reactor. A Task starts when it is
+  awaited, and resumes its awaiter when it finishes, so nested `co_await`s read like the blocking calls they replace.
+  Exceptions are rethrown in the awaiter. T must be default constructible.
+**/
+template <typename T = void>
+class Task;
+
+namespace task_detail {
+
+// Allocate and free coroutine frames, counting their bytes in the metrics. Defined in Metrics.cpp
+void *allocate_frame(std::size_t size);
+void  free_frame(void *frame, std::size_t size);
+
+struct PromiseBase {
+  std::coroutine_handle<> continuation = std::noop_coroutine();
+  std::exception_ptr      exception;
+
+  // The frames of suspended tasks are most of the memory held by an idle connection
+  static void *operator new(std::size_t size) { return allocate_frame(size); }
+  static void  operator delete(void *frame, std::size_t size) { free_frame(frame, size); }
+
+  // Hand control back to the awaiter once the task is done
+  struct FinalAwaiter {
+    bool await_ready() noexcept { return false; }
+    template <typename P>
+    std::coroutine_handle<> await_suspend(std::coroutine_handle<P> handle) noexcept {
+      return handle.promise().continuation;
+    }
+    void await_resume() noexcept {}
+  };
+
+  std::suspend_always initial_suspend() noexcept { return {}; }
+  FinalAwaiter        final_suspend() noexcept { return {}; }
+  void                unhandled_exception() { exception = std::current_exception(); }
+};
+
+template <typename T>
+struct Promise : PromiseBase {
+  T value{};
+
+  Task<T> get_return_object();
+  template <typename U>
+  void return_value(U &&v) {
+    value = std::forward<U>(v);
+  }
+  T result() {
+    if (exception) std::rethrow_exception(exception);
+    return std::move(value);
+  }
+};
+
+template <>
+struct Promise<void> : PromiseBase {
+  Task<void> get_return_object();
+  void       return_void() {}
+  void       result() {
+    if (exception) std::rethrow_exception(exception);
+  }
+};
+
+}  // namespace task_detail
+
+template <typename T>
+class Task {
+ public:
+  using promise_type = task_detail::Promise<T>;
+  using handle_type  = std::coroutine_handle<promise_type>;
+
+  Task() = default;
+  explicit Task(handle_type handle) : handle_(handle) {}
+  Task(Task &&other) noexcept : handle_(std::exchange(other.handle_, nullptr)) {}
+  Task &operator=(Task &&other) noexcept {
+    if (this != &other) {
+      if (handle_) handle_.destroy();
+      handle_ = std::exchange(other.handle_, nullptr);
+    }
+    return *this;
+  }
+  Task(const Task &other) = delete;
+  Task &operator=(const Task &other) = delete;
+  ~Task() {
+    if (handle_) handle_.destroy();
+  }
+
+  bool done() const { return !handle_ || handle_.done(); }
+
+  // Start the task from a coroutine, which is resumed with the result once the task is done
+  bool                    await_ready() const noexcept { return !handle_ || handle_.done(); }
+  std::coroutine_handle<> await_suspend(std::coroutine_handle<> awaiter) noexcept {
+    handle_.promise().continuation = awaiter;
+    return handle_;
+  }
+  T await_resume() { return handle_.promise().result(); }
+
+  // Start the task from outside of a coroutine, it runs until its first suspension
+  void start() { handle_.resume(); }
+  T    result() { return handle_.promise().result(); }
+
+ private:
+  handle_type handle_ = nullptr;
+};
+
+namespace task_detail {
+
+template <typename T>
+Task<T> Promise<T>::get_return_object() {
+  return Task<T>(std::coroutine_handle<Promise<T>>::from_promise(*this));
+}
+
+inline Task<void> Promise<void>::get_return_object() {
+  return Task<void>(std::coroutine_handle<Promise<void>>::from_promise(*this));
+}
+
+}  // namespace task_detail
+
+/**
+  Coroutine that runs on its own once created and frees itself when done, used to run a Task without an awaiter.
+  An exception escaping it ends the process, like one escaping a connection thread.
+**/
+struct Detached {
+  struct promise_type {
+    Detached            get_return_object() { return {}; }
+    std::suspend_never  initial_suspend() noexcept { return {}; }
+    std::suspend_never  final_suspend() noexcept { return {}; }
+    void                return_void() {}
+    void                unhandled_exception() { std::terminate(); }
+  };
+};
+
+/**
+  @brief Run two tasks concurrently on the calling thread, and finish once both are done
+
+  @param[in]  first   Task to run
+  @param[in]  second  Task to run
+
+  @return  Task that finishes with the later of the two
+**/
+inline Task<void> when_all(Task<void> first, Task<void> second) {
+  struct Join {
+    int                     pending = 2;
+    std::coroutine_handle<> waiter;
+
+    bool await_ready() const noexcept { return pending == 0; }
+    void await_suspend(std::coroutine_handle<> handle) noexcept { waiter = handle; }
+    void await_resume() const noexcept {}
+  } join;
+
+  // Resuming the waiter is the last thing each task does, since the waiter owns both of them and the join
+  auto run = [](Task<void> &task, Join &join) -> Detached {
+    co_await task;
+    if (--join.pending == 0 && join.waiter) join.waiter.resume();
+  };
+  run(first, join);
+  run(second, join);
+  co_await join;
+}
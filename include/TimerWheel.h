@@ -0,0 +1,122 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <thread>
+
+#include "Signaler.h"
+#include "types.h"
+#include "utils.h"
+
+// Resolution of the timer wheel
+#define TIMER_WHEEL_TICK_MS 10
+// Each level of the wheel has 2^TIMER_WHEEL_BITS slots
+#define TIMER_WHEEL_BITS 6
+#define TIMER_WHEEL_SLOTS (1 << TIMER_WHEEL_BITS)
+// Number of levels, covering 2^(TIMER_WHEEL_BITS * TIMER_WHEEL_LEVELS) ticks (~46 hours at 10 ms)
+#define TIMER_WHEEL_LEVELS 4
+
+/**
+  Configurable timeouts of a proxy connection, set from the command line with `-t <name>=<seconds>`
+**/
+struct Timeouts {
+  std::chrono::milliseconds idle{20000};         // Waiting for the next request on a keep-alive connection
+  std::chrono::milliseconds header{10000};       // Receiving the rest of a request header after its first byte
+  std::chrono::milliseconds upstream{5000};      // Getting a response from the server, including retries
+  std::chrono::milliseconds tunnel_idle{50000};  // CONNECT tunnel without traffic in either direction
+  std::chrono::milliseconds prefetch{10000};     // Prefetching the links of a page
+  std::chrono::milliseconds drain{30000};        // Letting open connections finish after the server stops accepting
+
+  bool parse(const std::string &option);
+
+  static Timeouts &global();
+};
+
+struct TimerNode {
+  TimerNode *prev = this;
+  TimerNode *next = this;
+};
+
+class TimerWheel;
+
+/**
+  Timer that can be armed on a TimerWheel. When it expires, `expired()` becomes true and the optional callback is run
+  on the wheel's thread, so callbacks must be short. An armed timer is cancelled when it is destroyed.
+
+  Idle timeouts call `touch()` on activity instead of re-arming: a touched timer is re-armed with its full timeout when
+  it comes due, so busy connections never take the wheel's lock. The timeout then fires between one and two periods
+  after the last activity.
+
+  Timers marked with `expire_on_drain()` also expire when the server starts draining, e.g. to close idle keep-alive
+  connections without cutting off requests in progress.
+**/
+class Timer : private TimerNode {
+ public:
+  Timer(std::function<void()> callback = nullptr) : callback_(std::move(callback)) {}
+  Timer(const Timer &other) = delete;
+  Timer &operator=(const Timer &other) = delete;
+  ~Timer();
+
+  bool expired() const { return expired_; }
+  void touch() { touched_ = true; }
+  void expire_on_drain() { drain_ = true; }
+
+ private:
+  friend class TimerWheel;
+
+  TimerWheel               *wheel_   = nullptr;
+  bool                      armed_   = false;
+  bool                      drain_   = false;
+  std::uint64_t             expires_ = 0;
+  std::chrono::milliseconds timeout_{0};
+  std::function<void()>     callback_;
+  std::atomic<bool>         expired_{false};
+  std::atomic<bool>         touched_{false};
+};
+
+/**
+  Hierarchical timer wheel. Timers are kept in intrusive lists, one per slot, so arming and cancelling a timer are O(1).
+  Level 0 holds the timers due within the next TIMER_WHEEL_SLOTS ticks; each higher level covers TIMER_WHEEL_SLOTS
+  times the range of the one below it, and its slots are cascaded down as the wheel turns.
+**/
+class TimerWheel {
+ public:
+  TimerWheel(std::chrono::milliseconds tick = std::chrono::milliseconds{TIMER_WHEEL_TICK_MS});
+  TimerWheel(const TimerWheel &other) = delete;
+  TimerWheel &operator=(const TimerWheel &other) = delete;
+  ~TimerWheel();
+
+  static TimerWheel &global();
+
+  void   arm(Timer &timer, std::chrono::milliseconds timeout);
+  void   cancel(Timer &timer);
+  void   advance(time_point now);
+  void   expire_all();
+  void   drain();
+  size_t size() const;
+
+  void start();
+  void stop();
+
+ private:
+  void insert(Timer &timer);
+  void cascade(int level, size_t slot);
+  void fire(TimerNode &list);
+  void run();
+
+  static void unlink(TimerNode &node);
+  static void push_back(TimerNode &list, TimerNode &node);
+
+  std::chrono::milliseconds    tick_;
+  time_point                   start_;
+  std::uint64_t                current_ = 0;
+  size_t                       size_    = 0;
+  TimerNode                    slots_[TIMER_WHEEL_LEVELS][TIMER_WHEEL_SLOTS];
+  mutable std::recursive_mutex mutex_;
+  std::thread                  thread_;
+  std::atomic<bool>            stop_{false};
+};
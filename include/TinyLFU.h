@@ -0,0 +1,100 @@
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+#include <deque>
+#include <list>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "Cache.h"
+#include "HTTPResponse.h"
+#include "URIKey.h"
+#include "types.h"
+#include "utils.h"
+
+// Share of the capacity given to the window that admits new pages unconditionally, in percent
+#define TINYLFU_WINDOW_PERCENT 1
+// Share of the main region kept for pages hit again since they were admitted, in percent
+#define TINYLFU_PROTECTED_PERCENT 80
+// Accesses counted per page of capacity before every frequency is halved
+#define TINYLFU_SAMPLE_FACTOR 10
+
+/**
+  Count-min sketch of 4-bit counters estimating how often each key was accessed recently. Each key increments one
+  counter in each of 4 rows, and its frequency is the smallest of them. Once as many accesses as TINYLFU_SAMPLE_FACTOR
+  times the capacity were counted, every counter is halved, so old popularity fades.
+**/
+class FrequencySketch {
+ public:
+  void     resize(size_t capacity);
+  void     increment(std::uint64_t hash);
+  unsigned frequency(std::uint64_t hash) const;
+
+ private:
+  size_t counter(std::uint64_t hash, unsigned row) const;
+  void   age();
+
+  std::vector<std::uint8_t> table_;  // Two counters per byte, rows one after the other
+  size_t                    width_       = 0;
+  size_t                    samples_     = 0;
+  size_t                    sample_size_ = 0;
+};
+
+/**
+  Admission policy of the page cache, W-TinyLFU style, set from the command line with `-c <pages>`. The policy tracks
+  the keys of the cached pages, up to the capacity, and evicts pages from the cache to stay within it.
+
+  New pages enter a small LRU window. A page pushed out of the window only enters the main region if it was accessed
+  more often than the page the main region would evict for it, according to a FrequencySketch of every request. Pages
+  requested once, such as scans or prefetched pages nobody reads, thus never push out popular ones. The main region is
+  a segmented LRU: a page hit again moves from probation to the protected segment, and is evicted last.
+
+  Pages also leave the cache without being evicted by the policy. Pages older than the cache timeout are expired by the
+  policy itself, in the order they were inserted, and pages removed from the cache must be passed to remove(), so dead
+  pages stop counting against the capacity.
+**/
+class TinyLFU {
+ public:
+  void configure(size_t capacity, std::chrono::seconds timeout = std::chrono::seconds(0));
+  bool enabled() const { return capacity_ > 0; }
+
+  void   access(const URIKey &key);
+  void   admit(const URIKey &key, std::vector<URIKey> &evicted);
+  void   put(Cache<HTTPResponse, URIKey> &cache, const URIKey &key, const HTTPResponse &response);
+  void   remove(const URIKey &key, time_point before = time_point::max());
+  size_t size();
+
+  static TinyLFU &global();
+
+ private:
+  enum class Region : std::uint8_t { Window, Probation, Protected };
+
+  struct Entry {
+    URIKey     key;
+    Region     region;
+    time_point admitted;  // Last time the page was inserted into the cache
+  };
+  using List = std::list<Entry>;
+
+  struct Insertion {
+    URIKey     key;
+    time_point admitted;
+  };
+
+  void  promote(List::iterator it);
+  void  evict_window(std::vector<URIKey> &evicted);
+  void  expire(time_point now);
+  void  erase(std::unordered_map<URIKey, List::iterator>::iterator it);
+  List &segment(Region region);
+
+  std::mutex                                 mutex_;
+  FrequencySketch                            sketch_;
+  size_t                                     capacity_ = 0, window_capacity_ = 0, protected_capacity_ = 0;
+  std::chrono::seconds                       timeout_{0};  // Cache timeout, 0 if pages do not expire
+  List                                       window_, probation_, protected_;  // Most recently used first
+  std::unordered_map<URIKey, List::iterator> index_;
+  std::deque<Insertion>                      insertions_;  // Oldest first, those of pages inserted again are stale
+};
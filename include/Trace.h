@@ -0,0 +1,101 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "types.h"
+#include "utils.h"
+
+// Number of spans kept per thread, older spans are overwritten
+#define TRACE_RING_SIZE 4096
+// Number of slow requests whose trace files may wait for the writer thread, further ones are not written
+#define TRACE_MAX_PENDING_DUMPS 64
+
+enum class TracePhase : std::uint8_t {
+  Request,         // Whole request, from its first byte until the response is written
+  RequestHeader,   // Reading the request header from the client
+  Parse,           // Parsing the request header
+  CacheLookup,     // Looking up the page cache
+  Dns,             // getaddrinfo()
+  Connect,         // ::connect() to the server
+  UpstreamSend,    // Sending the request to the server
+  ResponseHeader,  // Waiting for and reading the response header
+  ResponseBody,    // Reading the response body
+  ClientWrite,     // Writing the response to the client
+  Tunnel,          // CONNECT tunnel
+  NumPhases
+};
+
+const char *to_string(TracePhase phase);
+
+/**
+  Timestamped phase of a request. Times are nanoseconds since the process started.
+**/
+struct TraceSpan {
+  std::uint64_t request;
+  std::uint64_t start;
+  std::uint64_t end;
+  TracePhase    phase;
+};
+
+/**
+  Preallocated ring of spans written by a single thread. Rings are pooled and reused by new threads, so their spans stay
+  readable after the thread that wrote them exits.
+**/
+struct TraceRing {
+  TraceSpan                  spans[TRACE_RING_SIZE];
+  std::atomic<std::uint64_t> head{0};
+  unsigned                   id = 0;
+};
+
+/**
+  Optional per-request tracing. Every phase of a request is recorded into the calling thread's ring; requests slower
+  than the threshold are written out as Chrome trace-event JSON by a writer thread, and all rings can be dumped on
+  demand.
+**/
+class Trace {
+ public:
+  static bool                      enabled;
+  static std::chrono::milliseconds threshold;
+  static std::string               dump_dir;
+
+  static void record(TracePhase phase, time_point start, time_point end) {
+    if (enabled) record_span(phase, start, end);
+  }
+
+  static std::uint64_t begin_request();
+  static void          end_request(time_point start);
+  static std::uint64_t current_request();
+  static void          resume_request(std::uint64_t request);
+
+  static std::string chrome_json();
+  static std::string chrome_json(std::uint64_t request);
+  static std::string chrome_json(const std::vector<TraceSpan> &spans, unsigned tid);
+
+ private:
+  static std::vector<TraceSpan> request_spans(std::uint64_t request);
+  static void       record_span(TracePhase phase, time_point start, time_point end);
+  static TraceRing &thread_ring();
+  static void       append_json(std::string &out, const TraceSpan &span, unsigned tid, bool &first);
+};
+
+/**
+  Records the whole-request span when it goes out of scope, and dumps the request if it was slow
+**/
+class TraceRequest {
+ public:
+  TraceRequest() : start_(myclock::now()) {
+    if (Trace::enabled) Trace::begin_request();
+  }
+  ~TraceRequest() {
+    if (Trace::enabled) Trace::end_request(start_);
+  }
+
+ private:
+  time_point start_;
+};
@@ -0,0 +1,69 @@
+#pragma once
+
+#include <cstdint>
+#include <functional>
+#include <string>
+#include <string_view>
+
+#include "types.h"
+
+// Port of URIs that do not give one
+#define URIKEY_DEFAULT_PORT 80
+
+/**
+  Canonical key of a URI in the page cache, and of a server in the IP cache. The key is built once per request, and
+  is then hashed and compared without building any string: its host is interned, so hosts compare by pointer, and its
+  64-bit hash is computed up front.
+
+  URIs that name the same resource get the same key: the host is lowercased and loses a trailing dot, a missing port
+  is the default one, percent-encoded unreserved characters are decoded and other escapes uppercased, and the dot
+  segments of the path are removed. With `-q`, query parameters are also sorted, for servers that ignore their order.
+  Only the key is normalized, requests are forwarded as the client sent them.
+
+  A response that varies on request headers is cached under a variant of its key, which adds the hash of the values of
+  these headers, see Variants.
+
+  Interned hosts are never freed, they are bounded by the number of distinct hosts the proxy ever served.
+**/
+class URIKey {
+ public:
+  URIKey() = default;
+  explicit URIKey(const ProxyURI &uri);
+
+  static URIKey origin(const ProxyURI &uri);
+  static void   sort_query(bool enabled);
+  URIKey        with_variant(std::uint64_t variant) const;
+
+  const std::string &host() const { return *host_; }
+  std::uint16_t      port() const { return port_; }
+  const std::string &target() const { return target_; }
+  std::uint64_t      variant() const { return variant_; }
+  std::uint64_t      hash() const { return hash_; }
+  std::string        str() const;
+
+  bool operator==(const URIKey &other) const {
+    return hash_ == other.hash_ && host_ == other.host_ && port_ == other.port_ && variant_ == other.variant_ && target_ == other.target_;
+  }
+  bool operator!=(const URIKey &other) const { return !(*this == other); }
+
+  static std::uint64_t hash(std::string_view bytes);
+
+ private:
+  URIKey(const ProxyURI &uri, bool with_target);
+  void rehash();
+
+  const std::string *host_    = &empty_host_;
+  std::uint16_t      port_    = 0;
+  std::string        target_;      // Normalized path and query, empty in the key of a server
+  std::uint64_t      variant_ = 0;  // Hash of the request headers the response varies on, 0 if it does not vary
+  std::uint64_t      hash_    = 0;
+
+  static const std::string empty_host_;
+};
+
+namespace std {
+template <>
+struct hash<URIKey> {
+  size_t operator()(const URIKey &key) const noexcept { return static_cast<size_t>(key.hash()); }
+};
+}  // namespace std
@@ -0,0 +1,72 @@
+#pragma once
+
+#include <chrono>
+
+#include "Connection.h"
+#include "IOUring.h"
+#include "Signaler.h"
+#include "TimerWheel.h"
+#include "utils.h"
+
+// Number of provided buffers per tunnel direction
+#define TUNNEL_BUFS 8
+// Size of each provided buffer
+#define TUNNEL_BUF_SIZE 16384
+// Interval at which the tunnel checks for shutdown and idle timeouts
+#define TUNNEL_TICK_MS 200
+
+/**
+  CONNECT tunnel driven by io_uring. Each side has a multishot receive armed that picks buffers from a provided buffer
+  group, and the received buffers are forwarded with WRITE_FIXED from the same, registered, memory. Submissions for both
+  directions are batched into one io_uring_enter call per loop iteration.
+**/
+class UringTunnel {
+ public:
+  UringTunnel(IOUring &ring, Connection &client, Connection &server);
+  UringTunnel(const UringTunnel &other) = delete;
+  UringTunnel &operator=(const UringTunnel &other) = delete;
+  ~UringTunnel();
+
+  bool          ok() const { return ok_; }
+  void          run(std::chrono::milliseconds idle_timeout);
+  std::uint64_t bytes() const { return dirs_[0].bytes + dirs_[1].bytes; }
+
+ private:
+  // Received data waiting to be written to the other side
+  struct Pending {
+    unsigned short bid;
+    unsigned       off;
+    unsigned       len;
+  };
+  // Data read from conns_[i] and written to conns_[1 - i]
+  struct Direction {
+    char         *bufs       = nullptr;
+    Pending       queue[TUNNEL_BUFS];
+    unsigned      head       = 0;
+    unsigned      count      = 0;
+    bool          recv_armed = false;
+    bool          sending    = false;
+    std::uint64_t bytes      = 0;
+    std::uint64_t stalls     = 0;  // Times receiving stopped because every buffer was queued
+  };
+
+  void arm_recv(int i);
+  void arm_send(int i);
+  void arm_timeout();
+  void provide(int i, unsigned short first, unsigned n);
+  void handle(const io_uring_cqe &cqe);
+  void cancel_all();
+  void drain();
+
+  IOUring          &ring_;
+  Connection       *conns_[2];
+  int               slots_[2];
+  Direction         dirs_[2];
+  char             *mem_      = nullptr;
+  size_t            mem_size_ = 0;
+  bool              ok_       = false;
+  bool              done_     = false;
+  unsigned          inflight_ = 0;
+  Timer             idle_timer_;
+  __kernel_timespec tick_;
+};
@@ -0,0 +1,45 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <shared_mutex>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include "HTTPResponse.h"
+#include "HeaderTable.h"
+#include "URIKey.h"
+#include "utils.h"
+
+// Most URIs whose Vary header is remembered, an arbitrary one is forgotten to make room
+#define VARIANTS_MAX_URIS 65536
+
+/**
+  Variants of the responses that vary on request headers, as named by their `Vary` header. Each variant is cached
+  under its own key, the key of its URI with the hash of the values of the named request headers added, so a response
+  is only served to the requests it was selected for.
+
+  The headers a URI varies on are remembered from its last response, so a lookup costs one hash map lookup, plus
+  hashing a few request headers for the URIs that vary. Values are compared with their whitespace removed. A response
+  with `Vary: *` varies on more than headers, and is never cached.
+**/
+class Variants {
+ public:
+  URIKey lookup(const URIKey &key, const HeaderTable &request_headers);
+  bool   store(const URIKey &key, const HeaderTable &request_headers, const HTTPResponse &response, URIKey &variant);
+  size_t size() const { return size_.load(std::memory_order_relaxed); }
+
+  static Variants &global();
+
+ private:
+  using Fields = std::vector<std::pair<Header, std::string>>;  // Request headers a URI varies on, sorted by name
+
+  static bool          parse(StrView vary, Fields &fields);
+  static std::uint64_t hash(const Fields &fields, const HeaderTable &request_headers);
+
+  std::shared_mutex                  mutex_;
+  std::unordered_map<URIKey, Fields> fields_;
+  std::atomic<size_t>                size_{0};
+};
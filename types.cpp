@@ -1,5 +1,8 @@
 #include "types.h"
 
+#include <algorithm>
+#include <utility>
+
 /**
   @brief Write a ProxyURI to an output stream
 
@@ -51,27 +54,81 @@ std::string extension_to_content_type(std::string extension) {
 **/
 bool is_text(const std::string &content_type) { return lower(content_type).find("text") != std::string::npos; }
 
+// Reason phrases of the standard status codes without a ResponseCode name, which servers may send
+static const std::pair<int, const char *> reason_phrases[] = {
+    {100, "Continue"},
+    {101, "Switching Protocols"},
+    {201, "Created"},
+    {202, "Accepted"},
+    {203, "Non-Authoritative Information"},
+    {204, "No Content"},
+    {205, "Reset Content"},
+    {300, "Multiple Choices"},
+    {301, "Moved Permanently"},
+    {302, "Found"},
+    {303, "See Other"},
+    {304, "Not Modified"},
+    {307, "Temporary Redirect"},
+    {308, "Permanent Redirect"},
+    {401, "Unauthorized"},
+    {405, "Method Not Allowed"},
+    {406, "Not Acceptable"},
+    {407, "Proxy Authentication Required"},
+    {408, "Request Timeout"},
+    {409, "Conflict"},
+    {410, "Gone"},
+    {411, "Length Required"},
+    {412, "Precondition Failed"},
+    {413, "Content Too Large"},
+    {414, "URI Too Long"},
+    {415, "Unsupported Media Type"},
+    {417, "Expectation Failed"},
+    {421, "Misdirected Request"},
+    {422, "Unprocessable Content"},
+    {426, "Upgrade Required"},
+    {428, "Precondition Required"},
+    {431, "Request Header Fields Too Large"},
+    {451, "Unavailable For Legal Reasons"},
+    {501, "Not Implemented"},
+    {502, "Bad Gateway"},
+    {505, "HTTP Version Not Supported"},
+};
+
 /**
-  @brief Convert a ResponseCode enum to a string
+  @brief Convert a ResponseCode enum to a string. A ResponseCode holds any status code a server sends, the named
+  ones are those the proxy sends itself.
 
   @param[in]  code  Input response code
 
-  @return  std::string  The response code as a string with message
+  @return  std::string  The response code as a string with message, "Unknown" for a non-standard status code
 **/
 std::string to_string(ResponseCode code) {
   switch (code) {
     case ResponseCode::OK:
       return std::string("OK");
+    case ResponseCode::PartialContent:
+      return std::string("Partial Content");
     case ResponseCode::BadRequest:
       return std::string("Bad Request");
     case ResponseCode::Forbidden:
       return std::string("Forbidden");
     case ResponseCode::NotFound:
       return std::string("Not Found");
+    case ResponseCode::RangeNotSatisfiable:
+      return std::string("Range Not Satisfiable");
+    case ResponseCode::TooManyRequests:
+      return std::string("Too Many Requests");
     case ResponseCode::InternalServerError:
       return std::string("Internal Server Error");
+    case ResponseCode::ServiceUnavailable:
+      return std::string("Service Unavailable");
     case ResponseCode::GatewayTimeout:
       return std::string("Gateway Timeout");
+    default:
+      for (const auto &phrase : reason_phrases) {
+        if (phrase.first == static_cast<int>(code)) return std::string(phrase.second);
+      }
+      return std::string("Unknown");
   }
 }
 
@@ -147,6 +204,49 @@ std::ostream &operator<<(std::ostream &os, ConnectionType type) {
   return os;
 }
 
+/**
+  @brief Convert a string to a RequestMethod enum
+
+  @param[in]  str  Input string
+
+  @return  RequestMethod  The request method, or RequestMethod::UNKNOWN
+**/
+RequestMethod to_method(const std::string &str) {
+  if (str == "GET") {
+    return RequestMethod::GET;
+  } else if (str == "HEAD") {
+    return RequestMethod::HEAD;
+  } else if (str == "POST") {
+    return RequestMethod::POST;
+  } else if (str == "CONNECT") {
+    return RequestMethod::CONNECT;
+  } else {
+    return RequestMethod::UNKNOWN;
+  }
+}
+
+/**
+  @brief Convert a RequestMethod enum to a string
+
+  @param[in]  method  Input request method
+
+  @return  std::string  The request method as a string
+**/
+std::string to_string(RequestMethod method) {
+  switch (method) {
+    case RequestMethod::GET:
+      return std::string("GET");
+    case RequestMethod::HEAD:
+      return std::string("HEAD");
+    case RequestMethod::POST:
+      return std::string("POST");
+    case RequestMethod::CONNECT:
+      return std::string("CONNECT");
+    case RequestMethod::UNKNOWN:
+      return std::string("UNKNOWN");
+  }
+}
+
 /**
   @brief Read a RequestMethod from an input stream
 
@@ -159,17 +259,7 @@ std::istream &operator>>(std::istream &is, RequestMethod &method) {
   std::string str_method;
 
   is >> str_method;
-  if (str_method == "GET") {
-    method = RequestMethod::GET;
-  } else if (str_method == "HEAD") {
-    method = RequestMethod::HEAD;
-  } else if (str_method == "POST") {
-    method = RequestMethod::POST;
-  } else if (str_method == "CONNECT") {
-    method = RequestMethod::CONNECT;
-  } else {
-    method = RequestMethod::UNKNOWN;
-  }
+  method = to_method(str_method);
 
   return is;
 }
@@ -218,75 +308,63 @@ std::ostream &operator<<(std::ostream &os, Repeat repeat) {
 }
 
 /**
-  @brief Parse URI and host info from an absolute URI
+  @brief Parse URI and host info from an absolute URI, or from a URI relative to a base URI. Each field is copied
+  once from the URI, without building intermediate strings.
 
   @param[in]  absolute_uri  Absolute URI to parse
+  @param[in]  base          URI the URI is relative to
 
   @return ProxyURI Constructed ProxyURI struct
 **/
 ProxyURI parse_uri(const std::string &absolute_uri, const ProxyURI &base) {
-  std::string url;
-  ProxyURI    uri_info;
-
-  log("Parsing URI %s", absolute_uri.c_str());
+  ProxyURI uri_info;
 
   if (absolute_uri.empty()) {
     uri_info.uri = "/";
     return uri_info;
   }
 
-  // Split section, if present
-  size_t section_idx = absolute_uri.find("#");
-  if (section_idx != std::string::npos) {
-    // uri_info.section = url.substr(section_idx);
-    url = absolute_uri.substr(0, section_idx);
-  } else {
-    url = absolute_uri;
-  }
+  // The section is never sent to the server
+  size_t end = std::min(absolute_uri.find('#'), absolute_uri.size());
 
   // Split the URI into scheme, host, port, and path
-  size_t split_idx = url.find("://");
-  if (split_idx != std::string::npos) {
+  size_t split_idx = absolute_uri.find("://");
+  if (split_idx < end) {
     // Absolute URI
-    url = url.substr(split_idx + 3);
-
-    // Find first slash
-    split_idx = url.find("/");
-    if (split_idx == std::string::npos) {
+    size_t host_idx = split_idx + 3;
+    size_t path_idx = std::min(absolute_uri.find('/', host_idx), end);
+    if (path_idx == end) {
       uri_info.uri = "/";
     } else {
-      uri_info.uri = url.substr(split_idx);
-      url          = url.substr(0, split_idx);
+      uri_info.uri.assign(absolute_uri, path_idx, end - path_idx);
     }
 
     // Split host and port
-    split_idx = url.find(":");
-    if (split_idx == std::string::npos) {
-      uri_info.host = url;
+    split_idx = absolute_uri.find(':', host_idx);
+    if (split_idx >= path_idx) {
+      uri_info.host.assign(absolute_uri, host_idx, path_idx - host_idx);
       uri_info.port = "80";
     } else {
-      uri_info.host = url.substr(0, split_idx);
-      uri_info.port = url.substr(split_idx + 1);
+      uri_info.host.assign(absolute_uri, host_idx, split_idx - host_idx);
+      uri_info.port.assign(absolute_uri, split_idx + 1, path_idx - split_idx - 1);
     }
   } else {
-    // Relative URI
-
-    // Find first slash
-    if (uri_info.uri[0] != '/') {
-      // Try to parse the URI as a relative URI
+    // Relative URI, to the directory of the base URI unless it starts with a slash
+    if (absolute_uri[0] != '/') {
       split_idx = base.uri.find_last_of("/");
       if (split_idx != std::string::npos) {
-        uri_info.uri = base.uri.substr(0, split_idx + 1) + url;
+        uri_info.uri.reserve(split_idx + 1 + end);
+        uri_info.uri.assign(base.uri, 0, split_idx + 1);
       } else {
-        uri_info.uri = "/" + url;
+        uri_info.uri = "/";
       }
+      uri_info.uri.append(absolute_uri, 0, end);
     } else {
-      uri_info.uri = url;
+      uri_info.uri.assign(absolute_uri, 0, end);
     }
     uri_info.host = base.host;
     uri_info.port = base.port;
     uri_info.ip   = base.ip;
-    log("Parsed relative URI %s", uri_info.absolute().c_str());
   }
 
   return uri_info;
@@ -74,6 +74,27 @@ std::string normalize_field_name(const std::string &str) {
   return ret;
 }
 
+/**
+  @brief Find the next line of a message, without copying it
+
+  @param[in]     str    Input string
+  @param[inout]  pos    Position to start searching from, updated to the start of the following line
+  @param[out]    start  Start index of the line
+  @param[out]    len    Length of the line, excluding the trailing "\r\n" or "\n"
+
+  @return  True if a line was found, false if `pos` is at the end of the string
+**/
+bool next_line(const std::string &str, size_t &pos, size_t &start, size_t &len) {
+  if (pos >= str.size()) return false;
+
+  size_t end = str.find('\n', pos);
+  start      = pos;
+  pos        = end == std::string::npos ? str.size() : end + 1;
+  len        = (end == std::string::npos ? str.size() : end) - start;
+  if (len > 0 && str[start + len - 1] == '\r') len--;
+  return true;
+}
+
 /**
   @brief Attempts to compute the terminal width using ioctl, returns 80 on failure
 
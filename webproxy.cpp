@@ -3,59 +3,272 @@
  */
 
 #include <sys/socket.h> /* for socket use */
+#include <unistd.h>     /* for getopt */
 
 #include <iostream>
 #include <mutex>
 #include <thread>
 
+#include "AccessLog.h"
+#include "Admission.h"
+#include "CachePolicy.h"
+#include "CannedResponse.h"
+#include "Handoff.h"
+#include "IOUring.h"
+#include "Metrics.h"
+#include "PeerCache.h"
 #include "Prefetcher.h"
+#include "Prefork.h"
 #include "ProxyConnection.h"
+#include "Reactor.h"
+#include "SharedPageCache.h"
 #include "Signaler.h"
+#include "SocketOptions.h"
+#include "TimerWheel.h"
+#include "TinyLFU.h"
+#include "Trace.h"
+#include "URIKey.h"
 
-int  open_listenfd(int port);
-void sigint_handler(int) { Signaler::done = true; }
+int       open_listenfd(int port);
+pthread_t main_thread;
+void      sigint_handler(int) { Signaler::done = true; }
+void      sigterm_handler(int) {
+  // Forward the signal to the main thread, so that it is interrupted in accept()
+  if (!Signaler::draining.exchange(true) && !pthread_equal(pthread_self(), main_thread)) pthread_kill(main_thread, SIGTERM);
+}
 
 int main(int argc, char **argv) {
-  int                listenfd, port, timeout_sec;
+  int                listenfd = -1, port, timeout_sec, metrics_port = 0, reactors = -1, workers = 0, shared_cache_mb = SHARED_CACHE_DEFAULT_MB;
   socklen_t          clientlen = sizeof(struct sockaddr_in);
   struct sockaddr_in clientaddr;
-  struct sigaction   act = {0};
-  std::uint64_t      id  = 0;
+  struct sigaction   act         = {0};
+  std::uint64_t      id          = 0;
+  size_t             cache_pages = 0;
+  AdmissionLimits    limits;
+  std::string        handoff_path, identity, access_log_path;
+
+  // Read command line options
+  int opt;
+  while ((opt = getopt(argc, argv, "zuqt:e:m:T:L:a:H:s:r:P:I:w:W:c:")) != -1) {
+    switch (opt) {
+      case 'z':
+        HTTPResponse::compress_text_bodies = true;
+        break;
+      case 'u':
+        Connection::set_backend(IOBackend::IOUring);
+        break;
+      case 'q':
+        URIKey::sort_query(true);
+        break;
+      case 't':
+        if (!Timeouts::global().parse(optarg)) {
+          fprintf(stderr, "invalid timeout '%s', expected <idle|header|upstream|tunnel|prefetch|drain>=<seconds>\n", optarg);
+          exit(0);
+        }
+        break;
+      case 'e':
+        if (!CachePolicy::global().parse(optarg)) {
+          fprintf(stderr, "invalid cache TTL '%s', expected <redirect|negative>=<seconds>\n", optarg);
+          exit(0);
+        }
+        break;
+      case 'm':
+        metrics_port = atoi(optarg);
+        break;
+      case 'T':
+        Trace::enabled   = true;
+        Trace::threshold = std::chrono::milliseconds{atoi(optarg)};
+        break;
+      case 'a':
+        if (!limits.parse(optarg)) {
+          fprintf(stderr, "invalid limit '%s', expected <connections|per_client|rate|burst|queue|clients>=<value>\n", optarg);
+          exit(0);
+        }
+        break;
+      case 'L':
+        if (!AccessLog::open(optarg)) {
+          fprintf(stderr, "could not open access log '%s'\n", optarg);
+          exit(0);
+        }
+        access_log_path = optarg;
+        break;
+      case 'H':
+        handoff_path = optarg;
+        break;
+      case 'r':
+        reactors = atoi(optarg);
+        break;
+      case 's':
+        if (!SocketOptions::global().parse(optarg)) {
+          fprintf(stderr, "invalid socket option '%s', expected <listener|client|upstream>.<name>=<value>\n", optarg);
+          exit(0);
+        }
+        break;
+      case 'P':
+        if (!PeerCache::global().add(optarg)) {
+          fprintf(stderr, "invalid peer '%s', expected <host>:<port>\n", optarg);
+          exit(0);
+        }
+        break;
+      case 'I':
+        identity = optarg;
+        break;
+      case 'w':
+        workers = atoi(optarg);
+        break;
+      case 'W':
+        shared_cache_mb = atoi(optarg);
+        break;
+      case 'c':
+        cache_pages = strtoul(optarg, nullptr, 10);
+        break;
+      default:
+        fprintf(stderr, "usage: %s [-z] [-u] [-q] [-t name=seconds] [-e name=seconds] [-m metrics_port] [-T trace_threshold_ms] [-L access_log] [-a name=value] [-H handoff_socket] [-s role.name=value] [-r reactors] [-P peer_host:port] [-I self_host:port] [-w workers] [-W shared_cache_mb] [-c cache_pages] <port> [cache_timeout, default=60]\n", argv[0]);
+        exit(0);
+    }
+  }
 
   // Read command line arguments
-  if (argc > 3 || argc < 2) {
-    fprintf(stderr, "usage: %s <port> [cache_timeout, default=60]\n", argv[0]);
+  if (argc - optind > 2 || argc - optind < 1) {
+    fprintf(stderr, "usage: %s [-z] [-u] [-q] [-t name=seconds] [-e name=seconds] [-m metrics_port] [-T trace_threshold_ms] [-L access_log] [-a name=value] [-H handoff_socket] [-s role.name=value] [-r reactors] [-P peer_host:port] [-I self_host:port] [-w workers] [-W shared_cache_mb] [-c cache_pages] <port> [cache_timeout, default=60]\n", argv[0]);
     exit(0);
   }
-  port        = atoi(argv[1]);
-  timeout_sec = argc == 3 ? atoi(argv[2]) : 60;
+  port        = atoi(argv[optind]);
+  timeout_sec = argc - optind == 2 ? atoi(argv[optind + 1]) : 60;
+  CachePolicy::global().timeout = std::chrono::seconds(timeout_sec);
 
   // Set up signal handler
   act.sa_handler = &sigint_handler;
   sigignore(SIGPIPE);
   sigaction(SIGINT, &act, NULL);
+  main_thread    = pthread_self();
+  act.sa_handler = &sigterm_handler;
+  sigaction(SIGTERM, &act, NULL);
 
   // Prevent buffering of stdout
   std::ios::sync_with_stdio(true);
 
+  // Fork the workers, which accept from the same listening socket and share a page cache in shared memory. The main
+  // process supervises them, and each worker runs the rest of the proxy on its own.
+  if (workers > 0) {
+    if (!handoff_path.empty()) {
+      fprintf(stderr, "-H can not be used with -w\n");
+      exit(0);
+    }
+    if (shared_cache_mb <= 0 || !SharedPageCache::global().open(static_cast<size_t>(shared_cache_mb) << 20, std::chrono::seconds(timeout_sec))) {
+      fprintf(stderr, "could not map a shared page cache of %d MB\n", shared_cache_mb);
+      exit(0);
+    }
+    if ((listenfd = open_listenfd(port)) < 0) {
+      fprintf(stderr, "could not listen on port %d: %s\n", port, strerror(errno));
+      exit(0);
+    }
+    int worker = Prefork::run(workers);
+    if (worker < 0) {
+      log("All workers exited, goodbye!");
+      return 0;
+    }
+    // Each worker serves metrics on a port of its own, and writes an access log of its own
+    if (metrics_port > 0) metrics_port += worker;
+    if (!access_log_path.empty()) {
+      AccessLog::close();
+      AccessLog::open(access_log_path + "." + std::to_string(worker));
+    }
+  }
+
   // Set up global caches
   ProxyConnection::load_blacklist("blacklist.txt");
-  auto page_cache = std::make_shared<Cache<HTTPResponse, ProxyURI>>(std::chrono::seconds(timeout_sec));
-  auto ip_cache   = std::make_shared<Cache<AddrInfo>>();
+  TinyLFU::global().configure(cache_pages, std::chrono::seconds(timeout_sec));
+  auto page_cache = std::make_shared<Cache<HTTPResponse, URIKey>>(std::chrono::seconds(timeout_sec));
+  auto ip_cache   = std::make_shared<Cache<AddrInfo, URIKey>>();
+  PeerCache::global().configure(identity.empty() ? "127.0.0.1:" + std::to_string(port) : identity, ip_cache);
+
+  // Take over the listening socket and page cache of a running proxy, if there is one
+  std::unique_ptr<Handoff> handoff;
+  if (!handoff_path.empty()) {
+    handoff.reset(new Handoff(handoff_path, page_cache, std::chrono::seconds(timeout_sec)));
+    listenfd = handoff->take_over();
+  }
+  bool taken_over = handoff && listenfd >= 0;
+
+  // Set prefetcher callback, inserted pages are also remembered for the next handoff
+  page_cache->set_insertion_callback([&ip_cache, &page_cache, &handoff](URIKey key, HTTPResponse resp) {
+    if (handoff) handoff->inserted(key);
+    start_prefetcher(ip_cache, page_cache, resp.proxy_uri(), resp);
+  });
+
+  // Serve metrics on the admin port, which a process that was taken over releases once it starts draining
+  bool metrics_open = metrics_port <= 0;
+  for (int attempt = 0; !metrics_open && attempt < (taken_over ? 50 : 1); attempt++) {
+    if (attempt > 0) std::this_thread::sleep_for(std::chrono::milliseconds(100));
+    metrics_open = Metrics::serve(metrics_port);
+  }
+  if (!metrics_open) {
+    fprintf(stderr, "could not open metrics port %d\n", metrics_port);
+    exit(0);
+  }
 
-  // Set prefetcher callback
-  page_cache->set_insertion_callback(
-      [&ip_cache, &page_cache](ProxyURI uri, HTTPResponse resp) { start_prefetcher(ip_cache, page_cache, uri, resp); });
+  // Serve connections as coroutines on shared reactors instead of a thread each. With io_uring, each reactor's ring
+  // has a fixed file slot for both sockets of every allowed connection.
+  if (reactors >= 0) {
+    Reactor::start(reactors, Connection::backend() == IOBackend::IOUring ? IOUring::reactor_files(limits.connections) : 0);
+  }
+
+  // Set admission limits
+  Admission &admission = Admission::global();
+  admission.configure(limits);
+
+  // Reject over-limit connections right away, without spawning a thread or reading the request
+  auto serve = [&](int connfdp) {
+    Metrics::connections.add();
+    std::uint64_t     client   = admission.limits_clients() ? Admission::client_key(connfdp) : 0;
+    AdmissionDecision decision = admission.admit(client);
+    if (decision != AdmissionDecision::Admit) {
+      bool               overloaded = decision == AdmissionDecision::Overloaded;
+      const std::string &response   = canned_response(overloaded ? ResponseCode::ServiceUnavailable : ResponseCode::TooManyRequests, "HTTP/1.0");
+      (overloaded ? Metrics::rejected_overloaded : Metrics::rejected_client_limit).add();
+      send(connfdp, response.data(), response.size(), MSG_DONTWAIT | MSG_NOSIGNAL);
+      close(connfdp);
+      return;
+    }
 
-  // Open listening socket
-  listenfd = open_listenfd(port);
-  while (!Signaler::done) {
+    SocketOptions::global().apply(connfdp, SocketRole::Client);
+    Signaler::num_threads++;
+    ProxyConnection proxy_conn(id++, connfdp, ip_cache, page_cache);
+    proxy_conn.set_client_key(client);
+    if (Reactor::running()) Reactor::next().spawn(ProxyConnection::serve(std::move(proxy_conn)));
+    else std::thread(std::move(proxy_conn)).detach();
+  };
+
+  // Open listening socket, unless it was taken over, and wait for the next process on the handoff socket
+  if (listenfd < 0) listenfd = open_listenfd(port);
+  if (handoff && !handoff->serve(listenfd)) {
+    fprintf(stderr, "could not open handoff socket '%s'\n", handoff_path.c_str());
+    exit(0);
+  }
+  while (!Signaler::done && !Signaler::draining) {
     // Accept connections
-    int connfdp = accept(listenfd, (struct sockaddr *)&clientaddr, &clientlen);
+    int connfdp = Connection::backend() == IOBackend::IOUring ? IOUring::thread_ring().accept(listenfd)
+                                                              : accept(listenfd, (struct sockaddr *)&clientaddr, &clientlen);
     if (connfdp < 0) continue;
-    Signaler::num_threads++;
-    ProxyConnection proxy_conn(id++, connfdp, ip_cache, page_cache, 20);
-    std::thread(std::move(proxy_conn)).detach();
+    serve(connfdp);
+  }
+
+  // Drain: stop accepting, close idle keep-alive connections and let the others finish their current request
+  if (Signaler::draining && !Signaler::done) {
+    std::vector<int> accepted;
+    if (Connection::backend() == IOBackend::IOUring) IOUring::thread_ring().cancel_accept(accepted);
+    if (handoff) handoff->stopped_accepting();
+    close(listenfd);
+    TimerWheel::global().drain();
+    for (int connfdp : accepted) serve(connfdp);
+    log("Draining %d connections...", Signaler::num_threads.load());
+
+    time_point start = myclock::now();
+    while (Signaler::num_threads > 0 && !Signaler::done && myclock::now() - start < Timeouts::global().drain) {
+      std::this_thread::sleep_for(std::chrono::milliseconds(100));
+    }
+    Signaler::done = true;
   }
   log("Waiting for %d threads to finish...", Signaler::num_threads.load());
 
@@ -66,6 +279,10 @@ int main(int argc, char **argv) {
   if (Signaler::num_threads > 0) {
     log("Timed out waiting for threads to finish...killing them");
   }
+  Reactor::stop();
+  PeerCache::global().close();
+  AccessLog::close();
+  handoff.reset();
   page_cache.reset();
   ip_cache.reset();
   log("Num references on page_cache: %d", page_cache.use_count());
@@ -89,6 +306,9 @@ int open_listenfd(int port) {
   /* Eliminates "Address already in use" error from bind. */
   if (setsockopt(listenfd, SOL_SOCKET, SO_REUSEADDR, (const void *)&optval, sizeof(int)) < 0) return -1;
 
+  /* Buffer sizes must be set before listen() to take effect on the window scale */
+  SocketOptions::global().apply(listenfd, SocketRole::Listener);
+
   /* listenfd will be an endpoint for all requests to port
      on any IP address for this host */
   bzero((char *)&serveraddr, sizeof(serveraddr));